@@ -47,6 +47,17 @@
 #include <OMX_Component.h>
 
 #include <android/log.h>
+#include <cutils/properties.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #ifdef LOG_TAG
 #undef LOG_TAG
@@ -95,17 +106,46 @@
 #define INFO_OUTPUT_FORMAT_CHANGED  -2
 #define INFO_TRY_AGAIN_LATER        -1
 #define INFO_OK                      0
+#define INFO_OUTPUT_DECODER_RESTARTED -5
 
-#define MAX_HOLDED_FRAMES            3
+#define MAX_HOLDED_FRAMES            3 // default decode-ahead depth
 
 #define IN_BUFFER_COUNT 4
+#define KEYFRAME_IN_BUFFER_COUNT 1 // keyframes waiting for the codec in keyframe-only mode
+#define PREWARM_BUFFER_COUNT 50
 #define OUT_BUFFER_COUNT 10
+#define REORDER_MAX_WINDOW 4 // frames held for pts reordering, each keeps a codec buffer
+#define REORDER_MAX_FRAME_US 1000000 // longer pts steps are gaps, not frame durations
+#define MAX_DECODE_ERRORS 3 // consecutive errors before backing off
+#define WATCHDOG_TIMEOUT_MS 5000 // above the 3 s OMXCodec buffer filled timeout
+#define RELEASE_TIMEOUT_MS 2000
+#define HW_BUDGET_MB_PER_SEC 489600 // 1080p60, two 1080p30 sessions
+#define HW_BUDGET_INSTANCES 4
+#define HW_ADMISSION_TIMEOUT_MS 500
+#define RENDER_QUEUE_DEPTH 2
+#define GRAPHIC_BUFFER_CACHE_SIZE 32 // above any window's buffer count
+#define FENCE_TIMEOUT_MS 100
+#define CONVERT_MAX_THREADS 8
+#define CONVERT_STRIPE_BYTES (64 * 1024) // source bytes per stripe, stays in L2
+#define CONVERT_PARALLEL_MIN_PIXELS (1280 * 720)
+#define JITTER_BUFFER_SLOTS 64
+#define JITTER_SLOT_BYTES (32 * 1024) // grown once for larger access units
+#define JITTER_DEPTH_FACTOR 4 // playout delay in inter-arrival jitter estimates
+#define JITTER_REBASE_US 2000000 // pts jump that restarts the playout timeline
+#define JITTER_SUBMIT_TIMEOUT_MS 1000 // a unit the decoder refuses this long is dropped
+#define POOL_FLUSH_WAIT_MS 200 // a parked decoder still draining its flush
+#define POOL_WINDOW_IDLE_MS 3000 // parked decoders outlive their window's last session
+#define MIGRATE_DRAIN_WAIT_MS 500 // the consumer takes the old component's last frames
+#define PCM_SPACE_WAIT_MS 100 // the PCM reader stopped, flags are checked again
 #define DECODER_PRIORITY ANDROID_PRIORITY_NORMAL
 
 #define ANNEXB_STARTCODE 0x01000000
 #define NAL_SPS    7
 #define NAL_PPS    8
 
+// MEDIA_MIMETYPE_VIDEO_HEVC is only declared since Lollipop
+#define MIMETYPE_VIDEO_HEVC "video/hevc"
+
 using namespace android;
 
 typedef Vector<MediaBuffer*> MediaBufferQueue;
@@ -204,6 +244,81 @@ inline const uint8_t* getNALFromFrame(int nalType, const uint8_t *buf, int buf_s
     return 0;
 }
 
+// Returns the first byte of a 00 00 01 start code in [buf, end) or end
+static inline const uint8_t* findStartCode(const uint8_t* buf, const uint8_t* end)
+{
+    const uint8_t* p = buf;
+    while (p + 2 < end) {
+        if (p[2] > 1) {
+            p += 3;
+        } else if (p[2] == 0) {
+            p++;
+        } else if (p[0] == 0 && p[1] == 0) {
+            return p;
+        } else {
+            p += 3;
+        }
+    }
+    return end;
+}
+
+typedef struct {
+    unsigned profile;
+    unsigned sf_index;
+    unsigned channels;
+    size_t header_size;
+    size_t frame_size;
+    unsigned raw_blocks;
+} adts_header_t;
+
+static inline bool parseADTSHeader(const uint8_t* buf, size_t size, adts_header_t* header)
+{
+    if (size < 7 || buf[0] != 0xFF || (buf[1] & 0xF6) != 0xF0)
+        return false;
+
+    header->profile = buf[2] >> 6;
+    header->sf_index = (buf[2] >> 2) & 0x0F;
+    header->channels = ((buf[2] & 0x01) << 2) | (buf[3] >> 6);
+    header->frame_size = ((buf[3] & 0x03) << 11) | (buf[4] << 3) | (buf[5] >> 5);
+    header->raw_blocks = (buf[6] & 0x03) + 1;
+    // with CRC, raw_data_block_position[] of the later blocks and the header CRC
+    header->header_size = (buf[1] & 0x01) ? 7 : 7 + 2 * header->raw_blocks;
+
+    return header->sf_index < 12 && header->frame_size > header->header_size;
+}
+
+#define ADTS_MAX_RAW_BLOCKS 4
+
+// Splits a complete ADTS frame into its raw_data_blocks, offsets are from the
+// frame start. 0 for several blocks without CRC, only the AAC syntax itself
+// tells where those end
+static size_t getADTSRawBlocks(const uint8_t* frame, const adts_header_t& header,
+        size_t offsets[ADTS_MAX_RAW_BLOCKS], size_t sizes[ADTS_MAX_RAW_BLOCKS])
+{
+    if (header.raw_blocks == 1) {
+        offsets[0] = header.header_size;
+        sizes[0] = header.frame_size - header.header_size;
+        return 1;
+    }
+    if (header.header_size == 7)
+        return 0;
+
+    // positions count from the first block, each block ends with its own CRC
+    for (size_t i = 0; i < header.raw_blocks; ++i) {
+        size_t start = header.header_size;
+        if (i > 0)
+            start += (frame[5 + 2 * i] << 8) | frame[6 + 2 * i];
+        size_t end = header.frame_size;
+        if (i + 1 < header.raw_blocks)
+            end = header.header_size + ((frame[7 + 2 * i] << 8) | frame[8 + 2 * i]);
+        if (start + 2 >= end || end > header.frame_size)
+            return 0;
+        offsets[i] = start;
+        sizes[i] = end - start - 2;
+    }
+    return header.raw_blocks;
+}
+
 typedef struct {
     int pixel_format;
     int stride;
@@ -221,6 +336,186 @@ typedef struct {
     int sample_rate;
 } source_audio_format_t;
 
+typedef struct {
+    int32_t open_ms;        // codec create and start on the decoder thread
+    int32_t first_frame_ms; // open request to the first decoded frame, -1 until then
+    int32_t prewarm_frames; // input buffered while the codec was opening
+} stagefright_startup_stats_t;
+
+typedef struct {
+    int32_t flush_count;
+    int32_t flush_ms;             // flush request until the codec ports are flushed
+    int32_t flush_first_frame_ms; // flush request to the first frame after it, -1 until then
+    int32_t dropped_frames;       // input discarded and output dropped by the last flush
+} stagefright_flush_stats_t;
+
+typedef struct {
+    int32_t admitted_frames; // sync frames let through while keyframe only
+    int32_t rejected_frames; // non-sync input dropped at admission
+    int32_t decoded_frames;  // keyframes decoded in trick play
+    int32_t replaced_frames; // ready keyframes superseded by a newer one
+} stagefright_trickplay_stats_t;
+
+typedef struct {
+    int32_t timeouts;         // ETIMEDOUT from OMXCodec::waitForBufferFilled_l, no resync
+    int32_t stream_errors;    // corrupted input, -1103 and unclassified errors
+    int32_t codec_errors;     // UNKNOWN_ERROR from the component
+    int32_t resync_count;
+    int32_t dropped_frames;   // input discarded while waiting for a sync frame
+    int32_t last_recovery_ms; // error to the next decoded frame, -1 while recovering
+    int32_t max_recovery_ms;
+} stagefright_resync_stats_t;
+
+typedef struct {
+    int32_t stalls;           // decoder made no progress for the watchdog timeout
+    int32_t restarts;
+    int32_t failed_restarts;
+    int32_t last_stall_ms;    // time without progress when the stall was detected
+    int32_t last_restart_ms;  // stall detection until the new codec is opening
+} stagefright_watchdog_stats_t;
+
+enum {
+    DECODER_MODE_HW = 0,
+    DECODER_MODE_SW = 1,
+};
+
+typedef struct {
+    int32_t mode;              // DECODER_MODE_HW or DECODER_MODE_SW in use
+    int32_t to_sw;             // mid-stream migrations to a software component
+    int32_t to_hw;
+    int32_t failed;            // migrations that kept or restored the old mode
+    int32_t open_fallbacks;    // HW open failed, the session started on SW
+    int32_t last_migration_ms; // request to the first frame of the new component, -1 until then
+} stagefright_migration_stats_t;
+
+typedef struct {
+    int64_t used_mb_per_sec;   // load of the sessions holding a HW decoder
+    int64_t budget_mb_per_sec;
+    int32_t instances;
+    int32_t max_instances;
+    int32_t foreground_instances;
+    int32_t load_percent;      // used_mb_per_sec of budget_mb_per_sec
+    int32_t admitted;
+    int32_t queued;            // foreground requests that waited for capacity
+    int32_t routed_to_sw;
+    int32_t demoted;           // background sessions moved to SW for a foreground one
+} stagefright_hw_utilisation_t;
+
+enum {
+    SESSION_PRIORITY_FOREGROUND = 0, // on-screen playback
+    SESSION_PRIORITY_NORMAL = 1,
+    SESSION_PRIORITY_BACKGROUND = 2, // thumbnails, previews
+    SESSION_PRIORITY_COUNT
+};
+
+typedef struct {
+    int32_t priority_class;
+    int32_t queue_depth;
+    int32_t throttle_events; // waits for a higher class that fell behind
+    int32_t throttled_ms;
+} stagefright_priority_stats_t;
+
+typedef void (*stagefright_release_cb)(void* cookie, int32_t releaseMs);
+
+typedef struct {
+    int32_t pending;         // sessions waiting for teardown
+    int32_t completed;
+    int32_t last_release_ms; // request to teardown done
+    int32_t max_release_ms;
+} stagefright_reaper_stats_t;
+
+typedef struct {
+    int32_t idle;             // opened decoders waiting for a session
+    int32_t capacity;
+    int32_t hits;             // sessions started on a pooled decoder
+    int32_t misses;
+    int32_t hit_rate;         // hits of hits + misses, percent
+    int32_t parked;
+    int32_t evicted;          // over capacity, cleared or idle window, no HW budget
+    int32_t avg_hit_open_ms;  // claim of a pooled decoder
+    int32_t avg_miss_open_ms; // codec create and start of a fresh decoder
+} stagefright_pool_stats_t;
+
+typedef struct {
+    int32_t depth;           // decoded frames the decoder may run ahead of the consumer
+    int32_t queued;          // decoded frames waiting for or held by the consumer
+    int32_t output_stalls;   // decodes that waited for the consumer to release a frame
+    int64_t idle_input_ms;   // decoder thread waiting for input
+    int64_t idle_output_ms;  // decoder thread waiting for a free output frame
+} stagefright_output_stats_t;
+
+typedef struct {
+    int32_t queued;          // frames waiting for the render thread
+    int32_t max_queued;
+    int32_t rendered;
+    int32_t dropped;         // oldest frames dropped while the render thread was behind
+    int32_t last_convert_us; // window buffer dequeue, conversion and queue of one frame
+    int32_t avg_convert_us;
+    int32_t max_convert_us;
+    int32_t buffer_wrappers;   // GraphicBuffer wrappers created for window buffers
+    int32_t buffer_cache_hits; // frames rendered through a cached wrapper
+    int32_t fence_waits;       // window buffers still in use by the consumer at write time
+    int32_t fence_timeouts;    // frames dropped, the buffer went back to the window unwritten
+    int32_t max_fence_wait_us;
+} stagefright_render_stats_t;
+
+typedef struct {
+    int32_t threads;        // caller included
+    int32_t jobs;           // frames converted in stripes
+    int32_t inline_jobs;    // small frames or the pool busy with another session
+    int32_t stripes;
+    int32_t stolen_stripes; // taken from another thread's range
+} stagefright_convert_stats_t;
+
+enum {
+    PRESENTATION_CLOCK_NONE = 0,     // frames render when released, the caller keeps time
+    PRESENTATION_CLOCK_WALL = 1,     // monotonic time from the first frame released
+    PRESENTATION_CLOCK_EXTERNAL = 2, // media time set by the caller
+    PRESENTATION_CLOCK_AUDIO = 3,    // PCM read from an audio session
+};
+
+#define PRESENTATION_JITTER_BUCKETS 8
+
+typedef struct {
+    int32_t clock;
+    int32_t queued;       // released frames waiting for their time
+    int32_t presented;
+    int32_t dropped_late; // a display period late with the next frame due as well
+    int32_t avg_jitter_us;
+    int32_t max_jitter_us;
+    // |render time - pts| on the clock: <1, <2, <4, <8, <16, <32, <64 and >=64 ms
+    int32_t jitter_histogram[PRESENTATION_JITTER_BUCKETS];
+} stagefright_presentation_stats_t;
+
+typedef struct {
+    int32_t depth_ms;      // playout delay in use
+    int32_t jitter_us;     // inter-arrival jitter estimate, RFC 3550
+    int32_t occupancy;     // access units buffered
+    int32_t max_occupancy;
+    int32_t released;
+    int32_t reordered;     // arrived ahead of an earlier unit
+    int32_t late;          // arrived after a later unit was released, dropped
+    int32_t underruns;     // arrived after its playout time, the buffer had run dry
+    int32_t overruns;      // no free slot, units released early or the new one dropped
+    int32_t dropped;       // refused by the decoder for JITTER_SUBMIT_TIMEOUT_MS
+} stagefright_jitter_stats_t;
+
+typedef struct {
+    int32_t window;            // frames held to sort output by pts
+    int32_t frame_duration_us; // estimated from the output pts steps
+    int32_t reordered;         // frames output ahead of an earlier decoded one
+    int32_t interpolated;      // frames without a pts
+    int32_t late;              // pts at or below the previous output, dropped
+    int64_t last_pts;
+} stagefright_reorder_stats_t;
+
+typedef struct {
+    int32_t seek_count;
+    int64_t target_us;      // last seek target
+    int32_t preroll_frames; // decoded frames dropped before the target
+    int32_t preroll_ms;     // seek request to the first frame at or after the target, -1 until then
+} stagefright_seek_stats_t;
+
 static inline int64_t getTimestampMs()
 {
     struct timespec time;
@@ -234,6 +529,14 @@ static inline int32_t getPeriodMs(int64_t start)
     return getTimestampMs() - start;
 }
 
+static inline int64_t getMonotonicUs()
+{
+    struct timespec time;
+    time.tv_sec = time.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
 static inline void releaseMediaBuffer(MediaBuffer*& buffer)
 {
     if (buffer) {
@@ -257,18 +560,287 @@ static inline void releaseMediaBufferQueue(MediaBufferQueue& mediaQueue)
 
 // 8192 = 2^13, 13bit AAC frame size (in bytes)
 #define AAC_MAX_FRAME_SIZE 8192
+#define AAC_MAX_CONFIG_SIZE 64
+
+static const int32_t kAACSamplingFreq[] = { 96000, 88200, 64000, 48000, 44100,
+        32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+
+class BitReader {
+public:
+    BitReader(const uint8_t* data, size_t size)
+        : mData(data)
+        , mSize(size)
+        , mPos(0)
+    {
+    }
+
+    uint32_t getBits(size_t n)
+    {
+        uint32_t value = 0;
+        while (n-- > 0) {
+            uint32_t bit = 0;
+            if (mPos < mSize * 8)
+                bit = (mData[mPos >> 3] >> (7 - (mPos & 7))) & 1;
+            value = (value << 1) | bit;
+            mPos++;
+        }
+        return value;
+    }
+
+    void skipBits(size_t n) { mPos += n; }
+    void alignByte() { mPos = (mPos + 7) & ~7; }
+    size_t position() const { return mPos; }
+    size_t numBitsLeft() const { return mPos < mSize * 8 ? mSize * 8 - mPos : 0; }
+    bool overflow() const { return mPos > mSize * 8; }
 
-static sp<MetaData> MakeAACCodecSpecificData(unsigned profile,
-        unsigned sampling_freq_index, unsigned channel_configuration)
+    // Copies n bits starting at bit offset pos into a byte aligned buffer
+    void copyBits(size_t pos, size_t n, uint8_t* out) const
+    {
+        BitReader br(mData, mSize);
+        br.skipBits(pos);
+        memset(out, 0, (n + 7) / 8);
+        for (size_t i = 0; i < n; ++i)
+            out[i >> 3] |= br.getBits(1) << (7 - (i & 7));
+    }
+
+private:
+    const uint8_t* mData;
+    size_t mSize;
+    size_t mPos;
+};
+
+// Size of the NAL unit length prefix of an avcC/hvcC configured stream,
+// 0 for Annex-B start codes
+static size_t getNALLengthSize(const char* mime, const uint8_t* config, size_t size)
 {
-    sp<MetaData> meta = new MetaData;
-    meta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_AUDIO_AAC);
+    if (!mime || !config || size < 1 || config[0] != 1)
+        return 0;
+    if (!strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_AVC) && size >= 7)
+        return (config[4] & 0x03) + 1; // lengthSizeMinusOne
+    if (!strcasecmp(mime, MIMETYPE_VIDEO_HEVC) && size >= 23)
+        return (config[21] & 0x03) + 1;
+    return 0;
+}
+
+// Returns the header of the next NAL unit from pos and moves pos past it,
+// NULL at the end. Annex-B units follow start codes, with a lengthSize
+// each unit is prefixed by its big-endian size
+static inline const uint8_t* nextNAL(const uint8_t*& pos, const uint8_t* end, size_t lengthSize)
+{
+    if (lengthSize == 0) {
+        const uint8_t* sc = findStartCode(pos, end);
+        if (sc + 3 >= end)
+            return NULL;
+        pos = sc + 3;
+        return pos;
+    }
+
+    while ((size_t)(end - pos) > lengthSize) {
+        size_t nalSize = 0;
+        for (size_t i = 0; i < lengthSize; ++i)
+            nalSize = (nalSize << 8) | pos[i];
+        const uint8_t* nal = pos + lengthSize;
+        pos = nalSize < (size_t)(end - nal) ? nal + nalSize : end;
+        if (nalSize > 0)
+            return nal;
+    }
+    return NULL;
+}
+
+// Sync frame detection, only the headers up to the first picture are scanned
+
+// H.264: the first slice NAL of the access unit is IDR
+static inline bool isAVCSyncFrame(const uint8_t* data, size_t size, size_t lengthSize)
+{
+    const uint8_t* pos = data;
+    const uint8_t* end = data + size;
+    for (const uint8_t* nal = nextNAL(pos, end, lengthSize); nal; nal = nextNAL(pos, end, lengthSize)) {
+        int type = nal[0] & 0x1f;
+        if (type >= 1 && type <= 5)
+            return type == 5;
+    }
+    return false;
+}
+
+// H.265: the first VCL NAL is IRAP (BLA, IDR, CRA and the reserved IRAP types)
+static inline bool isHEVCSyncFrame(const uint8_t* data, size_t size, size_t lengthSize)
+{
+    const uint8_t* pos = data;
+    const uint8_t* end = data + size;
+    for (const uint8_t* nal = nextNAL(pos, end, lengthSize); nal; nal = nextNAL(pos, end, lengthSize)) {
+        int type = (nal[0] >> 1) & 0x3f;
+        if (type < 32)
+            return type >= 16 && type <= 23;
+    }
+    return false;
+}
+
+// MPEG-4 Part 2: vop_coding_type of the first VOP is I (ISO/IEC 14496-2 6.2.5)
+static inline bool isMPEG4SyncFrame(const uint8_t* data, size_t size)
+{
+    const uint8_t* end = data + size;
+    for (const uint8_t* sc = findStartCode(data, end); sc + 4 < end; sc = findStartCode(sc + 3, end)) {
+        if (sc[3] == 0xb6)
+            return (sc[4] >> 6) == 0;
+    }
+    return false;
+}
+
+// H.263: picture coding type from PTYPE, or from MPPTYPE with PLUSPTYPE (ITU-T H.263 5.1)
+static inline bool isH263SyncFrame(const uint8_t* data, size_t size)
+{
+    if (size < 5 || data[0] != 0 || data[1] != 0 || (data[2] & 0xfc) != 0x80)
+        return false;
+
+    BitReader br(data, size);
+    br.skipBits(22 + 8);                // PSC, TR
+    if (br.getBits(2) != 2)             // PTYPE marker bits '10'
+        return false;
+    br.skipBits(3);                     // split screen, document camera, freeze release
+    unsigned format = br.getBits(3);
+    if (format != 7)
+        return br.getBits(1) == 0;      // INTRA
+
+    unsigned ufep = br.getBits(3);
+    if (ufep == 1)
+        br.skipBits(18);                // OPPTYPE
+    return !br.overflow() && br.getBits(3) == 0; // MPPTYPE picture type I
+}
+
+// lengthSize is the NAL length prefix size of H.264/H.265, see getNALLengthSize()
+static bool isSyncFrame(const char* mime, const uint8_t* data, size_t size, size_t lengthSize = 0)
+{
+    if (!mime || !data)
+        return false;
+    if (!strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_AVC))
+        return isAVCSyncFrame(data, size, lengthSize);
+    if (!strcasecmp(mime, MIMETYPE_VIDEO_HEVC))
+        return isHEVCSyncFrame(data, size, lengthSize);
+    if (!strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_MPEG4))
+        return isMPEG4SyncFrame(data, size);
+    if (!strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_H263))
+        return isH263SyncFrame(data, size);
+    return false;
+}
+
+typedef struct {
+    unsigned object_type; // core audio object type, 2 for AAC LC
+    int32_t sample_rate;
+    unsigned channels;
+    int32_t extension_sample_rate; // SBR output rate, 0 without SBR
+    bool sbr;
+    bool ps;
+} aac_config_t;
+
+static inline unsigned getAudioObjectType(BitReader& br)
+{
+    unsigned type = br.getBits(5);
+    return type == 31 ? 32 + br.getBits(6) : type;
+}
+
+static inline int32_t getSamplingFrequency(BitReader& br)
+{
+    unsigned index = br.getBits(4);
+    if (index == 0x0f)
+        return br.getBits(24);
+    return index < sizeof(kAACSamplingFreq) / sizeof(kAACSamplingFreq[0]) ? kAACSamplingFreq[index] : 0;
+}
+
+// ISO/IEC 14496-3 1.6.2.1 AudioSpecificConfig, explicit (AOT 5/29) and
+// backward compatible (sync extension 0x2b7/0x548) SBR and PS signalling.
+// The sync extension is only probed within configBits, 0 if the length is unknown.
+static bool parseAudioSpecificConfig(BitReader& br, aac_config_t* config, size_t configBits)
+{
+    memset(config, 0, sizeof(*config));
+    size_t start = br.position();
+
+    config->object_type = getAudioObjectType(br);
+    config->sample_rate = getSamplingFrequency(br);
+    config->channels = br.getBits(4);
+
+    if (config->object_type == 5 || config->object_type == 29) {
+        config->sbr = true;
+        config->ps = config->object_type == 29;
+        config->extension_sample_rate = getSamplingFrequency(br);
+        config->object_type = getAudioObjectType(br);
+        if (config->object_type == 22)
+            br.skipBits(4); // extensionChannelConfiguration
+    }
+
+    switch (config->object_type) {
+    case 1: case 2: case 3: case 4: case 6: case 7:
+    case 17: case 19: case 20: case 21: case 22: case 23: {
+        // GASpecificConfig
+        br.skipBits(1); // frameLengthFlag
+        if (br.getBits(1)) // dependsOnCoreCoder
+            br.skipBits(14);
+        unsigned extensionFlag = br.getBits(1);
+        if (config->channels == 0) {
+            LOGW("AAC program config element is not supported");
+            return false;
+        }
+        if (config->object_type == 6 || config->object_type == 20)
+            br.skipBits(3); // layerNr
+        if (extensionFlag) {
+            if (config->object_type == 22)
+                br.skipBits(16); // numOfSubFrame, layer_length
+            if (config->object_type == 17 || config->object_type == 19
+                    || config->object_type == 20 || config->object_type == 23)
+                br.skipBits(3); // resilience flags
+            br.skipBits(1); // extensionFlag3
+        }
+        break;
+    }
+    default:
+        LOGW("AAC audio object type %d is not supported", config->object_type);
+        return false;
+    }
+
+    if (config->object_type >= 17 && config->object_type <= 27 && br.getBits(2) > 1) {
+        LOGW("AAC epConfig is not supported");
+        return false;
+    }
+
+    if (!config->sbr && br.position() + 16 <= start + configBits) {
+        if (br.getBits(11) == 0x2b7 && getAudioObjectType(br) == 5) {
+            config->sbr = br.getBits(1);
+            if (config->sbr) {
+                config->extension_sample_rate = getSamplingFrequency(br);
+                if (br.position() + 12 <= start + configBits && br.getBits(11) == 0x548)
+                    config->ps = br.getBits(1);
+            }
+        }
+    }
+
+    return !br.overflow() && config->sample_rate > 0 && config->channels > 0;
+}
+
+static size_t makeAudioSpecificConfig(const adts_header_t& header, uint8_t* config)
+{
+    unsigned objectType = header.profile + 1;
+    config[0] = (objectType << 3) | (header.sf_index >> 1);
+    config[1] = ((header.sf_index & 1) << 7) | (header.channels << 3);
+    return 2;
+}
+
+static sp<MetaData> MakeAACCodecSpecificData(const uint8_t *config, size_t config_size)
+{
+    aac_config_t aac;
+    BitReader br(config, config_size);
+    if (!config || config_size < 2 || config_size > AAC_MAX_CONFIG_SIZE
+            || !parseAudioSpecificConfig(br, &aac, config_size * 8)) {
+        LOGV("Not correct config for aac codec");
+        return NULL;
+    }
 
-    static const int32_t kSamplingFreq[] = { 96000, 88200, 64000, 48000, 44100,
-            32000, 24000, 22050, 16000, 12000, 11025, 8000 };
+    LOGV("MakeAACCodecSpecificData type=%d rate=%d channels=%d sbr=%d(%d) ps=%d",
+            aac.object_type, aac.sample_rate, aac.channels, aac.sbr ? 1 : 0,
+            aac.extension_sample_rate, aac.ps ? 1 : 0);
 
-    meta->setInt32(kKeySampleRate, kSamplingFreq[sampling_freq_index]);
-    meta->setInt32(kKeyChannelCount, channel_configuration);
+    sp<MetaData> meta = new MetaData;
+    meta->setCString(kKeyMIMEType, MEDIA_MIMETYPE_AUDIO_AAC);
+    meta->setInt32(kKeySampleRate, aac.sample_rate);
+    meta->setInt32(kKeyChannelCount, aac.channels);
 
     uint8_t kStaticESDS[] = { 0x03, 22, 0x00,
             0x00, // ES_ID
@@ -280,41 +852,271 @@ static sp<MetaData> MakeAACCodecSpecificData(unsigned profile,
             0x00,
             0x05, 2
             // AudioSpecificInfo follows
-
-            // oooo offf fccc c000
-            // o - audioObjectType
-            // f - samplingFreqIndex
-            // c - channelConfig
-            , 0, 0
     };
 
-    int size = sizeof(kStaticESDS);
-    kStaticESDS[size - 2] = ((profile + 1) << 3) | (sampling_freq_index >> 1);
+    uint8_t esds[sizeof(kStaticESDS) + AAC_MAX_CONFIG_SIZE];
+    size_t size = sizeof(kStaticESDS);
+    memcpy(esds, kStaticESDS, size);
+    esds[1] += config_size - 2;
+    esds[6] += config_size - 2;
+    esds[size - 1] = config_size;
+    memcpy(esds + size, config, config_size);
+    size += config_size;
 
-    kStaticESDS[size - 1] = ((sampling_freq_index << 7) & 0x80)
-                                | (channel_configuration << 3);
-
-    meta->setData(kKeyESDS, 0, kStaticESDS, size);
+    meta->setData(kKeyESDS, 0, esds, size);
     return meta;
 }
 
-static sp<MetaData> MakeAACCodecSpecificData(const uint8_t *config, size_t config_size)
-{
-    if (config_size != 2) {
-        LOGV("Not correct config size for aac codec");
-        return NULL;
+// Splits ADTS or LOAS/LATM (AudioMuxElement with in-band StreamMuxConfig)
+// framed AAC into raw access units and derives the AudioSpecificConfig.
+class AACFramer {
+public:
+    enum Format {
+        FORMAT_UNKNOWN,
+        FORMAT_RAW,
+        FORMAT_ADTS,
+        FORMAT_LOAS,
+    };
+
+    struct Unit {
+        const uint8_t* data;
+        size_t size;
+    };
+
+    AACFramer()
+        : mFormat(FORMAT_UNKNOWN)
+        , mConfigSize(0)
+        , mSampleRate(0)
+        , mNumSubFrames(0)
+        , mFrameLengthType(0)
+        , mAudioMuxVersion(0)
+    {
+    }
+
+    static Format detect(const uint8_t* data, size_t size)
+    {
+        adts_header_t header;
+        if (parseADTSHeader(data, size, &header))
+            return FORMAT_ADTS;
+        if (size >= 3 && data[0] == 0x56 && (data[1] & 0xE0) == 0xE0)
+            return FORMAT_LOAS;
+        return FORMAT_RAW;
     }
 
-    unsigned profile = (config[0] >> 3) - 1;
+    // Detects framing on the first packet; false for raw AAC which carries no config
+    bool parseConfig(const uint8_t* data, size_t size)
+    {
+        mFormat = detect(data, size);
+        if (mFormat == FORMAT_ADTS) {
+            adts_header_t header;
+            parseADTSHeader(data, size, &header);
+            mConfigSize = makeAudioSpecificConfig(header, mConfig);
+            mSampleRate = kAACSamplingFreq[header.sf_index];
+        } else if (mFormat == FORMAT_LOAS) {
+            Vector<Unit> units;
+            split(data, size, units);
+        }
 
-    unsigned sf_index = ((config[0] & 7) << 1) | (config[1] >> 7);
+        LOGI("[AACFramer] format=%d, config size=%d, sample rate=%d", mFormat, mConfigSize, mSampleRate);
+        return mConfigSize > 0;
+    }
 
-    unsigned channel = (config[1] >> 3) & 0x0f;
+    Format format() const { return mFormat; }
+    const uint8_t* config() const { return mConfig; }
+    size_t configSize() const { return mConfigSize; }
 
-    LOGV("MakeAACCodecSpecificData %d %d %d", int(profile), int(sf_index), int(channel));
+    // Duration of one access unit, 1024 samples of the core sample rate
+    int64_t frameDurationUs() const { return mSampleRate > 0 ? 1024000000LL / mSampleRate : 0; }
 
-    return MakeAACCodecSpecificData(profile, sf_index, channel);
-}
+    // Strips all headers of a packet, units point into data or into the
+    // framer scratch buffer for unaligned LATM payloads. A frame cut short
+    // by the end of the packet ends the split, it is never passed on partially
+    size_t split(const uint8_t* data, size_t size, Vector<Unit>& units)
+    {
+        units.clear();
+        mScratch.clear();
+        mScratchUnits.clear();
+
+        if (mFormat == FORMAT_ADTS) {
+            adts_header_t header;
+            size_t offset = 0;
+            while (offset < size && parseADTSHeader(data + offset, size - offset, &header)) {
+                if (header.frame_size > size - offset) {
+                    LOGW("[AACFramer] ADTS frame of %d bytes truncated to %d", header.frame_size, size - offset);
+                    break;
+                }
+                size_t offsets[ADTS_MAX_RAW_BLOCKS], sizes[ADTS_MAX_RAW_BLOCKS];
+                size_t blocks = getADTSRawBlocks(data + offset, header, offsets, sizes);
+                if (blocks == 0)
+                    LOGW("[AACFramer] ADTS frame of %d raw data blocks without CRC dropped", header.raw_blocks);
+                for (size_t i = 0; i < blocks; ++i) {
+                    Unit unit;
+                    unit.data = data + offset + offsets[i];
+                    unit.size = sizes[i];
+                    units.push(unit);
+                }
+                offset += header.frame_size;
+            }
+        } else if (mFormat == FORMAT_LOAS) {
+            size_t offset = 0;
+            while (offset + 3 <= size && data[offset] == 0x56 && (data[offset + 1] & 0xE0) == 0xE0) {
+                size_t length = ((data[offset + 1] & 0x1F) << 8) | data[offset + 2];
+                offset += 3;
+                if (length > size - offset) {
+                    LOGW("[AACFramer] LOAS frame of %d bytes truncated to %d", length, size - offset);
+                    break;
+                }
+                if (!parseAudioMuxElement(data + offset, length, units))
+                    break;
+                offset += length;
+            }
+            // scratch may have been reallocated while growing
+            for (size_t i = 0; i < mScratchUnits.size(); ++i) {
+                Unit& unit = units.editItemAt(mScratchUnits[i]);
+                unit.data = mScratch.array() + (size_t)unit.data;
+            }
+        } else {
+            Unit unit;
+            unit.data = data;
+            unit.size = size;
+            units.push(unit);
+        }
+        return units.size();
+    }
+
+private:
+    static uint32_t latmGetValue(BitReader& br)
+    {
+        uint32_t bytes = br.getBits(2);
+        uint32_t value = 0;
+        for (uint32_t i = 0; i <= bytes; ++i)
+            value = (value << 8) | br.getBits(8);
+        return value;
+    }
+
+    // ISO/IEC 14496-3 1.7.3 StreamMuxConfig, single program and layer only
+    bool parseStreamMuxConfig(BitReader& br)
+    {
+        mAudioMuxVersion = br.getBits(1);
+        if (mAudioMuxVersion && br.getBits(1)) {
+            LOGW("[AACFramer] audioMuxVersionA is not supported");
+            return false;
+        }
+        if (mAudioMuxVersion)
+            latmGetValue(br); // taraBufferFullness
+
+        br.skipBits(1); // allStreamsSameTimeFraming
+        mNumSubFrames = br.getBits(6);
+        if (br.getBits(4) != 0 || br.getBits(3) != 0) {
+            LOGW("[AACFramer] multiple LATM programs/layers are not supported");
+            return false;
+        }
+
+        size_t ascLength = 0;
+        if (mAudioMuxVersion)
+            ascLength = latmGetValue(br);
+        size_t ascStart = br.position();
+
+        aac_config_t aac;
+        if (!parseAudioSpecificConfig(br, &aac, ascLength))
+            return false;
+
+        size_t ascBits = br.position() - ascStart;
+        if (mAudioMuxVersion && ascLength >= ascBits) {
+            br.skipBits(ascLength - ascBits); // fillBits
+            ascBits = ascLength;
+        }
+        if (ascBits > AAC_MAX_CONFIG_SIZE * 8)
+            return false;
+        br.copyBits(ascStart, ascBits, mConfig);
+        mConfigSize = (ascBits + 7) / 8;
+        mSampleRate = aac.sample_rate;
+
+        mFrameLengthType = br.getBits(3);
+        if (mFrameLengthType == 0) {
+            br.skipBits(8); // latmBufferFullness
+        } else {
+            LOGW("[AACFramer] LATM frameLengthType %d is not supported", mFrameLengthType);
+            return false;
+        }
+
+        if (br.getBits(1)) { // otherDataPresent
+            if (mAudioMuxVersion) {
+                latmGetValue(br);
+            } else {
+                uint32_t escape;
+                do {
+                    escape = br.getBits(1);
+                    br.skipBits(8);
+                } while (escape && !br.overflow());
+            }
+        }
+        if (br.getBits(1)) // crcCheckPresent
+            br.skipBits(8);
+        return !br.overflow();
+    }
+
+    bool parseAudioMuxElement(const uint8_t* data, size_t size, Vector<Unit>& units)
+    {
+        BitReader br(data, size);
+        if (!br.getBits(1)) { // useSameStreamMux
+            if (!parseStreamMuxConfig(br))
+                return false;
+        } else if (mConfigSize == 0) {
+            return false;
+        }
+
+        // subframes are passed on once the whole element parsed
+        Vector<Unit> element;
+        Vector<size_t> scratchUnits;
+        size_t scratchSize = mScratch.size();
+        for (uint32_t i = 0; i <= mNumSubFrames; ++i) {
+            size_t length = 0;
+            uint32_t tmp;
+            do {
+                tmp = br.getBits(8);
+                length += tmp;
+            } while (tmp == 255 && !br.overflow());
+
+            if (length > br.numBitsLeft() / 8) {
+                mScratch.resize(scratchSize);
+                return false;
+            }
+
+            Unit unit;
+            unit.size = length;
+            if ((br.position() & 7) == 0) {
+                unit.data = data + br.position() / 8;
+            } else {
+                // unaligned payload, store the scratch offset until split() fixes it up
+                size_t offset = mScratch.size();
+                mScratch.insertAt(0, offset, length);
+                br.copyBits(br.position(), length * 8, mScratch.editArray() + offset);
+                unit.data = reinterpret_cast<const uint8_t*>(offset);
+                scratchUnits.push(element.size());
+            }
+            element.push(unit);
+            br.skipBits(length * 8);
+        }
+
+        for (size_t i = 0; i < scratchUnits.size(); ++i)
+            mScratchUnits.push(units.size() + scratchUnits[i]);
+        units.appendVector(element);
+        return true;
+    }
+
+    Format mFormat;
+    uint8_t mConfig[AAC_MAX_CONFIG_SIZE];
+    size_t mConfigSize;
+    int32_t mSampleRate;
+
+    uint32_t mNumSubFrames;
+    uint32_t mFrameLengthType;
+    uint32_t mAudioMuxVersion;
+
+    Vector<uint8_t> mScratch;
+    Vector<size_t> mScratchUnits;
+};
 
 static size_t getFrameSize(int32_t colorFormat, int32_t width, int32_t height)
 {
@@ -338,17 +1140,239 @@ static size_t getFrameSize(int32_t colorFormat, int32_t width, int32_t height)
     return width * height * 4;
 }
 
-OMX_U32 getColorFormatForHWCodec(const sp<IOMX>& omx, const char* szMimeType)
-{
-    Vector<CodecCapabilities> results;
+class CodecCapabilityProvider : public RefBase {
+public:
+    virtual ~CodecCapabilityProvider() {}
+    virtual status_t query(const char* mimeType, bool hwOnly,
+            Vector<CodecCapabilities>* results) = 0;
+};
 
-    CHECK_EQ(QueryCodecs(omx, szMimeType, true, true, &results), (status_t) OK);
+class OMXCapabilityProvider : public CodecCapabilityProvider {
+public:
+    OMXCapabilityProvider(const sp<IOMX>& omx)
+        : mOMX(omx)
+    {
+    }
 
-    if (results.size() == 0)
-        return OMX_COLOR_FormatYUV420SemiPlanar;
+    virtual status_t query(const char* mimeType, bool hwOnly, Vector<CodecCapabilities>* results)
+    {
+        if (hwOnly)
+            return QueryCodecs(mOMX, mimeType, true, true, results);
+        // will retrieve hardware and software codecs
+        return QueryCodecs(mOMX, mimeType, true, results);
+    }
 
-    for (size_t c = 0; c < results.size(); ++c) {
-        for (size_t f = 0; f < results[c].mColorFormats.size(); ++f) {
+private:
+    sp<IOMX> mOMX;
+};
+
+// Process wide decoder capabilities per MIME type, populated lazily and
+// optionally persisted to a file keyed by the build fingerprint.
+class CodecCapabilityCache {
+public:
+    static CodecCapabilityCache& instance()
+    {
+        static CodecCapabilityCache s_instance;
+        return s_instance;
+    }
+
+    // Replaces the OMX query, e.g. with a fake provider; NULL restores it
+    void setProvider(const sp<CodecCapabilityProvider>& provider)
+    {
+        AutoMutex lock(mLock);
+        mProvider = provider;
+        mEntries.clear();
+    }
+
+    void setStoragePath(const char* path)
+    {
+        AutoMutex lock(mLock);
+        mPath = path ? path : "";
+        mLoaded = false;
+    }
+
+    void invalidate()
+    {
+        AutoMutex lock(mLock);
+        mEntries.clear();
+        if (!mPath.isEmpty())
+            unlink(mPath.string());
+        LOGI("[CodecCapabilityCache] invalidated");
+    }
+
+    status_t get(const sp<IOMX>& omx, const char* mimeType, bool hwOnly,
+            Vector<CodecCapabilities>* results)
+    {
+        AutoMutex lock(mLock);
+        if (!mLoaded) {
+            mLoaded = true;
+            load();
+        }
+
+        String8 key = makeKey(mimeType, hwOnly);
+        ssize_t index = mEntries.indexOfKey(key);
+        if (index >= 0) {
+            *results = mEntries.valueAt(index);
+            return OK;
+        }
+
+        sp<CodecCapabilityProvider> provider = mProvider;
+        if (provider == 0)
+            provider = new OMXCapabilityProvider(omx);
+
+        int64_t startTime = getTimestampMs();
+        status_t err = provider->query(mimeType, hwOnly, results);
+        LOGV("[CodecCapabilityCache] query %s hw=%d: %d codecs, %d ms", mimeType, hwOnly ? 1 : 0,
+                results->size(), getPeriodMs(startTime));
+        if (err != OK)
+            return err;
+
+        mEntries.add(key, *results);
+        save();
+        return OK;
+    }
+
+private:
+    CodecCapabilityCache()
+        : mLoaded(false)
+    {
+    }
+
+    static String8 makeKey(const char* mimeType, bool hwOnly)
+    {
+        String8 key(mimeType);
+        key.append(hwOnly ? " 1" : " 0");
+        return key;
+    }
+
+    static String8 fingerprint()
+    {
+        char value[PROPERTY_VALUE_MAX];
+        property_get("ro.build.fingerprint", value, "unknown");
+        return String8(value);
+    }
+
+    // File format, one record per line:
+    //   F <fingerprint>
+    //   M <mime> <hw only>
+    //   C <component> <color format count> <color formats...> <profile count> <profile level pairs...>
+    void load()
+    {
+        if (mPath.isEmpty())
+            return;
+
+        FILE* file = fopen(mPath.string(), "r");
+        if (!file)
+            return;
+
+        char line[4096];
+        String8 key;
+        bool valid = false;
+        while (fgets(line, sizeof(line), file)) {
+            char* saveptr = 0;
+            char* tag = strtok_r(line, " \n", &saveptr);
+            if (!tag)
+                continue;
+
+            if (!strcmp(tag, "F")) {
+                char* value = strtok_r(0, "\n", &saveptr);
+                valid = value && fingerprint() == String8(value);
+                if (!valid) {
+                    LOGI("[CodecCapabilityCache] stale cache %s", mPath.string());
+                    break;
+                }
+            } else if (valid && !strcmp(tag, "M")) {
+                char* mime = strtok_r(0, " \n", &saveptr);
+                char* hw = strtok_r(0, " \n", &saveptr);
+                if (!mime || !hw)
+                    break;
+                key = makeKey(mime, atoi(hw) != 0);
+                mEntries.add(key, Vector<CodecCapabilities>());
+            } else if (valid && !strcmp(tag, "C") && !key.isEmpty()) {
+                CodecCapabilities caps;
+                char* name = strtok_r(0, " \n", &saveptr);
+                if (!name)
+                    break;
+                caps.mComponentName = name;
+
+                char* token = strtok_r(0, " \n", &saveptr);
+                size_t count = token ? strtoul(token, 0, 0) : 0;
+                for (size_t i = 0; i < count && (token = strtok_r(0, " \n", &saveptr)); ++i)
+                    caps.mColorFormats.push((OMX_U32)strtoul(token, 0, 0));
+
+                token = strtok_r(0, " \n", &saveptr);
+                count = token ? strtoul(token, 0, 0) : 0;
+                for (size_t i = 0; i < count; ++i) {
+                    char* profile = strtok_r(0, " \n", &saveptr);
+                    char* level = strtok_r(0, " \n", &saveptr);
+                    if (!profile || !level)
+                        break;
+                    CodecProfileLevel profileLevel;
+                    profileLevel.mProfile = strtoul(profile, 0, 0);
+                    profileLevel.mLevel = strtoul(level, 0, 0);
+                    caps.mProfileLevels.push(profileLevel);
+                }
+                mEntries.editValueAt(mEntries.indexOfKey(key)).push(caps);
+            }
+        }
+        fclose(file);
+
+        if (!valid)
+            mEntries.clear();
+        LOGI("[CodecCapabilityCache] loaded %d MIME types from %s", mEntries.size(), mPath.string());
+    }
+
+    void save()
+    {
+        if (mPath.isEmpty())
+            return;
+
+        String8 tmpPath(mPath);
+        tmpPath.append(".tmp");
+        FILE* file = fopen(tmpPath.string(), "w");
+        if (!file) {
+            LOGW("[CodecCapabilityCache] cannot write %s: %s", tmpPath.string(), strerror(errno));
+            return;
+        }
+
+        fprintf(file, "F %s\n", fingerprint().string());
+        for (size_t i = 0; i < mEntries.size(); ++i) {
+            fprintf(file, "M %s\n", mEntries.keyAt(i).string());
+            const Vector<CodecCapabilities>& results = mEntries.valueAt(i);
+            for (size_t c = 0; c < results.size(); ++c) {
+                fprintf(file, "C %s %d", results[c].mComponentName.string(), results[c].mColorFormats.size());
+                for (size_t f = 0; f < results[c].mColorFormats.size(); ++f)
+                    fprintf(file, " %#x", (uint32_t)results[c].mColorFormats[f]);
+                fprintf(file, " %d", results[c].mProfileLevels.size());
+                for (size_t j = 0; j < results[c].mProfileLevels.size(); ++j) {
+                    fprintf(file, " %u %u", (uint32_t)results[c].mProfileLevels[j].mProfile,
+                            (uint32_t)results[c].mProfileLevels[j].mLevel);
+                }
+                fprintf(file, "\n");
+            }
+        }
+        fclose(file);
+        rename(tmpPath.string(), mPath.string());
+    }
+
+    Mutex mLock;
+    sp<CodecCapabilityProvider> mProvider;
+    KeyedVector<String8, Vector<CodecCapabilities> > mEntries;
+    String8 mPath;
+    bool mLoaded;
+};
+
+OMX_U32 getColorFormatForHWCodec(const sp<IOMX>& omx, const char* szMimeType)
+{
+    Vector<CodecCapabilities> results;
+
+    CHECK_EQ(CodecCapabilityCache::instance().get(omx, szMimeType, true, &results), (status_t) OK);
+
+    if (results.size() == 0)
+        return OMX_COLOR_FormatYUV420SemiPlanar;
+
+    for (size_t c = 0; c < results.size(); ++c) {
+        for (size_t f = 0; f < results[c].mColorFormats.size(); ++f) {
             const OMX_U32 colorFormat = results[c].mColorFormats[f];
             if (colorFormat == OMX_COLOR_FormatYUV420Planar ||
                     colorFormat == OMX_COLOR_FormatYUV420SemiPlanar ||
@@ -421,8 +1445,13 @@ static void dumpCodecProfiles(const sp<IOMX>& omx, bool queryDecoders)
 
         Vector<CodecCapabilities> results;
         // will retrieve hardware and software codecs
-        CHECK_EQ(QueryCodecs(omx, kMimeTypes[k], queryDecoders, &results),
-                (status_t) OK);
+        if (queryDecoders) {
+            CHECK_EQ(CodecCapabilityCache::instance().get(omx, kMimeTypes[k], false, &results),
+                    (status_t) OK);
+        } else {
+            CHECK_EQ(QueryCodecs(omx, kMimeTypes[k], queryDecoders, &results),
+                    (status_t) OK);
+        }
 
         for (size_t i = 0; i < results.size(); ++i) {
             LOGI("  %s '%s' supports profile levels:", codecType, results[i].mComponentName.string());
@@ -514,6 +1543,19 @@ public:
     {
     }
 
+    // Frame which borrows data kept alive by owner (e.g. a mapped file), no copy is made
+    explicit Frame(status_t status, const uint8_t* data, size_t size, int64_t pts, uint32_t flags,
+            const sp<RefBase>& owner)
+        : mStatus(status)
+        , mPts(pts)
+        , mSize(size)
+        , mBuffer(const_cast<uint8_t*>(data))
+        , mMediaBuffer(0)
+        , mFlags(flags)
+        , mOwner(owner)
+    {
+    }
+
     ~Frame()
     {
         clearBuffers(NULL);
@@ -541,7 +1583,18 @@ public:
             mFlags = other.mFlags;
             mMediaBuffer = other.mMediaBuffer;
 
-            if (oldSize > 0 && mSize <= oldSize && mBuffer) {
+            if (mOwner != 0) {
+                // borrowed data is never written to
+                mBuffer = NULL;
+                oldSize = 0;
+            }
+            mOwner = other.mOwner;
+
+            if (mOwner != 0) {
+                if (mBuffer)
+                    delete[] mBuffer;
+                mBuffer = other.mBuffer;
+            } else if (oldSize > 0 && mSize <= oldSize && mBuffer) {
                 // reuse frame allocated memory
                 memcpy(mBuffer, other.mBuffer, mSize);
             } else {
@@ -567,6 +1620,7 @@ public:
             uint8_t* buffer = mBuffer;
             uint32_t flags = mFlags;
             MediaBuffer* mediaBuffer = mMediaBuffer;
+            sp<RefBase> owner = mOwner;
 
             mStatus = other.mStatus;
             mPts = other.mPts;
@@ -574,6 +1628,7 @@ public:
             mBuffer = other.mBuffer;
             mFlags = other.mFlags;
             mMediaBuffer = other.mMediaBuffer;
+            mOwner = other.mOwner;
 
             other.mStatus = status;
             other.mPts = pts;
@@ -581,6 +1636,7 @@ public:
             other.mBuffer = buffer;
             other.mFlags = flags;
             other.mMediaBuffer = mediaBuffer;
+            other.mOwner = owner;
         }
     }
 
@@ -589,10 +1645,12 @@ public:
     void clearBuffers(MediaBufferQueue* mediaQueue)
     {
         if (mBuffer) {
-            delete[] mBuffer;
+            if (mOwner == 0)
+                delete[] mBuffer;
             mBuffer = 0;
             mSize = 0;
         }
+        mOwner.clear();
         if (mMediaBuffer) {
             if (mediaQueue)
                 mediaQueue->push_back(mMediaBuffer);
@@ -610,9 +1668,293 @@ public:
     uint8_t* mBuffer;
     uint32_t mFlags;
     MediaBuffer* mMediaBuffer;
+    sp<RefBase> mOwner;
+};
+
+// Persistent threads shared by all sessions for frame conversion in stripes.
+// Each thread starts on its own range of stripes and steals from the tail of
+// the others once it runs dry, the caller takes part as thread 0
+class ConvertPool {
+public:
+    typedef void (*StripeFunc)(void* arg, int32_t stripe);
+
+    static ConvertPool& instance()
+    {
+        static ConvertPool s_instance;
+        return s_instance;
+    }
+
+    // 0 picks the online CPU count
+    void setThreads(int32_t threads)
+    {
+        AutoMutex lock(mLock);
+        if (threads <= 0)
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+        mThreads = threads < 1 ? 1 : threads > CONVERT_MAX_THREADS ? CONVERT_MAX_THREADS : threads;
+    }
+
+    // Runs fn for stripes [0, count), returns once all of them are done
+    void run(StripeFunc fn, void* arg, int32_t count)
+    {
+        if (mRunLock.tryLock() != OK) {
+            // another session converts, this one does not wait for it
+            runInline(fn, arg, count);
+            return;
+        }
+
+        int32_t threads;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            threads = startWorkers_l();
+            if (threads > count)
+                threads = count;
+            if (threads > 1) {
+                mFunc = fn;
+                mArg = arg;
+                mCount = count;
+                mParticipants = threads;
+
+                AutoMutex jobLock(mJobLock);
+                mCompleted = 0;
+                for (int32_t i = 0; i < threads; ++i) {
+                    mRanges[i].begin = (int64_t)count * i / threads;
+                    mRanges[i].end = (int64_t)count * (i + 1) / threads;
+                }
+                mOpen = true;
+                mGeneration++;
+                mWork.broadcast();
+            }
+        }
+
+        if (threads <= 1) {
+            mRunLock.unlock();
+            runInline(fn, arg, count);
+            return;
+        }
+
+        work(0);
+
+        { // scopped lock
+            AutoMutex lock(mLock);
+            while (completed() < count)
+                mDone.wait(mLock);
+            // a worker still inside work() must not see the next job's ranges
+            mOpen = false;
+            while (mActive > 0)
+                mDone.wait(mLock);
+            mStats.jobs++;
+            mStats.stripes += count;
+        }
+        mRunLock.unlock();
+    }
+
+    void getStats(stagefright_convert_stats_t* stats)
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+        stats->threads = mThreads;
+        AutoMutex jobLock(mJobLock);
+        stats->stolen_stripes = mStolen;
+    }
+
+private:
+    class Worker : public Thread {
+    public:
+        Worker(ConvertPool* pool, int32_t index)
+            : Thread(false)
+            , mPool(pool)
+            , mIndex(index)
+            , mGeneration(0)
+        {}
+
+    private:
+        virtual bool threadLoop() { return mPool->workerLoop(mIndex, mGeneration); }
+
+        ConvertPool* mPool;
+        int32_t mIndex;
+        uint32_t mGeneration;
+    };
+
+    ConvertPool()
+        : mThreads(1)
+        , mFunc(0)
+        , mArg(0)
+        , mCount(0)
+        , mParticipants(0)
+        , mOpen(false)
+        , mGeneration(0)
+        , mCompleted(0)
+        , mStolen(0)
+        , mActive(0)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+        memset(mRanges, 0, sizeof(mRanges));
+        setThreads(0);
+    }
+
+    ConvertPool(const ConvertPool&);
+    ConvertPool &operator=(const ConvertPool&);
+
+    int32_t startWorkers_l()
+    {
+        while ((int32_t)mWorkers.size() + 1 < mThreads) {
+            sp<Worker> worker = new Worker(this, mWorkers.size() + 1);
+            if (worker->run(0, ANDROID_PRIORITY_DISPLAY) != OK) {
+                LOGE("[ConvertPool] cannot start worker %d", mWorkers.size() + 1);
+                break;
+            }
+            mWorkers.push(worker);
+        }
+        int32_t threads = mWorkers.size() + 1;
+        return threads < mThreads ? threads : mThreads;
+    }
+
+    bool workerLoop(int32_t index, uint32_t& generation)
+    {
+        { // scopped lock
+            AutoMutex lock(mLock);
+            while (generation == mGeneration)
+                mWork.wait(mLock);
+            generation = mGeneration;
+            if (!mOpen || index >= mParticipants)
+                return true;
+            mActive++;
+        }
+
+        work(index);
+
+        AutoMutex lock(mLock);
+        mActive--;
+        mDone.broadcast();
+        return true;
+    }
+
+    void work(int32_t index)
+    {
+        int32_t stripe = -1;
+        while ((stripe = next(index, stripe)) >= 0)
+            mFunc(mArg, stripe);
+    }
+
+    // Counts the finished stripe and hands out the next one, -1 when none is left
+    int32_t next(int32_t index, int32_t finished)
+    {
+        { // scopped lock
+            AutoMutex jobLock(mJobLock);
+            if (finished < 0 || ++mCompleted < mCount)
+                return take_l(index);
+        }
+        // mLock goes first everywhere else
+        AutoMutex lock(mLock);
+        mDone.broadcast();
+        return -1;
+    }
+
+    // The front of the thread's own range or the tail of another's
+    int32_t take_l(int32_t index)
+    {
+        Range& own = mRanges[index];
+        if (own.begin < own.end)
+            return own.begin++;
+        for (int32_t i = 1; i < mParticipants; ++i) {
+            Range& victim = mRanges[(index + i) % mParticipants];
+            if (victim.begin < victim.end) {
+                mStolen++;
+                return --victim.end;
+            }
+        }
+        return -1;
+    }
+
+    int32_t completed()
+    {
+        AutoMutex jobLock(mJobLock);
+        return mCompleted;
+    }
+
+    void runInline(StripeFunc fn, void* arg, int32_t count)
+    {
+        for (int32_t i = 0; i < count; ++i)
+            fn(arg, i);
+        AutoMutex lock(mLock);
+        mStats.inline_jobs++;
+    }
+
+    int32_t mThreads;
+    Vector<sp<Worker> > mWorkers;
+
+    // the running job, set up under mLock before mGeneration moves on
+    StripeFunc mFunc;
+    void* mArg;
+    int32_t mCount;
+    int32_t mParticipants;
+    bool mOpen;
+    uint32_t mGeneration;
+
+    // ranges and counters of the running job under mJobLock, taken once per stripe
+    struct Range {
+        int32_t begin;
+        int32_t end;
+    };
+    Range mRanges[CONVERT_MAX_THREADS];
+    int32_t mCompleted;
+    int32_t mStolen;
+    int32_t mActive;
+
+    stagefright_convert_stats_t mStats;
+    Mutex mRunLock;
+    Mutex mLock;
+    Mutex mJobLock;
+    Condition mWork;
+    Condition mDone;
+};
+
+// Media API connections per window, shared by the sessions rendering into it,
+// so a session torn down late does not disconnect its successor
+class WindowConnections {
+public:
+    static WindowConnections& instance()
+    {
+        static WindowConnections s_instance;
+        return s_instance;
+    }
+
+    void acquire(ANativeWindow* window)
+    {
+        AutoMutex lock(mLock);
+        ssize_t index = mCount.indexOfKey(window);
+        if (index >= 0) {
+            mCount.editValueAt(index)++;
+            return;
+        }
+
+        LOGI("[NativeWindowRenderer] connect window!");
+        int err = native_window_api_connect(window, NATIVE_WINDOW_API_MEDIA);
+        LOGR(err,"[Decoder] native_window_api_connect: %d", err);
+        err = native_window_set_scaling_mode(window, NATIVE_WINDOW_SCALING_MODE_SCALE_TO_WINDOW);
+        LOGR(err,"[Decoder] native_window_set_scaling_mode: %d", err);
+        mCount.add(window, 1);
+    }
+
+    void release(ANativeWindow* window)
+    {
+        AutoMutex lock(mLock);
+        ssize_t index = mCount.indexOfKey(window);
+        if (index < 0 || --mCount.editValueAt(index) > 0)
+            return;
+
+        LOGI("[NativeWindowRenderer] disconnect window!");
+        native_window_api_disconnect(window, NATIVE_WINDOW_API_MEDIA);
+        mCount.removeItemsAt(index);
+    }
+
+private:
+    WindowConnections() {}
+
+    KeyedVector<ANativeWindow*, int32_t> mCount;
+    Mutex mLock;
 };
 
-static volatile bool s_windowConnected = false;
 class NativeWindowRenderer : public RefBase {
 public:
     NativeWindowRenderer(const sp<ANativeWindow>& nativeWindow)
@@ -626,8 +1968,13 @@ public:
         , mCropBottom(0)
         , mCropWidth(0)
         , mCropHeight(0)
-        , mFenceFd(-1)
         , mSoftwareRendering(false)
+        , mConnected(false)
+        , mBufferWrappers(0)
+        , mBufferCacheHits(0)
+        , mFenceWaits(0)
+        , mFenceTimeouts(0)
+        , mMaxFenceWaitUs(0)
     {
         LOG_DEBUG;
         connectWindow();
@@ -636,29 +1983,23 @@ public:
     virtual ~NativeWindowRenderer()
     {
         LOG_DEBUG;
+        clearBufferCache();
         disconnectWindow();
     }
 
     void connectWindow()
     {
-        if (!s_windowConnected) {
-            if (mNativeWindow != 0) {
-                LOGI("[NativeWindowRenderer] connect window!");
-                int err = native_window_api_connect(mNativeWindow.get(), NATIVE_WINDOW_API_MEDIA);
-                LOGR(err,"[Decoder] native_window_api_connect: %d", err);
-                err = native_window_set_scaling_mode(mNativeWindow.get(), NATIVE_WINDOW_SCALING_MODE_SCALE_TO_WINDOW);
-                LOGR(err,"[Decoder] native_window_set_scaling_mode: %d", err);
-            }
-            s_windowConnected = true;
+        if (!mConnected && mNativeWindow != 0) {
+            WindowConnections::instance().acquire(mNativeWindow.get());
+            mConnected = true;
         }
     }
 
     void disconnectWindow()
     {
-        if (mNativeWindow != 0 && s_windowConnected) {
-            LOGI("[NativeWindowRenderer] disconnect window!");
-            native_window_api_disconnect(mNativeWindow.get(), NATIVE_WINDOW_API_MEDIA);
-            s_windowConnected = false;
+        if (mConnected) {
+            WindowConnections::instance().release(mNativeWindow.get());
+            mConnected = false;
         }
     }
 
@@ -666,6 +2007,7 @@ public:
     {
         LOG_DEBUG;
         mSoftwareRendering = true;
+        clearBufferCache(); // the window reallocates its buffers for the new geometry
 
         CHECK(meta->findInt32(kKeyColorFormat, &mColorFormat));
         CHECK(meta->findInt32(kKeyWidth, &mWidth));
@@ -743,18 +2085,31 @@ public:
             return;
 
         ANativeWindowBuffer* anb = NULL;
+        int fenceFd = -1;
 #if !defined(ANDROID_ICS)
-        status_t err = mNativeWindow->dequeueBuffer(mNativeWindow.get(), &anb, &mFenceFd);
+        status_t err = mNativeWindow->dequeueBuffer(mNativeWindow.get(), &anb, &fenceFd);
 #else
         status_t err = mNativeWindow->dequeueBuffer(mNativeWindow.get(), &anb);
 #endif
         if (err != NO_ERROR || !anb) {
             LOGE("[NativeWindowRenderer] ERROR: couldn't get video buffer(%d)!", err);
+            if (fenceFd >= 0)
+                close(fenceFd);
+            return;
+        }
+
+        sp<GraphicBuffer> buf = wrapBuffer(anb, fenceFd);
+        if (!waitReleaseFence(anb)) {
+            // the consumer still reads it, the frame is dropped rather than torn
+#if !defined(ANDROID_ICS)
+            mNativeWindow->cancelBuffer(mNativeWindow.get(), anb, takeReleaseFence(anb));
+#else
+            mNativeWindow->cancelBuffer(mNativeWindow.get(), anb);
+#endif
             return;
         }
 
         uint8_t* img = NULL;
-        sp<GraphicBuffer> buf(new GraphicBuffer(anb, false));
 
         buf->lock(GRALLOC_USAGE_SW_READ_NEVER | GRALLOC_USAGE_SW_WRITE_OFTEN, (void**) (&img));
         // http://stackoverflow.com/questions/10059738/qomx-color-formatyuv420packedsemiplanar64x32tile2m8ka-color-format
@@ -775,8 +2130,9 @@ public:
         }
         buf->unlock();
 
+        // written by the CPU, nothing left to wait for
 #if !defined(ANDROID_ICS)
-        mNativeWindow->queueBuffer(mNativeWindow.get(), buf->getNativeBuffer(), mFenceFd);
+        mNativeWindow->queueBuffer(mNativeWindow.get(), buf->getNativeBuffer(), -1);
 #else
         mNativeWindow->queueBuffer(mNativeWindow.get(), buf->getNativeBuffer());
 #endif
@@ -792,7 +2148,7 @@ public:
         native_window_set_buffers_timestamp(mNativeWindow.get(), timeUs * 1000);
 
 #if !defined(ANDROID_ICS)
-        status_t err = mNativeWindow->queueBuffer(mNativeWindow.get(), buffer->graphicBuffer().get(), mFenceFd);
+        status_t err = mNativeWindow->queueBuffer(mNativeWindow.get(), buffer->graphicBuffer().get(), -1);
 #else
         status_t err = mNativeWindow->queueBuffer(mNativeWindow.get(), buffer->graphicBuffer().get());
 #endif
@@ -804,80 +2160,249 @@ public:
         metaData->setInt32(kKeyRendered, 1);
     }
 
+    void getBufferStats(stagefright_render_stats_t* stats)
+    {
+        AutoMutex lock(mCacheLock);
+        stats->buffer_wrappers = mBufferWrappers;
+        stats->buffer_cache_hits = mBufferCacheHits;
+        stats->fence_waits = mFenceWaits;
+        stats->fence_timeouts = mFenceTimeouts;
+        stats->max_fence_wait_us = mMaxFenceWaitUs;
+    }
+
     ANativeWindow* window() const { return mNativeWindow != 0 ? mNativeWindow.get() : 0; }
     bool isSWRenderng() const { return mSoftwareRendering; }
+    // the decoder renders into the window itself again
+    void resetSoftwareRendering() { mSoftwareRendering = false; }
 
 private:
     NativeWindowRenderer(const NativeWindowRenderer&);
     NativeWindowRenderer &operator=(const NativeWindowRenderer&);
 
-    void convertYUV420Planar_to_YV12(uint8_t* dst, ANativeWindowBuffer* buf,
-            const uint8_t *data)
+    struct CachedBuffer {
+        CachedBuffer()
+            : releaseFenceFd(-1)
+        {}
+
+        sp<GraphicBuffer> buffer;
+        int releaseFenceFd; // the consumer's fence from dequeueBuffer, owned until waited on
+    };
+
+    // The window cycles through a few buffers, their wrappers are kept by handle
+    sp<GraphicBuffer> wrapBuffer(ANativeWindowBuffer* anb, int releaseFenceFd)
     {
-        const uint8_t *src_y = (const uint8_t *) data;
-        const uint8_t *src_u = (const uint8_t *) data + mWidth * mHeight;
-        const uint8_t *src_v = src_u + (mWidth / 2 * mHeight / 2);
+        AutoMutex lock(mCacheLock);
+        ssize_t index = mBufferCache.indexOfKey(anb->handle);
+        if (index < 0) {
+            // a cached wrapper keeps its buffer and handle alive, so a handle is
+            // never reused while cached, a full cache means the window reallocated
+            if (mBufferCache.size() >= GRAPHIC_BUFFER_CACHE_SIZE)
+                clearBufferCache_l();
+
+            CachedBuffer cached;
+            cached.buffer = new GraphicBuffer(anb, false);
+            index = mBufferCache.add(anb->handle, cached);
+            mBufferWrappers++;
+        } else {
+            mBufferCacheHits++;
+        }
 
-        uint8_t *dst_y = (uint8_t *) dst;
-        size_t dst_y_size = buf->stride * buf->height;
-        size_t dst_c_stride = ALIGN(buf->stride / 2, 16);
-        size_t dst_c_size = dst_c_stride * buf->height / 2;
-        uint8_t *dst_v = dst_y + dst_y_size;
-        uint8_t *dst_u = dst_v + dst_c_size;
+        CachedBuffer& cached = mBufferCache.editValueAt(index);
+        if (cached.releaseFenceFd >= 0)
+            close(cached.releaseFenceFd);
+        cached.releaseFenceFd = releaseFenceFd;
+        return cached.buffer;
+    }
+
+    // Polls the buffer's release fence right before the CPU write, false on timeout
+    bool waitReleaseFence(ANativeWindowBuffer* anb)
+    {
+        int fenceFd;
+        { // scopped lock
+            AutoMutex lock(mCacheLock);
+            ssize_t index = mBufferCache.indexOfKey(anb->handle);
+            fenceFd = index >= 0 ? mBufferCache.valueAt(index).releaseFenceFd : -1;
+        }
+        if (fenceFd < 0)
+            return true;
+
+        struct pollfd pfd;
+        pfd.fd = fenceFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        int64_t startUs = getMonotonicUs();
+        int res = poll(&pfd, 1, 0);
+        bool waited = res == 0;
+        while (res == 0 || (res < 0 && errno == EINTR)) {
+            int wait = FENCE_TIMEOUT_MS - (getMonotonicUs() - startUs) / 1000;
+            if (wait <= 0)
+                break;
+            res = poll(&pfd, 1, wait);
+        }
+        int32_t waitUs = getMonotonicUs() - startUs;
 
-        for (int y = 0; y < mCropHeight; ++y) {
-            memcpy(dst_y, src_y, mCropWidth);
+        AutoMutex lock(mCacheLock);
+        if (waited) {
+            mFenceWaits++;
+            if (waitUs > mMaxFenceWaitUs)
+                mMaxFenceWaitUs = waitUs;
+        }
+        if (res <= 0) {
+            mFenceTimeouts++;
+            LOGW("[NativeWindowRenderer] release fence not signaled in %d ms", FENCE_TIMEOUT_MS);
+            return false;
+        }
 
-            src_y += mWidth;
-            dst_y += buf->stride;
+        ssize_t index = mBufferCache.indexOfKey(anb->handle);
+        if (index >= 0 && mBufferCache.valueAt(index).releaseFenceFd == fenceFd) {
+            close(fenceFd);
+            mBufferCache.editValueAt(index).releaseFenceFd = -1;
         }
+        return true;
+    }
+
+    // Hands the fence back to the window with a cancelled buffer
+    int takeReleaseFence(ANativeWindowBuffer* anb)
+    {
+        AutoMutex lock(mCacheLock);
+        ssize_t index = mBufferCache.indexOfKey(anb->handle);
+        if (index < 0)
+            return -1;
+        int fenceFd = mBufferCache.valueAt(index).releaseFenceFd;
+        mBufferCache.editValueAt(index).releaseFenceFd = -1;
+        return fenceFd;
+    }
 
-        for (int y = 0; y < (mCropHeight + 1) / 2; ++y) {
-            memcpy(dst_u, src_u, (mCropWidth + 1) / 2);
-            memcpy(dst_v, src_v, (mCropWidth + 1) / 2);
+    void clearBufferCache()
+    {
+        AutoMutex lock(mCacheLock);
+        clearBufferCache_l();
+    }
 
-            src_u += mWidth / 2;
-            src_v += mWidth / 2;
-            dst_u += dst_c_stride;
-            dst_v += dst_c_stride;
+    void clearBufferCache_l()
+    {
+        for (size_t i = 0; i < mBufferCache.size(); ++i) {
+            if (mBufferCache.valueAt(i).releaseFenceFd >= 0)
+                close(mBufferCache.valueAt(i).releaseFenceFd);
         }
+        mBufferCache.clear();
+    }
+
+    void convertYUV420Planar_to_YV12(uint8_t* dst, ANativeWindowBuffer* buf,
+            const uint8_t *data)
+    {
+        ConvertJob job;
+        setupConvertJob(job, dst, buf, data);
+        job.srcU = data + mWidth * mHeight;
+        job.srcV = job.srcU + (mWidth / 2 * mHeight / 2);
+        job.srcUV = NULL;
+        job.srcCStride = mWidth / 2;
+        convert(job);
     }
 
     void convertYUV420PackedSemiPlanar_to_YV12(uint8_t* dst,
             ANativeWindowBuffer* buf, const uint8_t *data)
     {
-        const uint8_t *src_y = (const uint8_t *) data;
-        const uint8_t *src_uv = (const uint8_t *) data
-                + mWidth * (mHeight - mCropTop / 2);
-        uint8_t *dst_y = (uint8_t *) dst;
+        ConvertJob job;
+        setupConvertJob(job, dst, buf, data);
+        job.srcU = job.srcV = NULL;
+        job.srcUV = data + mWidth * (mHeight - mCropTop / 2);
+        job.srcCStride = mWidth;
+        convert(job);
+    }
+
+    struct ConvertJob {
+        const uint8_t* srcY;
+        const uint8_t* srcU;
+        const uint8_t* srcV;
+        const uint8_t* srcUV; // interleaved chroma, NULL for planar
+        int32_t srcStride;
+        int32_t srcCStride;
+        uint8_t* dstY;
+        uint8_t* dstU;
+        uint8_t* dstV;
+        int32_t dstStride;
+        int32_t dstCStride;
+        int32_t width;
+        int32_t height;
+        int32_t chromaRows;
+        int32_t stripeRows; // chroma rows, each with its two luma rows
+    };
 
+    void setupConvertJob(ConvertJob& job, uint8_t* dst, ANativeWindowBuffer* buf, const uint8_t* data)
+    {
         size_t dst_y_size = buf->stride * buf->height;
         size_t dst_c_stride = ALIGN(buf->stride / 2, 16);
         size_t dst_c_size = dst_c_stride * buf->height / 2;
-        uint8_t *dst_v = dst_y + dst_y_size;
-        uint8_t *dst_u = dst_v + dst_c_size;
 
-        for (int y = 0; y < mCropHeight; ++y) {
-            memcpy(dst_y, src_y, mCropWidth);
+        job.srcY = data;
+        job.srcStride = mWidth;
+        job.dstY = dst;
+        job.dstV = dst + dst_y_size;
+        job.dstU = job.dstV + dst_c_size;
+        job.dstStride = buf->stride;
+        job.dstCStride = dst_c_stride;
+        job.width = mCropWidth;
+        job.height = mCropHeight;
+        job.chromaRows = (mCropHeight + 1) / 2;
+        job.stripeRows = CONVERT_STRIPE_BYTES / (3 * mWidth);
+        if (job.stripeRows < 1)
+            job.stripeRows = 1;
+    }
 
-            src_y += mWidth;
-            dst_y += buf->stride;
+    static void convert(ConvertJob& job)
+    {
+        int32_t stripes = (job.chromaRows + job.stripeRows - 1) / job.stripeRows;
+        if (job.width * job.height < CONVERT_PARALLEL_MIN_PIXELS) {
+            for (int32_t i = 0; i < stripes; ++i)
+                convertStripe(&job, i);
+            return;
         }
+        ConvertPool::instance().run(convertStripe, &job, stripes);
+    }
 
-        for (int y = 0; y < (mCropHeight + 1) / 2; ++y) {
-            size_t tmp = (mCropWidth + 1) / 2;
-            for (size_t x = 0; x < tmp; ++x) {
-                dst_u[x] = src_uv[2 * x];
-                dst_v[x] = src_uv[2 * x + 1];
+    // Luma and chroma of a stripe together, the source is read once while in cache
+    static void convertStripe(void* arg, int32_t stripe)
+    {
+        const ConvertJob* job = static_cast<const ConvertJob*>(arg);
+        int32_t c0 = stripe * job->stripeRows;
+        int32_t c1 = c0 + job->stripeRows < job->chromaRows ? c0 + job->stripeRows : job->chromaRows;
+        int32_t y1 = 2 * c1 < job->height ? 2 * c1 : job->height;
+
+        for (int32_t y = 2 * c0; y < y1; ++y)
+            memcpy(job->dstY + y * job->dstStride, job->srcY + y * job->srcStride, job->width);
+
+        size_t width = (job->width + 1) / 2;
+        for (int32_t c = c0; c < c1; ++c) {
+            uint8_t* dst_u = job->dstU + c * job->dstCStride;
+            uint8_t* dst_v = job->dstV + c * job->dstCStride;
+            if (job->srcUV) {
+                deinterleaveUV(dst_u, dst_v, job->srcUV + c * job->srcCStride, width);
+            } else {
+                memcpy(dst_u, job->srcU + c * job->srcCStride, width);
+                memcpy(dst_v, job->srcV + c * job->srcCStride, width);
             }
+        }
+    }
 
-            src_uv += mWidth;
-            dst_u += dst_c_stride;
-            dst_v += dst_c_stride;
+    static void deinterleaveUV(uint8_t* dst_u, uint8_t* dst_v, const uint8_t* src_uv, size_t width)
+    {
+        size_t x = 0;
+#if defined(__ARM_NEON__)
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x2_t uv = vld2q_u8(src_uv + 2 * x);
+            vst1q_u8(dst_u + x, uv.val[0]);
+            vst1q_u8(dst_v + x, uv.val[1]);
+        }
+#endif
+        for (; x < width; ++x) {
+            dst_u[x] = src_uv[2 * x];
+            dst_v[x] = src_uv[2 * x + 1];
         }
     }
 
-    int ALIGN(int x, int y)
+    static int ALIGN(int x, int y)
     {
         // y must be a power of 2.
         return (x + y - 1) & ~(y - 1);
@@ -916,17 +2441,133 @@ private:
     int32_t mWidth, mHeight;
     int32_t mCropLeft, mCropTop, mCropRight, mCropBottom;
     int32_t mCropWidth, mCropHeight;
-    int32_t mFenceFd;
     bool mSoftwareRendering;
+    bool mConnected;
+
+    KeyedVector<buffer_handle_t, CachedBuffer> mBufferCache;
+    int32_t mBufferWrappers;
+    int32_t mBufferCacheHits;
+    int32_t mFenceWaits;
+    int32_t mFenceTimeouts;
+    int32_t mMaxFenceWaitUs;
+    Mutex mCacheLock;
 };
 
-class Decoder;
-class StagefrightContext;
-class MediaStreamSource : public MediaSource {
+// Converts and queues software rendered frames off the caller's thread
+class RenderStage : public Thread {
 public:
-    MediaStreamSource(Decoder* decoder, sp<MetaData>& meta)
+    RenderStage(const sp<NativeWindowRenderer>& renderer)
+        : Thread(false)
+        , mRenderer(renderer)
+        , mConvertUs(0)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+    }
+
+    // Takes the frame data, waits a frame period for room before dropping the oldest
+    void post(Frame& frame)
+    {
+        AutoMutex lock(mLock);
+        if (mQueue.size() >= RENDER_QUEUE_DEPTH) {
+            mSpace.waitRelative(mLock, (nsecs_t)s_frameDisplayTimeMsec * 1000000);
+            if (mQueue.size() >= RENDER_QUEUE_DEPTH) {
+                mQueue.erase(mQueue.begin());
+                mStats.dropped++;
+            }
+        }
+        mQueue.push_back(Frame());
+        (--mQueue.end())->swap(frame);
+        if ((int32_t)mQueue.size() > mStats.max_queued)
+            mStats.max_queued = mQueue.size();
+        mCondition.signal();
+    }
+
+    void clear()
+    {
+        AutoMutex lock(mLock);
+        mQueue.clear();
+        mSpace.broadcast();
+    }
+
+    void stop()
+    {
+        requestExit();
+        clear();
+        { // scopped lock
+            AutoMutex lock(mLock);
+            mCondition.signal();
+        }
+        requestExitAndWait();
+    }
+
+    void getStats(stagefright_render_stats_t* stats)
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+        stats->queued = mQueue.size();
+        stats->avg_convert_us = mStats.rendered > 0 ? (int32_t)(mConvertUs / mStats.rendered) : 0;
+    }
+
+private:
+    virtual bool threadLoop()
+    {
+        Frame frame;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            while (mQueue.empty() && !exitPending())
+                mCondition.wait(mLock);
+            if (exitPending())
+                return false;
+            frame.swap(*mQueue.begin());
+            mQueue.erase(mQueue.begin());
+            mSpace.signal();
+        }
+
+        int64_t startUs = getMonotonicUs();
+        mRenderer->render(frame.mBuffer, frame.mSize);
+        int32_t convertUs = getMonotonicUs() - startUs;
+
+        AutoMutex lock(mLock);
+        mStats.rendered++;
+        mStats.last_convert_us = convertUs;
+        if (convertUs > mStats.max_convert_us)
+            mStats.max_convert_us = convertUs;
+        mConvertUs += convertUs;
+        return true;
+    }
+
+    sp<NativeWindowRenderer> mRenderer;
+    List<Frame> mQueue;
+    stagefright_render_stats_t mStats;
+    int64_t mConvertUs;
+
+    Mutex mLock;
+    Condition mCondition;
+    Condition mSpace;
+};
+
+// MediaBuffer over borrowed memory, keeps the owner alive until the codec releases it
+class BorrowedMediaBuffer : public MediaBuffer {
+public:
+    BorrowedMediaBuffer(const uint8_t* data, size_t size, const sp<RefBase>& owner)
+        : MediaBuffer(const_cast<uint8_t*>(data), size)
+        , mOwner(owner)
+    {
+    }
+
+protected:
+    virtual ~BorrowedMediaBuffer() {}
+
+private:
+    sp<RefBase> mOwner;
+};
+
+class Decoder;
+class StagefrightContext;
+class MediaStreamSource : public MediaSource {
+public:
+    MediaStreamSource(Decoder* decoder, sp<MetaData>& meta)
         : mFrameSize(0)
-        , mSourceType(SOURCE_UNKNOWN)
         , mDecoder(decoder)
     {
         LOG_DEBUG;
@@ -960,7 +2601,6 @@ public:
         if (meta->findCString(kKeyMIMEType, &mime)) {
             if (!strcasecmp(mime, MEDIA_MIMETYPE_AUDIO_AAC)) {
                 mSourceMeta = meta;
-                mSourceType = SOURCE_AAC;
                 mBufferGroup.add_buffer(new MediaBuffer(AAC_MAX_FRAME_SIZE));
                 return;
             }
@@ -988,59 +2628,121 @@ public:
                 mBufferGroup.add_buffer(buffer);
             }
         }
-        if (mime) {
-            if (!strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_AVC)) {
-                mSourceType = SOURCE_AVC;
-            } else if (!strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_MPEG4)) {
-                mSourceType = SOURCE_MPEG4;
-            } else if (!strcasecmp(mime, MEDIA_MIMETYPE_VIDEO_H263)) {
-                mSourceType = SOURCE_H263;
-            }
-        }
-        LOGV("[MediaStreamSource] frameSize=%d, sourceType=%d", mFrameSize, mSourceType);
+        LOGV("[MediaStreamSource] frameSize=%d, mime=%s", mFrameSize, mime ? mime : "");
     }
 
 private:
-    bool isIDRFrame(const uint8_t* data, size_t size)
+    int mFrameSize;
+    MediaBufferGroup mBufferGroup;
+    sp<MetaData> mSourceMeta;
+
+    Decoder* mDecoder;
+};
+
+// Hands decoded frames on with strictly increasing pts: a bounded window
+// sorts output stamped in decode order, frames without a pts are interpolated
+// from the estimated frame duration, a frame that missed the window is
+// dropped. Frames pass on the decoder thread only
+class PtsReorder {
+public:
+    PtsReorder()
+        : mWindow(0)
     {
-        if (mSourceType == SOURCE_AAC) {
-            return false;
-        } else if (mSourceType == SOURCE_AVC) {
-            for (size_t i = 0; i + 3 < size && i < 60; ++i) {
-                if (!memcmp("\x00\x00\x01", &data[i], 3)) {
-                    uint8_t nalType = data[i + 3] & 0x1f;
-                    if (nalType == 5) {
-                        return true;
-                    }
-                }
+        memset(&mStats, 0, sizeof(mStats));
+        mStats.frame_duration_us = s_frameDisplayTimeMsec * 1000;
+        mStats.last_pts = -1;
+    }
+
+    ~PtsReorder() { reset(); }
+
+    void setWindow(int32_t frames)
+    {
+        AutoMutex lock(mLock);
+        mWindow = frames < 0 ? 0 : frames > REORDER_MAX_WINDOW ? REORDER_MAX_WINDOW : frames;
+    }
+
+    // Takes the frame, a missing pts keeps its decode position
+    void add(Frame& frame)
+    {
+        AutoMutex lock(mLock);
+        int64_t pts = frame.mPts < 0 ? -1 : frame.mPts;
+
+        List<Frame>::iterator it = mPending.end();
+        while (pts >= 0 && it != mPending.begin()) {
+            List<Frame>::iterator prev = it;
+            if ((--prev)->mPts <= pts)
+                break;
+            it = prev;
+        }
+        if (it != mPending.end())
+            mStats.reordered++;
+
+        it = mPending.insert(it, Frame());
+        it->swap(frame);
+        it->mPts = pts;
+    }
+
+    // The earliest frame once the window is full, or any frame when draining
+    bool next(Frame& frame, bool drain)
+    {
+        AutoMutex lock(mLock);
+        while (!mPending.empty() && (drain || mPending.size() > (size_t)mWindow)) {
+            frame.clearBuffers(NULL);
+            frame.swap(*mPending.begin());
+            mPending.erase(mPending.begin());
+
+            int64_t last = mStats.last_pts;
+            if (frame.mPts < 0) {
+                frame.mPts = last < 0 ? 0 : last + mStats.frame_duration_us;
+                mStats.interpolated++;
+            } else if (last >= 0 && frame.mPts <= last) {
+                // shown now it would go back in time, its codec buffer returns
+                frame.clearBuffers(NULL);
+                mStats.late++;
+                continue;
+            } else if (last >= 0 && frame.mPts - last < REORDER_MAX_FRAME_US) {
+                mStats.frame_duration_us += (int32_t)(frame.mPts - last - mStats.frame_duration_us) / 8;
             }
-        } else if (mSourceType == SOURCE_MPEG4) {
-            LOGW("[MediaStreamSource] NOT IMPLEMENTED: sync frame detection not implemented yet for MPEG4");
-        } else if (mSourceType == SOURCE_H263) {
-            LOGW("[MediaStreamSource] NOT IMPLEMENTED: sync frame detection not implemented yet for H.263");
+            mStats.last_pts = frame.mPts;
+            return true;
         }
         return false;
     }
 
-    enum SourceType {
-        SOURCE_AVC,
-        SOURCE_MPEG4,
-        SOURCE_H263,
-        SOURCE_AAC,
-        SOURCE_UNKNOWN,
-    };
+    int32_t window() const
+    {
+        AutoMutex lock(mLock);
+        return mWindow;
+    }
 
-    int mFrameSize;
-    MediaBufferGroup mBufferGroup;
-    sp<MetaData> mSourceMeta;
-    SourceType mSourceType;
+    // Drops the held frames and the pts history, the stream restarts
+    void reset()
+    {
+        AutoMutex lock(mLock);
+        for (List<Frame>::iterator it = mPending.begin(); it != mPending.end(); ++it)
+            it->clearBuffers(NULL);
+        mPending.clear();
+        mStats.last_pts = -1;
+    }
 
-    Decoder* mDecoder;
+    void getStats(stagefright_reorder_stats_t* stats)
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+        stats->window = mWindow;
+    }
+
+private:
+    int32_t mWindow;
+    List<Frame> mPending; // by pts
+    stagefright_reorder_stats_t mStats;
+    mutable Mutex mLock;
 };
 
 class BufferQueue {
 public:
     explicit BufferQueue(const int32_t capacity = OUT_BUFFER_COUNT)
+        : mInterrupted(false)
     {
         mElements.setCapacity(capacity);
         DataElement element;
@@ -1051,17 +2753,29 @@ public:
 
     virtual ~BufferQueue() { clearAll(); }
 
+    // Wakes the decoder thread waiting for an output slot
     void release()
     {
-        mHoldCondition.signal();
+        AutoMutex lock(mLock);
+        mNotFull.broadcast();
     }
 
-    int32_t push(Frame& data, bool wait = false)
+    // Wakes the decoder thread for good, a push to a full queue fails from now on
+    void interrupt()
+    {
+        AutoMutex lock(mLock);
+        mInterrupted = true;
+        mNotFull.broadcast();
+    }
+
+    int32_t push(Frame& data)
     {
-        int64_t startTime = getTimestampMs();
         AutoMutex lock(mLock);
-        while (isFull())
+        while (isFull()) {
+            if (mInterrupted)
+                return INFO_TRY_AGAIN_LATER; // the frame stays with the caller
             mNotFull.wait(mLock);
+        }
 
         int32_t index = 0;
         for (ElementIter it = mElements.begin(); it != mElements.end(); ++it) {
@@ -1069,10 +2783,6 @@ public:
                 it->mData.swap(data);
                 it->mStatus = mCount++;
                 index = static_cast<int32_t>(it - mElements.begin());
-
-                if (wait) {
-                    mHoldCondition.wait(mLock);
-                }
                 return index;
             }
         }
@@ -1131,22 +2841,6 @@ public:
         mNotFull.signal();
     }
 
-    void clearBuffer(int32_t index)
-    {
-        if (index < 0 || index > mElements.size())
-            return;
-
-        MediaBufferQueue mediaQueue;
-        { //scoped lock
-            AutoMutex lock(mLock);
-            (mElements.begin() + index)->mData.clearBuffers(&mMediaQueue);
-            mediaQueue.appendVector(mMediaQueue);
-            mMediaQueue.clear();
-        }
-
-        releaseMediaBufferQueue(mediaQueue);
-    }
-
     int32_t holdNext(Frame& data, uint8_t** buffer = NULL, size_t* size = NULL)
     {
         AutoMutex lock(mLock);
@@ -1176,8 +2870,6 @@ public:
             *size = next->mData.mSize;
         next->mStatus = HOLDED;
         int32_t index = static_cast<int32_t>(next - mElements.begin());
-
-        mHoldCondition.signal();
         return index;
     }
 
@@ -1195,12 +2887,7 @@ public:
     size_t filledCount() const
     {
         AutoMutex lock(mLock);
-        size_t count = 0;
-        for (ElementConstIter it = mElements.begin(); it != mElements.end(); ++it) {
-            if (!it->mData.empty())
-                count++;
-        }
-        return count;
+        return filledCount_l();
     }
 
     size_t readyCount() const
@@ -1250,50 +2937,61 @@ public:
         releaseMediaBufferQueue(mediaQueue);
     }
 
-    void releaseBuffers()
+    // Drops the frames nobody holds yet, returns how many
+    size_t dropReady()
     {
+        size_t count = 0;
         MediaBufferQueue mediaQueue;
-        { // scoped lock
+        { //scoped lock
             AutoMutex lock(mLock);
+            for (ElementIter it = mElements.begin(); it != mElements.end(); ++it) {
+                if (it->mStatus != FREE && it->mStatus != HOLDED) {
+                    it->mData.clearBuffers(&mMediaQueue);
+                    it->mStatus = FREE;
+                    count++;
+                }
+            }
             mediaQueue.appendVector(mMediaQueue);
             mMediaQueue.clear();
+            if (count > 0)
+                mNotFull.signal();
         }
         releaseMediaBufferQueue(mediaQueue);
+        return count;
     }
 
-    size_t waitRelease(int32_t waitTime)
+    void releaseBuffers()
     {
-        int64_t startTime = getTimestampMs();
-        size_t count = 0;
         MediaBufferQueue mediaQueue;
         { // scoped lock
             AutoMutex lock(mLock);
-            for (ElementConstIter it = mElements.begin(); it != mElements.end(); ++it) {
-                if (!it->mData.empty())
-                    count++;
-            }
-
-            while (count >= MAX_HOLDED_FRAMES) {
-                int sleep = waitTime - getPeriodMs(startTime);
-
-                if (sleep <= 0)
-                    break;
-
-                count = 0;
-                mNotFull.waitRelative(mLock, sleep * 1000000);
-                for (ElementIter it = mElements.begin(); it != mElements.end(); ++it) {
-                    if (!it->mData.empty())
-                        count++;
-                }
-            }
             mediaQueue.appendVector(mMediaQueue);
             mMediaQueue.clear();
         }
         releaseMediaBufferQueue(mediaQueue);
-        return count;
+    }
+
+    // Waits for fewer than depth frames keeping a codec buffer, false on timeout
+    bool waitFilledBelow(size_t depth, int32_t waitMs)
+    {
+        AutoMutex lock(mLock);
+        if (filledCount_l() < depth)
+            return true;
+        mNotFull.waitRelative(mLock, (nsecs_t)waitMs * 1000000);
+        return filledCount_l() < depth;
     }
 
 private:
+    size_t filledCount_l() const
+    {
+        size_t count = 0;
+        for (ElementConstIter it = mElements.begin(); it != mElements.end(); ++it) {
+            if (!it->mData.empty())
+                count++;
+        }
+        return count;
+    }
+
     bool isFull() const
     {
         for (ElementConstIter it = mElements.begin(); it != mElements.end(); ++it) {
@@ -1331,98 +3029,693 @@ private:
     MediaBufferQueue mMediaQueue;
     Elements mElements;
     uint32_t mCount;
+    bool mInterrupted;
 
     mutable Mutex mLock;
     Condition mNotFull;
-    Condition mHoldCondition;
 };
 
-class Decoder : public Thread {
+enum {
+    PCM_FORMAT_S16 = 0,
+    PCM_FORMAT_FLOAT = 1,
+};
+
+static void convertS16ToFloat(float* dst, const int16_t* src, size_t count)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON__)
+    const float32x4_t scale = vdupq_n_f32(1.0f / 32768);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t s = vld1q_s16(src + i);
+        vst1q_f32(dst + i, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s))), scale));
+        vst1q_f32(dst + i + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s))), scale));
+    }
+#endif
+    for (; i < count; ++i)
+        dst[i] = src[i] * (1.0f / 32768);
+}
+
+static void downmixStereoToMonoS16(int16_t* dst, const int16_t* src, size_t frames)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t s = vld2q_s16(src + 2 * i);
+        vst1q_s16(dst + i, vhaddq_s16(s.val[0], s.val[1]));
+    }
+#endif
+    for (; i < frames; ++i)
+        dst[i] = (src[2 * i] + src[2 * i + 1]) >> 1;
+}
+
+static void upmixMonoToStereoS16(int16_t* dst, const int16_t* src, size_t frames)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= frames; i += 8) {
+        int16x8x2_t d;
+        d.val[0] = d.val[1] = vld1q_s16(src + i);
+        vst2q_s16(dst + 2 * i, d);
+    }
+#endif
+    for (; i < frames; ++i)
+        dst[2 * i] = dst[2 * i + 1] = src[i];
+}
+
+static void remixS16(int16_t* dst, unsigned dstChannels, const int16_t* src,
+        unsigned srcChannels, size_t frames)
+{
+    if (srcChannels == dstChannels) {
+        memcpy(dst, src, frames * dstChannels * sizeof(int16_t));
+    } else if (srcChannels == 2 && dstChannels == 1) {
+        downmixStereoToMonoS16(dst, src, frames);
+    } else if (srcChannels == 1 && dstChannels == 2) {
+        upmixMonoToStereoS16(dst, src, frames);
+    } else if (srcChannels < dstChannels) {
+        for (size_t i = 0; i < frames; ++i, src += srcChannels, dst += dstChannels) {
+            for (unsigned c = 0; c < dstChannels; ++c)
+                dst[c] = src[c % srcChannels];
+        }
+    } else {
+        for (size_t i = 0; i < frames; ++i, src += srcChannels, dst += dstChannels) {
+            for (unsigned c = 0; c < dstChannels; ++c) {
+                int32_t sum = 0, count = 0;
+                for (unsigned k = c; k < srcChannels; k += dstChannels, ++count)
+                    sum += src[k];
+                dst[c] = sum / count;
+            }
+        }
+    }
+}
+
+// Single producer (decoder thread) / single consumer (caller) ring of
+// interleaved PCM. Read and write positions are free running frame counters,
+// the capacity is a power of two.
+class PcmRingBuffer : public RefBase {
 public:
-    Decoder()
-        : Thread(false)
-        , mTrack(0)
-        , mDecoderSource(0)
-        , mRenderer(0)
-        , mInterrupted(false)
-        , mFlushNeeded(false)
-        , mNeedSkip(false)
-        , mDecoderFlags(OMXCodec::kHardwareCodecsOnly)
-        , mVideoWidth(0)
-        , mVideoHeight(0)
-        , mVideoColorFormat(0)
-        , mVideoStride(0)
-        , mVideoSliceHeight(0)
-        , mVideoCropLeft(0)
-        , mVideoCropRight(0)
-        , mVideoCropBottom(0)
-        , mVideoCropTop(0)
-        , mVideoRotation(0)
-        , mOutQueue(OUT_BUFFER_COUNT)
-        , mSampleRate(0)
-        , mChannelCount()
-        , mIsVideoDecoder(true)
-        , mDelayedOpen(false)
+    PcmRingBuffer(int32_t durationMs, int32_t sampleFormat, int32_t channels)
+        : mDurationMs(durationMs)
+        , mSampleFormat(sampleFormat)
+        , mChannels(channels)
+        , mFrameBytes(0)
+        , mCapacity(0)
+        , mReady(0)
+        , mEndOfStream(0)
+        , mWritePos(0)
+        , mReadPos(0)
+        , mFlushPos(0)
+        , mAnchorWrite(0)
+        , mAnchorRead(0)
+        , mWakePending(false)
     {
-#if defined(ANDROID_ICS)
-        LOGI("[Decoder] (%p) Decoder for ICS", this);
-#elif defined(ANDROID_JBMR2)
-        LOGI("[Decoder] (%p) Decoder for JBMR2", this);
-#elif defined(ANDROID_KK)
-        LOGI("[Decoder] (%p) Decoder for KK", this);
-#elif defined(ANDROID_LL)
-        LOGI("[Decoder] (%p) Decoder for LL", this);
-#endif
     }
 
-    virtual ~Decoder() { LOGI("[Decoder] (%p) ~Decoder!", this); }
+    virtual ~PcmRingBuffer() {}
 
-    bool configure(void* nativeWindow, int w, int h, void *p_extra, int i_extra);
-    bool createDecoderByType(sp<IOMX>& iomx, const char* type);
-    bool createDecoder(sp<IOMX>& iomx, uint8_t* data, size_t size);
-    void release();
-    void releaseOutputBuffer(uint32_t index, int64_t pts)
+    // Called by the producer once the decoder output format is known
+    void configure(int32_t sampleRate, int32_t channels)
     {
-        if (pts < 0 || mRenderer == 0) {
-            mOutQueue.free(index);
+        if (__atomic_load_n(&mReady, __ATOMIC_ACQUIRE) || sampleRate <= 0 || channels <= 0)
             return;
-        }
-
-        if (mRenderer->isSWRenderng()) {
-            Frame frame;
-            mOutQueue.pull(frame, index);
 
-            mRenderer->render(frame.mBuffer, frame.mSize);
-        } else {
-            MediaBuffer* mediaBuffer = 0;
-            mOutQueue.get(mediaBuffer, index);
+        if (mChannels <= 0)
+            mChannels = channels;
+        mFrameBytes = mChannels * (mSampleFormat == PCM_FORMAT_FLOAT ? sizeof(float) : sizeof(int16_t));
 
-            mRenderer->render(mediaBuffer, pts);
+        uint32_t frames = (int64_t)sampleRate * mDurationMs / 1000;
+        mCapacity = 1024;
+        while (mCapacity < frames)
+            mCapacity <<= 1;
+        mData.insertAt(0, 0, mCapacity * mFrameBytes);
 
-            mOutQueue.free(index);
-        }
+        LOGI("[PcmRingBuffer] %d ms, rate=%d, channels=%d->%d, format=%d, capacity=%d frames",
+                mDurationMs, sampleRate, channels, mChannels, mSampleFormat, mCapacity);
+        __atomic_store_n(&mReady, 1, __ATOMIC_RELEASE);
     }
 
-    const char* getName() const
+    bool isReady() const { return __atomic_load_n(&mReady, __ATOMIC_ACQUIRE) != 0; }
+
+    size_t available() const
     {
-        AutoMutex lock(mLock);
-        return mComponentName.string();
+        if (!isReady())
+            return 0;
+        return __atomic_load_n(&mWritePos, __ATOMIC_ACQUIRE) - readPosition();
     }
 
-    int32_t outputBufferCount() const
+    // Producer side, blocks until the consumer frees space or wake() is called
+    void waitSpace(int32_t timeoutMs)
     {
-        AutoMutex lock(mLock);
-        return mOutQueue.readyCount();
+        AutoMutex lock(mSpaceLock);
+        if (!mWakePending && isReady() && space() == 0)
+            mSpaceCondition.waitRelative(mSpaceLock, (nsecs_t)timeoutMs * 1000000);
+        mWakePending = false;
     }
 
-    int waitReadOrOutput(size_t& readyCount, int waitMs)
+    // Ends the current or next waitSpace(), the producer has to look at its state
+    void wake()
     {
-        int res = TIMED_OUT;
-        int64_t startTime = getTimestampMs();
-        while (true) {
-            readyCount = mOutQueue.tryGetReadyCount();
-            if (readyCount > 0)
-                break;
+        AutoMutex lock(mSpaceLock);
+        mWakePending = true;
+        mSpaceCondition.signal();
+    }
+
+    // Producer side, drops everything written so far; the consumer skips it on the next read
+    void discard()
+    {
+        __atomic_store_n(&mFlushPos, __atomic_load_n(&mWritePos, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+        setEndOfStream(false);
+    }
+
+    // Producer side, returns the number of frames consumed from src
+    size_t write(const int16_t* src, size_t frames, int32_t srcChannels, int64_t pts, int32_t sampleRate)
+    {
+        if (!isReady() || frames == 0)
+            return 0;
+
+        uint32_t writePos = __atomic_load_n(&mWritePos, __ATOMIC_RELAXED);
+        size_t free = space();
+        if (frames > free)
+            frames = free;
+        if (frames == 0)
+            return 0;
+
+        addAnchor(writePos, pts, sampleRate);
+
+        const int16_t* in = src;
+        if (mSampleFormat == PCM_FORMAT_FLOAT && srcChannels != mChannels) {
+            mScratch.clear();
+            mScratch.insertAt(0, 0, frames * mChannels);
+            remixS16(mScratch.editArray(), mChannels, src, srcChannels, frames);
+            in = mScratch.array();
+            srcChannels = mChannels;
+        }
+
+        size_t done = 0;
+        while (done < frames) {
+            uint32_t offset = (writePos + done) & (mCapacity - 1);
+            size_t count = mCapacity - offset;
+            if (count > frames - done)
+                count = frames - done;
+
+            uint8_t* dst = mData.editArray() + offset * mFrameBytes;
+            const int16_t* from = in + done * srcChannels;
+            if (mSampleFormat == PCM_FORMAT_FLOAT)
+                convertS16ToFloat(reinterpret_cast<float*>(dst), from, count * mChannels);
+            else
+                remixS16(reinterpret_cast<int16_t*>(dst), mChannels, from, srcChannels, count);
+            done += count;
+        }
+
+        __atomic_store_n(&mWritePos, writePos + frames, __ATOMIC_RELEASE);
+        return frames;
+    }
+
+    // Consumer side, reads exactly frames or nothing unless the stream ended
+    int32_t read(void* data, size_t frames, int64_t* pts)
+    {
+        size_t ready = available();
+        bool eos = __atomic_load_n(&mEndOfStream, __ATOMIC_ACQUIRE) != 0;
+        if (ready < frames) {
+            if (!eos)
+                return INFO_TRY_AGAIN_LATER;
+            if (ready == 0)
+                return INFO_OUTPUT_END_OF_STREAM;
+            frames = ready;
+        }
+
+        uint32_t readPos = readPosition();
+        if (pts)
+            *pts = ptsAt(readPos);
+
+        uint8_t* out = static_cast<uint8_t*>(data);
+        size_t done = 0;
+        while (done < frames) {
+            uint32_t offset = (readPos + done) & (mCapacity - 1);
+            size_t count = mCapacity - offset;
+            if (count > frames - done)
+                count = frames - done;
+            memcpy(out + done * mFrameBytes, mData.array() + offset * mFrameBytes, count * mFrameBytes);
+            done += count;
+        }
+
+        __atomic_store_n(&mReadPos, readPos + frames, __ATOMIC_RELEASE);
+
+        AutoMutex lock(mSpaceLock);
+        mSpaceCondition.signal();
+        return frames;
+    }
+
+    void setEndOfStream(bool eos) { __atomic_store_n(&mEndOfStream, eos ? 1 : 0, __ATOMIC_RELEASE); }
+
+private:
+    enum { ANCHOR_COUNT = 128 };
+
+    struct Anchor {
+        uint32_t pos;
+        int32_t sampleRate;
+        int64_t pts;
+    };
+
+    size_t space() const
+    {
+        return mCapacity - (__atomic_load_n(&mWritePos, __ATOMIC_RELAXED) - readPosition());
+    }
+
+    uint32_t readPosition() const
+    {
+        uint32_t readPos = __atomic_load_n(&mReadPos, __ATOMIC_ACQUIRE);
+        uint32_t flushPos = __atomic_load_n(&mFlushPos, __ATOMIC_ACQUIRE);
+        return (int32_t)(flushPos - readPos) > 0 ? flushPos : readPos;
+    }
+
+    void addAnchor(uint32_t pos, int64_t pts, int32_t sampleRate)
+    {
+        uint32_t write = __atomic_load_n(&mAnchorWrite, __ATOMIC_RELAXED);
+        uint32_t read = __atomic_load_n(&mAnchorRead, __ATOMIC_ACQUIRE);
+        if (write - read >= ANCHOR_COUNT)
+            return; // consumer extrapolates from the previous anchor
+
+        Anchor& anchor = mAnchors[write % ANCHOR_COUNT];
+        anchor.pos = pos;
+        anchor.pts = pts;
+        anchor.sampleRate = sampleRate;
+        __atomic_store_n(&mAnchorWrite, write + 1, __ATOMIC_RELEASE);
+    }
+
+    int64_t ptsAt(uint32_t pos)
+    {
+        uint32_t read = __atomic_load_n(&mAnchorRead, __ATOMIC_RELAXED);
+        uint32_t write = __atomic_load_n(&mAnchorWrite, __ATOMIC_ACQUIRE);
+
+        // keep the last anchor at or before pos
+        while (write - read > 1 && (int32_t)(mAnchors[(read + 1) % ANCHOR_COUNT].pos - pos) <= 0)
+            read++;
+        __atomic_store_n(&mAnchorRead, read, __ATOMIC_RELEASE);
+
+        if (read == write)
+            return 0;
+        const Anchor& anchor = mAnchors[read % ANCHOR_COUNT];
+        if (anchor.sampleRate <= 0)
+            return anchor.pts;
+        return anchor.pts + (int64_t)(int32_t)(pos - anchor.pos) * 1000000 / anchor.sampleRate;
+    }
+
+    int32_t mDurationMs;
+    int32_t mSampleFormat;
+    int32_t mChannels;
+    size_t mFrameBytes;
+    uint32_t mCapacity;
+
+    int32_t mReady;
+    int32_t mEndOfStream;
+    uint32_t mWritePos;
+    uint32_t mReadPos;
+    uint32_t mFlushPos;
+
+    Anchor mAnchors[ANCHOR_COUNT];
+    uint32_t mAnchorWrite;
+    uint32_t mAnchorRead;
+
+    Vector<uint8_t> mData;
+    Vector<int16_t> mScratch;
+
+    Mutex mSpaceLock;
+    Condition mSpaceCondition; // the consumer freed space
+    bool mWakePending;
+};
+
+struct SessionPolicy {
+    int threadPriority;
+    size_t queueDepth;
+};
+
+static const SessionPolicy kSessionPolicy[SESSION_PRIORITY_COUNT] = {
+    { ANDROID_PRIORITY_DISPLAY, IN_BUFFER_COUNT },
+    { DECODER_PRIORITY, IN_BUFFER_COUNT },
+    { ANDROID_PRIORITY_BACKGROUND, 2 },
+};
+
+// Media time the presentation scheduler renders against
+class PresentationClock : public RefBase {
+public:
+    PresentationClock(int32_t source)
+        : mSource(source)
+        , mAnchorMediaUs(-1)
+        , mAnchorSysUs(0)
+        , mLimitUs(-1)
+    {
+    }
+
+    int32_t source() const { return mSource; }
+
+    // Media time now, -1 until anchored
+    int64_t nowUs() const
+    {
+        AutoMutex lock(mLock);
+        if (mAnchorMediaUs < 0)
+            return -1;
+        int64_t now = mAnchorMediaUs + getMonotonicUs() - mAnchorSysUs;
+        return mLimitUs >= 0 && now > mLimitUs ? mLimitUs : now;
+    }
+
+    // limitUs keeps an audio clock from running past the PCM handed out
+    void setTime(int64_t mediaUs, int64_t limitUs = -1)
+    {
+        AutoMutex lock(mLock);
+        mAnchorMediaUs = mediaUs;
+        mAnchorSysUs = getMonotonicUs();
+        mLimitUs = limitUs;
+    }
+
+    // A wall clock starts at the first frame and again after a flush
+    void start(int64_t mediaUs)
+    {
+        AutoMutex lock(mLock);
+        if (mAnchorMediaUs < 0) {
+            mAnchorMediaUs = mediaUs;
+            mAnchorSysUs = getMonotonicUs();
+        }
+    }
+
+    void reset()
+    {
+        AutoMutex lock(mLock);
+        if (mSource == PRESENTATION_CLOCK_WALL)
+            mAnchorMediaUs = -1;
+    }
+
+private:
+    int32_t mSource;
+    int64_t mAnchorMediaUs;
+    int64_t mAnchorSysUs;
+    int64_t mLimitUs;
+    mutable Mutex mLock;
+};
+
+// A released frame, HW frames stay held in the output queue by index,
+// SW frames carry their data
+struct PresentEntry {
+    PresentEntry()
+        : index(-1)
+        , pts(0)
+    {}
+
+    void swap(PresentEntry& other)
+    {
+        int32_t i = index;
+        int64_t p = pts;
+        index = other.index;
+        pts = other.pts;
+        other.index = i;
+        other.pts = p;
+        frame.swap(other.frame);
+    }
+
+    int32_t index;
+    int64_t pts;
+    Frame frame;
+};
+
+class Decoder;
+
+// Holds released frames and renders each one when the clock reaches its pts
+class PresentationScheduler : public Thread {
+public:
+    PresentationScheduler(Decoder* decoder, const sp<PresentationClock>& clock)
+        : Thread(false)
+        , mDecoder(decoder)
+        , mClock(clock)
+        , mJitterUs(0)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+        mStats.clock = clock->source();
+    }
+
+    void post(PresentEntry& entry)
+    {
+        AutoMutex lock(mLock);
+        List<PresentEntry>::iterator it = mQueue.begin();
+        while (it != mQueue.end() && it->pts <= entry.pts)
+            ++it;
+        it = mQueue.insert(it, PresentEntry());
+        it->swap(entry);
+        mCondition.signal();
+    }
+
+    // Drops the queued frames, the clock restarts with the next one
+    void clear();
+    void stop()
+    {
+        requestExit();
+        { // scopped lock
+            AutoMutex lock(mLock);
+            mCondition.signal();
+        }
+        requestExitAndWait();
+        clear();
+    }
+
+    void getStats(stagefright_presentation_stats_t* stats)
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+        stats->queued = mQueue.size();
+        stats->avg_jitter_us = mStats.presented > 0 ? (int32_t)(mJitterUs / mStats.presented) : 0;
+    }
+
+private:
+    virtual bool threadLoop();
+
+    void recordJitter(int64_t jitterUs)
+    {
+        if (jitterUs < 0)
+            jitterUs = -jitterUs;
+        int32_t bucket = 0;
+        for (int64_t limitUs = 1000; bucket < PRESENTATION_JITTER_BUCKETS - 1 && jitterUs >= limitUs; limitUs *= 2)
+            bucket++;
+        mStats.jitter_histogram[bucket]++;
+        mStats.presented++;
+        mJitterUs += jitterUs;
+        if (jitterUs > mStats.max_jitter_us)
+            mStats.max_jitter_us = jitterUs;
+    }
+
+    Decoder* mDecoder;
+    sp<PresentationClock> mClock;
+    List<PresentEntry> mQueue; // by pts
+    stagefright_presentation_stats_t mStats;
+    int64_t mJitterUs;
+
+    Mutex mLock;
+    Condition mCondition;
+};
+
+// Running decoders by priority class, lower classes yield to a higher one
+// that fell behind
+class SessionScheduler {
+public:
+    static SessionScheduler& instance()
+    {
+        static SessionScheduler s_instance;
+        return s_instance;
+    }
+
+    void add(Decoder* decoder)
+    {
+        AutoMutex lock(mLock);
+        mDecoders.push(decoder);
+    }
+
+    void remove(Decoder* decoder)
+    {
+        AutoMutex lock(mLock);
+        for (size_t i = 0; i < mDecoders.size(); ++i) {
+            if (mDecoders[i] == decoder) {
+                mDecoders.removeAt(i);
+                break;
+            }
+        }
+    }
+
+    // CPU mask for the decoder threads of a class, 0 leaves them unpinned
+    void setAffinity(int32_t priorityClass, unsigned long mask)
+    {
+        if (priorityClass < 0 || priorityClass >= SESSION_PRIORITY_COUNT)
+            return;
+        AutoMutex lock(mLock);
+        mAffinity[priorityClass] = mask;
+    }
+
+    unsigned long affinity(int32_t priorityClass) const
+    {
+        AutoMutex lock(mLock);
+        return mAffinity[priorityClass];
+    }
+
+    bool higherBehind(const Decoder* decoder, int32_t priorityClass) const;
+
+private:
+    SessionScheduler() { memset(mAffinity, 0, sizeof(mAffinity)); }
+
+    SessionScheduler(const SessionScheduler&);
+    SessionScheduler &operator=(const SessionScheduler&);
+
+    Vector<Decoder*> mDecoders;
+    unsigned long mAffinity[SESSION_PRIORITY_COUNT];
+    mutable Mutex mLock;
+};
+
+class Decoder : public Thread {
+public:
+    Decoder()
+        : Thread(false)
+        , mTrack(0)
+        , mDecoderSource(0)
+        , mRenderer(0)
+        , mInterrupted(false)
+        , mFlushPending(false)
+        , mNeedSkip(false)
+        , mDecoderFlags(OMXCodec::kHardwareCodecsOnly)
+        , mVideoWidth(0)
+        , mVideoHeight(0)
+        , mVideoColorFormat(0)
+        , mVideoStride(0)
+        , mVideoSliceHeight(0)
+        , mVideoCropLeft(0)
+        , mVideoCropRight(0)
+        , mVideoCropBottom(0)
+        , mVideoCropTop(0)
+        , mVideoRotation(0)
+        , mOutQueue(OUT_BUFFER_COUNT)
+        , mSampleRate(0)
+        , mChannelCount()
+        , mNALLengthSize(0)
+        , mIsVideoDecoder(true)
+        , mDelayedOpen(false)
+        , mOpenState(OPEN_IDLE)
+        , mOpenRequestTime(0)
+        , mOpenMs(0)
+        , mFirstFrameMs(-1)
+        , mPrewarmFrames(0)
+        , mFlushStartTime(0)
+        , mFlushFirstFramePending(false)
+        , mSeekTargetUs(-1)
+        , mSeekStartTime(0)
+        , mKeyframeOnly(false)
+        , mAwaitSync(false)
+        , mResyncPending(false)
+        , mRecoveryPending(false)
+        , mErrorTime(0)
+        , mHeartbeatMs(0)
+        , mInRead(false)
+        , mWaitingInput(false)
+        , mExited(true)
+        , mAbandoned(false)
+        , mMigratePending(false)
+        , mMigrateDraining(false)
+        , mMigrateFlags(0)
+        , mMigrateStartTime(0)
+        , mMigrationFirstFramePending(false)
+        , mPriorityClass(SESSION_PRIORITY_NORMAL)
+        , mInBufferCount(IN_BUFFER_COUNT)
+        , mTid(0)
+        , mDecodeAhead(MAX_HOLDED_FRAMES)
+    {
+        memset(&mOutputStats, 0, sizeof(mOutputStats));
+        memset(&mPriorityStats, 0, sizeof(mPriorityStats));
+        mPriorityStats.priority_class = mPriorityClass;
+        mPriorityStats.queue_depth = mInBufferCount;
+        memset(&mMigrationStats, 0, sizeof(mMigrationStats));
+        mMigrationStats.last_migration_ms = -1;
+        memset(&mResyncStats, 0, sizeof(mResyncStats));
+        memset(&mTrickPlayStats, 0, sizeof(mTrickPlayStats));
+        memset(&mFlushStats, 0, sizeof(mFlushStats));
+        mFlushStats.flush_first_frame_ms = -1;
+        memset(&mSeekStats, 0, sizeof(mSeekStats));
+        mSeekStats.target_us = mSeekStats.preroll_ms = -1;
+#if defined(ANDROID_ICS)
+        LOGI("[Decoder] (%p) Decoder for ICS", this);
+#elif defined(ANDROID_JBMR2)
+        LOGI("[Decoder] (%p) Decoder for JBMR2", this);
+#elif defined(ANDROID_KK)
+        LOGI("[Decoder] (%p) Decoder for KK", this);
+#elif defined(ANDROID_LL)
+        LOGI("[Decoder] (%p) Decoder for LL", this);
+#endif
+    }
+
+    virtual ~Decoder() { LOGI("[Decoder] (%p) ~Decoder!", this); }
+
+    bool configure(void* nativeWindow, int w, int h, void *p_extra, int i_extra);
+    bool createDecoderByType(sp<IOMX>& iomx, const char* type);
+    bool createDecoder(sp<IOMX>& iomx, uint8_t* data, size_t size);
+    bool openAsync(const sp<IOMX>& iomx, const uint8_t* config, size_t size);
+    void release();
+    void releaseOutputBuffer(uint32_t index, int64_t pts)
+    {
+        if (pts < 0 || mRenderer == 0) {
+            mOutQueue.free(index);
+            return;
+        }
+
+        PresentEntry entry;
+        entry.index = index;
+        entry.pts = pts;
+        if (mRenderer->isSWRenderng()) {
+            mOutQueue.pull(entry.frame, index);
+            entry.index = -1;
+        }
+
+        sp<PresentationScheduler> scheduler = presentationScheduler();
+        if (scheduler != 0)
+            scheduler->post(entry);
+        else
+            present(entry, true);
+    }
+
+    // Renders or drops a released frame, a HW frame goes back to the codec
+    void present(PresentEntry& entry, bool render)
+    {
+        if (entry.index < 0) {
+            if (!render)
+                return;
+            sp<RenderStage> stage = renderStage();
+            if (stage != 0)
+                stage->post(entry.frame);
+            else
+                mRenderer->render(entry.frame.mBuffer, entry.frame.mSize);
+            return;
+        }
+
+        if (render) {
+            MediaBuffer* mediaBuffer = 0;
+            mOutQueue.get(mediaBuffer, entry.index);
+
+            mRenderer->render(mediaBuffer, entry.pts);
+        }
+        mOutQueue.free(entry.index);
+    }
+
+    const char* getName() const
+    {
+        AutoMutex lock(mLock);
+        return mComponentName.string();
+    }
+
+    int32_t outputBufferCount() const
+    {
+        AutoMutex lock(mLock);
+        return mOutQueue.readyCount();
+    }
+
+    int waitReadOrOutput(size_t& readyCount, int waitMs)
+    {
+        int res = TIMED_OUT;
+        int64_t startTime = getTimestampMs();
+        while (true) {
+            readyCount = mOutQueue.tryGetReadyCount();
+            if (readyCount > 0)
+                break;
 
             int sleep = waitMs - getPeriodMs(startTime);
 
@@ -1439,11 +3732,31 @@ public:
         return res;
     }
 
+    // Keyframe-only input skips the pacing of the full stream, one keyframe
+    // waits for the codec and the caller blocks for at most a frame period
+    // while it is taken. Must be called with mInLock held
+    bool queueKeyframe(Frame& frame)
+    {
+        int64_t startTime = getTimestampMs();
+        while (mInQueue.size() >= KEYFRAME_IN_BUFFER_COUNT && !mInterrupted) {
+            int sleep = s_frameDisplayTimeMsec - getPeriodMs(startTime);
+            if (sleep <= 0)
+                return false;
+            mReadCondition.waitRelative(mInLock, sleep * 1000000);
+        }
+        mInQueue.push_back(frame);
+        mInCondition.signal();
+        return true;
+    }
+
     bool queueInputBuffer(int32_t index, uint8_t* data, size_t size,
-            int64_t pts, uint32_t flags)
+            int64_t pts, uint32_t flags, const sp<RefBase>& owner = sp<RefBase>())
     {
         LOG_DEBUG;
 
+        if (!admitInput(data, size, flags))
+            return true; // dropped by trick play, the caller moves on
+
         if (mRenderer != 0) {
             mRenderer->connectWindow();
         }
@@ -1457,13 +3770,21 @@ public:
         if ((flags & OMX_BUFFERFLAG_ENDOFFRAME))
             status =  INFO_DISCONTINUITY;
 
-        Frame frame(status, data, size, pts, flags);
+        Frame frame;
+        if (owner != 0) {
+            Frame borrowed(status, data, size, pts, flags, owner);
+            frame.swap(borrowed);
+        } else {
+            Frame copied(status, data, size, pts, flags);
+            frame.swap(copied);
+        }
 
         AutoMutex lock(mInLock);
         queueSize = mInQueue.size();
 
-        if (mDecoderSource == 0) {
-            if (queueSize < 50) {
+        if (mOpenState != OPEN_READY) {
+            // prewarm: keep input while the codec is opening on the decoder thread
+            if (mOpenState != OPEN_FAILED && queueSize < PREWARM_BUFFER_COUNT) {
                 mInQueue.push_back(frame);
                 return true;
             } else {
@@ -1471,9 +3792,12 @@ public:
             }
         }
 
-        if (queueSize > IN_BUFFER_COUNT) {
+        if (mKeyframeOnly)
+            return queueKeyframe(frame);
+
+        if (queueSize > mInBufferCount) {
             mNeedSkip = true;
-            while (queueSize >= IN_BUFFER_COUNT) {
+            while (queueSize >= mInBufferCount) {
                 waitReadOrOutput(readyCount, sleep);
                 if (readyCount > 0) {
                     mInQueue.push_back(frame);
@@ -1482,7 +3806,7 @@ public:
                 }
                 queueSize = mInQueue.size();
 
-                if (queueSize < IN_BUFFER_COUNT) {
+                if (queueSize < mInBufferCount) {
                     sleep = 0;
                     break;
                 }
@@ -1491,7 +3815,7 @@ public:
 
         mNeedSkip = false;
 
-        if (queueSize == IN_BUFFER_COUNT) {
+        if (queueSize == mInBufferCount) {
             int res = waitReadOrOutput(readyCount, sleep);
             if (res != OK && readyCount > 0) {
                 return false;
@@ -1500,9 +3824,9 @@ public:
             sleep = 0;
         }
 
-        if (queueSize < IN_BUFFER_COUNT) {
+        if (queueSize < mInBufferCount) {
             mInQueue.push_back(frame);
-            if (queueSize + 1 < IN_BUFFER_COUNT)
+            if (queueSize + 1 < mInBufferCount)
                 sleep = (queueSize + 1) * 25;
             mInCondition.signal();
             result = true;
@@ -1520,7 +3844,9 @@ public:
             usleep(timeoutUs);
 
         AutoMutex lock(mInLock);
-        if (mInQueue.size() < IN_BUFFER_COUNT) {
+        size_t limit = mOpenState == OPEN_PENDING ? PREWARM_BUFFER_COUNT
+                : mKeyframeOnly ? KEYFRAME_IN_BUFFER_COUNT : mInBufferCount;
+        if (mInQueue.size() < limit) {
             return 1; //ok?
         }
         return INFO_TRY_AGAIN_LATER;
@@ -1589,36 +3915,412 @@ public:
 
     int32_t getOutputBuffers() const { return mOutQueue.capacity(); }
 
-    void flush()
-    {
-        mFlushNeeded = true;
-        signalEOF();
-    }
+    void flush();
+    void seek(int64_t targetUs);
 
     status_t waitAndPopInputBuffer(Frame& frame)
     {
         LOG_DEBUG;
         AutoMutex lock(mInLock);
 
-        while (mInQueue.empty() && !mInterrupted)
-            mInCondition.wait(mInLock);
+        mWaitingInput = true;
+        if (mInQueue.empty() && !mInterrupted) {
+            int64_t idleTime = getTimestampMs();
+            while (mInQueue.empty() && !mInterrupted)
+                mInCondition.wait(mInLock);
+            mOutputStats.idle_input_ms += getPeriodMs(idleTime);
+        }
+        mWaitingInput = false;
+
+        if (mMigratePending && !mInQueue.empty()) {
+            const Frame& next = *mInQueue.begin();
+            if (next.mStatus != ERROR_END_OF_STREAM && ((next.mFlags & OMX_BUFFERFLAG_CODECCONFIG)
+                    || isSyncInput(next.mBuffer, next.mSize, next.mFlags))) {
+                // the old component ends before the sync frame, the new one starts with it
+                mMigrateDraining = true;
+                frame.mStatus = ERROR_END_OF_STREAM;
+                return frame.mStatus;
+            }
+        }
 
         if (!mInQueue.empty()) {
             frame.swap(*mInQueue.begin());
             mInQueue.erase(mInQueue.begin());
 
+            heartbeat();
             mReadCondition.signal();
         }
         return frame.mStatus;
     }
 
     bool IsDelayedOpen() const { return mDelayedOpen; }
+    bool IsVideoDecoder() const { return mIsVideoDecoder; }
 
-private:
-    virtual status_t readyToRun();
-    virtual bool threadLoop();
+    void getStartupStats(stagefright_startup_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        stats->open_ms = mOpenMs;
+        stats->first_frame_ms = mFirstFrameMs;
+        stats->prewarm_frames = mPrewarmFrames;
+    }
+
+    void getFlushStats(stagefright_flush_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        *stats = mFlushStats;
+    }
+
+    void getSeekStats(stagefright_seek_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        *stats = mSeekStats;
+    }
+
+    bool setKeyframeOnly(bool enable)
+    {
+        if (!mIsVideoDecoder)
+            return false;
+
+        AutoMutex lock(mInLock);
+        if (mKeyframeOnly && !enable) {
+            // the references of the next P frames were never decoded
+            mAwaitSync = true;
+        }
+        mKeyframeOnly = enable;
+        LOGI("[Decoder] (%p) keyframe only %s", this, enable ? "on" : "off");
+        return true;
+    }
+
+    void getTrickPlayStats(stagefright_trickplay_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        *stats = mTrickPlayStats;
+    }
+
+    void getResyncStats(stagefright_resync_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        *stats = mResyncStats;
+    }
+
+    // Time without progress while the codec owes output, 0 unless stalled
+    int32_t stalledMs(int32_t timeoutMs) const
+    {
+        if (mOpenState != OPEN_READY || mInterrupted || !mInRead || mWaitingInput)
+            return 0;
+        if (mOutQueue.filledCount() >= outputDepth())
+            return 0; // the caller holds the output, not the codec
+        int32_t idle = getMonotonicUs() / 1000 - mHeartbeatMs;
+        return idle > timeoutMs ? idle : 0;
+    }
+
+    // Abandons a stalled decoder thread, it exits on its own if the codec ever returns
+    void detach()
+    {
+        LOGE("[Decoder] (%p) detach stalled decoder", this);
+        { // scopped lock
+            AutoMutex lock(mInLock);
+            mInQueue.clear();
+        }
+        mInterrupted = true;
+        signalEOF();
+        mOutQueue.interrupt();
+        wakePcmWriter();
+
+        if (!abandon()) {
+            // got unstuck in the meantime
+            join();
+            shutdownDecoder();
+            stopTrack();
+        }
+    }
+
+    void awaitSyncFrame() { mResyncPending = true; }
+    void setPriorityClass(int32_t priorityClass)
+    {
+        if (priorityClass < 0 || priorityClass >= SESSION_PRIORITY_COUNT)
+            return;
+
+        { // scopped lock
+            AutoMutex lock(mInLock);
+            mPriorityClass = priorityClass;
+            mInBufferCount = kSessionPolicy[priorityClass].queueDepth;
+            mPriorityStats.priority_class = priorityClass;
+            mPriorityStats.queue_depth = mInBufferCount;
+        }
+        if (mTid > 0)
+            applyPriority();
+    }
+
+    void getPriorityStats(stagefright_priority_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        *stats = mPriorityStats;
+    }
+
+    int32_t priorityClass() const { return mPriorityClass; }
+
+    // Starving: input is waiting but nothing is ready for the consumer
+    bool isBehind()
+    {
+        if (mOpenState != OPEN_READY || mInterrupted)
+            return false;
+        { // scopped lock
+            AutoMutex lock(mInLock);
+            if (mInQueue.empty())
+                return false;
+        }
+        return mOutQueue.readyCount() == 0;
+    }
+
+    // Decoded frames the decoder runs ahead of the consumer, each keeps a
+    // codec buffer so it must stay below the buffers the codec allocated
+    void setDecodeAhead(int32_t depth)
+    {
+        if (depth <= 0)
+            return;
+        mDecodeAhead = depth < OUT_BUFFER_COUNT ? depth : OUT_BUFFER_COUNT - 1;
+        mOutQueue.release();
+    }
+
+    // The decode-ahead depth in use, the frames the reorder window holds
+    // keep codec buffers as well
+    size_t outputDepth() const
+    {
+        size_t depth = OUT_BUFFER_COUNT - 1 - mReorder.window();
+        return mDecodeAhead < depth ? mDecodeAhead : depth;
+    }
+
+    void getOutputStats(stagefright_output_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        *stats = mOutputStats;
+        stats->depth = outputDepth();
+        stats->queued = mOutQueue.filledCount();
+    }
+
+    // Frames held back to sort output stamped in decode order, 0 only
+    // interpolates missing pts
+    void setReorderWindow(int32_t frames) { mReorder.setWindow(frames); }
+    void getReorderStats(stagefright_reorder_stats_t* stats) { mReorder.getStats(stats); }
+
+    // Software rendering on a thread of its own, the caller only hands frames over
+    bool setRenderThread(bool enable)
+    {
+        if (!mIsVideoDecoder || mRenderer == 0)
+            return false;
+
+        sp<RenderStage> stage;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            if (enable == (mRenderStage != 0))
+                return true;
+            stage = mRenderStage;
+            if (enable) {
+                mRenderStage = new RenderStage(mRenderer);
+                if (mRenderStage->run(0, ANDROID_PRIORITY_DISPLAY) != OK) {
+                    LOGE("[Decoder] (%p) cannot start render thread", this);
+                    mRenderStage.clear();
+                    return false;
+                }
+            } else {
+                mRenderStage.clear();
+            }
+        }
+        if (stage != 0)
+            stage->stop();
+        return true;
+    }
+
+    // Released frames render at their pts on the clock, 0 renders on release
+    bool setPresentationClock(const sp<PresentationClock>& clock)
+    {
+        if (!mIsVideoDecoder || mRenderer == 0)
+            return false;
+
+        sp<PresentationScheduler> scheduler;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            scheduler = mScheduler;
+            mScheduler.clear();
+        }
+        if (scheduler != 0)
+            scheduler->stop();
+        if (clock == 0)
+            return true;
+
+        scheduler = new PresentationScheduler(this, clock);
+        if (scheduler->run(0, ANDROID_PRIORITY_DISPLAY) != OK) {
+            LOGE("[Decoder] (%p) cannot start presentation scheduler", this);
+            return false;
+        }
+        AutoMutex lock(mLock);
+        mScheduler = scheduler;
+        return true;
+    }
+
+    void getPresentationStats(stagefright_presentation_stats_t* stats)
+    {
+        sp<PresentationScheduler> scheduler = presentationScheduler();
+        if (scheduler != 0)
+            scheduler->getStats(stats);
+        else
+            memset(stats, 0, sizeof(*stats));
+    }
+
+    // An audio session drives the clock with the PCM the caller reads
+    void setAudioClock(const sp<PresentationClock>& clock)
+    {
+        AutoMutex lock(mLock);
+        mAudioClock = clock;
+    }
+
+    void getRenderStats(stagefright_render_stats_t* stats)
+    {
+        sp<RenderStage> stage = renderStage();
+        if (stage != 0)
+            stage->getStats(stats);
+        else
+            memset(stats, 0, sizeof(*stats));
+        if (mRenderer != 0)
+            mRenderer->getBufferStats(stats);
+    }
+
+    bool isSoftwareDecoding() const { return (mDecoderFlags & OMXCodec::kSoftwareCodecsOnly) != 0; }
+    bool isMigrating() const { return mMigratePending; }
+
+    // Moves a running video session to a HW or SW component at the next sync frame
+    bool setDecoderMode(int32_t mode)
+    {
+        if (!mIsVideoDecoder)
+            return false;
+
+        uint32_t flags = mode == DECODER_MODE_SW ? OMXCodec::kSoftwareCodecsOnly
+                : OMXCodec::kHardwareCodecsOnly;
+
+        AutoMutex lock(mInLock);
+        if (mOpenState != OPEN_READY) {
+            mDecoderFlags = flags; // not opened yet, applies to the first open
+            return true;
+        }
+        if (mDecoderFlags == flags && !mMigratePending)
+            return true;
+
+        mMigrateFlags = flags;
+        mMigratePending = true;
+        mMigrateStartTime = getTimestampMs();
+        LOGI("[Decoder] (%p) migrate to %s at the next sync frame", this,
+                mode == DECODER_MODE_SW ? "SW" : "HW");
+        return true;
+    }
+
+    void getMigrationStats(stagefright_migration_stats_t* stats)
+    {
+        AutoMutex lock(mInLock);
+        *stats = mMigrationStats;
+        stats->mode = (mDecoderFlags & OMXCodec::kSoftwareCodecsOnly) ? DECODER_MODE_SW : DECODER_MODE_HW;
+    }
+    const Vector<uint8_t>& codecConfig() const { return mCodecConfig; }
+    const Vector<uint8_t>& openConfig() const { return mOpenConfig; }
+
+    // An opened or opening video decoder another session can take over
+    bool isReusable() const
+    {
+        return mIsVideoDecoder && (mOpenState == OPEN_READY || mOpenState == OPEN_PENDING) && !mInterrupted
+                && !mMigratePending && pcmRing() == 0;
+    }
+    void reuse(const Vector<uint8_t>& codecConfig, int32_t claimMs);
+
+    bool setPcmOutput(int32_t durationMs, int32_t sampleFormat, int32_t channels)
+    {
+        if (mIsVideoDecoder || durationMs <= 0)
+            return false;
+
+        AutoMutex lock(mLock);
+        mPcmRing = new PcmRingBuffer(durationMs, sampleFormat, channels);
+        return true;
+    }
+
+    int32_t readPcm(void* data, int32_t frames, int64_t* pts)
+    {
+        sp<PcmRingBuffer> ring = pcmRing();
+        if (ring == 0 || !data || frames <= 0)
+            return INFO_TRY_AGAIN_LATER;
+
+        int64_t startUs = 0;
+        int32_t result = ring->read(data, frames, &startUs);
+        if (pts)
+            *pts = startUs;
+
+        sp<PresentationClock> clock;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            clock = mAudioClock;
+        }
+        if (clock != 0 && result > 0 && mSampleRate > 0)
+            clock->setTime(startUs, startUs + (int64_t)result * 1000000 / mSampleRate);
+        return result;
+    }
+
+    int32_t pcmAvailable()
+    {
+        sp<PcmRingBuffer> ring = pcmRing();
+        return ring != 0 ? ring->available() : 0;
+    }
+
+    // The input unit starts a picture the decoder can begin with
+    bool isSyncInput(const uint8_t* data, size_t size, uint32_t flags) const
+    {
+        return (flags & OMX_BUFFERFLAG_SYNCFRAME)
+                || isSyncFrame(mMimeType.string(), data, size, mNALLengthSize);
+    }
+
+private:
+    virtual status_t readyToRun();
+    virtual bool threadLoop();
 
     void decode();
+    bool openPending();
+
+    bool admitInput(const uint8_t* data, size_t size, uint32_t flags)
+    {
+        if (!mKeyframeOnly && !mAwaitSync && !mResyncPending)
+            return true;
+        if (flags & OMX_BUFFERFLAG_CODECCONFIG)
+            return true;
+
+        bool sync = isSyncInput(data, size, flags);
+
+        AutoMutex lock(mInLock);
+        if (!sync) {
+            if (mResyncPending)
+                mResyncStats.dropped_frames++;
+            else
+                mTrickPlayStats.rejected_frames++;
+            return false;
+        }
+        mAwaitSync = mResyncPending = false;
+        if (mKeyframeOnly)
+            mTrickPlayStats.admitted_frames++;
+        return true;
+    }
+
+    void beginResync(status_t status);
+
+    void heartbeat() { mHeartbeatMs = getMonotonicUs() / 1000; }
+
+    void applyPriority()
+    {
+        int32_t priorityClass = mPriorityClass;
+        androidSetThreadPriority(mTid, kSessionPolicy[priorityClass].threadPriority);
+
+        unsigned long mask = SessionScheduler::instance().affinity(priorityClass);
+        if (mask != 0 && syscall(__NR_sched_setaffinity, mTid, sizeof(mask), &mask) != 0)
+            LOGW("[Decoder] (%p) cannot set affinity %#lx: %s", this, mask, strerror(errno));
+    }
+
+    void throttle();
+    void onThreadExit();
 
     void signalEOF()
     {
@@ -1631,6 +4333,22 @@ private:
         mInCondition.signal();
     }
 
+    // Leaves the component to the decoder thread, false if it already exited
+    bool abandon()
+    {
+        AutoMutex lock(mInLock);
+        mAbandoned = !mExited;
+        return mAbandoned;
+    }
+
+    void stopTrack()
+    {
+        if (mTrack != 0) {
+            mTrack->stop();
+            mTrack.clear();
+        }
+    }
+
     void shutdownDecoder()
     {
         LOGI("[Decoder] (%p) shutdown", this);
@@ -1644,19 +4362,53 @@ private:
     bool createVideoDecoder(sp<IOMX>& iomx, uint8_t* config, size_t size);
     bool createAudioDecoder(sp<IOMX>& iomx, uint8_t* config, size_t size);
 
-    bool openVideoDecoder(const sp<IOMX>& iomx, const sp<MediaStreamSource>& source);
+    bool openVideoDecoder(const sp<IOMX>& iomx, const sp<MediaStreamSource>& source,
+            sp<MediaSource>& decoder);
+    bool migrateDecoder();
     void openAudioDecoder(const sp<IOMX>& iomx, const sp<MediaSource>& source);
     uint32_t getVideoDecoderFlags() const;
     bool setVideoDecoderFormat();
     bool setAudioDecoderFormat();
+    void writePcm(const sp<PcmRingBuffer>& ring, MediaBuffer* mediaBuffer, int64_t timeUs);
+    void queueOutput(Frame& frame);
+    void drainOutput();
+
+    sp<PcmRingBuffer> pcmRing() const
+    {
+        AutoMutex lock(mLock);
+        return mPcmRing;
+    }
+
+    void wakePcmWriter()
+    {
+        sp<PcmRingBuffer> ring = pcmRing();
+        if (ring != 0)
+            ring->wake();
+    }
+
+    sp<RenderStage> renderStage() const
+    {
+        AutoMutex lock(mLock);
+        return mRenderStage;
+    }
+
+    sp<PresentationScheduler> presentationScheduler() const
+    {
+        AutoMutex lock(mLock);
+        return mScheduler;
+    }
 
     sp<MediaStreamSource> mTrack;
     sp<MediaSource> mDecoderSource;
 
     sp<NativeWindowRenderer> mRenderer;
+    sp<RenderStage> mRenderStage;
+    sp<PresentationScheduler> mScheduler;
+    sp<PresentationClock> mAudioClock;
+    sp<PcmRingBuffer> mPcmRing;
 
     volatile bool mInterrupted;
-    volatile bool mFlushNeeded;
+    volatile bool mFlushPending;
     volatile bool mNeedSkip;
 
     uint32_t mDecoderFlags;
@@ -1676,10 +4428,66 @@ private:
     int32_t mChannelCount;
 
     Vector<uint8_t> mCodecConfig;
+    volatile size_t mNALLengthSize; // avcC/hvcC input, 0 for Annex-B
 
     bool mIsVideoDecoder;
     bool mDelayedOpen;
 
+    enum OpenState {
+        OPEN_IDLE,
+        OPEN_PENDING,
+        OPEN_READY,
+        OPEN_FAILED,
+    };
+
+    volatile OpenState mOpenState;
+    sp<IOMX> mIOMX;
+    Vector<uint8_t> mOpenConfig;
+    int64_t mOpenRequestTime;
+    int32_t mOpenMs;
+    int32_t mFirstFrameMs;
+    int32_t mPrewarmFrames;
+
+    int64_t mFlushStartTime;
+    bool mFlushFirstFramePending;
+    stagefright_flush_stats_t mFlushStats;
+
+    volatile int64_t mSeekTargetUs;
+    int64_t mSeekStartTime;
+    stagefright_seek_stats_t mSeekStats;
+
+    volatile bool mKeyframeOnly;
+    volatile bool mAwaitSync;
+    stagefright_trickplay_stats_t mTrickPlayStats;
+
+    volatile bool mResyncPending;
+    volatile bool mRecoveryPending;
+    int64_t mErrorTime;
+    stagefright_resync_stats_t mResyncStats;
+
+    volatile int64_t mHeartbeatMs;
+    volatile bool mInRead;
+    volatile bool mWaitingInput;
+    bool mExited;
+    bool mAbandoned; // nobody joins the thread, it stops the component itself
+    Condition mExitCondition;
+
+    volatile bool mMigratePending;
+    volatile bool mMigrateDraining;
+    uint32_t mMigrateFlags;
+    int64_t mMigrateStartTime;
+    bool mMigrationFirstFramePending;
+    stagefright_migration_stats_t mMigrationStats;
+
+    volatile int32_t mPriorityClass;
+    size_t mInBufferCount;
+    pid_t mTid;
+    stagefright_priority_stats_t mPriorityStats;
+
+    volatile size_t mDecodeAhead;
+    stagefright_output_stats_t mOutputStats;
+    PtsReorder mReorder;
+
     String8 mMimeType;
     String8 mComponentName;
 
@@ -1691,8 +4499,66 @@ private:
     Mutex mInLock;
     Condition mInCondition;
     Condition mReadCondition;
+    Condition mFlushCondition; // the decoder thread finished a flush
 };
 
+void PresentationScheduler::clear()
+{
+    List<PresentEntry> dropped;
+    { // scopped lock
+        AutoMutex lock(mLock);
+        while (!mQueue.empty()) {
+            dropped.push_back(PresentEntry());
+            (--dropped.end())->swap(*mQueue.begin());
+            mQueue.erase(mQueue.begin());
+        }
+    }
+    for (List<PresentEntry>::iterator it = dropped.begin(); it != dropped.end(); ++it)
+        mDecoder->present(*it, false);
+    mClock->reset();
+}
+
+bool PresentationScheduler::threadLoop()
+{
+    PresentEntry entry;
+    bool render = true;
+    { // scopped lock
+        AutoMutex lock(mLock);
+        while (mQueue.empty() && !exitPending())
+            mCondition.wait(mLock);
+        if (exitPending())
+            return false;
+
+        int64_t pts = mQueue.begin()->pts;
+        if (mClock->source() == PRESENTATION_CLOCK_WALL)
+            mClock->start(pts);
+
+        int64_t now = mClock->nowUs();
+        if (now < 0 || pts > now) {
+            // not anchored yet or early, an earlier frame posted meanwhile wakes us
+            int64_t waitUs = now < 0 ? s_frameDisplayTimeMsec * 1000 / 4 : pts - now;
+            if (waitUs > s_frameDisplayTimeMsec * 1000)
+                waitUs = s_frameDisplayTimeMsec * 1000; // the master clock may jump
+            mCondition.waitRelative(mLock, waitUs * 1000);
+            return true;
+        }
+
+        entry.swap(*mQueue.begin());
+        mQueue.erase(mQueue.begin());
+
+        // late by a display period and the next frame is due too: skip to it
+        if (now - pts > s_frameDisplayTimeMsec * 1000 && !mQueue.empty() && mQueue.begin()->pts <= now) {
+            render = false;
+            mStats.dropped_late++;
+        } else {
+            recordJitter(now - pts);
+        }
+    }
+
+    mDecoder->present(entry, render);
+    return true;
+}
+
 status_t MediaStreamSource::read(MediaBuffer** buffer,
         const MediaSource::ReadOptions* options)
 {
@@ -1714,19 +4580,24 @@ status_t MediaStreamSource::read(MediaBuffer** buffer,
     }
 
     if (status == OK) {
-        status = mBufferGroup.acquire_buffer(buffer);
+        if (frame.mOwner != 0) {
+            // zero-copy input, the codec reads straight from the owner memory
+            *buffer = new BorrowedMediaBuffer(frame.mBuffer, frame.mSize, frame.mOwner);
+        } else {
+            status = mBufferGroup.acquire_buffer(buffer);
+            if (status == OK && buffer)
+                memcpy((*buffer)->data(), frame.mBuffer, frame.mSize);
+        }
 
         if (status == OK && buffer) {
-            memcpy((*buffer)->data(), frame.mBuffer, frame.mSize);
             (*buffer)->set_range(0, frame.mSize);
             (*buffer)->meta_data()->clear();
 
             if (frame.mFlags & OMX_BUFFERFLAG_CODECCONFIG) {
                 (*buffer)->meta_data()->setInt32(kKeyIsCodecConfig, 1);
             } else {
-//              bool syncFrame = isIDRFrame(frame.mBuffer, frame.mSize);
-                (*buffer)->meta_data()->setInt32(kKeyIsSyncFrame,
-                        frame.mFlags & OMX_BUFFERFLAG_SYNCFRAME ? 1 : 0);
+                bool syncFrame = mDecoder->isSyncInput(frame.mBuffer, frame.mSize, frame.mFlags);
+                (*buffer)->meta_data()->setInt32(kKeyIsSyncFrame, syncFrame ? 1 : 0);
             }
 
             (*buffer)->meta_data()->setInt64(kKeyTime, frame.mPts);
@@ -1765,6 +4636,7 @@ bool Decoder::createDecoderByType(sp<IOMX>& iomx, const char* mimeType)
 {
     LOG_DEBUG;
     mMimeType = strdup(mimeType);
+    mNALLengthSize = getNALLengthSize(mimeType, mCodecConfig.array(), mCodecConfig.size());
 
     if (!strncasecmp(mimeType, "audio/", 6)) {
         mSampleRate = mChannelCount = 0;
@@ -1773,8 +4645,52 @@ bool Decoder::createDecoderByType(sp<IOMX>& iomx, const char* mimeType)
         return true;
     }
 
+    // the codec is opened asynchronously, see openAsync()
     mIsVideoDecoder = true;
-    return createDecoder(iomx, 0, 0);
+    return true;
+}
+
+bool Decoder::openAsync(const sp<IOMX>& iomx, const uint8_t* config, size_t configSize)
+{
+    LOG_DEBUG;
+    { // scopped lock
+        AutoMutex lock(mInLock);
+        mIOMX = iomx;
+        mOpenConfig.clear();
+        if (config && configSize > 0)
+            mOpenConfig.appendArray(config, configSize);
+        mOpenRequestTime = getTimestampMs();
+        mFirstFrameMs = -1;
+        mOpenState = OPEN_PENDING;
+        mExited = false;
+    }
+    mDelayedOpen = false;
+
+    if (run(0, kSessionPolicy[mPriorityClass].threadPriority) != OK) {
+        AutoMutex lock(mInLock);
+        mOpenState = OPEN_FAILED;
+        mExited = true;
+        return false;
+    }
+    return true;
+}
+
+bool Decoder::openPending()
+{
+    int64_t startTime = getTimestampMs();
+    bool result = createDecoder(mIOMX, mOpenConfig.editArray(), mOpenConfig.size())
+            && mDecoderSource != 0;
+
+    AutoMutex lock(mInLock);
+    mOpenMs = getPeriodMs(startTime);
+    mPrewarmFrames = mInQueue.size();
+    mOpenState = result ? OPEN_READY : OPEN_FAILED;
+    heartbeat();
+    mReadCondition.signal();
+
+    LOGI("[Decoder] (%p) codec open %s in %d ms, prewarm frames=%d", this,
+            result ? "done" : "failed", mOpenMs, mPrewarmFrames);
+    return result;
 }
 
 bool Decoder::createDecoder(sp<IOMX>& iomx, uint8_t* config, size_t configSize)
@@ -1790,8 +4706,10 @@ bool Decoder::createAudioDecoder(sp<IOMX>& iomx, uint8_t* config, size_t configS
     LOG_DEBUG;
     sp<MetaData> meta = NULL;
 
+    // ADTS/LATM framing is stripped by AACFramer before queueing
     meta = MakeAACCodecSpecificData(config, configSize);
-//    meta->setInt32('adts', true); // kKeyIsADTS
+    if (meta == 0)
+        return false;
 
     mTrack = new MediaStreamSource(this, meta);
     if (mTrack == 0)
@@ -1807,9 +4725,12 @@ bool Decoder::createAudioDecoder(sp<IOMX>& iomx, uint8_t* config, size_t configS
             return false;
         }
 
-        Frame frame;
-        frame.mStatus = INFO_FORMAT_CHANGED;
-        mOutQueue.push(frame);
+        // PCM ring readers get the format from the ring, nobody dequeues the event
+        if (pcmRing() == 0) {
+            Frame frame;
+            frame.mStatus = INFO_FORMAT_CHANGED;
+            mOutQueue.push(frame);
+        }
         return true;
 
     }
@@ -1893,23 +4814,36 @@ bool Decoder::createVideoDecoder(sp<IOMX>& iomx, uint8_t* config,
     android::ProcessState::self()->startThreadPool();
     //DataSource::RegisterDefaultSniffers();
 
-    AutoMutex lock(mLock);
-    mTrack = new MediaStreamSource(this, meta);
-    if (mTrack == 0)
+    sp<MediaStreamSource> track = new MediaStreamSource(this, meta);
+    if (track == 0)
         return false;
 
-    bool hasHWRendering = openVideoDecoder(iomx, mTrack);
+    // allocating and starting a component takes long, the getters must not wait for it
+    sp<MediaSource> decoder;
+    bool hasHWRendering = openVideoDecoder(iomx, track, decoder);
     LOGI("[Decoder] has hw rendering=%d", hasHWRendering?1:0);
+    bool started = decoder != 0 && decoder->start() == OK;
 
-    if (mDecoderSource != 0 && mDecoderSource->start() == OK) {
+    { // scopped lock
+        AutoMutex lock(mLock);
+        mTrack = track;
+        mDecoderSource = decoder;
+    }
+
+    if (started) {
 
         if (!hasHWRendering && mRenderer != 0) {
-            mRenderer->init(mDecoderSource->getFormat());
+            mRenderer->init(decoder->getFormat());
+        } else if (mRenderer != 0) {
+            mRenderer->resetSoftwareRendering();
         }
 
-        if (!setVideoDecoderFormat()) {
-            LOGW("[Decoder] (%p) Can't setVideoDecoderFormat for decoder", this);
-            return false;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            if (!setVideoDecoderFormat()) {
+                LOGW("[Decoder] (%p) Can't setVideoDecoderFormat for decoder", this);
+                return false;
+            }
         }
 
         Frame frame;
@@ -1919,31 +4853,194 @@ bool Decoder::createVideoDecoder(sp<IOMX>& iomx, uint8_t* config,
     return true;
 }
 
-void Decoder::release()
+void Decoder::flush()
 {
-    mFlushNeeded = false;
+    LOG_DEBUG;
+    sp<RenderStage> stage = renderStage();
+    if (stage != 0)
+        stage->clear();
+    sp<PresentationScheduler> scheduler = presentationScheduler();
+    if (scheduler != 0)
+        scheduler->clear();
 
     { // scopped lock
         AutoMutex lock(mInLock);
+        mFlushStartTime = getTimestampMs();
+        mFlushStats.dropped_frames = mInQueue.size();
         mInQueue.clear();
-    }
 
-    if (!mInterrupted) {
-        mInterrupted = true;
-        signalEOF();
+        if (mOpenState != OPEN_READY || mInterrupted) {
+            // nothing reached the codec yet, dropping the input is enough
+            mFlushStats.flush_count++;
+            mFlushStats.flush_ms = 0;
+            return;
+        }
+
+        // EOS drains the codec, the decoder thread then flushes its ports
+        // and keeps running with the same component
+        mFlushPending = true;
+        mFlushFirstFramePending = false;
+        Frame frame;
+        frame.mStatus = ERROR_END_OF_STREAM;
+        mInQueue.push_back(frame);
+        mInCondition.signal();
     }
+    wakePcmWriter();
 
+    // give the held output back to the codec
+    mOutQueue.clearAll();
     mOutQueue.release();
+}
+
+void Decoder::seek(int64_t targetUs)
+{
+    flush();
+
+    // the caller queues from the sync frame before targetUs, the decoder
+    // thread drops everything decoded ahead of the target
+    AutoMutex lock(mInLock);
+    mSeekTargetUs = targetUs;
+    mSeekStartTime = getTimestampMs();
+    mSeekStats.seek_count++;
+    mSeekStats.target_us = targetUs;
+    mSeekStats.preroll_frames = 0;
+    mSeekStats.preroll_ms = -1;
+    LOGI("[Decoder] (%p) seek to %lld us", this, targetUs);
+}
+
+void Decoder::reuse(const Vector<uint8_t>& codecConfig, int32_t claimMs)
+{
+    { // scopped lock
+        AutoMutex lock(mInLock);
+        // the previous session's flush may still be draining the codec
+        int64_t startTime = getTimestampMs();
+        while (mFlushPending && !mExited) {
+            int wait = POOL_FLUSH_WAIT_MS - getPeriodMs(startTime);
+            if (wait <= 0)
+                break;
+            mFlushCondition.waitRelative(mInLock, (nsecs_t)wait * 1000000);
+        }
+
+        mOpenRequestTime = getTimestampMs();
+        mOpenMs = claimMs;
+        mFirstFrameMs = -1;
+        mPrewarmFrames = 0;
+        mKeyframeOnly = mAwaitSync = false;
+        mSeekTargetUs = -1;
+
+        memset(&mFlushStats, 0, sizeof(mFlushStats));
+        mFlushStats.flush_first_frame_ms = -1;
+        memset(&mSeekStats, 0, sizeof(mSeekStats));
+        mSeekStats.target_us = mSeekStats.preroll_ms = -1;
+        memset(&mTrickPlayStats, 0, sizeof(mTrickPlayStats));
+        memset(&mResyncStats, 0, sizeof(mResyncStats));
+
+        bool changed = codecConfig.size() != mCodecConfig.size()
+                || memcmp(codecConfig.array(), mCodecConfig.array(), codecConfig.size());
+        if (!codecConfig.isEmpty() && changed) {
+            // Annex-B parameter sets go in-band ahead of the first sync frame
+            mCodecConfig = codecConfig;
+            mNALLengthSize = getNALLengthSize(mMimeType.string(), mCodecConfig.array(), mCodecConfig.size());
+            Frame frame(OK, mCodecConfig.editArray(), mCodecConfig.size(), 0, OMX_BUFFERFLAG_CODECCONFIG);
+            mInQueue.push_back(frame);
+            mInCondition.signal();
+        }
+    }
+    // the previous session's reference frames are gone
+    awaitSyncFrame();
+
+    if (mOpenState == OPEN_READY) {
+        // the new session sees the format before its first frame
+        Frame frame;
+        frame.mStatus = INFO_FORMAT_CHANGED;
+        mOutQueue.push(frame);
+    }
+    LOGI("[Decoder] (%p) reused in %d ms", this, claimMs);
+}
+
+// ETIMEDOUT only means the codec had nothing to return in time, the other
+// errors leave references broken until the next sync frame
+void Decoder::beginResync(status_t status)
+{
+    AutoMutex lock(mInLock);
+    if (status == ETIMEDOUT) {
+        mResyncStats.timeouts++;
+        return;
+    }
+
+    if (status == UNKNOWN_ERROR)
+        mResyncStats.codec_errors++;
+    else
+        mResyncStats.stream_errors++;
+
+    if (!mIsVideoDecoder)
+        return; // every AAC frame decodes on its own
+
+    if (!mRecoveryPending) {
+        mRecoveryPending = true;
+        mErrorTime = getTimestampMs();
+        mResyncStats.resync_count++;
+        mResyncStats.last_recovery_ms = -1;
+    }
+
+    // drop queued input up to the next sync frame, config and EOS go through
+    while (!mInQueue.empty()) {
+        const Frame& frame = *mInQueue.begin();
+        if (frame.mStatus == ERROR_END_OF_STREAM || (frame.mFlags & OMX_BUFFERFLAG_CODECCONFIG)
+                || isSyncInput(frame.mBuffer, frame.mSize, frame.mFlags))
+            break;
+        mInQueue.erase(mInQueue.begin());
+        mResyncStats.dropped_frames++;
+    }
+    mResyncPending = mInQueue.empty();
+    mReadCondition.signal();
+
+    LOGI("[Decoder] (%p) resync after error %d, dropped %d, waiting for sync frame=%d", this,
+            status, mResyncStats.dropped_frames, mResyncPending ? 1 : 0);
+}
+
+void Decoder::release()
+{
+    mFlushPending = false;
+    setPresentationClock(0);
+    setRenderThread(false);
+
+    { // scopped lock
+        AutoMutex lock(mInLock);
+        mInQueue.clear();
+    }
+
+    if (!mInterrupted) {
+        mInterrupted = true;
+        signalEOF();
+    }
+
+    mOutQueue.interrupt();
+    wakePcmWriter();
 
     LOGV("[Decoder] (%p) joining...", this);
+    { // scopped lock
+        AutoMutex lock(mInLock);
+        int64_t startTime = getTimestampMs();
+        while (!mExited) {
+            int wait = RELEASE_TIMEOUT_MS - getPeriodMs(startTime);
+            if (wait <= 0)
+                break;
+            mExitCondition.waitRelative(mInLock, (nsecs_t)wait * 1000000);
+        }
+    }
+
+    if (abandon()) {
+        // the codec is wedged inside read(), the thread keeps itself alive
+        // and stops the component if it ever returns
+        LOGE("[Decoder] (%p) decoder thread stuck, release abandons it", this);
+        mRenderer.clear();
+        return;
+    }
     join();
 
     shutdownDecoder();
-
-    if (mTrack != 0) {
-        mTrack->stop();
-        mTrack.clear();
-    }
+    stopTrack();
 
     mRenderer.clear();
     LOGI("[Decoder] (%p) release end!", this);
@@ -1952,14 +5049,81 @@ void Decoder::release()
 status_t Decoder::readyToRun()
 {
     mInterrupted = false;
+    mTid = gettid();
+    applyPriority();
+    SessionScheduler::instance().add(this);
     return OK;
 }
 
 bool Decoder::threadLoop()
 {
+    if (mOpenState == OPEN_PENDING && !openPending()) {
+        Frame frame;
+        frame.mStatus = ERROR_END_OF_STREAM;
+        mOutQueue.push(frame);
+        mInterrupted = true;
+
+        onThreadExit();
+        return false;
+    }
+
     decode();
     mInterrupted = true;
     LOGI("[Decoder] (%p) ************ EXIT DECODER! **********", this);
+
+    onThreadExit();
+    return false;
+}
+
+void Decoder::onThreadExit()
+{
+    SessionScheduler::instance().remove(this);
+
+    { // scopped lock
+        AutoMutex lock(mInLock);
+        if (!mAbandoned) {
+            mExited = true;
+            mExitCondition.broadcast();
+            mFlushCondition.broadcast();
+            return;
+        }
+    }
+
+    // release() gave up on this thread, the component is stopped here
+    LOGI("[Decoder] (%p) abandoned decoder thread returned", this);
+    shutdownDecoder();
+    stopTrack();
+
+    AutoMutex lock(mInLock);
+    mExited = true;
+}
+
+// Yields to a higher class that fell behind, for at most two frame periods
+// so that lower classes still make progress
+void Decoder::throttle()
+{
+    if (!SessionScheduler::instance().higherBehind(this, mPriorityClass))
+        return;
+
+    int64_t startTime = getTimestampMs();
+    do {
+        usleep(s_frameDisplayTimeMsec * 1000 / 4);
+    } while (!mInterrupted && !mFlushPending && getPeriodMs(startTime) < 2 * s_frameDisplayTimeMsec
+            && SessionScheduler::instance().higherBehind(this, mPriorityClass));
+
+    AutoMutex lock(mInLock);
+    mPriorityStats.throttle_events++;
+    mPriorityStats.throttled_ms += getPeriodMs(startTime);
+}
+
+bool SessionScheduler::higherBehind(const Decoder* decoder, int32_t priorityClass) const
+{
+    AutoMutex lock(mLock);
+    for (size_t i = 0; i < mDecoders.size(); ++i) {
+        Decoder* other = mDecoders[i];
+        if (other != decoder && other->priorityClass() < priorityClass && other->isBehind())
+            return true;
+    }
     return false;
 }
 
@@ -1970,22 +5134,30 @@ void Decoder::decode()
 
     bool decodeDone = false;
     status_t status = OK;
-//    MediaSource::ReadOptions readopt;
+    MediaSource::ReadOptions readopt;
     int64_t startTime = getTimestampMs();
     MediaBuffer* mediaBuffer = 0;
     bool skipEnabled = false;
+    int errorCount = 0;
 
     do {
         releaseMediaBuffer(mediaBuffer);
 
         mOutQueue.releaseBuffers();
 
+        if (mPriorityClass != SESSION_PRIORITY_FOREGROUND)
+            throttle();
+
         startTime = getTimestampMs();
 
-        status = mDecoderSource->read(&mediaBuffer, NULL);//&readopt);
+        mInRead = true;
+        status = mDecoderSource->read(&mediaBuffer, &readopt);
+        mInRead = false;
+        if (status == OK || status == INFO_FORMAT_CHANGED)
+            heartbeat();
 
         mOutQueue.releaseBuffers();
-//        readopt.clearSeekTo();
+        readopt.clearSeekTo();
 
         if (mInterrupted)
             break;
@@ -1994,6 +5166,14 @@ void Decoder::decode()
             if (!mediaBuffer)
                 continue;
 
+            if (mFlushPending) {
+                // output of the input queued before the flush
+                releaseMediaBuffer(mediaBuffer);
+                AutoMutex lock(mInLock);
+                mFlushStats.dropped_frames++;
+                continue;
+            }
+
             if (!mediaBuffer->graphicBuffer().get() && !mediaBuffer->range_length()) {
                 LOGI("[Decoder] (%p) ERROR: soft buffer with zero length", this);
                 releaseMediaBuffer(mediaBuffer);
@@ -2016,38 +5196,120 @@ void Decoder::decode()
 
             int filled = mOutQueue.filledCount();
 
-            if (timeUs < 0) {
+            if (timeUs < 0 && !mIsVideoDecoder) {
                 LOGW("[Decoder] (%p) frame time %lld must be nonnegative", this, timeUs);
                 continue;
             }
 
-            if (!mediaBuffer->graphicBuffer().get()) {
+            if (mFirstFrameMs < 0) {
+                AutoMutex lock(mInLock);
+                mFirstFrameMs = getPeriodMs(mOpenRequestTime);
+                LOGI("[Decoder] (%p) first frame in %d ms", this, mFirstFrameMs);
+            }
+
+            if (mSeekTargetUs >= 0) {
+                AutoMutex lock(mInLock);
+                if (timeUs < mSeekTargetUs) {
+                    // preroll, never surfaced through mOutQueue
+                    mSeekStats.preroll_frames++;
+                    releaseMediaBuffer(mediaBuffer);
+                    continue;
+                }
+                mSeekTargetUs = -1;
+                mSeekStats.preroll_ms = getPeriodMs(mSeekStartTime);
+                LOGI("[Decoder] (%p) seek done in %d ms, preroll frames=%d", this,
+                        mSeekStats.preroll_ms, mSeekStats.preroll_frames);
+            }
+
+            errorCount = 0;
+            if (mRecoveryPending) {
+                AutoMutex lock(mInLock);
+                mRecoveryPending = false;
+                mResyncStats.last_recovery_ms = getPeriodMs(mErrorTime);
+                if (mResyncStats.last_recovery_ms > mResyncStats.max_recovery_ms)
+                    mResyncStats.max_recovery_ms = mResyncStats.last_recovery_ms;
+                LOGI("[Decoder] (%p) recovered in %d ms", this, mResyncStats.last_recovery_ms);
+            }
+
+            if (mMigrationFirstFramePending) {
+                AutoMutex lock(mInLock);
+                mMigrationFirstFramePending = false;
+                mMigrationStats.last_migration_ms = getPeriodMs(mMigrateStartTime);
+                LOGI("[Decoder] (%p) first frame after migration in %d ms", this,
+                        mMigrationStats.last_migration_ms);
+            }
+
+            if (mFlushFirstFramePending) {
+                AutoMutex lock(mInLock);
+                mFlushFirstFramePending = false;
+                mFlushStats.flush_first_frame_ms = getPeriodMs(mFlushStartTime);
+                LOGI("[Decoder] (%p) first frame after flush in %d ms", this, mFlushStats.flush_first_frame_ms);
+            }
+
+            if (!mIsVideoDecoder) {
+                sp<PcmRingBuffer> ring = pcmRing();
+                if (ring != 0) {
+                    writePcm(ring, mediaBuffer, timeUs);
+                    releaseMediaBuffer(mediaBuffer);
+                    continue;
+                }
+            }
+
+            if (mKeyframeOnly) {
+                // trick play: one output frame, the newest keyframe wins, no
+                // reordering and no hold handshake
+                drainOutput();
+                size_t replaced = mOutQueue.dropReady();
+                if (!mediaBuffer->graphicBuffer().get()) {
+                    Frame frame(status, reinterpret_cast<uint8_t*>(mediaBuffer->data())
+                            + mediaBuffer->range_offset(), mediaBuffer->range_length(), timeUs, 0);
+                    mOutQueue.push(frame);
+                    releaseMediaBuffer(mediaBuffer);
+                } else {
+                    Frame frame(status, mediaBuffer, timeUs, 0);
+                    mOutQueue.push(frame);
+                    mediaBuffer = 0;
+                }
+
+                AutoMutex lock(mInLock);
+                mTrickPlayStats.decoded_frames++;
+                mTrickPlayStats.replaced_frames += replaced;
+            } else if (!mediaBuffer->graphicBuffer().get()) {
                 uint8_t* data = reinterpret_cast<uint8_t*>(mediaBuffer->data())
                             + mediaBuffer->range_offset();
                 size_t length = mediaBuffer->range_length();
 
                 Frame frame(status, data, length, timeUs, 0);
-                mOutQueue.push(frame);
+                if (mIsVideoDecoder)
+                    queueOutput(frame);
+                else
+                    mOutQueue.push(frame);
 
                 releaseMediaBuffer(mediaBuffer);
             } else {
-                if (filled >= MAX_HOLDED_FRAMES && !mInterrupted) {
-                    filled = mOutQueue.waitRelease(2 * s_frameDisplayTimeMsec);
-                    if (filled >= MAX_HOLDED_FRAMES)
-                        releaseMediaBuffer(mediaBuffer);
+                // hand the frame off and decode on, only a used up decode-ahead
+                // depth waits for the consumer to give a codec buffer back
+                size_t depth = outputDepth();
+                if (filled >= (int)depth && !mInterrupted && !mFlushPending) {
+                    int64_t idleTime = getTimestampMs();
+                    while (!mOutQueue.waitFilledBelow(depth, s_frameDisplayTimeMsec)
+                            && !mInterrupted && !mFlushPending)
+                        ;
+                    AutoMutex lock(mInLock);
+                    mOutputStats.output_stalls++;
+                    mOutputStats.idle_output_ms += getPeriodMs(idleTime);
+                }
+
+                if (mInterrupted || mFlushPending) {
+                    releaseMediaBuffer(mediaBuffer);
+                    continue;
                 }
+
                 Frame frame(status, mediaBuffer, timeUs, 0);
-                int index = mOutQueue.push(frame, true);
+                queueOutput(frame);
                 mediaBuffer = 0;
 
                 skipEnabled = true;
-                if (filled + 1 >= MAX_HOLDED_FRAMES && !mInterrupted) {
-                    filled = mOutQueue.waitRelease(mFlushNeeded ? (OUT_BUFFER_COUNT * s_frameDisplayTimeMsec) : (2 * s_frameDisplayTimeMsec));
-                    if (filled >= MAX_HOLDED_FRAMES) {
-                        mOutQueue.clearBuffer(index);
-                        skipEnabled = false;
-                    }
-                }
             }
         } else if (status == INFO_FORMAT_CHANGED) {
             LOGI("[Decoder] (%p) decode ====== INFO_FORMAT_CHANGED ======", this);
@@ -2063,20 +5325,50 @@ void Decoder::decode()
 //            sp<MetaData> meta = mDecoderSource->getFormat();
 //            mTrack->setFormat(meta);
 
-            Frame frame;
-            frame.mStatus = status;
-            mOutQueue.push(frame);
+            // frames of the old format go out first
+            drainOutput();
+            if (mIsVideoDecoder || pcmRing() == 0) {
+                Frame frame;
+                frame.mStatus = status;
+                mOutQueue.push(frame);
+            }
             continue;
 
         } else if (status == ERROR_END_OF_STREAM) {
-            LOGI("[Decoder] (%p) decode ====== END_OF_STREAM ======", this);
-
             releaseMediaBuffer(mediaBuffer);
-            if (mFlushNeeded) {
-                Frame frame;
-                frame.mStatus = status;
-                mOutQueue.push(frame, true);
+            sp<PcmRingBuffer> ring = pcmRing();
+
+            if (mMigrateDraining) {
+                if (!migrateDecoder())
+                    break;
+                continue;
+            }
+
+            if (mFlushPending) {
+                // the codec is drained, a seek read flushes its ports and resumes it
+                mReorder.reset();
+                mOutQueue.clearAll();
+                if (ring != 0)
+                    ring->discard();
+                readopt.setSeekTo(0);
+
+                AutoMutex lock(mInLock);
+                mFlushPending = false;
+                mFlushCondition.broadcast();
+                mFlushFirstFramePending = true;
+                mFlushStats.flush_count++;
+                mFlushStats.flush_ms = getPeriodMs(mFlushStartTime);
+                mFlushStats.flush_first_frame_ms = -1;
+                LOGI("[Decoder] (%p) decode ====== FLUSHED in %d ms, dropped %d ======", this,
+                        mFlushStats.flush_ms, mFlushStats.dropped_frames);
+                continue;
             }
+
+            LOGI("[Decoder] (%p) decode ====== END_OF_STREAM ======", this);
+            drainOutput();
+
+            if (ring != 0)
+                ring->setEndOfStream(true);
             decodeDone = true;
 
             continue;
@@ -2089,19 +5381,26 @@ void Decoder::decode()
             LOGE("[Decoder] (%p) decode ERROR %d(%#x)", this, status, status);
             releaseMediaBuffer(mediaBuffer);
 
-            if (status == ETIMEDOUT) { // -110
-                // rised by OMXCodec::waitForBufferFilled_l
-            }
-            if (status == 0xfffffbb1) { // -1103
-            }
-            if (status == UNKNOWN_ERROR) {
-            }
-
             if (mInterrupted)
                 break;
 
-            mOutQueue.clearAll();
-            usleep(s_frameDisplayTimeMsec * 1000);
+            // ETIMEDOUT(-110) is rised by OMXCodec::waitForBufferFilled_l,
+            // -1103 and UNKNOWN_ERROR need a sync frame, held output stays valid
+            beginResync(status);
+
+            // a codec stuck in its error state returns at once, do not spin on it
+            if (++errorCount >= MAX_DECODE_ERRORS) {
+                if (status == UNKNOWN_ERROR && mIsVideoDecoder && mRenderer != 0
+                        && (mDecoderFlags & OMXCodec::kHardwareCodecsOnly)) {
+                    // the HW component keeps failing, resync already waits for a sync frame
+                    setDecoderMode(DECODER_MODE_SW);
+                    errorCount = 0;
+                    if (!migrateDecoder())
+                        break;
+                    continue;
+                }
+                usleep(s_frameDisplayTimeMsec * 1000);
+            }
 
             continue;
         }
@@ -2109,9 +5408,51 @@ void Decoder::decode()
     } while (!decodeDone && !mInterrupted);
 
     releaseMediaBuffer(mediaBuffer);
+    mReorder.reset();
     mOutQueue.clearAll();
 }
 
+void Decoder::queueOutput(Frame& frame)
+{
+    mReorder.add(frame);
+
+    Frame next;
+    while (mReorder.next(next, false))
+        mOutQueue.push(next);
+}
+
+void Decoder::drainOutput()
+{
+    Frame next;
+    while (!mInterrupted && mReorder.next(next, true))
+        mOutQueue.push(next);
+    if (mInterrupted)
+        mReorder.reset();
+}
+
+void Decoder::writePcm(const sp<PcmRingBuffer>& ring, MediaBuffer* mediaBuffer, int64_t timeUs)
+{
+    if (mSampleRate <= 0 || mChannelCount <= 0)
+        return;
+
+    ring->configure(mSampleRate, mChannelCount);
+
+    const int16_t* data = reinterpret_cast<const int16_t*>(
+            reinterpret_cast<uint8_t*>(mediaBuffer->data()) + mediaBuffer->range_offset());
+    size_t frames = mediaBuffer->range_length() / (mChannelCount * sizeof(int16_t));
+
+    // the consumer pulls at its own pace, wait for space instead of dropping samples
+    size_t done = 0;
+    while (done < frames && !mInterrupted && !mFlushPending) {
+        int64_t pts = timeUs + (int64_t)done * 1000000 / mSampleRate;
+        size_t written = ring->write(data + done * mChannelCount, frames - done, mChannelCount,
+                pts, mSampleRate);
+        done += written;
+        if (written == 0)
+            ring->waitSpace(PCM_SPACE_WAIT_MS);
+    }
+}
+
 bool Decoder::setVideoDecoderFormat()
 {
     LOG_DEBUG;
@@ -2228,25 +5569,40 @@ bool Decoder::setAudioDecoderFormat()
     return true;
 }
 
-bool Decoder::openVideoDecoder(const sp<IOMX>& omx, const sp<MediaStreamSource>& track)
+// Creates the component without holding mLock, the caller publishes it
+bool Decoder::openVideoDecoder(const sp<IOMX>& omx, const sp<MediaStreamSource>& track,
+        sp<MediaSource>& decoder)
 {
     LOGV("[Decoder] (%p) openVideoDecoder", this);
     int32_t decoderFlags = getVideoDecoderFlags();
     if (mRenderer != 0) {
         sp<ANativeWindow> window = mRenderer->window();
         if (window != 0) {
-            mDecoderSource = OMXCodec::Create(omx, track->getFormat(), false, track, 0, decoderFlags, window);
-            if (mDecoderSource != 0) {
+            decoder = OMXCodec::Create(omx, track->getFormat(), false, track, 0, decoderFlags, window);
+            if (decoder != 0) {
                 LOGV("[Decoder] (%p) decoder opened!", this);
             }
         }
     }
-    if (mDecoderSource == 0) {
+    if (decoder == 0 && (decoderFlags & OMXCodec::kHardwareCodecsOnly) && mRenderer != 0) {
+        // HW instances exhausted or missing, decode in SW and render ourselves
+        LOGW("[Decoder] (%p) falling back to software video decoder", this);
+        track->setColorFormat(OMX_COLOR_FormatYUV420Planar);
+        decoderFlags = (decoderFlags & ~OMXCodec::kHardwareCodecsOnly) | OMXCodec::kSoftwareCodecsOnly;
+        decoder = OMXCodec::Create(omx, track->getFormat(), false, track, 0, decoderFlags, 0);
+        if (decoder != 0) {
+            AutoMutex lock(mInLock);
+            mDecoderFlags = OMXCodec::kSoftwareCodecsOnly;
+            mMigrationStats.open_fallbacks++;
+            return false;
+        }
+    }
+    if (decoder == 0) {
         LOGW("[Decoder] (%p) cannot open OMXCodec!", this);
         return false;
     }
 
-    sp<MetaData> format = mDecoderSource->getFormat();
+    sp<MetaData> format = decoder->getFormat();
     const char* component = 0;
     if (format->findCString(kKeyDecoderComponent, &component)) {
         if (strncmp(component, "OMX.", 4)
@@ -2254,15 +5610,69 @@ bool Decoder::openVideoDecoder(const sp<IOMX>& omx, const sp<MediaStreamSource>&
             || !strncmp(component, "OMX.Nvidia.mpeg2v.decode", 24)) {
             LOGV("[Decoder] (%p), use software renderer for %s decoder", this, component);
             track->setColorFormat(OMX_COLOR_FormatYUV420Planar);
-            mDecoderSource.clear();
+            decoder.clear();
             decoderFlags |= OMXCodec::kClientNeedsFramebuffer;
-            mDecoderSource = OMXCodec::Create(omx, track->getFormat(), false, track, 0, decoderFlags, 0);
+            decoder = OMXCodec::Create(omx, track->getFormat(), false, track, 0, decoderFlags, 0);
             return false;
         }
     }
     return true;
 }
 
+// Runs on the decoder thread once the old component is drained or broken,
+// queued input stays in mInQueue for the new one
+bool Decoder::migrateDecoder()
+{
+    uint32_t previous = mDecoderFlags;
+    uint32_t flags;
+    { // scopped lock
+        AutoMutex lock(mInLock);
+        flags = mMigrateFlags;
+        mMigratePending = mMigrateDraining = false;
+    }
+    LOGI("[Decoder] (%p) migrate %s -> %s", this,
+            (previous & OMXCodec::kSoftwareCodecsOnly) ? "SW" : "HW",
+            (flags & OMXCodec::kSoftwareCodecsOnly) ? "SW" : "HW");
+
+    // the frames the old component already decoded are still shown
+    drainOutput();
+    int64_t waitTime = getTimestampMs();
+    while (mOutQueue.filledCount() > 0 && !mInterrupted && !mFlushPending
+            && getPeriodMs(waitTime) < MIGRATE_DRAIN_WAIT_MS)
+        mOutQueue.waitFilledBelow(1, s_frameDisplayTimeMsec);
+
+    // the old component wants its output buffers back before stop()
+    mOutQueue.clearAll();
+    shutdownDecoder();
+    if (mTrack != 0) {
+        mTrack->stop();
+        mTrack.clear();
+    }
+
+    mDecoderFlags = flags;
+    bool result = createVideoDecoder(mIOMX, 0, 0) && mDecoderSource != 0;
+    if (!result) {
+        LOGE("[Decoder] (%p) migration failed, reopen the previous component", this);
+        shutdownDecoder();
+        mDecoderFlags = previous;
+        createVideoDecoder(mIOMX, 0, 0);
+    }
+
+    AutoMutex lock(mInLock);
+    if (result) {
+        if (mDecoderFlags & OMXCodec::kSoftwareCodecsOnly)
+            mMigrationStats.to_sw++;
+        else
+            mMigrationStats.to_hw++;
+        mMigrationStats.last_migration_ms = -1;
+        mMigrationFirstFramePending = true;
+    } else {
+        mMigrationStats.failed++;
+    }
+    heartbeat();
+    return mDecoderSource != 0;
+}
+
 void Decoder::openAudioDecoder(const sp<IOMX>& omx, const sp<MediaSource>& track)
 {
     LOGV("[Decoder] (%p) openAudioDecoder", this);
@@ -2289,144 +5699,2165 @@ uint32_t Decoder::getVideoDecoderFlags() const
     return flags;
 }
 
-class StagefrightContext {
-public:
-    StagefrightContext()
-        : mDecoder(new Decoder())
-    {}
-
-    ~StagefrightContext() {}
-
-    bool configure(void* nativewWindow, int w, int h, void *p_extra, int i_extra);
-    bool createDecoderByType(const char* mimeType);
-    void release();
-    void releaseOutputBuffer(int index, int64_t pts);
-    const char* getName();
-    void getOutputFormat(void*);
-    int32_t getOutputBuffers();
-    bool queueInputBuffer(int32_t index, uint8_t* data, size_t size,
-            int64_t pts, uint32_t flags);
-    int32_t dequeueInputBuffer(int64_t timeoutUs);
-    int32_t dequeueOutputBuffer(uint8_t** data, size_t* size, int64_t* pts);
-    int32_t outputBufferCount();
-    void flush() { if (mDecoder != NULL) mDecoder->flush(); }
-
-private:
-    OMXClient mClient;
-    sp<Decoder> mDecoder;
+enum {
+    STREAM_TYPE_H264 = 0,
+    STREAM_TYPE_H265 = 1,
+    STREAM_TYPE_ADTS = 2,
 };
 
-bool StagefrightContext::configure(void* nativeWindow, int w, int h, void *p_extra, int i_extra)
-{
-    LOG_DEBUG;
-    if (mClient.connect() != OK) {
-        LOGW("[StagefrightContext] OMXClient failed to connect");
-        mDecoder = NULL;
-        return false;
+// Memory mapped Annex-B or ADTS file split into access units in one pass.
+class ElementaryStreamFile : public RefBase {
+public:
+    struct AccessUnit {
+        size_t offset;
+        size_t size;
+        int64_t pts;
+        uint32_t flags;
+    };
+
+    ElementaryStreamFile()
+        : mData(0)
+        , mSize(0)
+        , mStreamType(STREAM_TYPE_H264)
+        , mNext(0)
+    {
+        memset(mAudioConfig, 0, sizeof(mAudioConfig));
     }
 
-    if (!mDecoder->configure(nativeWindow, w, h, p_extra, i_extra)) {
-        mClient.disconnect();
-        mDecoder = NULL;
-        return false;
+    virtual ~ElementaryStreamFile()
+    {
+        if (mData)
+            munmap(const_cast<uint8_t*>(mData), mSize);
     }
-    return true;
-}
 
-bool StagefrightContext::createDecoderByType(const char* mimeType)
-{
-    LOG_DEBUG;
-    if (mDecoder != NULL) {
-        sp<IOMX> iomx = mClient.interface();
-        dumpCodecProfiles(iomx, true);
-        bool result = mDecoder->createDecoderByType(iomx, mimeType);
+    bool open(const char* path, int streamType, int64_t frameDurationUs)
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            LOGE("[ElementaryStreamFile] cannot open %s: %s", path, strerror(errno));
+            return false;
+        }
 
-        if (result) {
-            if (mDecoder->IsDelayedOpen())
-                return true;
-            if (OK == mDecoder->run(0, DECODER_PRIORITY))
-                return true;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                mData = static_cast<const uint8_t*>(data);
+                mSize = st.st_size;
+                madvise(data, mSize, MADV_SEQUENTIAL);
+            }
         }
-    }
-    return false;
-}
+        ::close(fd);
 
-void StagefrightContext::release()
-{
-    sp<Decoder> decoder = mDecoder;
-    if (mDecoder != 0) {
-        mDecoder.clear();
+        if (!mData)
+            return false;
+
+        mStreamType = streamType;
+        if (frameDurationUs <= 0)
+            frameDurationUs = s_frameDisplayTimeMsec * 1000;
+
+        int64_t startTime = getTimestampMs();
+        bool result = streamType == STREAM_TYPE_ADTS ? indexADTS()
+                : indexAnnexB(streamType == STREAM_TYPE_H265, frameDurationUs);
+
+        LOGI("[ElementaryStreamFile] %s: %d access units, %d bytes, indexed in %d ms",
+                path, mUnits.size(), mSize, getPeriodMs(startTime));
+        return result && !mUnits.isEmpty();
+    }
+
+    size_t count() const { return mUnits.size(); }
+
+    // Next access unit to feed, NULL at end of stream
+    const AccessUnit* peek() const { return mNext < mUnits.size() ? &mUnits[mNext] : 0; }
+    void advance() { mNext++; }
+
+    // Rewind to the last sync unit at or before targetUs, returns its pts or -1
+    int64_t seekTo(int64_t targetUs)
+    {
+        if (mUnits.isEmpty())
+            return -1;
+
+        // units are indexed in presentation order
+        size_t lo = 0, hi = mUnits.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (mUnits[mid].pts <= targetUs)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        size_t index = lo;
+        while (index > 0 && !(mUnits[index].flags & OMX_BUFFERFLAG_SYNCFRAME))
+            index--;
+
+        mNext = index;
+        return mUnits[index].pts;
+    }
+
+    const uint8_t* data(const AccessUnit& unit) const { return mData + unit.offset; }
+
+    // 2-byte AudioSpecificConfig derived from the first ADTS header
+    const uint8_t* audioConfig() const { return mAudioConfig; }
+    size_t audioConfigSize() const { return mStreamType == STREAM_TYPE_ADTS ? sizeof(mAudioConfig) : 0; }
+
+private:
+    ElementaryStreamFile(const ElementaryStreamFile&);
+    ElementaryStreamFile &operator=(const ElementaryStreamFile&);
+
+    bool indexAnnexB(bool hevc, int64_t frameDurationUs)
+    {
+        const uint8_t* end = mData + mSize;
+        const uint8_t* nal = findStartCode(mData, end);
+        const uint8_t* auStart = mData;
+        bool hasSlice = false;
+        bool isSync = false;
+        int64_t pts = 0;
+
+        while (nal < end) {
+            const uint8_t* payload = nal + 3;
+            const uint8_t* next = findStartCode(payload, end);
+            // keep the leading zero of a 4-byte start code with its NAL
+            const uint8_t* nalStart = (nal > mData && nal[-1] == 0) ? nal - 1 : nal;
+
+            if (payload + 2 < next) {
+                bool slice, sync, firstSlice, prefix;
+                if (hevc) {
+                    int type = (payload[0] >> 1) & 0x3f;
+                    slice = type < 32;
+                    sync = type >= 16 && type <= 23;
+                    firstSlice = (payload[2] & 0x80) != 0;
+                    prefix = (type >= 32 && type <= 35) || type == 39
+                            || (type >= 41 && type <= 44) || (type >= 48 && type <= 55);
+                } else {
+                    int type = payload[0] & 0x1f;
+                    slice = type == 1 || type == 5;
+                    sync = type == 5;
+                    // first_mb_in_slice == 0 is coded as a single '1' bit
+                    firstSlice = (payload[1] & 0x80) != 0;
+                    prefix = (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+                }
+
+                if (hasSlice && ((slice && firstSlice) || prefix)) {
+                    addUnit(auStart, nalStart, pts, isSync ? OMX_BUFFERFLAG_SYNCFRAME : 0);
+                    pts += frameDurationUs;
+                    auStart = nalStart;
+                    hasSlice = isSync = false;
+                }
+                hasSlice |= slice;
+                isSync |= sync;
+            }
+            nal = next;
+        }
+
+        if (auStart < end) {
+            addUnit(auStart, end, pts, hasSlice ? (isSync ? OMX_BUFFERFLAG_SYNCFRAME : 0)
+                    : OMX_BUFFERFLAG_CODECCONFIG);
+        }
+        return true;
+    }
+
+    bool indexADTS()
+    {
+        size_t offset = 0;
+        int64_t samples = 0;
+        adts_header_t header;
+        while (offset < mSize) {
+            if (!parseADTSHeader(mData + offset, mSize - offset, &header)
+                    || offset + header.frame_size > mSize) {
+                // resync on the next 0xFFF syncword
+                offset++;
+                continue;
+            }
+
+            size_t offsets[ADTS_MAX_RAW_BLOCKS], sizes[ADTS_MAX_RAW_BLOCKS];
+            size_t blocks = getADTSRawBlocks(mData + offset, header, offsets, sizes);
+            if (blocks == 0) {
+                LOGE("[ElementaryStreamFile] ADTS frame at %d has %d raw data blocks without CRC",
+                        offset, header.raw_blocks);
+                return false;
+            }
+
+            if (mUnits.isEmpty())
+                makeAudioSpecificConfig(header, mAudioConfig);
+
+            // one access unit per raw_data_block, 1024 samples each
+            for (size_t i = 0; i < blocks; ++i) {
+                AccessUnit unit;
+                unit.offset = offset + offsets[i];
+                unit.size = sizes[i];
+                unit.pts = samples * 1000000 / kAACSamplingFreq[header.sf_index];
+                unit.flags = OMX_BUFFERFLAG_SYNCFRAME;
+                mUnits.push(unit);
+                samples += 1024;
+            }
+            offset += header.frame_size;
+        }
+        return true;
+    }
+
+    void addUnit(const uint8_t* start, const uint8_t* end, int64_t pts, uint32_t flags)
+    {
+        AccessUnit unit;
+        unit.offset = start - mData;
+        unit.size = end - start;
+        unit.pts = pts;
+        unit.flags = flags;
+        mUnits.push(unit);
+    }
+
+    const uint8_t* mData;
+    size_t mSize;
+    int mStreamType;
+    uint8_t mAudioConfig[2];
+
+    Vector<AccessUnit> mUnits;
+    size_t mNext;
+};
+
+// Recorded stream layout (all fields in host byte order):
+//   record_header_t
+//   record_entry_t + payload (padded to 8 bytes), repeated
+//   uint64_t offsets[count] at header.index_offset
+#define RECORD_MAGIC   0x43524653 // 'SFRC'
+#define RECORD_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t index_offset;
+} record_header_t;
+
+typedef struct {
+    int64_t pts;
+    int64_t delay_us; // inter-arrival time from the previous queue call
+    uint32_t flags;
+    uint32_t size;
+} record_entry_t;
+
+typedef struct {
+    int32_t frames_queued;
+    int32_t frames_rejected;
+    int32_t frames_decoded;
+    int32_t frames_dropped;
+    int64_t bytes_queued;
+    int32_t elapsed_ms;
+    float fps;
+    float kbps;
+    int32_t latency_min_ms;
+    int32_t latency_avg_ms;
+    int32_t latency_max_ms;
+} stagefright_replay_stats_t;
+
+class StreamRecorder {
+public:
+    StreamRecorder()
+        : mFile(0)
+        , mOffset(0)
+        , mLastTimeUs(-1)
+        , mFailed(false)
+    {
+    }
+
+    ~StreamRecorder() { close(); }
+
+    bool open(const char* path)
+    {
+        AutoMutex lock(mLock);
+        closeLocked();
+        mFile = fopen(path, "wb");
+        if (!mFile) {
+            LOGE("[StreamRecorder] cannot open %s: %s", path, strerror(errno));
+            return false;
+        }
+
+        // the header stays zero, an invalid record, until close() completes it
+        record_header_t header;
+        memset(&header, 0, sizeof(header));
+        if (fwrite(&header, 1, sizeof(header), mFile) != sizeof(header)) {
+            LOGE("[StreamRecorder] cannot write %s: %s", path, strerror(errno));
+            fclose(mFile);
+            mFile = 0;
+            return false;
+        }
+        mOffset = sizeof(header);
+        mLastTimeUs = -1;
+        mFailed = false;
+        mIndex.clear();
+        LOGI("[StreamRecorder] recording to %s", path);
+        return true;
+    }
+
+    void write(const uint8_t* data, size_t size, int64_t pts, uint32_t flags)
+    {
+        AutoMutex lock(mLock);
+        if (!mFile || mFailed)
+            return;
+
+        int64_t now = getMonotonicUs();
+        record_entry_t entry;
+        entry.pts = pts;
+        entry.delay_us = mLastTimeUs < 0 ? 0 : now - mLastTimeUs;
+        entry.flags = flags;
+        entry.size = data ? size : 0;
+        mLastTimeUs = now;
+
+        static const uint8_t kPadding[8] = { 0 };
+        size_t padding = (8 - (entry.size & 7)) & 7;
+
+        // a short write stops recording, close() keeps the complete entries
+        if (fwrite(&entry, 1, sizeof(entry), mFile) != sizeof(entry)
+                || (entry.size > 0 && fwrite(data, 1, entry.size, mFile) != entry.size)
+                || (padding > 0 && fwrite(kPadding, 1, padding, mFile) != padding)) {
+            LOGE("[StreamRecorder] write failed after %d frames: %s", (int)mIndex.size(),
+                    strerror(errno));
+            mFailed = true;
+            return;
+        }
+        mIndex.push(mOffset);
+        mOffset += sizeof(entry) + entry.size + padding;
+    }
+
+    // False when the record could not be completed, it is then left invalid
+    bool close()
+    {
+        AutoMutex lock(mLock);
+        return closeLocked();
+    }
+
+    bool isRecording() const
+    {
+        AutoMutex lock(mLock);
+        return mFile != 0 && !mFailed;
+    }
+
+private:
+    StreamRecorder(const StreamRecorder&);
+    StreamRecorder &operator=(const StreamRecorder&);
+
+    bool closeLocked()
+    {
+        if (!mFile)
+            return true;
+
+        record_header_t header;
+        header.magic = RECORD_MAGIC;
+        header.version = RECORD_VERSION;
+        header.count = mIndex.size();
+        header.reserved = 0;
+        header.index_offset = mOffset;
+
+        // the index overwrites a partly written entry, the header goes last so
+        // that the record only becomes valid once everything before it is on disk
+        bool result = fseeko(mFile, mOffset, SEEK_SET) == 0
+                && (mIndex.isEmpty()
+                    || fwrite(mIndex.array(), sizeof(uint64_t), mIndex.size(), mFile) == mIndex.size())
+                && fflush(mFile) == 0
+                && fseek(mFile, 0, SEEK_SET) == 0
+                && fwrite(&header, 1, sizeof(header), mFile) == sizeof(header);
+        if (fclose(mFile) != 0)
+            result = false;
+        mFile = 0;
+
+        if (result)
+            LOGI("[StreamRecorder] recorded %d frames", header.count);
+        else
+            LOGE("[StreamRecorder] cannot complete the record of %d frames: %s", header.count,
+                    strerror(errno));
+        return result;
+    }
+
+    FILE* mFile;
+    uint64_t mOffset;
+    int64_t mLastTimeUs;
+    bool mFailed;
+    Vector<uint64_t> mIndex;
+    mutable Mutex mLock;
+};
+
+class StreamReplayer {
+public:
+    StreamReplayer()
+        : mData(0)
+        , mSize(0)
+        , mHeader(0)
+        , mIndex(0)
+    {
+    }
+
+    ~StreamReplayer() { close(); }
+
+    bool open(const char* path)
+    {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            LOGE("[StreamReplayer] cannot open %s: %s", path, strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(record_header_t)) {
+            void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                mData = static_cast<const uint8_t*>(data);
+                mSize = st.st_size;
+            }
+        }
+        ::close(fd);
+
+        if (!mData)
+            return false;
+
+        mHeader = reinterpret_cast<const record_header_t*>(mData);
+        if (mHeader->magic != RECORD_MAGIC || mHeader->version != RECORD_VERSION
+                || mHeader->index_offset + mHeader->count * sizeof(uint64_t) > mSize) {
+            LOGE("[StreamReplayer] %s is not a valid record", path);
+            close();
+            return false;
+        }
+        mIndex = reinterpret_cast<const uint64_t*>(mData + mHeader->index_offset);
+        return true;
+    }
+
+    void close()
+    {
+        if (mData)
+            munmap(const_cast<uint8_t*>(mData), mSize);
+        mData = 0;
+        mSize = 0;
+        mHeader = 0;
+        mIndex = 0;
+    }
+
+    uint32_t count() const { return mHeader ? mHeader->count : 0; }
+
+    const record_entry_t* entry(uint32_t i, const uint8_t** payload) const
+    {
+        if (i >= count() || mIndex[i] + sizeof(record_entry_t) > mSize)
+            return 0;
+
+        const record_entry_t* e = reinterpret_cast<const record_entry_t*>(mData + mIndex[i]);
+        if (mIndex[i] + sizeof(record_entry_t) + e->size > mSize)
+            return 0;
+
+        if (payload)
+            *payload = mData + mIndex[i] + sizeof(record_entry_t);
+        return e;
+    }
+
+private:
+    StreamReplayer(const StreamReplayer&);
+    StreamReplayer &operator=(const StreamReplayer&);
+
+    const uint8_t* mData;
+    size_t mSize;
+    const record_header_t* mHeader;
+    const uint64_t* mIndex;
+};
+
+// Process-wide HW decoder budget in macroblocks per second and instances.
+// Sessions over it wait, push background sessions to SW, or decode in SW.
+class HwDecoderArbiter {
+public:
+    static HwDecoderArbiter& instance()
+    {
+        static HwDecoderArbiter s_instance;
+        return s_instance;
+    }
+
+    static int64_t load(int32_t width, int32_t height, int32_t frameRate)
+    {
+        return (int64_t)((width + 15) / 16) * ((height + 15) / 16) * frameRate;
+    }
+
+    void setBudget(int64_t mbPerSec, int32_t instances)
+    {
+        AutoMutex lock(mLock);
+        mBudgetLoad = mbPerSec > 0 ? mbPerSec : HW_BUDGET_MB_PER_SEC;
+        mBudgetInstances = instances > 0 ? instances : HW_BUDGET_INSTANCES;
+        mReleased.broadcast();
+    }
+
+    // true if the session may open a HW decoder
+    bool acquire(const void* session, const sp<Decoder>& decoder, int64_t load, bool foreground)
+    {
+        AutoMutex lock(mLock);
+        release_l(session);
+
+        if (!fits(load) && foreground) {
+            // newest background sessions go first, grants are sorted by session
+            ssize_t i;
+            while (!fits(load) && (i = newestBackground()) >= 0) {
+                sp<Decoder> demoted = mGrants.valueAt(i).decoder.promote();
+                if (demoted != 0)
+                    demoted->setDecoderMode(DECODER_MODE_SW);
+                mUsedLoad -= mGrants.valueAt(i).load;
+                mGrants.removeItemsAt(i);
+                mStats.demoted++;
+            }
+
+            if (!fits(load)) {
+                mStats.queued++;
+                int64_t startTime = getTimestampMs();
+                while (!fits(load)) {
+                    int wait = HW_ADMISSION_TIMEOUT_MS - getPeriodMs(startTime);
+                    if (wait <= 0)
+                        break;
+                    mReleased.waitRelative(mLock, (nsecs_t)wait * 1000000);
+                }
+            }
+        }
+
+        if (!fits(load)) {
+            mStats.routed_to_sw++;
+            LOGI("[HwDecoderArbiter] %p routed to SW, load=%lld, used=%lld/%lld, instances=%d/%d",
+                    session, load, mUsedLoad, mBudgetLoad, mGrants.size(), mBudgetInstances);
+            return false;
+        }
+
+        Grant grant;
+        grant.decoder = decoder;
+        grant.load = load;
+        grant.foreground = foreground;
+        grant.serial = mNextSerial++;
+        mGrants.add(session, grant);
+        mUsedLoad += load;
+        mStats.admitted++;
+        LOGI("[HwDecoderArbiter] %p admitted, load=%lld, used=%lld/%lld, instances=%d/%d",
+                session, load, mUsedLoad, mBudgetLoad, mGrants.size(), mBudgetInstances);
+        return true;
+    }
+
+    void release(const void* session)
+    {
+        AutoMutex lock(mLock);
+        release_l(session);
+    }
+
+    bool isGranted(const void* session) const
+    {
+        AutoMutex lock(mLock);
+        return mGrants.indexOfKey(session) >= 0;
+    }
+
+    void getUtilisation(stagefright_hw_utilisation_t* stats) const
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+        stats->used_mb_per_sec = mUsedLoad;
+        stats->budget_mb_per_sec = mBudgetLoad;
+        stats->instances = mGrants.size();
+        stats->max_instances = mBudgetInstances;
+        stats->foreground_instances = 0;
+        for (size_t i = 0; i < mGrants.size(); ++i) {
+            if (mGrants.valueAt(i).foreground)
+                stats->foreground_instances++;
+        }
+        stats->load_percent = mBudgetLoad > 0 ? (int32_t)(mUsedLoad * 100 / mBudgetLoad) : 0;
+    }
+
+private:
+    HwDecoderArbiter()
+        : mBudgetLoad(HW_BUDGET_MB_PER_SEC)
+        , mBudgetInstances(HW_BUDGET_INSTANCES)
+        , mUsedLoad(0)
+        , mNextSerial(0)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+    }
+
+    HwDecoderArbiter(const HwDecoderArbiter&);
+    HwDecoderArbiter &operator=(const HwDecoderArbiter&);
+
+    bool fits(int64_t load) const
+    {
+        return (int32_t)mGrants.size() < mBudgetInstances && mUsedLoad + load <= mBudgetLoad;
+    }
+
+    ssize_t newestBackground() const
+    {
+        ssize_t newest = -1;
+        for (size_t i = 0; i < mGrants.size(); ++i) {
+            if (!mGrants.valueAt(i).foreground
+                    && (newest < 0 || mGrants.valueAt(i).serial > mGrants.valueAt(newest).serial))
+                newest = i;
+        }
+        return newest;
+    }
+
+    void release_l(const void* session)
+    {
+        ssize_t index = mGrants.indexOfKey(session);
+        if (index < 0)
+            return;
+        mUsedLoad -= mGrants.valueAt(index).load;
+        mGrants.removeItemsAt(index);
+        mReleased.broadcast();
+    }
+
+    struct Grant {
+        wp<Decoder> decoder;
+        int64_t load;
+        bool foreground;
+        uint32_t serial;
+    };
+
+    int64_t mBudgetLoad;
+    int32_t mBudgetInstances;
+    int64_t mUsedLoad;
+    uint32_t mNextSerial;
+    KeyedVector<const void*, Grant> mGrants;
+    stagefright_hw_utilisation_t mStats;
+
+    mutable Mutex mLock;
+    Condition mReleased;
+};
+
+// Opened video decoders kept between sessions, a new session with the same
+// mime type, window and resolution class skips the codec create and start
+class CodecPool {
+public:
+    static CodecPool& instance()
+    {
+        static CodecPool s_instance;
+        return s_instance;
+    }
+
+    // Up to 1620 (720x576), 3600 (720p), 8160 (1080p) macroblocks and above
+    static int32_t resolutionClass(int32_t width, int32_t height)
+    {
+        int32_t mbs = ((width + 15) / 16) * ((height + 15) / 16);
+        if (mbs <= 1620)
+            return 0;
+        if (mbs <= 3600)
+            return 1;
+        return mbs <= 8160 ? 2 : 3;
+    }
+
+    void setCapacity(int32_t capacity)
+    {
+        Vector<sp<Decoder> > evicted;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            mCapacity = capacity > 0 ? capacity : 0;
+            while (mIdle.size() > (size_t)mCapacity)
+                evict_l(mIdle.begin(), evicted);
+        }
+        releaseAll(evicted);
+    }
+
+    int32_t capacity() const
+    {
+        AutoMutex lock(mLock);
+        return mCapacity;
+    }
+
+    // Takes an opened and flushed decoder, false if the caller has to release it
+    bool park(const sp<Decoder>& decoder, const char* mimeType, void* window, int32_t width, int32_t height)
+    {
+        if (!isCapacity())
+            return false;
+
+        // an idle HW component still takes an instance of the budget
+        if (!decoder->isSoftwareDecoding()
+                && !HwDecoderArbiter::instance().acquire(decoder.get(), decoder, 0, false))
+            return false;
+
+        decoder->setPriorityClass(SESSION_PRIORITY_BACKGROUND);
+
+        Entry entry;
+        entry.decoder = decoder;
+        entry.mimeType = mimeType;
+        entry.window = window;
+        entry.resolutionClass = resolutionClass(width, height);
+        entry.idleTime = getTimestampMs();
+
+        Vector<sp<Decoder> > evicted;
+        bool orphaned;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            mIdle.push_back(entry);
+            mStats.parked++;
+            while (mIdle.size() > (size_t)mCapacity)
+                evict_l(mIdle.begin(), evicted);
+            orphaned = window && sessions_l(window) == 0;
+        }
+        releaseAll(evicted);
+        if (orphaned)
+            scheduleSweep();
+        LOGI("[CodecPool] (%p) parked %s, class=%d", decoder.get(), mimeType, entry.resolutionClass);
+        return true;
+    }
+
+    // The newest matching decoder, 0 on a miss
+    sp<Decoder> claim(const char* mimeType, void* window, int32_t width, int32_t height,
+            const Vector<uint8_t>& codecConfig)
+    {
+        int32_t resClass = resolutionClass(width, height);
+        sp<Decoder> decoder;
+        Vector<sp<Decoder> > evicted;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            if (mCapacity == 0)
+                return 0;
+
+            List<Entry>::iterator it = mIdle.end();
+            while (it != mIdle.begin()) {
+                --it;
+                if (it->window != window || it->resolutionClass != resClass
+                        || strcasecmp(it->mimeType.string(), mimeType))
+                    continue;
+                if (!it->decoder->isReusable()) {
+                    // demoted by the arbiter or the codec failed while idle
+                    it = evict_l(it, evicted);
+                    continue;
+                }
+                if (!isCompatible(it->decoder->codecConfig(), codecConfig))
+                    continue;
+                decoder = it->decoder;
+                mIdle.erase(it);
+                break;
+            }
+
+            if (decoder != 0)
+                mStats.hits++;
+            else
+                mStats.misses++;
+        }
+        releaseAll(evicted);
+
+        if (decoder != 0)
+            HwDecoderArbiter::instance().release(decoder.get());
+        return decoder;
+    }
+
+    // Drops the decoders rendering to a window, all of them for NULL
+    void clear(void* window)
+    {
+        Vector<sp<Decoder> > evicted;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            List<Entry>::iterator it = mIdle.begin();
+            while (it != mIdle.end()) {
+                if (window && it->window != window)
+                    ++it;
+                else
+                    it = evict_l(it, evicted);
+            }
+        }
+        releaseAll(evicted);
+    }
+
+    // Sessions rendering to a window, its parked decoders keep it alive
+    void attach(void* window)
+    {
+        if (!window)
+            return;
+        AutoMutex lock(mLock);
+        ssize_t index = mSessions.indexOfKey(window);
+        if (index < 0)
+            mSessions.add(window, 1);
+        else
+            mSessions.editValueAt(index)++;
+    }
+
+    void detach(void* window);
+
+    // Releases the decoders of windows left without a session for
+    // POOL_WINDOW_IDLE_MS, returns the ms until the next one is due or -1
+    int32_t sweep()
+    {
+        Vector<sp<Decoder> > evicted;
+        int32_t next = -1;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            List<Entry>::iterator it = mIdle.begin();
+            while (it != mIdle.end()) {
+                if (!it->window || sessions_l(it->window) > 0) {
+                    ++it;
+                    continue;
+                }
+                int32_t left = POOL_WINDOW_IDLE_MS - getPeriodMs(it->idleTime);
+                if (left > 0) {
+                    next = next < 0 || left < next ? left : next;
+                    ++it;
+                } else {
+                    LOGI("[CodecPool] (%p) window %p has no session, evicted", it->decoder.get(), it->window);
+                    it = evict_l(it, evicted);
+                }
+            }
+        }
+        releaseAll(evicted);
+        return next;
+    }
+
+    void recordOpen(bool hit, int32_t openMs)
+    {
+        AutoMutex lock(mLock);
+        if (hit) {
+            mHitOpenMs += openMs;
+            mHitOpens++;
+        } else if (openMs > 0) {
+            mMissOpenMs += openMs;
+            mMissOpens++;
+        }
+    }
+
+    void getStats(stagefright_pool_stats_t* stats) const
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+        stats->idle = mIdle.size();
+        stats->capacity = mCapacity;
+        int32_t claims = mStats.hits + mStats.misses;
+        stats->hit_rate = claims > 0 ? mStats.hits * 100 / claims : 0;
+        stats->avg_hit_open_ms = mHitOpens > 0 ? (int32_t)(mHitOpenMs / mHitOpens) : 0;
+        stats->avg_miss_open_ms = mMissOpens > 0 ? (int32_t)(mMissOpenMs / mMissOpens) : 0;
+    }
+
+private:
+    CodecPool()
+        : mCapacity(0)
+        , mHitOpenMs(0)
+        , mHitOpens(0)
+        , mMissOpenMs(0)
+        , mMissOpens(0)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+    }
+
+    CodecPool(const CodecPool&);
+    CodecPool &operator=(const CodecPool&);
+
+    struct Entry {
+        sp<Decoder> decoder;
+        String8 mimeType;
+        void* window;
+        int32_t resolutionClass;
+        int64_t idleTime; // parked or the window's last session gone
+    };
+
+    bool isCapacity() const
+    {
+        AutoMutex lock(mLock);
+        return mCapacity > 0;
+    }
+
+    // AVCC configuration is fixed at open, Annex-B goes in-band on reuse
+    static bool isCompatible(const Vector<uint8_t>& pooled, const Vector<uint8_t>& config)
+    {
+        if (config.isEmpty() || config[0] != 1)
+            return true;
+        return pooled.size() == config.size() && !memcmp(pooled.array(), config.array(), config.size());
+    }
+
+    int32_t sessions_l(void* window) const
+    {
+        ssize_t index = mSessions.indexOfKey(window);
+        return index >= 0 ? mSessions.valueAt(index) : 0;
+    }
+
+    static void scheduleSweep();
+
+    List<Entry>::iterator evict_l(List<Entry>::iterator it, Vector<sp<Decoder> >& evicted)
+    {
+        evicted.push(it->decoder);
+        mStats.evicted++;
+        return mIdle.erase(it);
+    }
+
+    // outside the lock, a release joins the decoder thread
+    static void releaseAll(Vector<sp<Decoder> >& evicted)
+    {
+        for (size_t i = 0; i < evicted.size(); ++i) {
+            HwDecoderArbiter::instance().release(evicted[i].get());
+            evicted.editItemAt(i)->release();
+        }
+        evicted.clear();
+    }
+
+    int32_t mCapacity;
+    List<Entry> mIdle; // oldest first
+    KeyedVector<void*, int32_t> mSessions;
+    stagefright_pool_stats_t mStats;
+    int64_t mHitOpenMs;
+    int32_t mHitOpens;
+    int64_t mMissOpenMs;
+    int32_t mMissOpens;
+
+    mutable Mutex mLock;
+};
+
+class StagefrightContext;
+
+// Reorders bursty network input by sequence or DTS in preallocated slots and
+// releases it to the decoder on the stream's own timeline plus a playout
+// delay that follows the measured inter-arrival jitter
+class JitterBuffer : public Thread {
+public:
+    JitterBuffer(StagefrightContext* context, int32_t minDepthMs, int32_t maxDepthMs)
+        : Thread(false)
+        , mContext(context)
+        , mMinDepthUs((int64_t)minDepthMs * 1000)
+        , mMaxDepthUs((int64_t)(maxDepthMs > minDepthMs ? maxDepthMs : minDepthMs) * 1000)
+        , mBoostUs(0)
+        , mJitterUs(0)
+        , mLastArrivalUs(-1)
+        , mLastPts(-1)
+        , mBaseSysUs(-1)
+        , mBasePts(0)
+        , mLastReleasedKey(0)
+        , mReleasedAny(false)
+        , mOverrunPending(false)
+        , mRefusedSlot(-1)
+        , mRefusedSinceUs(0)
+        , mRetryUs(0)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+        for (int32_t i = 0; i < JITTER_BUFFER_SLOTS; ++i) {
+            mSlots[i].setCapacity(JITTER_SLOT_BYTES);
+            mFreeSlots.push(i);
+        }
+    }
+
+    // sequence orders the units, without one (-1) they keep their arrival
+    // order: that is the decode order, pts is not once there are B-frames
+    bool push(const uint8_t* data, size_t size, int64_t pts, int64_t sequence, uint32_t flags)
+    {
+        int64_t arrivalUs = getMonotonicUs();
+
+        AutoMutex lock(mLock);
+        int64_t key = sequence;
+        if (sequence < 0)
+            key = mUnits.empty() ? mLastReleasedKey : (--mUnits.end())->key;
+        else if (mReleasedAny && key < mLastReleasedKey) {
+            mStats.late++;
+            return true;
+        }
+
+        if (mFreeSlots.isEmpty()) {
+            mStats.overruns++;
+            mOverrunPending = true;
+            mCondition.signal();
+            mSpace.waitRelative(mLock, (nsecs_t)s_frameDisplayTimeMsec * 1000000);
+            if (mFreeSlots.isEmpty())
+                return false;
+        }
+
+        updateJitter(arrivalUs, pts);
+
+        Unit unit;
+        unit.key = key;
+        unit.pts = pts;
+        unit.flags = flags;
+        unit.arrivalUs = arrivalUs;
+        unit.size = size;
+        unit.slot = mFreeSlots.top();
+        mFreeSlots.pop();
+
+        Vector<uint8_t>& slot = mSlots[unit.slot];
+        slot.clear();
+        slot.appendArray(data, size);
+
+        if (pts >= 0 && (mBaseSysUs < 0 || llabs(pts - mBasePts - (arrivalUs - mBaseSysUs)) > JITTER_REBASE_US)) {
+            mBaseSysUs = arrivalUs;
+            mBasePts = pts;
+        } else if (dueUs(unit) < arrivalUs) {
+            // the buffer ran dry before this unit came in, deepen it
+            mStats.underruns++;
+            mBoostUs += s_frameDisplayTimeMsec * 1000;
+        }
+
+        List<Unit>::iterator it = mUnits.end();
+        while (it != mUnits.begin()) {
+            List<Unit>::iterator prev = it;
+            if ((--prev)->key <= key)
+                break;
+            it = prev;
+        }
+        if (it != mUnits.end())
+            mStats.reordered++;
+        mUnits.insert(it, unit);
+
+        if ((int32_t)mUnits.size() > mStats.max_occupancy)
+            mStats.max_occupancy = mUnits.size();
+        mCondition.signal();
+        return true;
+    }
+
+    // Returns once a unit in flight reached the decoder, a flush after it
+    // drops it there
+    void clear()
+    {
+        AutoMutex submitLock(mSubmitLock);
+        AutoMutex lock(mLock);
+        for (List<Unit>::iterator it = mUnits.begin(); it != mUnits.end(); ++it)
+            mFreeSlots.push(it->slot);
+        mUnits.clear();
+        mBaseSysUs = mLastArrivalUs = -1;
+        mReleasedAny = false;
+        mRefusedSlot = -1;
+        mSpace.broadcast();
+    }
+
+    void stop()
+    {
+        requestExit();
+        { // scopped lock
+            AutoMutex lock(mLock);
+            mCondition.signal();
+        }
+        requestExitAndWait();
+    }
+
+    void getStats(stagefright_jitter_stats_t* stats)
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+        stats->depth_ms = depthUs() / 1000;
+        stats->jitter_us = mJitterUs;
+        stats->occupancy = mUnits.size();
+    }
+
+private:
+    struct Unit {
+        int64_t key;
+        int64_t pts;
+        uint32_t flags;
+        int64_t arrivalUs;
+        size_t size;
+        int32_t slot;
+    };
+
+    virtual bool threadLoop();
+
+    // J += (|D| - J) / 16 with D the arrival spacing minus the pts spacing
+    void updateJitter(int64_t arrivalUs, int64_t pts)
+    {
+        if (mLastArrivalUs >= 0 && pts >= 0 && mLastPts >= 0 && pts != mLastPts) {
+            int64_t d = (arrivalUs - mLastArrivalUs) - (pts - mLastPts);
+            if (d < 0)
+                d = -d;
+            if (d < JITTER_REBASE_US)
+                mJitterUs += (d - mJitterUs) / 16;
+        }
+        mLastArrivalUs = arrivalUs;
+        if (pts >= 0)
+            mLastPts = pts;
+    }
+
+    int64_t depthUs() const
+    {
+        int64_t depth = JITTER_DEPTH_FACTOR * mJitterUs + mBoostUs;
+        if (depth < mMinDepthUs)
+            return mMinDepthUs;
+        return depth > mMaxDepthUs ? mMaxDepthUs : depth;
+    }
+
+    int64_t dueUs(const Unit& unit) const
+    {
+        if (unit.slot == mRefusedSlot)
+            return mRetryUs;
+        if (unit.pts < 0 || mBaseSysUs < 0)
+            return unit.arrivalUs + depthUs();
+        return mBaseSysUs + (unit.pts - mBasePts) + depthUs();
+    }
+
+    StagefrightContext* mContext;
+    int64_t mMinDepthUs;
+    int64_t mMaxDepthUs;
+    int64_t mBoostUs;
+    int64_t mJitterUs;
+    int64_t mLastArrivalUs;
+    int64_t mLastPts;
+    int64_t mBaseSysUs;
+    int64_t mBasePts;
+    int64_t mLastReleasedKey;
+    bool mReleasedAny;
+    bool mOverrunPending;
+    int32_t mRefusedSlot; // the first unit, the decoder did not take it
+    int64_t mRefusedSinceUs;
+    int64_t mRetryUs;
+
+    List<Unit> mUnits; // by key
+    Vector<uint8_t> mSlots[JITTER_BUFFER_SLOTS];
+    Vector<int32_t> mFreeSlots;
+    stagefright_jitter_stats_t mStats;
+
+    Mutex mSubmitLock; // held while a unit is handed to the decoder, before mLock
+    Mutex mLock;
+    Condition mCondition;
+    Condition mSpace;
+};
+
+class StagefrightContext {
+public:
+    StagefrightContext()
+        : mDecoder(new Decoder())
+        , mNativeWindow(0)
+        , mWidth(0)
+        , mHeight(0)
+        , mKeyframeOnly(false)
+        , mPcmDurationMs(0)
+        , mPcmSampleFormat(PCM_FORMAT_S16)
+        , mPcmChannels(0)
+        , mWatchdogMs(WATCHDOG_TIMEOUT_MS)
+        , mRestarted(false)
+        , mFrameRate(1000 / s_frameDisplayTimeMsec)
+        , mForeground(true)
+        , mPriorityClass(SESSION_PRIORITY_NORMAL)
+        , mPooled(false)
+        , mDecodeAhead(0)
+        , mReorderWindow(0)
+        , mRenderThread(false)
+    {
+        memset(&mWatchdogStats, 0, sizeof(mWatchdogStats));
+    }
+
+    ~StagefrightContext() {}
+
+    bool configure(void* nativewWindow, int w, int h, void *p_extra, int i_extra);
+    bool createDecoderByType(const char* mimeType);
+    void release();
+    void releaseOutputBuffer(int index, int64_t pts);
+    const char* getName();
+    void getOutputFormat(void*);
+    int32_t getOutputBuffers();
+    bool queueInputBuffer(int32_t index, uint8_t* data, size_t size,
+            int64_t pts, uint32_t flags);
+    int32_t dequeueInputBuffer(int64_t timeoutUs);
+    int32_t dequeueOutputBuffer(uint8_t** data, size_t* size, int64_t* pts);
+    int32_t outputBufferCount();
+    void flush()
+    {
+        if (mJitterBuffer != 0)
+            mJitterBuffer->clear();
+        mAudioRemainder.clear();
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0) decoder->flush();
+    }
+
+    bool setPcmOutput(int32_t durationMs, int32_t sampleFormat, int32_t channels)
+    {
+        mPcmDurationMs = durationMs;
+        mPcmSampleFormat = sampleFormat;
+        mPcmChannels = channels;
+        sp<Decoder> decoder = currentDecoder();
+        return decoder != 0 && decoder->setPcmOutput(durationMs, sampleFormat, channels);
+    }
+    int32_t readPcm(void* data, int32_t frames, int64_t* pts)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0) return decoder->readPcm(data, frames, pts);
+        return INFO_TRY_AGAIN_LATER;
+    }
+    int32_t pcmAvailable()
+    {
+        sp<Decoder> decoder = currentDecoder();
+        return decoder != 0 ? decoder->pcmAvailable() : 0;
+    }
+    void getStartupStats(stagefright_startup_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getStartupStats(stats);
+    }
+    void getFlushStats(stagefright_flush_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getFlushStats(stats);
+    }
+    void getSeekStats(stagefright_seek_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getSeekStats(stats);
+    }
+    int64_t seek(int64_t targetUs);
+    bool setKeyframeOnly(bool enable)
+    {
+        mKeyframeOnly = enable;
+        sp<Decoder> decoder = currentDecoder();
+        return decoder != 0 && decoder->setKeyframeOnly(enable);
+    }
+    void getTrickPlayStats(stagefright_trickplay_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getTrickPlayStats(stats);
+    }
+    void getResyncStats(stagefright_resync_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getResyncStats(stats);
+    }
+    void setWatchdogTimeout(int32_t timeoutMs) { mWatchdogMs = timeoutMs; }
+    bool setDecoderMode(int32_t mode);
+    void setSessionHints(int32_t frameRate, bool foreground)
+    {
+        if (frameRate > 0)
+            mFrameRate = frameRate;
+        mForeground = foreground;
+    }
+    void setSessionPriority(int32_t priorityClass)
+    {
+        if (priorityClass < 0 || priorityClass >= SESSION_PRIORITY_COUNT)
+            return;
+        mPriorityClass = priorityClass;
+        mForeground = priorityClass != SESSION_PRIORITY_BACKGROUND;
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0) decoder->setPriorityClass(priorityClass);
+    }
+    void getPriorityStats(stagefright_priority_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getPriorityStats(stats);
+    }
+    void getMigrationStats(stagefright_migration_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getMigrationStats(stats);
+    }
+    void setDecodeAhead(int32_t depth)
+    {
+        mDecodeAhead = depth;
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0) decoder->setDecodeAhead(depth);
+    }
+    void getOutputStats(stagefright_output_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getOutputStats(stats);
+    }
+    void setReorderWindow(int32_t frames)
+    {
+        mReorderWindow = frames;
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0) decoder->setReorderWindow(frames);
+    }
+    void getReorderStats(stagefright_reorder_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getReorderStats(stats);
+    }
+    bool setRenderThread(bool enable)
+    {
+        mRenderThread = enable;
+        sp<Decoder> decoder = currentDecoder();
+        return decoder != 0 && decoder->setRenderThread(enable);
+    }
+    void getRenderStats(stagefright_render_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getRenderStats(stats);
+    }
+    bool setPresentationClock(int32_t source, StagefrightContext* audio);
+    void setClockTime(int64_t mediaUs)
+    {
+        if (mPresentationClock != 0 && mPresentationClock->source() == PRESENTATION_CLOCK_EXTERNAL)
+            mPresentationClock->setTime(mediaUs);
+    }
+    void getPresentationStats(stagefright_presentation_stats_t* stats)
+    {
+        sp<Decoder> decoder = currentDecoder();
+        if (decoder != 0 && stats) decoder->getPresentationStats(stats);
+    }
+    bool setJitterBuffer(int32_t minDepthMs, int32_t maxDepthMs);
+    bool queueNetworkInput(uint8_t* data, size_t size, int64_t pts, int64_t sequence, uint32_t flags);
+    void getJitterStats(stagefright_jitter_stats_t* stats)
+    {
+        if (!stats)
+            return;
+        if (mJitterBuffer != 0)
+            mJitterBuffer->getStats(stats);
+        else
+            memset(stats, 0, sizeof(*stats));
+    }
+    // Called on the jitter buffer thread
+    bool releaseJitterUnit(uint8_t* data, size_t size, int64_t pts, uint32_t flags)
+    {
+        AutoMutex lock(mInputLock);
+        return submitInput(data, size, pts, flags, sp<RefBase>());
+    }
+    void getWatchdogStats(stagefright_watchdog_stats_t* stats)
+    {
+        if (stats) *stats = mWatchdogStats;
+    }
+
+    int32_t openInputFile(const char* path, int streamType, int64_t frameDurationUs);
+    int32_t queueInputFileUnit();
+
+    bool startRecording(const char* path) { return path && mRecorder.open(path); }
+    bool stopRecording() { return mRecorder.close(); }
+    bool replay(const char* path, float speed, stagefright_replay_stats_t* stats);
+
+private:
+    // Queue times in queue order, the same pts may be queued more than once
+    struct PendingFrame {
+        int64_t pts;
+        int64_t queueTime;
+    };
+    typedef List<PendingFrame> PendingFrames;
+
+    void drainReplayOutput(PendingFrames& pending, stagefright_replay_stats_t& stats,
+            int64_t& latencySum, int32_t& latencyCount);
+    bool queueInput(uint8_t* data, size_t size, int64_t pts, uint32_t flags,
+            const sp<RefBase>& owner);
+    bool submitInput(uint8_t* data, size_t size, int64_t pts, uint32_t flags,
+            const sp<RefBase>& owner);
+
+    bool queueAudioInput(uint8_t* data, size_t size, int64_t pts, uint32_t flags);
+
+    bool checkWatchdog();
+    bool restartDecoder();
+    bool claimPooledDecoder();
+
+    // The decoder the calls go to, a restart replaces it from another thread
+    sp<Decoder> currentDecoder() const
+    {
+        AutoMutex lock(mDecoderLock);
+        return mDecoder;
+    }
+    void setDecoder(const sp<Decoder>& decoder)
+    {
+        AutoMutex lock(mDecoderLock);
+        mDecoder = decoder;
+    }
+
+    OMXClient mClient;
+    sp<Decoder> mDecoder;
+    mutable Mutex mDecoderLock;
+
+    // what a restarted decoder is created from
+    void* mNativeWindow;
+    int mWidth;
+    int mHeight;
+    String8 mMimeType;
+    bool mKeyframeOnly;
+    int32_t mPcmDurationMs;
+    int32_t mPcmSampleFormat;
+    int32_t mPcmChannels;
+
+    int32_t mWatchdogMs;
+    bool mRestarted;
+    stagefright_watchdog_stats_t mWatchdogStats;
+
+    int32_t mFrameRate;
+    bool mForeground;
+    int32_t mPriorityClass;
+    bool mPooled;
+    int32_t mDecodeAhead;
+    int32_t mReorderWindow;
+    bool mRenderThread;
+    sp<PresentationClock> mPresentationClock;
+    sp<JitterBuffer> mJitterBuffer;
+    Mutex mInputLock; // the jitter buffer thread and the watchdog checks against a decoder restart
+    sp<PresentationClock> mAudioClock; // follows the PCM read here, video sessions render against it
+    AACFramer mFramer;
+    List<Frame> mAudioRemainder; // split units the decoder did not take yet
+    StreamRecorder mRecorder;
+    sp<ElementaryStreamFile> mInputFile;
+};
+
+bool StagefrightContext::configure(void* nativeWindow, int w, int h, void *p_extra, int i_extra)
+{
+    LOG_DEBUG;
+    if (mClient.connect() != OK) {
+        LOGW("[StagefrightContext] OMXClient failed to connect");
+        mDecoder = NULL;
+        return false;
+    }
+
+    if (!mDecoder->configure(nativeWindow, w, h, p_extra, i_extra)) {
+        mClient.disconnect();
+        mDecoder = NULL;
+        return false;
+    }
+    mNativeWindow = nativeWindow;
+    mWidth = w;
+    mHeight = h;
+    CodecPool::instance().attach(mNativeWindow);
+    return true;
+}
+
+bool StagefrightContext::createDecoderByType(const char* mimeType)
+{
+    LOG_DEBUG;
+    if (mDecoder != NULL) {
+        mMimeType = mimeType;
+        sp<IOMX> iomx = mClient.interface();
+        dumpCodecProfiles(iomx, true);
+        bool result = mDecoder->createDecoderByType(iomx, mimeType);
+
+        if (result) {
+            if (mDecoder->IsDelayedOpen())
+                return true;
+
+            if (claimPooledDecoder())
+                return true;
+
+            int64_t load = HwDecoderArbiter::load(mWidth, mHeight, mFrameRate);
+            if (!HwDecoderArbiter::instance().acquire(this, mDecoder, load, mForeground))
+                mDecoder->setDecoderMode(DECODER_MODE_SW);
+            return mDecoder->openAsync(iomx, 0, 0);
+        }
+    }
+    return false;
+}
+
+bool StagefrightContext::setPresentationClock(int32_t source, StagefrightContext* audio)
+{
+    sp<Decoder> decoder = currentDecoder();
+    sp<PresentationClock> clock;
+    switch (source) {
+    case PRESENTATION_CLOCK_NONE:
+        break;
+    case PRESENTATION_CLOCK_WALL:
+    case PRESENTATION_CLOCK_EXTERNAL:
+        clock = new PresentationClock(source);
+        break;
+    case PRESENTATION_CLOCK_AUDIO:
+        if (!audio || audio == this || audio->currentDecoder() == 0)
+            return false;
+        if (audio->mAudioClock == 0) {
+            audio->mAudioClock = new PresentationClock(source);
+            audio->currentDecoder()->setAudioClock(audio->mAudioClock);
+        }
+        clock = audio->mAudioClock;
+        break;
+    default:
+        return false;
+    }
+
+    mPresentationClock = clock;
+    return decoder != 0 && decoder->setPresentationClock(clock);
+}
+
+bool StagefrightContext::claimPooledDecoder()
+{
+    int64_t startTime = getTimestampMs();
+    sp<Decoder> pooled = CodecPool::instance().claim(mMimeType.string(), mNativeWindow,
+            mWidth, mHeight, mDecoder->codecConfig());
+    if (pooled == 0)
+        return false;
+
+    sp<Decoder> fresh = mDecoder;
+    setDecoder(pooled);
+    fresh->release();
+
+    int64_t load = HwDecoderArbiter::load(mWidth, mHeight, mFrameRate);
+    bool hw = HwDecoderArbiter::instance().acquire(this, pooled, load, mForeground);
+    pooled->setDecoderMode(hw ? DECODER_MODE_HW : DECODER_MODE_SW);
+    pooled->setPriorityClass(mPriorityClass);
+    pooled->setDecodeAhead(mDecodeAhead > 0 ? mDecodeAhead : MAX_HOLDED_FRAMES);
+    pooled->setReorderWindow(mReorderWindow);
+    pooled->setRenderThread(mRenderThread);
+    pooled->setPresentationClock(mPresentationClock);
+    pooled->reuse(fresh->codecConfig(), getPeriodMs(startTime));
+    if (mKeyframeOnly)
+        pooled->setKeyframeOnly(true);
+
+    mPooled = true;
+    return true;
+}
+
+void StagefrightContext::release()
+{
+    setJitterBuffer(0, 0);
+    mRecorder.close();
+    HwDecoderArbiter::instance().release(this);
+
+    sp<Decoder> decoder = currentDecoder();
+    setDecoder(0);
+
+    if (decoder != 0 && decoder->IsVideoDecoder()) {
+        stagefright_startup_stats_t startup;
+        decoder->getStartupStats(&startup);
+        CodecPool::instance().recordOpen(mPooled, startup.open_ms);
+
+        if (decoder->isReusable() && !decoder->stalledMs(mWatchdogMs)) {
+            decoder->flush();
+            if (CodecPool::instance().park(decoder, mMimeType.string(), mNativeWindow, mWidth, mHeight))
+                decoder = 0;
+        }
     }
 
     if (decoder != 0) {
         decoder->release();
         decoder = 0;
     }
-    mClient.disconnect();
-}
+    CodecPool::instance().detach(mNativeWindow);
+    mNativeWindow = NULL;
+    mInputFile.clear();
+    mClient.disconnect();
+}
+
+void StagefrightContext::releaseOutputBuffer(int index, int64_t pts)
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder != 0 && index >= 0)
+        decoder->releaseOutputBuffer(index, pts);
+}
+
+const char* StagefrightContext::getName()
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder != 0) return decoder->getName();
+    return NULL;
+}
+
+void StagefrightContext::getOutputFormat(void* outFormat)
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder != 0) decoder->getOutputFormat(outFormat);
+}
+
+int32_t StagefrightContext::getOutputBuffers()
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder != 0) return decoder->getOutputBuffers();
+    return 0;
+}
+
+bool StagefrightContext::queueInputBuffer(int32_t index, uint8_t* data,
+        size_t size, int64_t pts, uint32_t flags)
+{
+    // paced, not reordered: the caller queues in decode order
+    if (mJitterBuffer != 0)
+        return queueNetworkInput(data, size, pts, -1, flags);
+    return queueInput(data, size, pts, flags, sp<RefBase>());
+}
+
+bool StagefrightContext::queueNetworkInput(uint8_t* data, size_t size, int64_t pts,
+        int64_t sequence, uint32_t flags)
+{
+    if (mJitterBuffer == 0)
+        return queueInput(data, size, pts, flags, sp<RefBase>());
+
+    if (mRecorder.isRecording())
+        mRecorder.write(data, size, pts, flags);
+    checkWatchdog();
+    return size > 0 && mJitterBuffer->push(data, size, pts, sequence, flags);
+}
+
+bool StagefrightContext::setJitterBuffer(int32_t minDepthMs, int32_t maxDepthMs)
+{
+    if (mJitterBuffer != 0) {
+        mJitterBuffer->stop();
+        mJitterBuffer.clear();
+    }
+    if (maxDepthMs <= 0)
+        return true;
+
+    sp<JitterBuffer> jitter = new JitterBuffer(this, minDepthMs, maxDepthMs);
+    if (jitter->run(0, DECODER_PRIORITY) != OK) {
+        LOGE("[StagefrightContext] cannot start jitter buffer");
+        return false;
+    }
+    mJitterBuffer = jitter;
+    return true;
+}
+
+bool StagefrightContext::queueInput(uint8_t* data, size_t size, int64_t pts,
+        uint32_t flags, const sp<RefBase>& owner)
+{
+    if (mRecorder.isRecording())
+        mRecorder.write(data, size, pts, flags);
+
+    checkWatchdog();
+    return submitInput(data, size, pts, flags, owner);
+}
+
+bool StagefrightContext::submitInput(uint8_t* data, size_t size, int64_t pts,
+        uint32_t flags, const sp<RefBase>& owner)
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (size > 0 && decoder != 0) {
+        if (decoder->IsDelayedOpen()) {
+            if (flags & OMX_BUFFERFLAG_CODECCONFIG) {
+                sp<IOMX> iomx = mClient.interface();
+                decoder->openAsync(iomx, data, size);
+                return true;
+            } else if (mFramer.parseConfig(data, size)) {
+                sp<IOMX> iomx = mClient.interface();
+                if (!decoder->openAsync(iomx, mFramer.config(), mFramer.configSize()))
+                    return false;
+            } else {
+                LOGW("[Decoder] First frame must contain config!");
+                return false;
+            }
+        }
+        if (!decoder->IsVideoDecoder() && owner == 0 && !(flags & OMX_BUFFERFLAG_CODECCONFIG))
+            return queueAudioInput(data, size, pts, flags);
+        return decoder->queueInputBuffer(0, data, size, pts, flags, owner);
+    }
+    return false;
+}
+
+bool JitterBuffer::threadLoop()
+{
+    { // scopped lock
+        AutoMutex lock(mLock);
+        while (mUnits.empty() && !exitPending())
+            mCondition.wait(mLock);
+        if (exitPending())
+            return false;
+
+        int64_t now = getMonotonicUs();
+        int64_t due = dueUs(*mUnits.begin());
+        if (due > now && !mOverrunPending) {
+            mCondition.waitRelative(mLock, (due - now) * 1000);
+            return true;
+        }
+    }
+
+    // clear() waits for the unit in flight, so nothing pushed before a flush
+    // reaches the decoder after it
+    AutoMutex submitLock(mSubmitLock);
+    Unit unit;
+    { // scopped lock
+        AutoMutex lock(mLock);
+        if (mUnits.empty() || (dueUs(*mUnits.begin()) > getMonotonicUs() && !mOverrunPending))
+            return true; // cleared meanwhile
+        mOverrunPending = false;
+
+        // the first unit stays in its slot until the decoder took it, the
+        // ones arriving behind it from now on are late
+        unit = *mUnits.begin();
+        mLastReleasedKey = unit.key;
+        mReleasedAny = true;
+    }
+
+    bool queued = mContext->releaseJitterUnit(mSlots[unit.slot].editArray(), unit.size, unit.pts, unit.flags);
+
+    AutoMutex lock(mLock);
+    if (!queued) {
+        // the decoder is full or not open yet, the unit goes first again
+        int64_t now = getMonotonicUs();
+        if (mRefusedSlot != unit.slot) {
+            mRefusedSlot = unit.slot;
+            mRefusedSinceUs = now;
+        }
+        if (now - mRefusedSinceUs < JITTER_SUBMIT_TIMEOUT_MS * 1000LL) {
+            mRetryUs = now + s_frameDisplayTimeMsec * 250;
+            return true;
+        }
+        LOGW("[JitterBuffer] (%p) unit %lld refused for %d ms, dropped", this,
+                (long long)unit.key, JITTER_SUBMIT_TIMEOUT_MS);
+        mStats.dropped++;
+    } else {
+        mStats.released++;
+        if (mBoostUs > 0)
+            mBoostUs -= mBoostUs < 1000 ? mBoostUs : 1000; // 1 ms per unit on time
+    }
+    mRefusedSlot = -1;
+    mUnits.erase(mUnits.begin());
+    mFreeSlots.push(unit.slot);
+    mSpace.signal();
+    return true;
+}
+
+// A packet is taken as a whole: units the decoder refuses are kept and go
+// first on the next call, which refuses its packet until they are through
+bool StagefrightContext::queueAudioInput(uint8_t* data, size_t size, int64_t pts, uint32_t flags)
+{
+    sp<Decoder> decoder = currentDecoder();
+    while (!mAudioRemainder.empty()) {
+        Frame& unit = *mAudioRemainder.begin();
+        if (!decoder->queueInputBuffer(0, unit.mBuffer, unit.mSize, unit.mPts, unit.mFlags))
+            return false;
+        mAudioRemainder.erase(mAudioRemainder.begin());
+    }
+
+    if (mFramer.format() == AACFramer::FORMAT_UNKNOWN)
+        mFramer.parseConfig(data, size);
+
+    if (mFramer.format() == AACFramer::FORMAT_RAW)
+        return decoder->queueInputBuffer(0, data, size, pts, flags);
+
+    Vector<AACFramer::Unit> units;
+    mFramer.split(data, size, units);
+    if (units.isEmpty())
+        return false;
+
+    for (size_t i = 0; i < units.size(); ++i) {
+        int64_t unitPts = pts + i * mFramer.frameDurationUs();
+        uint8_t* unitData = const_cast<uint8_t*>(units[i].data);
+        uint32_t unitFlags = flags | OMX_BUFFERFLAG_SYNCFRAME;
+        if (mAudioRemainder.empty()
+                && decoder->queueInputBuffer(0, unitData, units[i].size, unitPts, unitFlags))
+            continue;
+        Frame unit(OK, unitData, units[i].size, unitPts, unitFlags);
+        mAudioRemainder.push_back(unit);
+    }
+    return true;
+}
+
+int32_t StagefrightContext::openInputFile(const char* path, int streamType, int64_t frameDurationUs)
+{
+    LOG_DEBUG;
+    sp<Decoder> decoder = currentDecoder();
+    mInputFile.clear();
+    if (!path || decoder == 0)
+        return -1;
+
+    sp<ElementaryStreamFile> file = new ElementaryStreamFile();
+    if (!file->open(path, streamType, frameDurationUs))
+        return -1;
+
+    if (file->audioConfigSize() > 0) {
+        // audio sessions open the codec on the first config packet
+        queueInput(const_cast<uint8_t*>(file->audioConfig()), file->audioConfigSize(), 0,
+                OMX_BUFFERFLAG_CODECCONFIG, sp<RefBase>());
+    }
+    mInputFile = file;
+    return file->count();
+}
+
+int64_t StagefrightContext::seek(int64_t targetUs)
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder == 0 || targetUs < 0)
+        return -1;
+
+    if (mJitterBuffer != 0)
+        mJitterBuffer->clear();
+    mAudioRemainder.clear();
+    decoder->seek(targetUs);
+
+    // file input restarts from the sync unit itself, otherwise the caller does
+    if (mInputFile != 0)
+        return mInputFile->seekTo(targetUs);
+    return targetUs;
+}
+
+int32_t StagefrightContext::queueInputFileUnit()
+{
+    if (mInputFile == 0)
+        return INFO_OUTPUT_END_OF_STREAM;
+
+    const ElementaryStreamFile::AccessUnit* unit = mInputFile->peek();
+    if (!unit) {
+        mInputFile.clear();
+        return INFO_OUTPUT_END_OF_STREAM;
+    }
+
+    if (!queueInput(const_cast<uint8_t*>(mInputFile->data(*unit)), unit->size, unit->pts,
+            unit->flags, mInputFile))
+        return INFO_TRY_AGAIN_LATER;
+
+    mInputFile->advance();
+    return INFO_OK;
+}
+
+int32_t StagefrightContext::dequeueInputBuffer(int64_t timeoutUs)
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder != 0) return decoder->dequeueInputBuffer(timeoutUs);
+    return INFO_TRY_AGAIN_LATER;
+}
+
+int32_t StagefrightContext::dequeueOutputBuffer(uint8_t** data, size_t* size,
+        int64_t* pts)
+{
+    checkWatchdog();
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder != 0 && decoder->isSoftwareDecoding() && !decoder->isMigrating())
+        HwDecoderArbiter::instance().release(this); // fell back or was demoted
+    if (mRestarted) {
+        mRestarted = false;
+        return INFO_OUTPUT_DECODER_RESTARTED;
+    }
+    if (decoder != 0) return decoder->dequeueOutputBuffer(data, size, pts);
+    return INFO_TRY_AGAIN_LATER;
+}
+
+bool StagefrightContext::setDecoderMode(int32_t mode)
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder == 0 || !decoder->IsVideoDecoder())
+        return false;
+
+    HwDecoderArbiter& arbiter = HwDecoderArbiter::instance();
+    if (mode == DECODER_MODE_HW && !arbiter.isGranted(this)) {
+        int64_t load = HwDecoderArbiter::load(mWidth, mHeight, mFrameRate);
+        if (!arbiter.acquire(this, decoder, load, mForeground))
+            return false;
+    }
+
+    if (!decoder->setDecoderMode(mode)) {
+        if (mode == DECODER_MODE_HW)
+            arbiter.release(this);
+        return false;
+    }
+    if (mode == DECODER_MODE_SW)
+        arbiter.release(this);
+    return true;
+}
+
+bool StagefrightContext::checkWatchdog()
+{
+    if (mWatchdogMs <= 0)
+        return false;
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder == 0 || decoder->stalledMs(mWatchdogMs) <= 0)
+        return false;
+
+    // the input and the output thread may both see the stall, one restarts
+    AutoMutex lock(mInputLock);
+    decoder = currentDecoder();
+    int32_t stalled = decoder != 0 ? decoder->stalledMs(mWatchdogMs) : 0;
+    if (stalled <= 0)
+        return false;
+
+    LOGE("[StagefrightContext] decoder made no progress for %d ms, restarting", stalled);
+    mWatchdogStats.stalls++;
+    mWatchdogStats.last_stall_ms = stalled;
+
+    if (!restartDecoder()) {
+        mWatchdogStats.failed_restarts++;
+        return false;
+    }
+    mWatchdogStats.restarts++;
+    mRestarted = true;
+    return true;
+}
+
+// Replaces a wedged decoder with a new one built from the same configuration,
+// decoding resumes at the next sync frame
+bool StagefrightContext::restartDecoder()
+{
+    int64_t startTime = getTimestampMs();
+    sp<Decoder> stalled = mDecoder;
+    Vector<uint8_t> codecConfig = stalled->codecConfig();
+    Vector<uint8_t> openConfig = stalled->openConfig();
+    bool video = stalled->IsVideoDecoder();
+    bool software = stalled->isSoftwareDecoding(); // a fallback or a demotion stays
+
+    // callers holding the stalled decoder return from it, new calls wait for the new one
+    stalled->detach();
+    stalled.clear();
+    setDecoder(0);
+    HwDecoderArbiter::instance().release(this);
+
+    sp<Decoder> decoder = new Decoder();
+    if (!decoder->configure(mNativeWindow, mWidth, mHeight,
+            codecConfig.editArray(), codecConfig.size()))
+        return false;
+
+    sp<IOMX> iomx = mClient.interface();
+    if (!decoder->createDecoderByType(iomx, mMimeType.string()))
+        return false;
+
+    if (mPcmDurationMs > 0)
+        decoder->setPcmOutput(mPcmDurationMs, mPcmSampleFormat, mPcmChannels);
+    if (mKeyframeOnly)
+        decoder->setKeyframeOnly(true);
+    decoder->setPriorityClass(mPriorityClass);
+    decoder->setDecodeAhead(mDecodeAhead);
+    decoder->setReorderWindow(mReorderWindow);
+    if (mRenderThread)
+        decoder->setRenderThread(true);
+    if (mPresentationClock != 0)
+        decoder->setPresentationClock(mPresentationClock);
+    decoder->setAudioClock(mAudioClock);
+    decoder->awaitSyncFrame();
+
+    if (video) {
+        int64_t load = HwDecoderArbiter::load(mWidth, mHeight, mFrameRate);
+        if (software || !HwDecoderArbiter::instance().acquire(this, decoder, load, mForeground))
+            decoder->setDecoderMode(DECODER_MODE_SW);
+        if (!decoder->openAsync(iomx, 0, 0)) {
+            HwDecoderArbiter::instance().release(this);
+            return false;
+        }
+    } else if (!openConfig.isEmpty()) {
+        if (!decoder->openAsync(iomx, openConfig.array(), openConfig.size()))
+            return false;
+    }
+
+    setDecoder(decoder);
+    mPooled = false;
+    mWatchdogStats.last_restart_ms = getPeriodMs(startTime);
+    LOGI("[StagefrightContext] decoder restarted in %d ms", mWatchdogStats.last_restart_ms);
+    return true;
+}
+
+int32_t StagefrightContext::outputBufferCount()
+{
+    sp<Decoder> decoder = currentDecoder();
+    if (decoder != 0) return decoder->outputBufferCount();
+    return 0;
+}
+
+void StagefrightContext::drainReplayOutput(PendingFrames& pending,
+        stagefright_replay_stats_t& stats, int64_t& latencySum, int32_t& latencyCount)
+{
+    while (true) {
+        uint8_t* data = 0;
+        size_t size = 0;
+        int64_t pts = 0;
+        int32_t index = dequeueOutputBuffer(&data, &size, &pts);
+
+        if (index == INFO_OUTPUT_FORMAT_CHANGED)
+            continue;
+        if (index < 0)
+            break;
+
+        // the oldest frame queued with this pts
+        PendingFrames::iterator it = pending.begin();
+        while (it != pending.end() && it->pts != pts)
+            ++it;
+        if (it != pending.end()) {
+            int32_t latency = (getMonotonicUs() - it->queueTime) / 1000;
+            if (latency < stats.latency_min_ms)
+                stats.latency_min_ms = latency;
+            if (latency > stats.latency_max_ms)
+                stats.latency_max_ms = latency;
+            latencySum += latency;
+            latencyCount++;
+            pending.erase(it);
+        }
+        stats.frames_decoded++;
+        releaseOutputBuffer(index, pts);
+    }
+}
+
+bool StagefrightContext::replay(const char* path, float speed, stagefright_replay_stats_t* stats)
+{
+    LOG_DEBUG;
+    StreamReplayer replayer;
+    if (!path || !replayer.open(path))
+        return false;
+
+    stagefright_replay_stats_t result;
+    memset(&result, 0, sizeof(result));
+    result.latency_min_ms = 0x7fffffff;
+
+    PendingFrames pending;
+    int64_t latencySum = 0;
+    int32_t latencyCount = 0;
+    int64_t startTime = getMonotonicUs();
+    int64_t dueTime = startTime;
+
+    LOGI("[StagefrightContext] replay %d frames from %s, speed=%.2f", replayer.count(), path, speed);
+
+    // speed <= 0 replays as fast as the decoder accepts input
+    for (uint32_t i = 0; i < replayer.count(); ++i) {
+        const uint8_t* payload = 0;
+        const record_entry_t* entry = replayer.entry(i, &payload);
+        if (!entry) {
+            LOGW("[StagefrightContext] replay: broken record %d", i);
+            break;
+        }
+
+        if (speed > 0) {
+            dueTime += (int64_t)(entry->delay_us / speed);
+            int64_t sleep = dueTime - getMonotonicUs();
+            if (sleep > 0)
+                usleep(sleep);
+        }
+
+        int64_t queueTime = getMonotonicUs();
+        if (queueInputBuffer(0, const_cast<uint8_t*>(payload), entry->size, entry->pts, entry->flags)) {
+            result.frames_queued++;
+            result.bytes_queued += entry->size;
+            if (!(entry->flags & OMX_BUFFERFLAG_CODECCONFIG)) {
+                PendingFrame frame;
+                frame.pts = entry->pts;
+                frame.queueTime = queueTime;
+                pending.push_back(frame);
+            }
+        } else {
+            result.frames_rejected++;
+        }
+
+        drainReplayOutput(pending, result, latencySum, latencyCount);
+    }
+
+    int64_t drainStart = getTimestampMs();
+    while (!pending.empty() && getPeriodMs(drainStart) < OUT_BUFFER_COUNT * s_frameDisplayTimeMsec) {
+        drainReplayOutput(pending, result, latencySum, latencyCount);
+        usleep(s_frameDisplayTimeMsec * 1000 / 4);
+    }
+
+    result.frames_dropped = pending.size();
+    result.elapsed_ms = (getMonotonicUs() - startTime) / 1000;
+    if (result.elapsed_ms > 0) {
+        result.fps = result.frames_decoded * 1000.0f / result.elapsed_ms;
+        result.kbps = result.bytes_queued * 8.0f / result.elapsed_ms;
+    }
+    if (latencyCount > 0)
+        result.latency_avg_ms = latencySum / latencyCount;
+    else
+        result.latency_min_ms = 0;
 
-void StagefrightContext::releaseOutputBuffer(int index, int64_t pts)
-{
-    if (mDecoder != 0 && index >= 0)
-        mDecoder->releaseOutputBuffer(index, pts);
-}
+    LOGI("[StagefrightContext] replay done: queued=%d, rejected=%d, decoded=%d, dropped=%d, "
+            "%d ms, %.1f fps, %.1f kbps, latency min/avg/max=%d/%d/%d ms",
+            result.frames_queued, result.frames_rejected, result.frames_decoded,
+            result.frames_dropped, result.elapsed_ms, result.fps, result.kbps,
+            result.latency_min_ms, result.latency_avg_ms, result.latency_max_ms);
 
-const char* StagefrightContext::getName()
-{
-    if (mDecoder != 0) return mDecoder->getName();
-    return NULL;
+    if (stats)
+        *stats = result;
+    return true;
 }
 
-void StagefrightContext::getOutputFormat(void* outFormat)
-{
-    if (mDecoder != 0) mDecoder->getOutputFormat(outFormat);
-}
+// Tears sessions down in the background so that the next one can open
+// while the previous codec is still stopping
+class SessionReaper : public Thread {
+public:
+    static sp<SessionReaper> instance()
+    {
+        static Mutex s_lock;
+        static sp<SessionReaper> s_instance;
+
+        AutoMutex lock(s_lock);
+        if (s_instance == 0) {
+            s_instance = new SessionReaper();
+            if (s_instance->run(0, ANDROID_PRIORITY_BACKGROUND) != OK) {
+                LOGE("[SessionReaper] cannot start reaper thread");
+                s_instance.clear();
+            }
+        }
+        return s_instance;
+    }
 
-int32_t StagefrightContext::getOutputBuffers()
-{
-    if (mDecoder != 0) return mDecoder->getOutputBuffers();
-    return 0;
-}
+    void post(StagefrightContext* ctx, stagefright_release_cb callback, void* cookie)
+    {
+        Job job;
+        job.ctx = ctx;
+        job.callback = callback;
+        job.cookie = cookie;
+        job.requestTime = getTimestampMs();
 
-bool StagefrightContext::queueInputBuffer(int32_t index, uint8_t* data,
-        size_t size, int64_t pts, uint32_t flags)
-{
-    if (size > 0 && mDecoder != 0) {
-        if (mDecoder->IsDelayedOpen()) {
-            if (flags & OMX_BUFFERFLAG_CODECCONFIG) {
-                sp<IOMX> iomx = mClient.interface();
-                bool result = mDecoder->createDecoder(iomx, data, size);
+        AutoMutex lock(mLock);
+        mJobs.push_back(job);
+        mStats.pending++;
+        mCondition.signal();
+    }
 
-                if (result)
-                    mDecoder->run(0, DECODER_PRIORITY);
-                return true;
-            } else {
-                LOGW("[Decoder] First frame must contain config!");
-                return false;
+    void getStats(stagefright_reaper_stats_t* stats)
+    {
+        AutoMutex lock(mLock);
+        *stats = mStats;
+    }
+
+    // Runs CodecPool::sweep() in delayMs, sessions go first
+    void scheduleSweep(int32_t delayMs)
+    {
+        AutoMutex lock(mLock);
+        int64_t sweepTime = getTimestampMs() + delayMs;
+        if (mSweepTime < 0 || sweepTime < mSweepTime) {
+            mSweepTime = sweepTime;
+            mCondition.signal();
+        }
+    }
+
+private:
+    SessionReaper()
+        : Thread(false)
+        , mSweepTime(-1)
+    {
+        memset(&mStats, 0, sizeof(mStats));
+    }
+
+    virtual bool threadLoop()
+    {
+        Job job;
+        bool sweep = false;
+        { // scopped lock
+            AutoMutex lock(mLock);
+            while (mJobs.empty() && !sweep) {
+                if (mSweepTime < 0) {
+                    mCondition.wait(mLock);
+                    continue;
+                }
+                int64_t wait = mSweepTime - getTimestampMs();
+                if (wait > 0) {
+                    mCondition.waitRelative(mLock, (nsecs_t)wait * 1000000);
+                } else {
+                    mSweepTime = -1;
+                    sweep = true;
+                }
             }
+            if (!sweep) {
+                job = *mJobs.begin();
+                mJobs.erase(mJobs.begin());
+            }
+        }
+
+        if (sweep) {
+            int32_t next = CodecPool::instance().sweep();
+            if (next >= 0)
+                scheduleSweep(next);
+            return true;
+        }
+
+        job.ctx->release();
+        delete job.ctx;
+
+        int32_t releaseMs = getPeriodMs(job.requestTime);
+        { // scopped lock
+            AutoMutex lock(mLock);
+            mStats.pending--;
+            mStats.completed++;
+            mStats.last_release_ms = releaseMs;
+            if (releaseMs > mStats.max_release_ms)
+                mStats.max_release_ms = releaseMs;
         }
-        return mDecoder->queueInputBuffer(index, data, size, pts, flags);
+        LOGI("[SessionReaper] session %p released in %d ms", job.ctx, releaseMs);
+
+        if (job.callback)
+            job.callback(job.cookie, releaseMs);
+        return true;
     }
-    return false;
-}
 
-int32_t StagefrightContext::dequeueInputBuffer(int64_t timeoutUs)
-{
-    if (mDecoder != 0) return mDecoder->dequeueInputBuffer(timeoutUs);
-    return INFO_TRY_AGAIN_LATER;
-}
+    struct Job {
+        StagefrightContext* ctx;
+        stagefright_release_cb callback;
+        void* cookie;
+        int64_t requestTime;
+    };
 
-int32_t StagefrightContext::dequeueOutputBuffer(uint8_t** data, size_t* size,
-        int64_t* pts)
+    List<Job> mJobs;
+    stagefright_reaper_stats_t mStats;
+    int64_t mSweepTime; // -1 without a pool sweep due
+    Mutex mLock;
+    Condition mCondition;
+};
+
+void CodecPool::detach(void* window)
 {
-    if (mDecoder != 0) return mDecoder->dequeueOutputBuffer(data, size, pts);
-    return INFO_TRY_AGAIN_LATER;
+    if (!window)
+        return;
+
+    bool orphaned = false;
+    { // scopped lock
+        AutoMutex lock(mLock);
+        ssize_t index = mSessions.indexOfKey(window);
+        if (index < 0 || --mSessions.editValueAt(index) > 0)
+            return;
+        mSessions.removeItemsAt(index);
+
+        // the next session on this window may still claim them for a while
+        int64_t now = getTimestampMs();
+        for (List<Entry>::iterator it = mIdle.begin(); it != mIdle.end(); ++it) {
+            if (it->window == window) {
+                it->idleTime = now;
+                orphaned = true;
+            }
+        }
+    }
+    if (orphaned)
+        scheduleSweep();
 }
 
-int32_t StagefrightContext::outputBufferCount()
+void CodecPool::scheduleSweep()
 {
-    if (mDecoder != 0) return mDecoder->outputBufferCount();
-    return 0;
+    sp<SessionReaper> reaper = SessionReaper::instance();
+    if (reaper != 0)
+        reaper->scheduleSweep(POOL_WINDOW_IDLE_MS);
 }
 
 extern "C" {
@@ -2458,6 +7889,31 @@ ATTRIBUTE_PUBLIC void Stagefright_Release(StagefrightContext* ctx)
     }
 }
 
+// Returns at once, the callback runs on the reaper thread after teardown
+ATTRIBUTE_PUBLIC void Stagefright_ReleaseAsync(StagefrightContext* ctx,
+        stagefright_release_cb callback, void* cookie)
+{
+    if (!ctx)
+        return;
+
+    sp<SessionReaper> reaper = SessionReaper::instance();
+    if (reaper == 0) {
+        int64_t startTime = getTimestampMs();
+        ctx->release();
+        delete ctx;
+        if (callback)
+            callback(cookie, getPeriodMs(startTime));
+        return;
+    }
+    reaper->post(ctx, callback, cookie);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetReaperStats(stagefright_reaper_stats_t* stats)
+{
+    sp<SessionReaper> reaper = SessionReaper::instance();
+    if (stats && reaper != 0) reaper->getStats(stats);
+}
+
 ATTRIBUTE_PUBLIC const char* Stagefright_GetName(StagefrightContext* ctx)
 {
     if (ctx) return ctx->getName();
@@ -2501,7 +7957,13 @@ ATTRIBUTE_PUBLIC void Stagefright_ReleaseOutputBuffer(StagefrightContext* ctx, i
 ATTRIBUTE_PUBLIC int32_t Stagefright_DequeueOutputBuffer(StagefrightContext* ctx, uint8_t** outData,
         unsigned int* outSize, int64_t* outTs)
 {
-    if (ctx) return ctx->dequeueOutputBuffer(outData, outSize, outTs);
+    if (ctx) {
+        // size_t is wider than the exported type on 64-bit ABIs
+        size_t size = 0;
+        int32_t result = ctx->dequeueOutputBuffer(outData, &size, outTs);
+        *outSize = size;
+        return result;
+    }
     return INFO_TRY_AGAIN_LATER;
 }
 
@@ -2510,4 +7972,283 @@ ATTRIBUTE_PUBLIC int32_t Stagefright_OutputBufferCount(StagefrightContext* ctx)
     return 0;
 }
 
+ATTRIBUTE_PUBLIC void Stagefright_SetCapabilityCachePath(const char* path)
+{
+    CodecCapabilityCache::instance().setStoragePath(path);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_InvalidateCapabilityCache()
+{
+    CodecCapabilityCache::instance().invalidate();
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetStartupStats(StagefrightContext* ctx, stagefright_startup_stats_t* stats)
+{
+    if (ctx) ctx->getStartupStats(stats);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetFlushStats(StagefrightContext* ctx, stagefright_flush_stats_t* stats)
+{
+    if (ctx) ctx->getFlushStats(stats);
+}
+
+ATTRIBUTE_PUBLIC int64_t Stagefright_Seek(StagefrightContext* ctx, int64_t targetUs)
+{
+    if (ctx) return ctx->seek(targetUs);
+    return -1;
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetSeekStats(StagefrightContext* ctx, stagefright_seek_stats_t* stats)
+{
+    if (ctx) ctx->getSeekStats(stats);
+}
+
+ATTRIBUTE_PUBLIC bool Stagefright_SetKeyframeOnly(StagefrightContext* ctx, bool enable)
+{
+    if (ctx) return ctx->setKeyframeOnly(enable);
+    return false;
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetTrickPlayStats(StagefrightContext* ctx, stagefright_trickplay_stats_t* stats)
+{
+    if (ctx) ctx->getTrickPlayStats(stats);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetResyncStats(StagefrightContext* ctx, stagefright_resync_stats_t* stats)
+{
+    if (ctx) ctx->getResyncStats(stats);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetWatchdogTimeout(StagefrightContext* ctx, int32_t timeoutMs)
+{
+    if (ctx) ctx->setWatchdogTimeout(timeoutMs);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetWatchdogStats(StagefrightContext* ctx, stagefright_watchdog_stats_t* stats)
+{
+    if (ctx) ctx->getWatchdogStats(stats);
+}
+
+ATTRIBUTE_PUBLIC bool Stagefright_SetDecoderMode(StagefrightContext* ctx, int32_t mode)
+{
+    if (ctx) return ctx->setDecoderMode(mode);
+    return false;
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetMigrationStats(StagefrightContext* ctx, stagefright_migration_stats_t* stats)
+{
+    if (ctx) ctx->getMigrationStats(stats);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetSessionHints(StagefrightContext* ctx, int32_t frameRate, bool foreground)
+{
+    if (ctx) ctx->setSessionHints(frameRate, foreground);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetSessionPriority(StagefrightContext* ctx, int32_t priorityClass)
+{
+    if (ctx) ctx->setSessionPriority(priorityClass);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetSessionAffinity(int32_t priorityClass, unsigned long cpuMask)
+{
+    SessionScheduler::instance().setAffinity(priorityClass, cpuMask);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetPriorityStats(StagefrightContext* ctx, stagefright_priority_stats_t* stats)
+{
+    if (ctx) ctx->getPriorityStats(stats);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetHwBudget(int64_t mbPerSec, int32_t instances)
+{
+    HwDecoderArbiter::instance().setBudget(mbPerSec, instances);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetHwUtilisation(stagefright_hw_utilisation_t* stats)
+{
+    if (stats) HwDecoderArbiter::instance().getUtilisation(stats);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetDecodeAheadDepth(StagefrightContext* ctx, int32_t depth)
+{
+    if (ctx) ctx->setDecodeAhead(depth);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetOutputStats(StagefrightContext* ctx, stagefright_output_stats_t* stats)
+{
+    if (ctx) ctx->getOutputStats(stats);
+}
+
+// Video output is sorted by pts over a window of frames, each one a frame of
+// latency. 0, the default, keeps decode order and only drops late frames
+ATTRIBUTE_PUBLIC void Stagefright_SetPtsReorderWindow(StagefrightContext* ctx, int32_t frames)
+{
+    if (ctx) ctx->setReorderWindow(frames);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetReorderStats(StagefrightContext* ctx, stagefright_reorder_stats_t* stats)
+{
+    if (ctx) ctx->getReorderStats(stats);
+}
+
+// Software rendered frames are converted on a render thread instead of in ReleaseOutputBuffer
+ATTRIBUTE_PUBLIC bool Stagefright_SetRenderThread(StagefrightContext* ctx, bool enable)
+{
+    if (ctx) return ctx->setRenderThread(enable);
+    return false;
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetRenderStats(StagefrightContext* ctx, stagefright_render_stats_t* stats)
+{
+    if (ctx) ctx->getRenderStats(stats);
+}
+
+// Threads converting software rendered frames, shared by all sessions, 0 for one per CPU
+ATTRIBUTE_PUBLIC void Stagefright_SetConvertThreads(int32_t threads)
+{
+    ConvertPool::instance().setThreads(threads);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetConvertStats(stagefright_convert_stats_t* stats)
+{
+    if (stats) ConvertPool::instance().getStats(stats);
+}
+
+// Released frames render at their pts on a clock, audio names the session driving PRESENTATION_CLOCK_AUDIO
+ATTRIBUTE_PUBLIC bool Stagefright_SetPresentationClock(StagefrightContext* ctx, int32_t clock,
+        StagefrightContext* audio)
+{
+    if (ctx) return ctx->setPresentationClock(clock, audio);
+    return false;
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetClockTime(StagefrightContext* ctx, int64_t mediaUs)
+{
+    if (ctx) ctx->setClockTime(mediaUs);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetPresentationStats(StagefrightContext* ctx,
+        stagefright_presentation_stats_t* stats)
+{
+    if (ctx) ctx->getPresentationStats(stats);
+}
+
+// Network input is reordered and paced by a jitter buffer of minDepthMs..maxDepthMs, 0 disables it
+ATTRIBUTE_PUBLIC bool Stagefright_SetJitterBuffer(StagefrightContext* ctx, int32_t minDepthMs,
+        int32_t maxDepthMs)
+{
+    if (ctx) return ctx->setJitterBuffer(minDepthMs, maxDepthMs);
+    return false;
+}
+
+// sequence orders the access units, with -1 they keep their arrival order
+ATTRIBUTE_PUBLIC bool Stagefright_QueueNetworkInput(StagefrightContext* ctx, uint8_t* data,
+        size_t size, int64_t pts, int64_t sequence, uint32_t flags)
+{
+    if (ctx) return ctx->queueNetworkInput(data, size, pts, sequence, flags);
+    return false;
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetJitterStats(StagefrightContext* ctx,
+        stagefright_jitter_stats_t* stats)
+{
+    if (ctx) ctx->getJitterStats(stats);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_SetDecoderPoolSize(int32_t capacity)
+{
+    CodecPool::instance().setCapacity(capacity);
+}
+
+// Opens a decoder into the pool for a session that is about to start
+ATTRIBUTE_PUBLIC bool Stagefright_PrewarmDecoder(void* nativeWindow, const char* mimeType,
+        int width, int height, void* p_extra, int i_extra)
+{
+    if (!mimeType || CodecPool::instance().capacity() == 0)
+        return false;
+
+    OMXClient client;
+    if (client.connect() != OK)
+        return false;
+
+    sp<IOMX> iomx = client.interface();
+    sp<Decoder> decoder = new Decoder();
+    bool result = decoder->configure(nativeWindow, width, height, p_extra, i_extra)
+            && decoder->createDecoderByType(iomx, mimeType) && decoder->IsVideoDecoder();
+    if (result) {
+        decoder->setPriorityClass(SESSION_PRIORITY_BACKGROUND);
+        result = decoder->openAsync(iomx, 0, 0)
+                && CodecPool::instance().park(decoder, mimeType, nativeWindow, width, height);
+    }
+    client.disconnect();
+
+    if (!result)
+        decoder->release();
+    return result;
+}
+
+// Drops the pooled decoders of a window about to be destroyed, all for NULL
+ATTRIBUTE_PUBLIC void Stagefright_ClearDecoderPool(void* nativeWindow)
+{
+    CodecPool::instance().clear(nativeWindow);
+}
+
+ATTRIBUTE_PUBLIC void Stagefright_GetDecoderPoolStats(stagefright_pool_stats_t* stats)
+{
+    if (stats) CodecPool::instance().getStats(stats);
+}
+
+ATTRIBUTE_PUBLIC bool Stagefright_SetPcmOutput(StagefrightContext* ctx, int32_t durationMs,
+        int32_t sampleFormat, int32_t channels)
+{
+    if (ctx) return ctx->setPcmOutput(durationMs, sampleFormat, channels);
+    return false;
+}
+
+ATTRIBUTE_PUBLIC int32_t Stagefright_ReadPcm(StagefrightContext* ctx, void* data, int32_t frames,
+        int64_t* pts)
+{
+    if (ctx) return ctx->readPcm(data, frames, pts);
+    return INFO_TRY_AGAIN_LATER;
+}
+
+ATTRIBUTE_PUBLIC int32_t Stagefright_PcmAvailable(StagefrightContext* ctx)
+{
+    if (ctx) return ctx->pcmAvailable();
+    return 0;
+}
+
+ATTRIBUTE_PUBLIC int32_t Stagefright_OpenInputFile(StagefrightContext* ctx, const char* path,
+        int streamType, int64_t frameDurationUs)
+{
+    if (ctx) return ctx->openInputFile(path, streamType, frameDurationUs);
+    return -1;
+}
+
+ATTRIBUTE_PUBLIC int32_t Stagefright_QueueInputFileUnit(StagefrightContext* ctx)
+{
+    if (ctx) return ctx->queueInputFileUnit();
+    return INFO_OUTPUT_END_OF_STREAM;
+}
+
+ATTRIBUTE_PUBLIC bool Stagefright_StartRecording(StagefrightContext* ctx, const char* path)
+{
+    if (ctx) return ctx->startRecording(path);
+    return false;
+}
+
+ATTRIBUTE_PUBLIC bool Stagefright_StopRecording(StagefrightContext* ctx)
+{
+    if (ctx) return ctx->stopRecording();
+    return false;
+}
+
+ATTRIBUTE_PUBLIC bool Stagefright_Replay(StagefrightContext* ctx, const char* path, float speed,
+        stagefright_replay_stats_t* stats)
+{
+    if (ctx) return ctx->replay(path, speed, stats);
+    return false;
+}
+
 }
@@ -0,0 +1,88 @@
+/*****************************************************************************
+ * bench_convert.cpp: Stripe conversion throughput of the shared ConvertPool
+ * for 1..CONVERT_MAX_THREADS threads, 1080p NV12 to YV12
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static const int32_t kWidth = 1920;
+static const int32_t kHeight = 1080;
+static const int kFrames = 60;
+
+// The layout NativeWindowRenderer converts, chroma rows carry their two luma rows
+struct Job {
+    const uint8_t* src;
+    uint8_t* dst;
+    int32_t stripeRows;
+};
+
+static void convertStripe(void* arg, int32_t stripe)
+{
+    const Job* job = static_cast<const Job*>(arg);
+    int32_t c0 = stripe * job->stripeRows;
+    int32_t c1 = c0 + job->stripeRows < kHeight / 2 ? c0 + job->stripeRows : kHeight / 2;
+
+    memcpy(job->dst + 2 * c0 * kWidth, job->src + 2 * c0 * kWidth, 2 * (c1 - c0) * kWidth);
+
+    const uint8_t* srcUV = job->src + kWidth * kHeight;
+    uint8_t* dstV = job->dst + kWidth * kHeight;
+    uint8_t* dstU = dstV + kWidth / 2 * kHeight / 2;
+    for (int32_t c = c0; c < c1; ++c) {
+        const uint8_t* uv = srcUV + c * kWidth;
+        uint8_t* u = dstU + c * kWidth / 2;
+        uint8_t* v = dstV + c * kWidth / 2;
+        for (int32_t x = 0; x < kWidth / 2; ++x) {
+            u[x] = uv[2 * x];
+            v[x] = uv[2 * x + 1];
+        }
+    }
+}
+
+TEST(convertScaling)
+{
+    size_t size = kWidth * kHeight * 3 / 2;
+    Vector<uint8_t> src, reference, dst;
+    src.insertAt(0, 0, size);
+    reference.insertAt(0, 0, size);
+    dst.insertAt(0, 0, size);
+    for (size_t i = 0; i < size; ++i)
+        src.editItemAt(i) = (uint8_t)(i * 7 + (i >> 11));
+
+    Job job = { src.array(), reference.editArray(), CONVERT_STRIPE_BYTES / (3 * kWidth) };
+    int32_t stripes = (kHeight / 2 + job.stripeRows - 1) / job.stripeRows;
+    for (int32_t i = 0; i < stripes; ++i)
+        convertStripe(&job, i);
+
+    ConvertPool& pool = ConvertPool::instance();
+    printf("  %d online CPUs, %d stripes per frame\n", (int)sysconf(_SC_NPROCESSORS_ONLN), stripes);
+    double single = 0;
+    for (int32_t threads = 1; threads <= CONVERT_MAX_THREADS; ++threads) {
+        pool.setThreads(threads);
+        stagefright_convert_stats_t before, after;
+        pool.getStats(&before);
+
+        job.dst = dst.editArray();
+        memset(job.dst, 0, size);
+        int64_t start = test::nowUs();
+        for (int i = 0; i < kFrames; ++i)
+            pool.run(convertStripe, &job, stripes);
+        double seconds = (test::nowUs() - start) / 1000000.0;
+        double gbps = (double)size * kFrames / seconds / 1e9;
+        if (threads == 1)
+            single = gbps;
+
+        pool.getStats(&after);
+        printf("  %d threads %7.2f GB/s (x%.2f), stolen %d stripes\n", threads, gbps, gbps / single,
+                after.stolen_stripes - before.stolen_stripes);
+        EXPECT(!memcmp(dst.array(), reference.array(), size));
+        EXPECT_EQ(after.stripes - before.stripes, threads > 1 ? kFrames * stripes : 0);
+    }
+    pool.setThreads(0);
+}
+
+TEST_MAIN()
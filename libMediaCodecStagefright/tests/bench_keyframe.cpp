@@ -0,0 +1,107 @@
+/*****************************************************************************
+ * bench_keyframe.cpp: Keyframe-only (trick play) throughput against the
+ * stub decoder, the same session scrubs with and without the mode
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+#include <pthread.h>
+
+static const int kGops = 10;
+static const int kGopSize = 30;
+static const int32_t kDecodeUs = 4000;
+
+struct Consumer {
+    StagefrightContext* ctx;
+    volatile bool stop;
+};
+
+static void* consume(void* arg)
+{
+    Consumer* consumer = static_cast<Consumer*>(arg);
+    while (!consumer->stop) {
+        uint8_t* data;
+        unsigned int size;
+        int64_t pts;
+        int32_t index = Stagefright_DequeueOutputBuffer(consumer->ctx, &data, &size, &pts);
+        if (index >= 0)
+            Stagefright_ReleaseOutputBuffer(consumer->ctx, index, pts);
+        else
+            usleep(500);
+    }
+    return NULL;
+}
+
+// Annex-B access unit, an IDR slice starts each GOP
+static size_t makeUnit(uint8_t* out, bool idr)
+{
+    static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+    memcpy(out, kStartCode, sizeof(kStartCode));
+    out[4] = idr ? 0x65 : 0x41;
+    memset(out + 5, 0x80, 59);
+    return 64;
+}
+
+// Feeds kGops GOPs, returns the keyframes shown per second
+static double scrub(StagefrightContext* ctx, int64_t& startPts)
+{
+    int32_t outputs = fake::codecCounters().outputs;
+    int64_t start = test::nowUs();
+    uint8_t unit[64];
+    for (int i = 0; i < kGops * kGopSize; ++i) {
+        size_t size = makeUnit(unit, i % kGopSize == 0);
+        while (!Stagefright_QueueInputBuffer(ctx, 0, unit, size, startPts, 0))
+            ;
+        startPts += kFrameUs;
+    }
+
+    stagefright_trickplay_stats_t stats;
+    Stagefright_GetTrickPlayStats(ctx, &stats);
+    int32_t expected = stats.admitted_frames > 0 ? kGops : kGops * kGopSize;
+    WAIT_FOR(fake::codecCounters().outputs - outputs >= expected, 10000);
+    return kGops * 1000000.0 / (test::nowUs() - start);
+}
+
+TEST(keyframeThroughput)
+{
+    fake::codecConfig().decodeUs = kDecodeUs;
+    fake::Window window;
+
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+
+    Consumer consumer = { ctx, false };
+    pthread_t thread;
+    pthread_create(&thread, NULL, consume, &consumer);
+
+    int64_t pts = 0;
+    double full = scrub(ctx, pts);
+    EXPECT(Stagefright_SetKeyframeOnly(ctx, true));
+    double keyframes = scrub(ctx, pts);
+    EXPECT(Stagefright_SetKeyframeOnly(ctx, false));
+    double back = scrub(ctx, pts);
+
+    stagefright_trickplay_stats_t stats;
+    Stagefright_GetTrickPlayStats(ctx, &stats);
+    printf("  full stream     %8.1f keyframes/s\n", full);
+    printf("  keyframe-only   %8.1f keyframes/s (x%.1f)\n", keyframes, keyframes / full);
+    printf("  full again      %8.1f keyframes/s\n", back);
+    printf("  admitted %d rejected %d decoded %d replaced %d\n", stats.admitted_frames,
+            stats.rejected_frames, stats.decoded_frames, stats.replaced_frames);
+    EXPECT_EQ(stats.admitted_frames, kGops);
+    EXPECT(keyframes > 3 * full);
+
+    consumer.stop = true;
+    pthread_join(thread, NULL);
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+TEST_MAIN()
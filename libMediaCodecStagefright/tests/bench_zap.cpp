@@ -0,0 +1,103 @@
+/*****************************************************************************
+ * bench_zap.cpp: Channel zap latency against the stub decoder, the old
+ * session released in place or on the reaper while the next one opens
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static const int kZaps = 8;
+static const int32_t kOpenDelayMs = 40;
+static const int32_t kStopDelayMs = 150;
+
+struct Completion {
+    volatile int32_t count;
+    volatile int32_t totalMs;
+};
+
+// Runs on the reaper thread, one session at a time
+static void onReleased(void* cookie, int32_t releaseMs)
+{
+    Completion* completion = static_cast<Completion*>(cookie);
+    completion->totalMs += releaseMs;
+    completion->count++;
+}
+
+// Opens a session and feeds sync frames until the first one is decoded
+static StagefrightContext* tuneIn(fake::Window& window)
+{
+    StagefrightContext* ctx = test::openSession(&window);
+    if (!ctx)
+        return NULL;
+
+    int64_t pts = 0;
+    int64_t deadline = test::nowUs() + 2000000;
+    while (test::nowUs() < deadline) {
+        if (Stagefright_QueueInputBuffer(ctx, 0, (uint8_t*)kAvcIDR, sizeof(kAvcIDR), pts, 0))
+            pts += kFrameUs;
+        uint8_t* data;
+        unsigned int size;
+        int64_t outPts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &size, &outPts);
+        if (index >= 0) {
+            Stagefright_ReleaseOutputBuffer(ctx, index, outPts);
+            break;
+        }
+        usleep(1000);
+    }
+    return ctx;
+}
+
+// Average ms from leaving a channel to the first frame of the next one
+static double zap(fake::Window& window, bool async, Completion* completion)
+{
+    StagefrightContext* ctx = tuneIn(window);
+    int64_t total = 0;
+    for (int i = 0; i < kZaps && ctx; ++i) {
+        int64_t start = test::nowUs();
+        if (async)
+            Stagefright_ReleaseAsync(ctx, onReleased, completion);
+        else
+            Stagefright_Release(ctx);
+        ctx = tuneIn(window);
+        total += test::nowUs() - start;
+    }
+    Stagefright_Release(ctx);
+    return total / 1000.0 / kZaps;
+}
+
+TEST(zapLatency)
+{
+    fake::codecConfig().openDelayMs = kOpenDelayMs;
+    fake::codecConfig().stopDelayMs = kStopDelayMs;
+    stagefright_pool_stats_t pool;
+    Stagefright_GetDecoderPoolStats(&pool);
+    Stagefright_SetDecoderPoolSize(0); // every zap opens and stops a component
+    fake::Window window;
+
+    double sync = zap(window, false, NULL);
+    Completion completion = { 0, 0 };
+    double async = zap(window, true, &completion);
+    EXPECT(WAIT_FOR(completion.count == kZaps, 5000));
+
+    stagefright_reaper_stats_t stats;
+    Stagefright_GetReaperStats(&stats);
+    printf("  open %d ms, stop %d ms\n", kOpenDelayMs, kStopDelayMs);
+    printf("  sync release    %8.1f ms per zap\n", sync);
+    printf("  async release   %8.1f ms per zap (x%.1f)\n", async, sync / async);
+    printf("  reaper: completed %d, avg %d ms, max %d ms\n", stats.completed,
+            completion.count ? completion.totalMs / completion.count : 0, stats.max_release_ms);
+    EXPECT_EQ(stats.completed, kZaps);
+    EXPECT_EQ(stats.pending, 0);
+    EXPECT(stats.max_release_ms >= kStopDelayMs);
+    EXPECT(async + kStopDelayMs / 2 < sync);
+
+    EXPECT(WAIT_FOR(fake::codecCounters().live == 0, 2000));
+    Stagefright_SetDecoderPoolSize(pool.capacity);
+}
+
+TEST_MAIN()
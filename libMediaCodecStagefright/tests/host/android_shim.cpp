@@ -0,0 +1,1372 @@
+/*****************************************************************************
+ * android_shim.cpp: Host stand-ins for the Android framework and the fake
+ * OMX backend, see android_shim.h
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "android_shim.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+extern "C" int __android_log_print(int prio, const char* tag, const char* fmt, ...)
+{
+    static const char* s_level = getenv("STAGEFRIGHT_LOG");
+    if (!s_level || prio < atoi(s_level))
+        return 0;
+
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s ", tag);
+    int result = vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return result;
+}
+
+extern "C" int property_get(const char* key, char* value, const char* defaultValue)
+{
+    const char* result = defaultValue ? defaultValue : "";
+    if (!strcmp(key, "ro.build.fingerprint") && getenv("STAGEFRIGHT_FINGERPRINT"))
+        result = getenv("STAGEFRIGHT_FINGERPRINT");
+    strncpy(value, result, PROPERTY_VALUE_MAX - 1);
+    value[PROPERTY_VALUE_MAX - 1] = 0;
+    return strlen(value);
+}
+
+namespace android {
+
+nsecs_t systemTime(int clock)
+{
+    struct timespec t;
+    clock_gettime(clock == SYSTEM_TIME_REALTIME ? CLOCK_REALTIME : CLOCK_MONOTONIC, &t);
+    return (nsecs_t)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int androidSetThreadPriority(pid_t tid, int priority)
+{
+    // raising the priority needs CAP_SYS_NICE, the policy is what is tested
+    setpriority(PRIO_PROCESS, tid, priority);
+    return 0;
+}
+
+// RefBase
+
+#define INITIAL_STRONG_VALUE (1 << 28)
+
+class RefBase::weakref_impl : public RefBase::weakref_type {
+public:
+    explicit weakref_impl(RefBase* base)
+        : mStrong(INITIAL_STRONG_VALUE)
+        , mWeak(0)
+        , mBase(base)
+    {
+    }
+
+    volatile int32_t mStrong;
+    volatile int32_t mWeak;
+    RefBase* const mBase;
+};
+
+RefBase::RefBase()
+    : mRefs(new weakref_impl(this))
+{
+}
+
+RefBase::~RefBase()
+{
+    // never strongly referenced, nothing else frees the weak counts
+    if (mRefs->mStrong == INITIAL_STRONG_VALUE)
+        delete mRefs;
+}
+
+void RefBase::incStrong(const void* id) const
+{
+    weakref_impl* const refs = mRefs;
+    refs->incWeak(id);
+    const int32_t c = __sync_fetch_and_add(&refs->mStrong, 1);
+    if (c != INITIAL_STRONG_VALUE)
+        return;
+    __sync_fetch_and_sub(&refs->mStrong, INITIAL_STRONG_VALUE);
+    const_cast<RefBase*>(this)->onFirstRef();
+}
+
+void RefBase::decStrong(const void* id) const
+{
+    weakref_impl* const refs = mRefs;
+    const int32_t c = __sync_fetch_and_sub(&refs->mStrong, 1);
+    CHECK(c >= 1);
+    if (c == 1) {
+        const_cast<RefBase*>(this)->onLastStrongRef(id);
+        delete this;
+    }
+    refs->decWeak(id);
+}
+
+int32_t RefBase::getStrongCount() const
+{
+    return mRefs->mStrong == INITIAL_STRONG_VALUE ? 0 : mRefs->mStrong;
+}
+
+RefBase::weakref_type* RefBase::createWeak(const void* id) const
+{
+    mRefs->incWeak(id);
+    return mRefs;
+}
+
+RefBase::weakref_type* RefBase::getWeakRefs() const
+{
+    return mRefs;
+}
+
+RefBase* RefBase::weakref_type::refBase() const
+{
+    return static_cast<const weakref_impl*>(this)->mBase;
+}
+
+void RefBase::weakref_type::incWeak(const void*)
+{
+    __sync_fetch_and_add(&static_cast<weakref_impl*>(this)->mWeak, 1);
+}
+
+void RefBase::weakref_type::decWeak(const void*)
+{
+    weakref_impl* const impl = static_cast<weakref_impl*>(this);
+    const int32_t c = __sync_fetch_and_sub(&impl->mWeak, 1);
+    CHECK(c >= 1);
+    if (c != 1)
+        return;
+
+    if (impl->mStrong == INITIAL_STRONG_VALUE)
+        delete impl->mBase; // frees impl too
+    else
+        delete impl;
+}
+
+bool RefBase::weakref_type::attemptIncStrong(const void* id)
+{
+    incWeak(id);
+
+    weakref_impl* const impl = static_cast<weakref_impl*>(this);
+    int32_t c = impl->mStrong;
+    while (c > 0 && c != INITIAL_STRONG_VALUE) {
+        if (__sync_bool_compare_and_swap(&impl->mStrong, c, c + 1))
+            return true;
+        c = impl->mStrong;
+    }
+
+    if (c == INITIAL_STRONG_VALUE) {
+        c = __sync_fetch_and_add(&impl->mStrong, 1);
+        if (c == INITIAL_STRONG_VALUE) {
+            __sync_fetch_and_sub(&impl->mStrong, INITIAL_STRONG_VALUE);
+            impl->mBase->onFirstRef();
+        }
+        return true;
+    }
+
+    decWeak(id);
+    return false;
+}
+
+// String8
+
+status_t String8::appendFormat(const char* fmt, ...)
+{
+    char buffer[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return append(buffer);
+}
+
+String8 String8::format(const char* fmt, ...)
+{
+    char buffer[1024];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return String8(buffer);
+}
+
+// Condition, on the monotonic clock like bionic
+
+Condition::Condition()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mCond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+status_t Condition::waitRelative(Mutex& mutex, nsecs_t reltime)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (reltime < 0)
+        reltime = 0;
+    int64_t nsec = ts.tv_nsec + reltime % 1000000000LL;
+    ts.tv_sec += reltime / 1000000000LL + nsec / 1000000000LL;
+    ts.tv_nsec = nsec % 1000000000LL;
+    return -pthread_cond_timedwait(&mCond, &mutex.mMutex, &ts);
+}
+
+// Thread
+
+Thread::Thread(bool)
+    : mStatus(NO_ERROR)
+    , mExitPending(false)
+    , mRunning(false)
+    , mHasThread(false)
+    , mTid(-1)
+{
+}
+
+Thread::~Thread()
+{
+}
+
+status_t Thread::readyToRun()
+{
+    return NO_ERROR;
+}
+
+status_t Thread::run(const char*, int32_t priority, size_t)
+{
+    Mutex::Autolock lock(mLock);
+    if (mRunning)
+        return INVALID_OPERATION;
+
+    mStatus = NO_ERROR;
+    mExitPending = false;
+    mHasThread = false;
+    mHoldSelf = this;
+    mRunning = true;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&mThread, &attr, _threadLoop, this);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        mStatus = UNKNOWN_ERROR;
+        mRunning = false;
+        mHoldSelf.clear();
+        return UNKNOWN_ERROR;
+    }
+    mHasThread = true;
+    (void)priority;
+    return NO_ERROR;
+}
+
+void* Thread::_threadLoop(void* user)
+{
+    Thread* const self = static_cast<Thread*>(user);
+
+    sp<Thread> strong;
+    { // the creator may still be in run()
+        Mutex::Autolock lock(self->mLock);
+        strong = self->mHoldSelf;
+        self->mHoldSelf.clear();
+        self->mTid = gettid();
+    }
+    wp<Thread> weak(strong);
+
+    bool first = true;
+    do {
+        bool result;
+        if (first) {
+            first = false;
+            self->mStatus = self->readyToRun();
+            result = (self->mStatus == NO_ERROR);
+            if (result && !self->exitPending())
+                result = self->threadLoop();
+        } else {
+            result = self->threadLoop();
+        }
+
+        { // scopped lock
+            Mutex::Autolock lock(self->mLock);
+            if (!result || self->mExitPending) {
+                self->mExitPending = true;
+                self->mRunning = false;
+                self->mHasThread = false;
+                self->mThreadExitedCondition.broadcast();
+                break;
+            }
+        }
+
+        // between loops only a strong reference elsewhere keeps the thread
+        strong.clear();
+        strong = weak.promote();
+    } while (strong != 0);
+
+    return 0;
+}
+
+void Thread::requestExit()
+{
+    Mutex::Autolock lock(mLock);
+    mExitPending = true;
+}
+
+status_t Thread::requestExitAndWait()
+{
+    Mutex::Autolock lock(mLock);
+    if (mHasThread && pthread_equal(mThread, pthread_self()))
+        return WOULD_BLOCK;
+
+    mExitPending = true;
+    while (mRunning)
+        mThreadExitedCondition.wait(mLock);
+    mExitPending = false;
+    return mStatus;
+}
+
+status_t Thread::join()
+{
+    Mutex::Autolock lock(mLock);
+    if (mHasThread && pthread_equal(mThread, pthread_self()))
+        return WOULD_BLOCK;
+
+    while (mRunning)
+        mThreadExitedCondition.wait(mLock);
+    return mStatus;
+}
+
+bool Thread::isRunning() const
+{
+    Mutex::Autolock lock(mLock);
+    return mRunning;
+}
+
+pid_t Thread::getTid() const
+{
+    Mutex::Autolock lock(mLock);
+    return mRunning ? mTid : -1;
+}
+
+bool Thread::exitPending() const
+{
+    Mutex::Autolock lock(mLock);
+    return mExitPending;
+}
+
+// ProcessState
+
+sp<ProcessState> ProcessState::self()
+{
+    static sp<ProcessState> s_instance = new ProcessState();
+    return s_instance;
+}
+
+// GraphicBuffer
+
+static volatile int32_t s_graphicBufferWrappers = 0;
+
+GraphicBuffer::GraphicBuffer(uint32_t w, uint32_t h, int fmt, uint32_t use)
+    : mOwnedHandle(new native_handle_t())
+{
+    width = w;
+    height = h;
+    stride = w;
+    format = fmt;
+    usage = use;
+    mStorage.resize(w * h * 3 / 2 + 1);
+    memset(mOwnedHandle, 0, sizeof(*mOwnedHandle));
+    mOwnedHandle->base = &mStorage[0];
+    handle = mOwnedHandle;
+}
+
+GraphicBuffer::GraphicBuffer(ANativeWindowBuffer* buffer, bool)
+    : mOwnedHandle(0)
+{
+    width = buffer->width;
+    height = buffer->height;
+    stride = buffer->stride;
+    format = buffer->format;
+    usage = buffer->usage;
+    handle = buffer->handle;
+    __sync_fetch_and_add(&s_graphicBufferWrappers, 1);
+}
+
+GraphicBuffer::~GraphicBuffer()
+{
+    delete mOwnedHandle;
+}
+
+status_t GraphicBuffer::lock(uint32_t, void** vaddr)
+{
+    *vaddr = handle ? handle->base : 0;
+    return handle ? OK : BAD_VALUE;
+}
+
+status_t GraphicBuffer::unlock()
+{
+    return OK;
+}
+
+ANativeWindowBuffer* GraphicBuffer::getNativeBuffer() const
+{
+    return const_cast<ANativeWindowBuffer*>(static_cast<const ANativeWindowBuffer*>(this));
+}
+
+int32_t GraphicBuffer::wrapperCount()
+{
+    return s_graphicBufferWrappers;
+}
+
+// MetaData
+
+bool MetaData::setData(uint32_t key, uint32_t type, const void* data, size_t size)
+{
+    bool overwrote = mItems.count(key) > 0;
+    Item& item = mItems[key];
+    item.type = type;
+    item.data.assign(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+    return overwrote;
+}
+
+bool MetaData::findData(uint32_t key, uint32_t* type, const void** data, size_t* size)
+{
+    std::map<uint32_t, Item>::iterator it = mItems.find(key);
+    if (it == mItems.end())
+        return false;
+    *type = it->second.type;
+    *data = it->second.data.empty() ? 0 : &it->second.data[0];
+    *size = it->second.data.size();
+    return true;
+}
+
+bool MetaData::setCString(uint32_t key, const char* value)
+{
+    return setData(key, TYPE_C_STRING, value, strlen(value) + 1);
+}
+
+bool MetaData::setInt32(uint32_t key, int32_t value)
+{
+    return setData(key, TYPE_INT32, &value, sizeof(value));
+}
+
+bool MetaData::setInt64(uint32_t key, int64_t value)
+{
+    return setData(key, TYPE_INT64, &value, sizeof(value));
+}
+
+bool MetaData::setRect(uint32_t key, int32_t left, int32_t top, int32_t right, int32_t bottom)
+{
+    int32_t rect[4] = { left, top, right, bottom };
+    return setData(key, TYPE_RECT, rect, sizeof(rect));
+}
+
+bool MetaData::findCString(uint32_t key, const char** value)
+{
+    uint32_t type;
+    const void* data;
+    size_t size;
+    if (!findData(key, &type, &data, &size) || type != TYPE_C_STRING)
+        return false;
+    *value = static_cast<const char*>(data);
+    return true;
+}
+
+bool MetaData::findInt32(uint32_t key, int32_t* value)
+{
+    uint32_t type;
+    const void* data;
+    size_t size;
+    if (!findData(key, &type, &data, &size) || type != TYPE_INT32)
+        return false;
+    memcpy(value, data, sizeof(*value));
+    return true;
+}
+
+bool MetaData::findInt64(uint32_t key, int64_t* value)
+{
+    uint32_t type;
+    const void* data;
+    size_t size;
+    if (!findData(key, &type, &data, &size) || type != TYPE_INT64)
+        return false;
+    memcpy(value, data, sizeof(*value));
+    return true;
+}
+
+bool MetaData::findRect(uint32_t key, int32_t* left, int32_t* top, int32_t* right, int32_t* bottom)
+{
+    uint32_t type;
+    const void* data;
+    size_t size;
+    if (!findData(key, &type, &data, &size) || type != TYPE_RECT)
+        return false;
+    const int32_t* rect = static_cast<const int32_t*>(data);
+    *left = rect[0];
+    *top = rect[1];
+    *right = rect[2];
+    *bottom = rect[3];
+    return true;
+}
+
+const char* MEDIA_MIMETYPE_VIDEO_AVC = "video/avc";
+const char* MEDIA_MIMETYPE_VIDEO_HEVC = "video/hevc";
+const char* MEDIA_MIMETYPE_VIDEO_MPEG4 = "video/mp4v-es";
+const char* MEDIA_MIMETYPE_VIDEO_H263 = "video/3gpp";
+const char* MEDIA_MIMETYPE_AUDIO_AAC = "audio/mp4a-latm";
+
+// MediaBuffer
+
+static volatile int32_t s_mediaBuffers = 0;
+
+MediaBuffer::MediaBuffer(void* data, size_t size)
+    : mObserver(0)
+    , mRefCount(0)
+    , mData(data)
+    , mSize(size)
+    , mRangeOffset(0)
+    , mRangeLength(size)
+    , mOwnsData(false)
+    , mMetaData(new MetaData)
+{
+    __sync_fetch_and_add(&s_mediaBuffers, 1);
+}
+
+MediaBuffer::MediaBuffer(size_t size)
+    : mObserver(0)
+    , mRefCount(0)
+    , mData(malloc(size))
+    , mSize(size)
+    , mRangeOffset(0)
+    , mRangeLength(size)
+    , mOwnsData(true)
+    , mMetaData(new MetaData)
+{
+    __sync_fetch_and_add(&s_mediaBuffers, 1);
+}
+
+MediaBuffer::MediaBuffer(const sp<GraphicBuffer>& graphicBuffer)
+    : mObserver(0)
+    , mRefCount(0)
+    , mData(0)
+    , mSize(1)
+    , mRangeOffset(0)
+    , mRangeLength(1)
+    , mOwnsData(false)
+    , mGraphicBuffer(graphicBuffer)
+    , mMetaData(new MetaData)
+{
+    __sync_fetch_and_add(&s_mediaBuffers, 1);
+}
+
+MediaBuffer::~MediaBuffer()
+{
+    CHECK(mObserver == NULL);
+    if (mOwnsData)
+        free(mData);
+    __sync_fetch_and_sub(&s_mediaBuffers, 1);
+}
+
+void MediaBuffer::release()
+{
+    if (mObserver == NULL) {
+        CHECK_EQ(mRefCount, 0);
+        delete this;
+        return;
+    }
+
+    int32_t prevCount = __sync_fetch_and_sub(&mRefCount, 1);
+    CHECK(prevCount > 0);
+    if (prevCount == 1)
+        mObserver->signalBufferReturned(this);
+}
+
+void MediaBuffer::add_ref()
+{
+    __sync_fetch_and_add(&mRefCount, 1);
+}
+
+void MediaBuffer::set_range(size_t offset, size_t length)
+{
+    CHECK(mGraphicBuffer != 0 || offset + length <= mSize);
+    mRangeOffset = offset;
+    mRangeLength = length;
+}
+
+int32_t MediaBuffer::liveCount()
+{
+    return s_mediaBuffers;
+}
+
+// MediaBufferGroup
+
+MediaBufferGroup::~MediaBufferGroup()
+{
+    for (size_t i = 0; i < mBuffers.size(); ++i) {
+        CHECK_EQ(mBuffers[i]->refcount(), 0);
+        mBuffers[i]->setObserver(NULL);
+        mBuffers[i]->release();
+    }
+}
+
+void MediaBufferGroup::add_buffer(MediaBuffer* buffer)
+{
+    Mutex::Autolock lock(mLock);
+    buffer->setObserver(this);
+    mBuffers.push_back(buffer);
+}
+
+status_t MediaBufferGroup::acquire_buffer(MediaBuffer** out)
+{
+    Mutex::Autolock lock(mLock);
+    for (;;) {
+        for (size_t i = 0; i < mBuffers.size(); ++i) {
+            if (mBuffers[i]->refcount() == 0) {
+                mBuffers[i]->add_ref();
+                mBuffers[i]->set_range(0, mBuffers[i]->size());
+                *out = mBuffers[i];
+                return OK;
+            }
+        }
+        mCondition.wait(mLock);
+    }
+}
+
+void MediaBufferGroup::signalBufferReturned(MediaBuffer*)
+{
+    Mutex::Autolock lock(mLock);
+    mCondition.signal();
+}
+
+} // namespace android
+
+// The fake OMX backend
+
+using namespace android;
+
+namespace {
+
+Mutex s_codecLock;
+Condition s_stallCondition;
+int32_t s_stallGeneration = 0;
+fake::CodecConfig s_config;
+fake::CodecCounters s_counters;
+Vector<int64_t> s_decodedPts;
+Vector<const void*> s_decodedData;
+
+fake::CodecConfig defaultConfig()
+{
+    fake::CodecConfig config;
+    config.openDelayMs = 0;
+    config.stopDelayMs = 0;
+    config.decodeUs = 0;
+    config.hwInstances = -1;
+    config.failHwOpen = false;
+    config.failSwOpen = false;
+    config.failConnect = false;
+    config.outputBuffers = 8;
+    config.stallAfter = -1;
+    config.errorAfter = -1;
+    config.errorCount = 0;
+    config.errorStatus = UNKNOWN_ERROR;
+    config.hwErrorsOnly = false;
+    return config;
+}
+
+struct ConfigInit {
+    ConfigInit()
+    {
+        s_config = defaultConfig();
+        memset(&s_counters, 0, sizeof(s_counters));
+    }
+} s_configInit;
+
+// Output buffers of one component, kept until the client gave back the last
+// one even if the component is gone by then
+class OutputPool : public RefBase, public MediaBufferObserver {
+public:
+    OutputPool()
+        : mClosed(false)
+    {
+    }
+
+    void add(MediaBuffer* buffer)
+    {
+        Mutex::Autolock lock(mLock);
+        buffer->setObserver(this);
+        mFree.push_back(buffer);
+    }
+
+    MediaBuffer* acquire(int32_t timeoutMs)
+    {
+        Mutex::Autolock lock(mLock);
+        nsecs_t deadline = systemTime() + (nsecs_t)timeoutMs * 1000000;
+        while (mFree.empty()) {
+            nsecs_t wait = deadline - systemTime();
+            if (wait <= 0)
+                return 0;
+            mCondition.waitRelative(mLock, wait);
+        }
+        MediaBuffer* buffer = mFree.back();
+        mFree.pop_back();
+        buffer->add_ref();
+        incStrong(this); // per outstanding buffer
+        return buffer;
+    }
+
+    void close()
+    {
+        Mutex::Autolock lock(mLock);
+        mClosed = true;
+        for (size_t i = 0; i < mFree.size(); ++i) {
+            mFree[i]->setObserver(NULL);
+            mFree[i]->release();
+        }
+        mFree.clear();
+    }
+
+    virtual void signalBufferReturned(MediaBuffer* buffer)
+    {
+        { // scopped lock
+            Mutex::Autolock lock(mLock);
+            if (mClosed) {
+                buffer->setObserver(NULL);
+                buffer->release();
+            } else {
+                buffer->meta_data()->clear();
+                mFree.push_back(buffer);
+                mCondition.signal();
+            }
+        }
+        decStrong(this);
+    }
+
+private:
+    std::vector<MediaBuffer*> mFree;
+    bool mClosed;
+    Mutex mLock;
+    Condition mCondition;
+};
+
+class FakeOMX : public IOMX {
+};
+
+class FakeCodec : public MediaSource {
+public:
+    FakeCodec(const sp<MetaData>& meta, const sp<MediaSource>& source, bool hw,
+            const sp<ANativeWindow>& window)
+        : mSource(source)
+        , mHw(hw)
+        , mGraphic(window != 0)
+        , mStarted(false)
+        , mEOS(false)
+        , mStalled(false)
+        , mOutputs(0)
+        , mErrors(0)
+        , mOutputFormat(new MetaData)
+        , mPool(new OutputPool)
+    {
+        const char* mime = "";
+        meta->findCString(kKeyMIMEType, &mime);
+        mVideo = !strncasecmp(mime, "video/", 6);
+
+        int32_t width = 320, height = 240, colorFormat = OMX_COLOR_FormatYUV420Planar;
+        int32_t sampleRate = 44100, channels = 2;
+        meta->findInt32(kKeyWidth, &width);
+        meta->findInt32(kKeyHeight, &height);
+        if (hw)
+            meta->findInt32(kKeyColorFormat, &colorFormat);
+        meta->findInt32(kKeySampleRate, &sampleRate);
+        meta->findInt32(kKeyChannelCount, &channels);
+
+        const char* name = mVideo
+                ? (hw ? "OMX.fake.video.decoder" : "OMX.google.fake.video.decoder")
+                : (hw ? "OMX.fake.audio.decoder" : "OMX.google.fake.audio.decoder");
+        mOutputFormat->setCString(kKeyDecoderComponent, name);
+        if (mVideo) {
+            mOutputFormat->setCString(kKeyMIMEType, "video/raw");
+            mOutputFormat->setInt32(kKeyWidth, width);
+            mOutputFormat->setInt32(kKeyHeight, height);
+            mOutputFormat->setInt32(kKeyColorFormat, colorFormat);
+        } else {
+            mOutputFormat->setCString(kKeyMIMEType, "audio/raw");
+            mOutputFormat->setInt32(kKeySampleRate, sampleRate);
+            mOutputFormat->setInt32(kKeyChannelCount, channels);
+        }
+
+        size_t size = mVideo ? width * height * 3 / 2 : 1024 * channels * sizeof(int16_t);
+        for (int32_t i = 0; i < s_config.outputBuffers; ++i) {
+            if (mGraphic)
+                mPool->add(new MediaBuffer(new GraphicBuffer(width, height, HAL_PIXEL_FORMAT_YV12, 0)));
+            else
+                mPool->add(new MediaBuffer(size));
+        }
+
+        s_counters.creates++;
+        s_counters.live++;
+        if (hw) {
+            s_counters.hwCreates++;
+            s_counters.liveHw++;
+        } else {
+            s_counters.swCreates++;
+        }
+    }
+
+    virtual status_t start(MetaData* params)
+    {
+        CHECK(!mStarted);
+        mStarted = true;
+        { // scopped lock
+            Mutex::Autolock lock(s_codecLock);
+            s_counters.starts++;
+        }
+        return mSource->start(params);
+    }
+
+    virtual status_t stop()
+    {
+        if (!mStarted)
+            return OK;
+        mStarted = false;
+        int32_t stopDelayMs;
+        { // scopped lock
+            Mutex::Autolock lock(s_codecLock);
+            s_counters.stops++;
+            stopDelayMs = s_config.stopDelayMs;
+        }
+        if (stopDelayMs > 0)
+            usleep(stopDelayMs * 1000);
+        return mSource->stop();
+    }
+
+    virtual sp<MetaData> getFormat() { return mOutputFormat; }
+
+    virtual status_t read(MediaBuffer** out, const ReadOptions* options)
+    {
+        *out = 0;
+        CHECK(mStarted);
+
+        int64_t seekTimeUs;
+        ReadOptions::SeekMode mode;
+        if (options && options->getSeekTo(&seekTimeUs, &mode))
+            mEOS = false; // ports flushed, the component resumes
+
+        if (mEOS)
+            return ERROR_END_OF_STREAM;
+
+        { // scopped lock
+            Mutex::Autolock lock(s_codecLock);
+            bool eligible = mHw || !s_config.hwErrorsOnly;
+            if (eligible && !mStalled && s_config.stallAfter >= 0 && mOutputs >= s_config.stallAfter) {
+                // wedged like a component that stopped returning buffers
+                mStalled = true;
+                int32_t generation = s_stallGeneration;
+                s_counters.stalled++;
+                while (generation == s_stallGeneration)
+                    s_stallCondition.wait(s_codecLock);
+                s_counters.stalled--;
+                return TIMED_OUT;
+            }
+            if (eligible && s_config.errorAfter >= 0 && mOutputs >= s_config.errorAfter
+                    && mErrors < s_config.errorCount) {
+                mErrors++;
+                return s_config.errorStatus;
+            }
+        }
+
+        int64_t timeUs = -1;
+        const void* data = 0;
+        for (;;) {
+            MediaBuffer* input = 0;
+            status_t err = mSource->read(&input, NULL);
+            if (err == ERROR_END_OF_STREAM) {
+                mEOS = true;
+                return ERROR_END_OF_STREAM;
+            }
+            if (err != OK)
+                return err;
+            if (!input)
+                continue;
+
+            int32_t config = 0;
+            input->meta_data()->findInt32(kKeyIsCodecConfig, &config);
+            if (!input->meta_data()->findInt64(kKeyTime, &timeUs))
+                timeUs = -1;
+            data = (const uint8_t*)input->data() + input->range_offset();
+            input->release();
+            if (!config)
+                break;
+        }
+
+        int32_t decodeUs;
+        { // scopped lock
+            Mutex::Autolock lock(s_codecLock);
+            decodeUs = s_config.decodeUs;
+            s_decodedPts.push(timeUs);
+            s_decodedData.push(data);
+        }
+        if (decodeUs > 0)
+            usleep(decodeUs);
+
+        // OMXCodec gives up on a buffer the client keeps after 3 s
+        MediaBuffer* buffer = mPool->acquire(3000);
+        if (!buffer)
+            return TIMED_OUT;
+
+        if (!mGraphic) {
+            memset(buffer->data(), (uint8_t)mOutputs, buffer->size() < 64 ? buffer->size() : 64);
+            buffer->set_range(0, buffer->size());
+        }
+        buffer->meta_data()->setInt64(kKeyTime, timeUs);
+        mOutputs++;
+        { // scopped lock
+            Mutex::Autolock lock(s_codecLock);
+            s_counters.outputs++;
+        }
+        *out = buffer;
+        return OK;
+    }
+
+protected:
+    virtual ~FakeCodec()
+    {
+        // OMXCodec aborts when it is destroyed while still executing
+        CHECK(!mStarted);
+        mPool->close();
+
+        Mutex::Autolock lock(s_codecLock);
+        s_counters.live--;
+        if (mHw)
+            s_counters.liveHw--;
+    }
+
+private:
+    sp<MediaSource> mSource;
+    bool mHw;
+    bool mGraphic;
+    bool mVideo;
+    bool mStarted;
+    bool mEOS;
+    bool mStalled;
+    int32_t mOutputs;
+    int32_t mErrors;
+    sp<MetaData> mOutputFormat;
+    sp<OutputPool> mPool;
+};
+
+} // namespace
+
+namespace android {
+
+status_t OMXClient::connect()
+{
+    Mutex::Autolock lock(s_codecLock);
+    if (s_config.failConnect)
+        return UNKNOWN_ERROR;
+    mOMX = new FakeOMX;
+    return OK;
+}
+
+void OMXClient::disconnect()
+{
+    mOMX.clear();
+}
+
+status_t QueryCodecs(const sp<IOMX>& omx, const char* mimeType, bool queryDecoders,
+        bool hwCodecOnly, Vector<CodecCapabilities>* results)
+{
+    (void)omx;
+    results->clear();
+    { // scopped lock
+        Mutex::Autolock lock(s_codecLock);
+        s_counters.queries++;
+    }
+    if (!queryDecoders)
+        return OK;
+
+    bool video = !strncasecmp(mimeType, "video/", 6);
+    CodecCapabilities caps;
+    CodecProfileLevel profileLevel;
+    profileLevel.mProfile = 1;
+    profileLevel.mLevel = 0x200;
+    caps.mProfileLevels.push(profileLevel);
+
+    caps.mComponentName = video ? "OMX.fake.video.decoder" : "OMX.fake.audio.decoder";
+    if (video)
+        caps.mColorFormats.push(OMX_COLOR_FormatYUV420SemiPlanar);
+    results->push(caps);
+
+    if (!hwCodecOnly) {
+        caps.mComponentName = video ? "OMX.google.fake.video.decoder" : "OMX.google.fake.audio.decoder";
+        caps.mColorFormats.clear();
+        if (video)
+            caps.mColorFormats.push(OMX_COLOR_FormatYUV420Planar);
+        results->push(caps);
+    }
+    return OK;
+}
+
+status_t QueryCodecs(const sp<IOMX>& omx, const char* mimeType, bool queryDecoders,
+        Vector<CodecCapabilities>* results)
+{
+    return QueryCodecs(omx, mimeType, queryDecoders, false, results);
+}
+
+sp<MediaSource> OMXCodec::Create(const sp<IOMX>&, const sp<MetaData>& meta,
+        bool createEncoder, const sp<MediaSource>& source, const char*, uint32_t flags,
+        const sp<ANativeWindow>& nativeWindow)
+{
+    if (createEncoder)
+        return NULL;
+
+    int32_t openDelayMs;
+    { // scopped lock
+        Mutex::Autolock lock(s_codecLock);
+        openDelayMs = s_config.openDelayMs;
+    }
+    if (openDelayMs > 0)
+        usleep(openDelayMs * 1000);
+
+    Mutex::Autolock lock(s_codecLock);
+    bool hw = !(flags & (kSoftwareCodecsOnly | kPreferSoftwareCodecs));
+    if (hw && (s_config.failHwOpen
+            || (s_config.hwInstances >= 0 && s_counters.liveHw >= s_config.hwInstances))) {
+        if (flags & kHardwareCodecsOnly)
+            return NULL;
+        hw = false;
+    }
+    if (!hw && s_config.failSwOpen)
+        return NULL;
+
+    return new FakeCodec(meta, source, hw, nativeWindow);
+}
+
+bool OMXCodec::findCodecQuirks(const char*, uint32_t* quirks)
+{
+    *quirks = 0;
+    return true;
+}
+
+} // namespace android
+
+namespace fake {
+
+CodecConfig& codecConfig()
+{
+    return s_config;
+}
+
+void resetCodecs()
+{
+    Mutex::Autolock lock(s_codecLock);
+    int32_t live = s_counters.live;
+    int32_t liveHw = s_counters.liveHw;
+    int32_t stalled = s_counters.stalled;
+    s_config = defaultConfig();
+    memset(&s_counters, 0, sizeof(s_counters));
+    s_decodedPts.clear();
+    s_decodedData.clear();
+    s_counters.live = live;
+    s_counters.liveHw = liveHw;
+    s_counters.stalled = stalled;
+}
+
+CodecCounters codecCounters()
+{
+    Mutex::Autolock lock(s_codecLock);
+    return s_counters;
+}
+
+Vector<int64_t> decodedPts()
+{
+    Mutex::Autolock lock(s_codecLock);
+    return s_decodedPts;
+}
+
+Vector<const void*> decodedData()
+{
+    Mutex::Autolock lock(s_codecLock);
+    return s_decodedData;
+}
+
+void releaseStall()
+{
+    Mutex::Autolock lock(s_codecLock);
+    s_stallGeneration++;
+    s_stallCondition.broadcast();
+}
+
+// Window
+
+Window::Window(int32_t bufferCount, int32_t width, int32_t height)
+    : mRefs(0)
+    , mConnected(0)
+    , mNext(0)
+    , mFences(false)
+    , mFencesSignaled(false)
+    , mQueued(0)
+    , mCancelled(0)
+    , mDequeued(0)
+    , mForeignQueued(0)
+    , mLastQueued(-1)
+    , mLastTimestamp(-1)
+{
+    pthread_mutex_init(&mLock, 0);
+    common.incRef = hookIncRef;
+    common.decRef = hookDecRef;
+    dequeueBuffer = hookDequeue;
+    queueBuffer = hookQueue;
+    cancelBuffer = hookCancel;
+    perform = hookPerform;
+
+    mGeometryWidth = width;
+    mGeometryHeight = height;
+    for (int32_t i = 0; i < bufferCount; ++i)
+        mBuffers.push_back(newBuffer(width, height));
+}
+
+Window::~Window()
+{
+    for (size_t i = 0; i < mBuffers.size(); ++i)
+        deleteBuffer(mBuffers[i]);
+    for (size_t i = 0; i < mRetired.size(); ++i)
+        deleteBuffer(mRetired[i]);
+    pthread_mutex_destroy(&mLock);
+}
+
+Window::Buffer* Window::newBuffer(int32_t width, int32_t height)
+{
+    Buffer* buffer = new Buffer;
+    int32_t stride = (width + 15) & ~15;
+    buffer->storage.resize(stride * height * 2 + 4096);
+    memset(&buffer->handle, 0, sizeof(buffer->handle));
+    buffer->handle.base = &buffer->storage[0];
+    buffer->anb.width = width;
+    buffer->anb.height = height;
+    buffer->anb.stride = stride;
+    buffer->anb.format = HAL_PIXEL_FORMAT_YV12;
+    buffer->anb.handle = &buffer->handle;
+    buffer->fenceWriteFd = -1;
+    return buffer;
+}
+
+void Window::deleteBuffer(Buffer* buffer)
+{
+    if (buffer->fenceWriteFd >= 0)
+        close(buffer->fenceWriteFd);
+    delete buffer;
+}
+
+void Window::setFences(bool enable)
+{
+    pthread_mutex_lock(&mLock);
+    mFences = enable;
+    pthread_mutex_unlock(&mLock);
+}
+
+void Window::setFencesSignaled(bool signaled)
+{
+    pthread_mutex_lock(&mLock);
+    mFencesSignaled = signaled;
+    pthread_mutex_unlock(&mLock);
+}
+
+void Window::signalFence(int32_t buffer)
+{
+    pthread_mutex_lock(&mLock);
+    if (buffer >= 0 && buffer < (int32_t)mBuffers.size() && mBuffers[buffer]->fenceWriteFd >= 0) {
+        char signal = 1;
+        if (write(mBuffers[buffer]->fenceWriteFd, &signal, 1) != 1)
+            fprintf(stderr, "fence write failed: %s\n", strerror(errno));
+        close(mBuffers[buffer]->fenceWriteFd);
+        mBuffers[buffer]->fenceWriteFd = -1;
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+#define WINDOW_GETTER(_type_, _name_, _member_) \
+    _type_ Window::_name_() const \
+    { \
+        pthread_mutex_lock(&mLock); \
+        _type_ result = _member_; \
+        pthread_mutex_unlock(&mLock); \
+        return result; \
+    }
+
+WINDOW_GETTER(int32_t, refs, mRefs)
+WINDOW_GETTER(int32_t, connected, mConnected)
+WINDOW_GETTER(int32_t, queued, mQueued)
+WINDOW_GETTER(int32_t, cancelled, mCancelled)
+WINDOW_GETTER(int32_t, dequeued, mDequeued)
+WINDOW_GETTER(int32_t, foreignQueued, mForeignQueued)
+WINDOW_GETTER(int64_t, lastTimestamp, mLastTimestamp)
+WINDOW_GETTER(int32_t, lastQueued, mLastQueued)
+
+#undef WINDOW_GETTER
+
+const uint8_t* Window::bufferData(int32_t buffer) const
+{
+    return &mBuffers[buffer]->storage[0];
+}
+
+int32_t Window::indexOf(const ANativeWindowBuffer* buffer) const
+{
+    for (size_t i = 0; i < mBuffers.size(); ++i) {
+        if (buffer->handle == &mBuffers[i]->handle)
+            return i;
+    }
+    return -1;
+}
+
+void Window::hookIncRef(android_native_base_t* base)
+{
+    Window* window = static_cast<Window*>(reinterpret_cast<ANativeWindow*>(base));
+    __sync_fetch_and_add(&window->mRefs, 1);
+}
+
+void Window::hookDecRef(android_native_base_t* base)
+{
+    Window* window = static_cast<Window*>(reinterpret_cast<ANativeWindow*>(base));
+    CHECK(__sync_fetch_and_sub(&window->mRefs, 1) > 0);
+}
+
+#if defined(ANDROID_ICS)
+int Window::hookDequeue(ANativeWindow* anw, ANativeWindowBuffer** out)
+{
+    int unused = -1;
+    int* fenceFd = &unused;
+#else
+int Window::hookDequeue(ANativeWindow* anw, ANativeWindowBuffer** out, int* fenceFd)
+{
+#endif
+    Window* window = static_cast<Window*>(anw);
+    pthread_mutex_lock(&window->mLock);
+    Buffer* buffer = window->mBuffers[window->mNext];
+    window->mNext = (window->mNext + 1) % window->mBuffers.size();
+    window->mDequeued++;
+
+    *fenceFd = -1;
+    if (window->mFences) {
+        if (buffer->fenceWriteFd >= 0) {
+            // the previous consumer read of this buffer never completed
+            close(buffer->fenceWriteFd);
+            buffer->fenceWriteFd = -1;
+        }
+        int fds[2];
+        if (pipe(fds) == 0) {
+            fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+            if (window->mFencesSignaled) {
+                char signal = 1;
+                if (write(fds[1], &signal, 1) != 1)
+                    fprintf(stderr, "fence write failed: %s\n", strerror(errno));
+                close(fds[1]);
+            } else {
+                buffer->fenceWriteFd = fds[1];
+            }
+            *fenceFd = fds[0];
+        }
+    }
+    *out = &buffer->anb;
+    pthread_mutex_unlock(&window->mLock);
+#if defined(ANDROID_ICS)
+    if (unused >= 0)
+        close(unused);
+#endif
+    return 0;
+}
+
+#if defined(ANDROID_ICS)
+int Window::hookQueue(ANativeWindow* anw, ANativeWindowBuffer* buffer)
+{
+    int fenceFd = -1;
+#else
+int Window::hookQueue(ANativeWindow* anw, ANativeWindowBuffer* buffer, int fenceFd)
+{
+#endif
+    Window* window = static_cast<Window*>(anw);
+    pthread_mutex_lock(&window->mLock);
+    int32_t index = window->indexOf(buffer);
+    if (index < 0) {
+        window->mForeignQueued++;
+    } else {
+        window->mQueued++;
+        window->mLastQueued = index;
+    }
+    pthread_mutex_unlock(&window->mLock);
+    if (fenceFd >= 0)
+        close(fenceFd);
+    return 0;
+}
+
+#if defined(ANDROID_ICS)
+int Window::hookCancel(ANativeWindow* anw, ANativeWindowBuffer*)
+{
+    int fenceFd = -1;
+#else
+int Window::hookCancel(ANativeWindow* anw, ANativeWindowBuffer*, int fenceFd)
+{
+#endif
+    Window* window = static_cast<Window*>(anw);
+    pthread_mutex_lock(&window->mLock);
+    window->mCancelled++;
+    pthread_mutex_unlock(&window->mLock);
+    if (fenceFd >= 0)
+        close(fenceFd);
+    return 0;
+}
+
+int Window::hookPerform(ANativeWindow* anw, int operation, ...)
+{
+    Window* window = static_cast<Window*>(anw);
+    int result = 0;
+    va_list args;
+    va_start(args, operation);
+    pthread_mutex_lock(&window->mLock);
+    switch (operation) {
+    case NATIVE_WINDOW_API_CONNECT:
+        va_arg(args, int);
+        if (window->mConnected)
+            result = -EINVAL;
+        else
+            window->mConnected = 1;
+        break;
+    case NATIVE_WINDOW_API_DISCONNECT:
+        va_arg(args, int);
+        if (!window->mConnected)
+            result = -EINVAL;
+        window->mConnected = 0;
+        break;
+    case NATIVE_WINDOW_SET_BUFFERS_TIMESTAMP:
+        window->mLastTimestamp = va_arg(args, int64_t);
+        break;
+    case NATIVE_WINDOW_SET_BUFFERS_GEOMETRY: {
+        int width = va_arg(args, int);
+        int height = va_arg(args, int);
+        va_arg(args, int);
+        if (width > 0 && height > 0
+                && (width != window->mGeometryWidth || height != window->mGeometryHeight)) {
+            // reallocated, the old handles stay valid for stale wrappers
+            window->mGeometryWidth = width;
+            window->mGeometryHeight = height;
+            for (size_t i = 0; i < window->mBuffers.size(); ++i) {
+                window->mRetired.push_back(window->mBuffers[i]);
+                window->mBuffers[i] = newBuffer(width, height);
+            }
+        }
+        break;
+    }
+    default:
+        va_arg(args, int);
+        break;
+    }
+    pthread_mutex_unlock(&window->mLock);
+    va_end(args);
+    return result;
+}
+
+} // namespace fake
@@ -0,0 +1,1144 @@
+/*****************************************************************************
+ * android_shim.h: Host stand-ins for the Android framework used by
+ * StagefrightDecoder.cpp, with the same behaviour for the parts it relies on
+ * (reference counting, threads, media buffers) and a fake OMX backend.
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#ifndef STAGEFRIGHT_HOST_ANDROID_SHIM_H
+#define STAGEFRIGHT_HOST_ANDROID_SHIM_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// android/log.h
+enum {
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+};
+extern "C" int __android_log_print(int prio, const char* tag, const char* fmt, ...);
+
+// cutils/properties.h
+#define PROPERTY_VALUE_MAX 92
+extern "C" int property_get(const char* key, char* value, const char* defaultValue);
+
+// media/stagefright/MediaDebug.h
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            abort(); \
+        } \
+    } while (0)
+#define CHECK_EQ(x, y) CHECK((x) == (y))
+
+// OMX_Component.h
+typedef uint32_t OMX_U32;
+enum {
+    OMX_COLOR_FormatUnused = 0,
+    OMX_COLOR_FormatYUV420Planar = 0x13,
+    OMX_COLOR_FormatYUV420SemiPlanar = 0x15,
+    OMX_COLOR_FormatYCbYCr = 0x19,
+    OMX_COLOR_FormatCbYCrY = 0x1B,
+    OMX_TI_COLOR_FormatYUV420PackedSemiPlanar = 0x7F000100,
+    OMX_QCOM_COLOR_FormatYVU420SemiPlanar = 0x7FA30C00,
+};
+#define OMX_BUFFERFLAG_EOS          0x00000001
+#define OMX_BUFFERFLAG_STARTTIME    0x00000002
+#define OMX_BUFFERFLAG_DECODEONLY   0x00000004
+#define OMX_BUFFERFLAG_DATACORRUPT  0x00000008
+#define OMX_BUFFERFLAG_ENDOFFRAME   0x00000010
+#define OMX_BUFFERFLAG_SYNCFRAME    0x00000020
+#define OMX_BUFFERFLAG_EXTRADATA    0x00000040
+#define OMX_BUFFERFLAG_CODECCONFIG  0x00000080
+
+// system/graphics.h, hardware/gralloc.h
+#define HAL_PIXEL_FORMAT_YV12 0x32315659
+#define GRALLOC_USAGE_SW_READ_NEVER 0x00000000
+#define GRALLOC_USAGE_SW_WRITE_OFTEN 0x00000030
+#define GRALLOC_USAGE_HW_TEXTURE 0x00000100
+#define GRALLOC_USAGE_EXTERNAL_DISP 0x00002000
+#define HAL_TRANSFORM_FLIP_H 0x01
+#define HAL_TRANSFORM_FLIP_V 0x02
+#define HAL_TRANSFORM_ROT_90 0x04
+#define HAL_TRANSFORM_ROT_180 0x03
+#define HAL_TRANSFORM_ROT_270 0x07
+
+// cutils/native_handle.h, the gralloc handle maps straight to host memory
+typedef struct native_handle {
+    int version;
+    int numFds;
+    int numInts;
+    void* base; // host only, what lock() returns
+} native_handle_t;
+typedef const native_handle_t* buffer_handle_t;
+
+// system/window.h
+typedef struct android_native_base_t {
+    int magic;
+    int version;
+    void* reserved[4];
+    void (*incRef)(struct android_native_base_t* base);
+    void (*decRef)(struct android_native_base_t* base);
+} android_native_base_t;
+
+typedef struct ANativeWindowBuffer {
+    ANativeWindowBuffer() { memset(this, 0, sizeof(*this)); }
+
+    android_native_base_t common;
+    int width;
+    int height;
+    int stride;
+    int format;
+    int usage;
+    void* reserved[2];
+    buffer_handle_t handle;
+    void* reserved_proc[8];
+} ANativeWindowBuffer_t;
+
+enum {
+    NATIVE_WINDOW_SET_USAGE = 0,
+    NATIVE_WINDOW_CONNECT,
+    NATIVE_WINDOW_DISCONNECT,
+    NATIVE_WINDOW_SET_BUFFERS_GEOMETRY,
+    NATIVE_WINDOW_SET_BUFFERS_TRANSFORM,
+    NATIVE_WINDOW_SET_BUFFERS_TIMESTAMP,
+    NATIVE_WINDOW_SET_SCALING_MODE,
+    NATIVE_WINDOW_API_CONNECT,
+    NATIVE_WINDOW_API_DISCONNECT,
+};
+#define NATIVE_WINDOW_API_MEDIA 3
+#define NATIVE_WINDOW_SCALING_MODE_SCALE_TO_WINDOW 1
+
+struct ANativeWindow {
+    ANativeWindow() { memset(&common, 0, sizeof(common)); }
+
+    void incStrong(const void*) const { common.incRef(const_cast<android_native_base_t*>(&common)); }
+    void decStrong(const void*) const { common.decRef(const_cast<android_native_base_t*>(&common)); }
+
+    android_native_base_t common;
+#if defined(ANDROID_ICS)
+    int (*dequeueBuffer)(ANativeWindow* window, ANativeWindowBuffer** buffer);
+    int (*queueBuffer)(ANativeWindow* window, ANativeWindowBuffer* buffer);
+    int (*cancelBuffer)(ANativeWindow* window, ANativeWindowBuffer* buffer);
+#else
+    int (*dequeueBuffer)(ANativeWindow* window, ANativeWindowBuffer** buffer, int* fenceFd);
+    int (*queueBuffer)(ANativeWindow* window, ANativeWindowBuffer* buffer, int fenceFd);
+    int (*cancelBuffer)(ANativeWindow* window, ANativeWindowBuffer* buffer, int fenceFd);
+#endif
+    int (*perform)(ANativeWindow* window, int operation, ...);
+};
+
+static inline int native_window_api_connect(ANativeWindow* window, int api)
+{
+    return window->perform(window, NATIVE_WINDOW_API_CONNECT, api);
+}
+static inline int native_window_api_disconnect(ANativeWindow* window, int api)
+{
+    return window->perform(window, NATIVE_WINDOW_API_DISCONNECT, api);
+}
+static inline int native_window_set_usage(ANativeWindow* window, int usage)
+{
+    return window->perform(window, NATIVE_WINDOW_SET_USAGE, usage);
+}
+static inline int native_window_set_scaling_mode(ANativeWindow* window, int mode)
+{
+    return window->perform(window, NATIVE_WINDOW_SET_SCALING_MODE, mode);
+}
+static inline int native_window_set_buffers_geometry(ANativeWindow* window, int w, int h, int format)
+{
+    return window->perform(window, NATIVE_WINDOW_SET_BUFFERS_GEOMETRY, w, h, format);
+}
+static inline int native_window_set_buffers_transform(ANativeWindow* window, int transform)
+{
+    return window->perform(window, NATIVE_WINDOW_SET_BUFFERS_TRANSFORM, transform);
+}
+static inline int native_window_set_buffers_timestamp(ANativeWindow* window, int64_t timestamp)
+{
+    return window->perform(window, NATIVE_WINDOW_SET_BUFFERS_TIMESTAMP, timestamp);
+}
+
+namespace android {
+
+// utils/Errors.h
+typedef int32_t status_t;
+enum {
+    OK = 0,
+    NO_ERROR = 0,
+    UNKNOWN_ERROR = (-2147483647 - 1),
+    NO_MEMORY = -ENOMEM,
+    INVALID_OPERATION = -ENOSYS,
+    BAD_VALUE = -EINVAL,
+    NAME_NOT_FOUND = -ENOENT,
+    ALREADY_EXISTS = -EEXIST,
+    DEAD_OBJECT = -EPIPE,
+    WOULD_BLOCK = -EWOULDBLOCK,
+    TIMED_OUT = -ETIMEDOUT,
+};
+
+// media/stagefright/MediaErrors.h
+enum {
+    MEDIA_ERROR_BASE = -1000,
+    ERROR_ALREADY_CONNECTED = MEDIA_ERROR_BASE,
+    ERROR_NOT_CONNECTED = MEDIA_ERROR_BASE - 1,
+    ERROR_UNKNOWN_HOST = MEDIA_ERROR_BASE - 2,
+    ERROR_CANNOT_CONNECT = MEDIA_ERROR_BASE - 3,
+    ERROR_IO = MEDIA_ERROR_BASE - 4,
+    ERROR_CONNECTION_LOST = MEDIA_ERROR_BASE - 5,
+    ERROR_MALFORMED = MEDIA_ERROR_BASE - 7,
+    ERROR_OUT_OF_RANGE = MEDIA_ERROR_BASE - 8,
+    ERROR_BUFFER_TOO_SMALL = MEDIA_ERROR_BASE - 9,
+    ERROR_UNSUPPORTED = MEDIA_ERROR_BASE - 10,
+    ERROR_END_OF_STREAM = MEDIA_ERROR_BASE - 11,
+    INFO_FORMAT_CHANGED = MEDIA_ERROR_BASE - 12,
+    INFO_DISCONTINUITY = MEDIA_ERROR_BASE - 13,
+};
+
+// utils/ThreadDefs.h
+enum {
+    ANDROID_PRIORITY_LOWEST = 19,
+    ANDROID_PRIORITY_BACKGROUND = 10,
+    ANDROID_PRIORITY_NORMAL = 0,
+    ANDROID_PRIORITY_FOREGROUND = -2,
+    ANDROID_PRIORITY_DISPLAY = -4,
+    ANDROID_PRIORITY_URGENT_DISPLAY = -8,
+    ANDROID_PRIORITY_AUDIO = -16,
+    ANDROID_PRIORITY_URGENT_AUDIO = -19,
+    ANDROID_PRIORITY_HIGHEST = -20,
+    ANDROID_PRIORITY_DEFAULT = ANDROID_PRIORITY_NORMAL,
+    ANDROID_PRIORITY_MORE_FAVORABLE = -1,
+    ANDROID_PRIORITY_LESS_FAVORABLE = +1,
+};
+
+typedef int64_t nsecs_t;
+enum { SYSTEM_TIME_REALTIME = 0, SYSTEM_TIME_MONOTONIC = 1 };
+nsecs_t systemTime(int clock = SYSTEM_TIME_MONOTONIC);
+int androidSetThreadPriority(pid_t tid, int priority);
+
+// utils/RefBase.h, strong and weak counts as on the device
+class RefBase {
+public:
+    void incStrong(const void* id) const;
+    void decStrong(const void* id) const;
+    int32_t getStrongCount() const;
+
+    class weakref_type {
+    public:
+        RefBase* refBase() const;
+        void incWeak(const void* id);
+        void decWeak(const void* id);
+        bool attemptIncStrong(const void* id);
+    };
+
+    weakref_type* createWeak(const void* id) const;
+    weakref_type* getWeakRefs() const;
+
+protected:
+    RefBase();
+    virtual ~RefBase();
+
+    virtual void onFirstRef() {}
+    virtual void onLastStrongRef(const void*) {}
+
+private:
+    friend class weakref_type;
+    class weakref_impl;
+
+    RefBase(const RefBase&);
+    RefBase& operator=(const RefBase&);
+
+    weakref_impl* const mRefs;
+};
+
+template<class T>
+class LightRefBase {
+public:
+    LightRefBase() : mCount(0) {}
+    void incStrong(const void*) const { __sync_fetch_and_add(&mCount, 1); }
+    void decStrong(const void*) const
+    {
+        if (__sync_fetch_and_sub(&mCount, 1) == 1)
+            delete static_cast<const T*>(this);
+    }
+    int32_t getStrongCount() const { return mCount; }
+
+protected:
+    ~LightRefBase() {}
+
+private:
+    mutable volatile int32_t mCount;
+};
+
+template<typename T> class wp;
+
+template<typename T>
+class sp {
+public:
+    sp() : m_ptr(0) {}
+    sp(T* other) : m_ptr(other) { if (other) other->incStrong(this); }
+    sp(const sp<T>& other) : m_ptr(other.m_ptr) { if (m_ptr) m_ptr->incStrong(this); }
+    template<typename U> sp(U* other) : m_ptr(other) { if (m_ptr) m_ptr->incStrong(this); }
+    template<typename U> sp(const sp<U>& other) : m_ptr(other.m_ptr) { if (m_ptr) m_ptr->incStrong(this); }
+    ~sp() { if (m_ptr) m_ptr->decStrong(this); }
+
+    sp& operator=(const sp<T>& other)
+    {
+        T* otherPtr(other.m_ptr);
+        if (otherPtr) otherPtr->incStrong(this);
+        if (m_ptr) m_ptr->decStrong(this);
+        m_ptr = otherPtr;
+        return *this;
+    }
+    sp& operator=(T* other)
+    {
+        if (other) other->incStrong(this);
+        if (m_ptr) m_ptr->decStrong(this);
+        m_ptr = other;
+        return *this;
+    }
+    template<typename U> sp& operator=(const sp<U>& other)
+    {
+        T* otherPtr(other.m_ptr);
+        if (otherPtr) otherPtr->incStrong(this);
+        if (m_ptr) m_ptr->decStrong(this);
+        m_ptr = otherPtr;
+        return *this;
+    }
+    template<typename U> sp& operator=(U* other)
+    {
+        T* otherPtr(other);
+        if (otherPtr) otherPtr->incStrong(this);
+        if (m_ptr) m_ptr->decStrong(this);
+        m_ptr = otherPtr;
+        return *this;
+    }
+
+    void clear()
+    {
+        if (m_ptr) {
+            m_ptr->decStrong(this);
+            m_ptr = 0;
+        }
+    }
+
+    T& operator*() const { return *m_ptr; }
+    T* operator->() const { return m_ptr; }
+    T* get() const { return m_ptr; }
+
+#define SP_COMPARE(_op_) \
+    bool operator _op_ (const sp<T>& o) const { return m_ptr _op_ o.m_ptr; } \
+    bool operator _op_ (const T* o) const { return m_ptr _op_ o; } \
+    template<typename U> bool operator _op_ (const sp<U>& o) const { return m_ptr _op_ o.m_ptr; } \
+    template<typename U> bool operator _op_ (const U* o) const { return m_ptr _op_ o; } \
+    bool operator _op_ (const wp<T>& o) const { return m_ptr _op_ o.m_ptr; }
+    SP_COMPARE(==)
+    SP_COMPARE(!=)
+    SP_COMPARE(<)
+    SP_COMPARE(>)
+#undef SP_COMPARE
+
+private:
+    template<typename Y> friend class sp;
+    template<typename Y> friend class wp;
+    void set_pointer(T* ptr) { m_ptr = ptr; }
+    T* m_ptr;
+};
+
+template<typename T>
+class wp {
+public:
+    typedef typename RefBase::weakref_type weakref_type;
+
+    wp() : m_ptr(0), m_refs(0) {}
+    wp(T* other) : m_ptr(other), m_refs(other ? other->createWeak(this) : 0) {}
+    wp(const wp<T>& other) : m_ptr(other.m_ptr), m_refs(other.m_refs) { if (m_ptr) m_refs->incWeak(this); }
+    wp(const sp<T>& other) : m_ptr(other.m_ptr), m_refs(m_ptr ? m_ptr->createWeak(this) : 0) {}
+    ~wp() { if (m_ptr) m_refs->decWeak(this); }
+
+    wp& operator=(T* other)
+    {
+        weakref_type* newRefs = other ? other->createWeak(this) : 0;
+        if (m_ptr) m_refs->decWeak(this);
+        m_ptr = other;
+        m_refs = newRefs;
+        return *this;
+    }
+    wp& operator=(const wp<T>& other)
+    {
+        weakref_type* otherRefs(other.m_refs);
+        T* otherPtr(other.m_ptr);
+        if (otherPtr) otherRefs->incWeak(this);
+        if (m_ptr) m_refs->decWeak(this);
+        m_ptr = otherPtr;
+        m_refs = otherRefs;
+        return *this;
+    }
+    wp& operator=(const sp<T>& other)
+    {
+        weakref_type* newRefs = other != 0 ? other->createWeak(this) : 0;
+        T* otherPtr(other.m_ptr);
+        if (m_ptr) m_refs->decWeak(this);
+        m_ptr = otherPtr;
+        m_refs = newRefs;
+        return *this;
+    }
+
+    sp<T> promote() const
+    {
+        sp<T> result;
+        if (m_ptr && m_refs->attemptIncStrong(&result))
+            result.set_pointer(m_ptr);
+        return result;
+    }
+
+    void clear()
+    {
+        if (m_ptr) {
+            m_refs->decWeak(this);
+            m_ptr = 0;
+        }
+    }
+
+    T* unsafe_get() const { return m_ptr; }
+
+    bool operator==(const wp<T>& o) const { return m_ptr == o.m_ptr; }
+    bool operator!=(const wp<T>& o) const { return m_ptr != o.m_ptr; }
+    bool operator==(const T* o) const { return m_ptr == o; }
+    bool operator!=(const T* o) const { return m_ptr != o; }
+
+private:
+    template<typename Y> friend class sp;
+    template<typename Y> friend class wp;
+    T* m_ptr;
+    weakref_type* m_refs;
+};
+
+// utils/Vector.h
+template<class T>
+class Vector {
+public:
+    typedef T value_type;
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    Vector() {}
+
+    size_t size() const { return mItems.size(); }
+    bool isEmpty() const { return mItems.empty(); }
+    bool empty() const { return mItems.empty(); }
+    size_t capacity() const { return mItems.capacity(); }
+    ssize_t setCapacity(size_t size) { mItems.reserve(size); return mItems.capacity(); }
+    ssize_t resize(size_t size) { mItems.resize(size); return size; }
+    void clear() { mItems.clear(); }
+
+    const T* array() const { return mItems.empty() ? 0 : &mItems[0]; }
+    T* editArray() { return mItems.empty() ? 0 : &mItems[0]; }
+    const T& operator[](size_t index) const { return mItems[index]; }
+    const T& itemAt(size_t index) const { return mItems[index]; }
+    T& editItemAt(size_t index) { return mItems[index]; }
+    const T& top() const { return mItems.back(); }
+    T& editTop() { return mItems.back(); }
+
+    ssize_t insertAt(const T& item, size_t index, size_t numItems = 1)
+    {
+        mItems.insert(mItems.begin() + index, numItems, item);
+        return index;
+    }
+    ssize_t insertAt(size_t index, size_t numItems = 1) { return insertAt(T(), index, numItems); }
+    ssize_t replaceAt(const T& item, size_t index) { mItems[index] = item; return index; }
+    ssize_t add(const T& item) { mItems.push_back(item); return mItems.size() - 1; }
+    ssize_t push(const T& item) { return add(item); }
+    void push_back(const T& item) { mItems.push_back(item); }
+    void push_front(const T& item) { mItems.insert(mItems.begin(), item); }
+    void pop() { if (!mItems.empty()) mItems.pop_back(); }
+    ssize_t appendVector(const Vector<T>& other)
+    {
+        mItems.insert(mItems.end(), other.mItems.begin(), other.mItems.end());
+        return mItems.size();
+    }
+    ssize_t appendArray(const T* array, size_t length)
+    {
+        mItems.insert(mItems.end(), array, array + length);
+        return mItems.size();
+    }
+    ssize_t removeItemsAt(size_t index, size_t count = 1)
+    {
+        mItems.erase(mItems.begin() + index, mItems.begin() + index + count);
+        return index;
+    }
+    ssize_t removeAt(size_t index) { return removeItemsAt(index); }
+
+    iterator begin() { return editArray(); }
+    iterator end() { return editArray() + size(); }
+    const_iterator begin() const { return array(); }
+    const_iterator end() const { return array() + size(); }
+    iterator erase(iterator pos)
+    {
+        ssize_t index = removeItemsAt(pos - array());
+        return begin() + index;
+    }
+
+private:
+    std::vector<T> mItems;
+};
+
+// utils/KeyedVector.h, sorted by key
+template<typename KEY, typename VALUE>
+class KeyedVector {
+public:
+    KeyedVector() {}
+
+    size_t size() const { return mItems.size(); }
+    bool isEmpty() const { return mItems.empty(); }
+    void clear() { mItems.clear(); }
+    ssize_t setCapacity(size_t size) { mItems.reserve(size); return mItems.capacity(); }
+
+    ssize_t indexOfKey(const KEY& key) const
+    {
+        size_t index = lowerBound(key);
+        if (index < mItems.size() && !(key < mItems[index].first))
+            return index;
+        return NAME_NOT_FOUND;
+    }
+    const VALUE& valueFor(const KEY& key) const { return mItems[indexOfKey(key)].second; }
+    const VALUE& valueAt(size_t index) const { return mItems[index].second; }
+    const KEY& keyAt(size_t index) const { return mItems[index].first; }
+    const VALUE& operator[](size_t index) const { return valueAt(index); }
+    VALUE& editValueFor(const KEY& key) { return mItems[indexOfKey(key)].second; }
+    VALUE& editValueAt(size_t index) { return mItems[index].second; }
+
+    ssize_t add(const KEY& key, const VALUE& value)
+    {
+        size_t index = lowerBound(key);
+        if (index < mItems.size() && !(key < mItems[index].first)) {
+            mItems[index].second = value;
+            return index;
+        }
+        mItems.insert(mItems.begin() + index, std::make_pair(key, value));
+        return index;
+    }
+    ssize_t replaceValueFor(const KEY& key, const VALUE& value) { return add(key, value); }
+    ssize_t replaceValueAt(size_t index, const VALUE& value)
+    {
+        mItems[index].second = value;
+        return index;
+    }
+    ssize_t removeItem(const KEY& key)
+    {
+        ssize_t index = indexOfKey(key);
+        if (index >= 0)
+            mItems.erase(mItems.begin() + index);
+        return index;
+    }
+    ssize_t removeItemsAt(size_t index, size_t count = 1)
+    {
+        mItems.erase(mItems.begin() + index, mItems.begin() + index + count);
+        return index;
+    }
+
+private:
+    size_t lowerBound(const KEY& key) const
+    {
+        size_t lo = 0, hi = mItems.size();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (mItems[mid].first < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    std::vector<std::pair<KEY, VALUE> > mItems;
+};
+
+// utils/List.h
+template<typename T>
+class List {
+public:
+    typedef typename std::list<T>::iterator iterator;
+    typedef typename std::list<T>::const_iterator const_iterator;
+
+    size_t size() const { return mItems.size(); }
+    bool empty() const { return mItems.empty(); }
+    void clear() { mItems.clear(); }
+    void push_back(const T& item) { mItems.push_back(item); }
+    void push_front(const T& item) { mItems.push_front(item); }
+    iterator insert(iterator pos, const T& item) { return mItems.insert(pos, item); }
+    iterator erase(iterator pos) { return mItems.erase(pos); }
+    iterator erase(iterator first, iterator last) { return mItems.erase(first, last); }
+    iterator begin() { return mItems.begin(); }
+    iterator end() { return mItems.end(); }
+    const_iterator begin() const { return mItems.begin(); }
+    const_iterator end() const { return mItems.end(); }
+
+private:
+    std::list<T> mItems;
+};
+
+// utils/String8.h
+class String8 {
+public:
+    String8() {}
+    String8(const char* other) : mString(other ? other : "") {}
+    String8(const char* other, size_t length) : mString(other, length) {}
+
+    const char* string() const { return mString.c_str(); }
+    size_t size() const { return mString.size(); }
+    size_t length() const { return mString.size(); }
+    bool isEmpty() const { return mString.empty(); }
+    operator const char*() const { return mString.c_str(); }
+
+    void setTo(const char* other) { mString = other ? other : ""; }
+    status_t append(const char* other) { mString += other ? other : ""; return OK; }
+    status_t append(const String8& other) { mString += other.mString; return OK; }
+    status_t append(const char* other, size_t length) { mString.append(other, length); return OK; }
+    status_t appendFormat(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    static String8 format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+    String8& operator=(const char* other) { setTo(other); return *this; }
+    bool operator==(const String8& other) const { return mString == other.mString; }
+    bool operator!=(const String8& other) const { return mString != other.mString; }
+    bool operator<(const String8& other) const { return mString < other.mString; }
+
+private:
+    std::string mString;
+};
+
+// utils/Mutex.h, utils/Condition.h
+class Condition;
+
+class Mutex {
+public:
+    Mutex() { pthread_mutex_init(&mMutex, 0); }
+    explicit Mutex(const char*) { pthread_mutex_init(&mMutex, 0); }
+    ~Mutex() { pthread_mutex_destroy(&mMutex); }
+
+    status_t lock() { return -pthread_mutex_lock(&mMutex); }
+    void unlock() { pthread_mutex_unlock(&mMutex); }
+    status_t tryLock() { return -pthread_mutex_trylock(&mMutex); }
+
+    class Autolock {
+    public:
+        inline Autolock(Mutex& mutex) : mLock(mutex) { mLock.lock(); }
+        inline Autolock(Mutex* mutex) : mLock(*mutex) { mLock.lock(); }
+        inline ~Autolock() { mLock.unlock(); }
+    private:
+        Mutex& mLock;
+    };
+
+private:
+    friend class Condition;
+    Mutex(const Mutex&);
+    Mutex& operator=(const Mutex&);
+
+    pthread_mutex_t mMutex;
+};
+typedef Mutex::Autolock AutoMutex;
+
+class Condition {
+public:
+    Condition();
+    ~Condition() { pthread_cond_destroy(&mCond); }
+
+    status_t wait(Mutex& mutex) { return -pthread_cond_wait(&mCond, &mutex.mMutex); }
+    status_t waitRelative(Mutex& mutex, nsecs_t reltime);
+    void signal() { pthread_cond_signal(&mCond); }
+    void broadcast() { pthread_cond_broadcast(&mCond); }
+
+private:
+    Condition(const Condition&);
+    Condition& operator=(const Condition&);
+
+    pthread_cond_t mCond;
+};
+
+// utils/Thread.h, threadLoop() runs until it returns false or exit is requested
+class Thread : virtual public RefBase {
+public:
+    explicit Thread(bool canCallJava = true);
+    virtual ~Thread();
+
+    virtual status_t run(const char* name = 0, int32_t priority = ANDROID_PRIORITY_DEFAULT,
+            size_t stack = 0);
+    virtual void requestExit();
+    virtual status_t readyToRun();
+    status_t requestExitAndWait();
+    status_t join();
+    bool isRunning() const;
+    pid_t getTid() const;
+
+protected:
+    bool exitPending() const;
+
+private:
+    virtual bool threadLoop() = 0;
+    static void* _threadLoop(void* user);
+
+    Thread(const Thread&);
+    Thread& operator=(const Thread&);
+
+    mutable Mutex mLock;
+    Condition mThreadExitedCondition;
+    status_t mStatus;
+    volatile bool mExitPending;
+    volatile bool mRunning;
+    sp<Thread> mHoldSelf;
+    pthread_t mThread;
+    bool mHasThread;
+    pid_t mTid;
+};
+
+// utils/UniquePtr.h
+template<typename T>
+class UniquePtr {
+public:
+    explicit UniquePtr(T* ptr = 0) : mPtr(ptr) {}
+    ~UniquePtr() { reset(); }
+    T& operator*() const { return *mPtr; }
+    T* operator->() const { return mPtr; }
+    T* get() const { return mPtr; }
+    T* release() { T* result = mPtr; mPtr = 0; return result; }
+    void reset(T* ptr = 0) { if (ptr != mPtr) { delete mPtr; mPtr = ptr; } }
+private:
+    UniquePtr(const UniquePtr&);
+    void operator=(const UniquePtr&);
+    T* mPtr;
+};
+
+template<typename T>
+class UniquePtr<T[]> {
+public:
+    explicit UniquePtr(T* ptr = 0) : mPtr(ptr) {}
+    ~UniquePtr() { reset(); }
+    T& operator[](size_t i) const { return mPtr[i]; }
+    T* get() const { return mPtr; }
+    T* release() { T* result = mPtr; mPtr = 0; return result; }
+    void reset(T* ptr = 0) { if (ptr != mPtr) { delete[] mPtr; mPtr = ptr; } }
+private:
+    UniquePtr(const UniquePtr&);
+    void operator=(const UniquePtr&);
+    T* mPtr;
+};
+
+// binder/ProcessState.h
+class ProcessState : public virtual RefBase {
+public:
+    static sp<ProcessState> self();
+    void startThreadPool() {}
+};
+
+// ui/GraphicBuffer.h, wraps a window buffer or allocates host memory
+class GraphicBuffer : public ANativeWindowBuffer, public RefBase {
+public:
+    GraphicBuffer(uint32_t width, uint32_t height, int format, uint32_t usage);
+    GraphicBuffer(ANativeWindowBuffer* buffer, bool keepOwnership);
+
+    status_t initCheck() const { return handle ? OK : NO_MEMORY; }
+    uint32_t getWidth() const { return width; }
+    uint32_t getHeight() const { return height; }
+    uint32_t getStride() const { return stride; }
+    status_t lock(uint32_t usage, void** vaddr);
+    status_t unlock();
+    ANativeWindowBuffer* getNativeBuffer() const;
+
+    // host only, wrappers of window buffers created so far
+    static int32_t wrapperCount();
+
+protected:
+    virtual ~GraphicBuffer();
+
+private:
+    native_handle_t* mOwnedHandle;
+    std::vector<uint8_t> mStorage;
+};
+
+// media/stagefright/MetaData.h
+enum {
+    kKeyMIMEType = 'mime',
+    kKeyWidth = 'widt',
+    kKeyHeight = 'heig',
+    kKeyStride = 'strd',
+    kKeySliceHeight = 'slht',
+    kKeyColorFormat = 'colf',
+    kKeyCropRect = 'crop',
+    kKeyRotation = 'rotA',
+    kKeySampleRate = 'srte',
+    kKeyChannelCount = '#chn',
+    kKeyESDS = 'esds',
+    kKeyAVCC = 'avcc',
+    kKeyHVCC = 'hvcc',
+    kKeyTime = 'time',
+    kKeyDuration = 'dura',
+    kKeyIsSyncFrame = 'sync',
+    kKeyIsCodecConfig = 'conf',
+    kKeyDecoderComponent = 'decC',
+    kKeyRendered = 'rend',
+    kKeyIsADTS = 'adts',
+    kKeyTargetTime = 'tarT',
+};
+
+enum {
+    kTypeESDS = 'esds',
+    kTypeAVCC = 'avcc',
+    kTypeHVCC = 'hvcc',
+};
+
+class MetaData : public RefBase {
+public:
+    MetaData() {}
+    MetaData(const MetaData& other) : RefBase(), mItems(other.mItems) {}
+
+    enum Type {
+        TYPE_NONE = 'none',
+        TYPE_C_STRING = 'cstr',
+        TYPE_INT32 = 'in32',
+        TYPE_INT64 = 'in64',
+        TYPE_RECT = 'rect',
+    };
+
+    void clear() { mItems.clear(); }
+    bool remove(uint32_t key) { return mItems.erase(key) > 0; }
+
+    bool setCString(uint32_t key, const char* value);
+    bool setInt32(uint32_t key, int32_t value);
+    bool setInt64(uint32_t key, int64_t value);
+    bool setRect(uint32_t key, int32_t left, int32_t top, int32_t right, int32_t bottom);
+    bool setData(uint32_t key, uint32_t type, const void* data, size_t size);
+
+    bool findCString(uint32_t key, const char** value);
+    bool findInt32(uint32_t key, int32_t* value);
+    bool findInt64(uint32_t key, int64_t* value);
+    bool findRect(uint32_t key, int32_t* left, int32_t* top, int32_t* right, int32_t* bottom);
+    bool findData(uint32_t key, uint32_t* type, const void** data, size_t* size);
+
+    void dumpToLog() const {}
+
+protected:
+    virtual ~MetaData() {}
+
+private:
+    struct Item {
+        uint32_t type;
+        std::vector<uint8_t> data;
+    };
+    std::map<uint32_t, Item> mItems;
+};
+
+// media/stagefright/MediaDefs.h
+extern const char* MEDIA_MIMETYPE_VIDEO_AVC;
+extern const char* MEDIA_MIMETYPE_VIDEO_HEVC;
+extern const char* MEDIA_MIMETYPE_VIDEO_MPEG4;
+extern const char* MEDIA_MIMETYPE_VIDEO_H263;
+extern const char* MEDIA_MIMETYPE_AUDIO_AAC;
+
+// media/stagefright/MediaBuffer.h
+class MediaBuffer;
+
+class MediaBufferObserver {
+public:
+    MediaBufferObserver() {}
+    virtual ~MediaBufferObserver() {}
+    virtual void signalBufferReturned(MediaBuffer* buffer) = 0;
+};
+
+class MediaBuffer {
+public:
+    MediaBuffer(void* data, size_t size);
+    explicit MediaBuffer(size_t size);
+    explicit MediaBuffer(const sp<GraphicBuffer>& graphicBuffer);
+
+    // decrements the reference count, without an observer it must be 0
+    void release();
+    void add_ref();
+
+    void* data() const { return mData; }
+    size_t size() const { return mSize; }
+    size_t range_offset() const { return mRangeOffset; }
+    size_t range_length() const { return mRangeLength; }
+    void set_range(size_t offset, size_t length);
+    sp<GraphicBuffer> graphicBuffer() const { return mGraphicBuffer; }
+    sp<MetaData> meta_data() { return mMetaData; }
+    void setObserver(MediaBufferObserver* observer) { mObserver = observer; }
+    int refcount() const { return mRefCount; }
+
+    // host only, buffers alive in the process
+    static int32_t liveCount();
+
+protected:
+    virtual ~MediaBuffer();
+
+private:
+    MediaBuffer(const MediaBuffer&);
+    MediaBuffer& operator=(const MediaBuffer&);
+
+    MediaBufferObserver* mObserver;
+    volatile int32_t mRefCount;
+    void* mData;
+    size_t mSize, mRangeOffset, mRangeLength;
+    bool mOwnsData;
+    sp<GraphicBuffer> mGraphicBuffer;
+    sp<MetaData> mMetaData;
+};
+
+// media/stagefright/MediaBufferGroup.h
+class MediaBufferGroup : public MediaBufferObserver {
+public:
+    MediaBufferGroup() {}
+    ~MediaBufferGroup();
+
+    void add_buffer(MediaBuffer* buffer);
+    // blocks until one of the buffers is free
+    status_t acquire_buffer(MediaBuffer** buffer);
+
+protected:
+    virtual void signalBufferReturned(MediaBuffer* buffer);
+
+private:
+    std::vector<MediaBuffer*> mBuffers;
+    Mutex mLock;
+    Condition mCondition;
+};
+
+// media/stagefright/MediaSource.h
+struct MediaSource : public virtual RefBase {
+    MediaSource() {}
+
+    virtual status_t start(MetaData* params = NULL) = 0;
+    virtual status_t stop() = 0;
+    virtual sp<MetaData> getFormat() = 0;
+
+    struct ReadOptions {
+        enum SeekMode {
+            SEEK_PREVIOUS_SYNC,
+            SEEK_NEXT_SYNC,
+            SEEK_CLOSEST_SYNC,
+            SEEK_CLOSEST,
+        };
+
+        ReadOptions() { reset(); }
+        void reset() { mOptions = 0; mSeekTimeUs = 0; mLatenessUs = 0; mSeekMode = SEEK_CLOSEST_SYNC; }
+        void setSeekTo(int64_t timeUs, SeekMode mode = SEEK_CLOSEST_SYNC)
+        {
+            mOptions |= kSeekTo_Option;
+            mSeekTimeUs = timeUs;
+            mSeekMode = mode;
+        }
+        void clearSeekTo() { mOptions &= ~kSeekTo_Option; mSeekTimeUs = 0; mSeekMode = SEEK_CLOSEST_SYNC; }
+        bool getSeekTo(int64_t* timeUs, SeekMode* mode) const
+        {
+            *timeUs = mSeekTimeUs;
+            *mode = mSeekMode;
+            return (mOptions & kSeekTo_Option) != 0;
+        }
+        void setLateBy(int64_t lateness_us) { mLatenessUs = lateness_us; }
+        int64_t getLateBy() const { return mLatenessUs; }
+
+    private:
+        enum Options { kSeekTo_Option = 1 };
+        uint32_t mOptions;
+        int64_t mSeekTimeUs;
+        SeekMode mSeekMode;
+        int64_t mLatenessUs;
+    };
+
+    virtual status_t read(MediaBuffer** buffer, const ReadOptions* options = NULL) = 0;
+    virtual status_t pause() { return ERROR_UNSUPPORTED; }
+
+protected:
+    virtual ~MediaSource() {}
+
+private:
+    MediaSource(const MediaSource&);
+    MediaSource& operator=(const MediaSource&);
+};
+
+// media/IOMX.h, media/stagefright/OMXClient.h, media/stagefright/OMXCodec.h
+class IOMX : public virtual RefBase {
+};
+
+class OMXClient {
+public:
+    OMXClient() {}
+    status_t connect();
+    void disconnect();
+    sp<IOMX> interface() { return mOMX; }
+
+private:
+    sp<IOMX> mOMX;
+};
+
+struct CodecProfileLevel {
+    OMX_U32 mProfile;
+    OMX_U32 mLevel;
+};
+
+struct CodecCapabilities {
+    String8 mComponentName;
+    Vector<CodecProfileLevel> mProfileLevels;
+    Vector<OMX_U32> mColorFormats;
+};
+
+status_t QueryCodecs(const sp<IOMX>& omx, const char* mimeType, bool queryDecoders,
+        bool hwCodecOnly, Vector<CodecCapabilities>* results);
+status_t QueryCodecs(const sp<IOMX>& omx, const char* mimeType, bool queryDecoders,
+        Vector<CodecCapabilities>* results);
+
+struct OMXCodec : public MediaSource {
+    enum CreationFlags {
+        kPreferSoftwareCodecs = 1,
+        kIgnoreCodecSpecificData = 2,
+        kClientNeedsFramebuffer = 4,
+        kHardwareCodecsOnly = 8,
+        kStoreMetaDataInVideoBuffers = 16,
+        kOnlySubmitOneInputBufferAtOneTime = 32,
+        kEnableGrallocUsageProtected = 128,
+        kSoftwareCodecsOnly = 512,
+    };
+
+    static sp<MediaSource> Create(const sp<IOMX>& omx, const sp<MetaData>& meta,
+            bool createEncoder, const sp<MediaSource>& source,
+            const char* matchComponentName = NULL, uint32_t flags = 0,
+            const sp<ANativeWindow>& nativeWindow = NULL);
+    static bool findCodecQuirks(const char* componentName, uint32_t* quirks);
+};
+
+} // namespace android
+
+// The fake OMX backend and window, configured by the tests
+namespace fake {
+
+using android::status_t;
+
+struct CodecConfig {
+    int32_t openDelayMs;      // spent in OMXCodec::Create(), like allocating a component
+    int32_t stopDelayMs;      // spent in stop(), like freeing the component's buffers
+    int32_t decodeUs;         // spent per frame in read()
+    int32_t hwInstances;      // HW components that can exist at once, -1 for no limit
+    bool failHwOpen;
+    bool failSwOpen;
+    bool failConnect;         // OMXClient::connect()
+    int32_t outputBuffers;    // per component, read() waits for one to come back
+    int32_t stallAfter;       // outputs before read() wedges until releaseStall(), -1 never
+    int32_t errorAfter;       // outputs before read() fails errorCount times, -1 never
+    int32_t errorCount;
+    status_t errorStatus;
+    bool hwErrorsOnly;        // only HW components fail
+};
+
+struct CodecCounters {
+    int32_t creates;
+    int32_t hwCreates;
+    int32_t swCreates;
+    int32_t starts;
+    int32_t stops;
+    int32_t live;             // components created and not destroyed
+    int32_t liveHw;
+    int32_t outputs;
+    int32_t queries;          // QueryCodecs() calls
+    int32_t stalled;          // read() calls wedged right now
+};
+
+// Defaults: no delays, no limits, no failures, 8 output buffers
+CodecConfig& codecConfig();
+void resetCodecs();
+CodecCounters codecCounters();
+// pts of the access units the components took, in decode order
+android::Vector<int64_t> decodedPts();
+// where the data of those access units was, only compared, never read
+android::Vector<const void*> decodedData();
+// Unblocks every wedged read(), it returns ETIMEDOUT like OMXCodec
+void releaseStall();
+
+// A window with a fixed set of buffers in host memory, each dequeue can hand
+// out a pipe read end as release fence that signalFence() completes
+class Window : public ANativeWindow {
+public:
+    explicit Window(int32_t bufferCount = 4, int32_t width = 320, int32_t height = 240);
+    ~Window();
+
+    void setFences(bool enable);
+    // signals the release fence of the most recently dequeued copy of a buffer
+    void signalFence(int32_t buffer);
+    // fence of every later dequeue signals at once
+    void setFencesSignaled(bool signaled);
+
+    int32_t refs() const;
+    int32_t connected() const;
+    int32_t queued() const;
+    int32_t cancelled() const;
+    int32_t dequeued() const;
+    int32_t foreignQueued() const; // buffers not dequeued from here, e.g. codec output
+    int64_t lastTimestamp() const;
+    int32_t bufferCount() const { return (int32_t)mBuffers.size(); }
+    const uint8_t* bufferData(int32_t buffer) const;
+    int32_t lastQueued() const;
+
+private:
+    static void hookIncRef(android_native_base_t* base);
+    static void hookDecRef(android_native_base_t* base);
+#if defined(ANDROID_ICS)
+    static int hookDequeue(ANativeWindow* window, ANativeWindowBuffer** buffer);
+    static int hookQueue(ANativeWindow* window, ANativeWindowBuffer* buffer);
+    static int hookCancel(ANativeWindow* window, ANativeWindowBuffer* buffer);
+#else
+    static int hookDequeue(ANativeWindow* window, ANativeWindowBuffer** buffer, int* fenceFd);
+    static int hookQueue(ANativeWindow* window, ANativeWindowBuffer* buffer, int fenceFd);
+    static int hookCancel(ANativeWindow* window, ANativeWindowBuffer* buffer, int fenceFd);
+#endif
+    static int hookPerform(ANativeWindow* window, int operation, ...);
+
+    int32_t indexOf(const ANativeWindowBuffer* buffer) const;
+
+    struct Buffer {
+        ANativeWindowBuffer anb;
+        native_handle_t handle;
+        std::vector<uint8_t> storage;
+        int fenceWriteFd;
+    };
+
+    static Buffer* newBuffer(int32_t width, int32_t height);
+    static void deleteBuffer(Buffer* buffer);
+
+    std::vector<Buffer*> mBuffers;
+    std::vector<Buffer*> mRetired; // replaced by a geometry change
+    int32_t mGeometryWidth, mGeometryHeight;
+    mutable pthread_mutex_t mLock;
+    volatile int32_t mRefs;
+    int32_t mConnected;
+    int32_t mNext;
+    bool mFences;
+    bool mFencesSignaled;
+    int32_t mQueued, mCancelled, mDequeued, mForeignQueued, mLastQueued;
+    int64_t mLastTimestamp;
+};
+
+} // namespace fake
+
+#endif // STAGEFRIGHT_HOST_ANDROID_SHIM_H
@@ -0,0 +1,2 @@
+// host build, see android_shim.h
+#include "android_shim.h"
@@ -0,0 +1,261 @@
+/*****************************************************************************
+ * test_aac.cpp: AAC framing and config tests
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+TEST(adtsConfig)
+{
+    uint8_t packet[64];
+    size_t size = test::makeADTS(packet, 32, false, 0);
+
+    AACFramer framer;
+    ASSERT(framer.parseConfig(packet, size));
+    EXPECT_EQ(framer.format(), AACFramer::FORMAT_ADTS);
+    EXPECT_EQ(framer.configSize(), 2);
+    EXPECT_EQ(framer.config()[0], 0x12);
+    EXPECT_EQ(framer.config()[1], 0x10);
+    EXPECT_EQ(framer.frameDurationUs(), 1024000000LL / 44100);
+
+    sp<MetaData> meta = MakeAACCodecSpecificData(framer.config(), framer.configSize());
+    ASSERT(meta != 0);
+    int32_t rate = 0, channels = 0;
+    EXPECT(meta->findInt32(kKeySampleRate, &rate));
+    EXPECT(meta->findInt32(kKeyChannelCount, &channels));
+    EXPECT_EQ(rate, 44100);
+    EXPECT_EQ(channels, 2);
+}
+
+TEST(adtsSplit)
+{
+    uint8_t packet[256];
+    size_t size = test::makeADTS(packet, 20, false, 1);
+    size += test::makeADTS(packet + size, 30, true, 2);
+    size += test::makeADTS(packet + size, 40, false, 3);
+
+    AACFramer framer;
+    framer.parseConfig(packet, size);
+    Vector<AACFramer::Unit> units;
+    ASSERT(framer.split(packet, size, units) == 3);
+    EXPECT_EQ(units[0].size, 20);
+    EXPECT_EQ(units[1].size, 30);
+    EXPECT_EQ(units[2].size, 40);
+    EXPECT_EQ(units[0].data[0], 1);
+    EXPECT_EQ(units[1].data[0], 2);
+    EXPECT_EQ(units[2].data[39], 3);
+}
+
+TEST(adtsTruncatedCrcFrame)
+{
+    uint8_t packet[128];
+    size_t size = test::makeADTS(packet, 20, false, 1);
+    AACFramer framer;
+    framer.parseConfig(packet, size);
+
+    // only the 7 fixed header bytes of a CRC frame made it into the packet
+    size_t second = test::makeADTS(packet + size, 30, true, 2);
+    Vector<AACFramer::Unit> units;
+    EXPECT_EQ(framer.split(packet, size + 7, units), 1);
+    EXPECT_EQ(units[0].size, 20);
+
+    EXPECT_EQ(framer.split(packet + size, 8, units), 0);
+
+    // a frame cut inside its payload is not passed on either
+    EXPECT_EQ(framer.split(packet, size + second - 1, units), 1);
+    EXPECT_EQ(framer.split(packet, size + second, units), 2);
+}
+
+// Each raw data block is a unit of its own, their ends are only known with CRC
+TEST(adtsSplitRawBlocks)
+{
+    uint8_t packet[256];
+    size_t size = test::makeADTS(packet, 20, true, 1, 3);
+    EXPECT_EQ(size, 13 + 3 * 22);
+    AACFramer framer;
+    ASSERT(framer.parseConfig(packet, size));
+
+    Vector<AACFramer::Unit> units;
+    ASSERT(framer.split(packet, size, units) == 3);
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT(units[i].data == packet + 13 + i * 22);
+        EXPECT_EQ(units[i].size, 20);
+        EXPECT_EQ(units[i].data[0], i + 1);
+        EXPECT_EQ(units[i].data[19], i + 1);
+    }
+
+    // two blocks without CRC are dropped, the frame after them is not
+    size = test::makeADTS(packet, 20, false, 1, 2);
+    size_t single = test::makeADTS(packet + size, 30, false, 5);
+    ASSERT(framer.split(packet, size + single, units) == 1);
+    EXPECT(units[0].data == packet + size + 7);
+    EXPECT_EQ(units[0].size, 30);
+}
+
+class BitWriter {
+public:
+    BitWriter(uint8_t* out) : mOut(out), mBits(0) {}
+    void put(uint32_t value, int bits)
+    {
+        while (bits-- > 0) {
+            if ((mBits & 7) == 0)
+                mOut[mBits / 8] = 0;
+            if ((value >> bits) & 1)
+                mOut[mBits / 8] |= 0x80 >> (mBits & 7);
+            mBits++;
+        }
+    }
+    size_t bytes() const { return (mBits + 7) / 8; }
+
+private:
+    uint8_t* mOut;
+    size_t mBits;
+};
+
+// AudioMuxElement with an in-band StreamMuxConfig for AAC LC 44.1 kHz stereo,
+// each of the subFrames carries payload
+static size_t makeLOAS(uint8_t* out, const uint8_t* payload, size_t payloadSize, uint32_t subFrames = 1)
+{
+    BitWriter bw(out + 3);
+    bw.put(0, 1); // useSameStreamMux
+    bw.put(0, 1); // audioMuxVersion
+    bw.put(1, 1); // allStreamsSameTimeFraming
+    bw.put(subFrames - 1, 6); // numSubFrames
+    bw.put(0, 4); // numProgram
+    bw.put(0, 3); // numLayer
+    bw.put(2, 5); // AudioSpecificConfig
+    bw.put(4, 4);
+    bw.put(2, 4);
+    bw.put(0, 3);
+    bw.put(0, 3); // frameLengthType
+    bw.put(0xFF, 8); // latmBufferFullness
+    bw.put(0, 1); // otherDataPresent
+    bw.put(0, 1); // crcCheckPresent
+    for (uint32_t i = 0; i < subFrames; ++i) {
+        bw.put(payloadSize, 8); // PayloadLengthInfo
+        for (size_t j = 0; j < payloadSize; ++j)
+            bw.put(payload[j], 8);
+    }
+
+    size_t length = bw.bytes();
+    out[0] = 0x56;
+    out[1] = 0xE0 | (length >> 8);
+    out[2] = length & 0xFF;
+    return length + 3;
+}
+
+TEST(loasTruncatedFrame)
+{
+    static const uint8_t kPayload[] = { 0x11, 0x22, 0x33, 0x44 };
+    uint8_t packet[64];
+    size_t size = makeLOAS(packet, kPayload, sizeof(kPayload));
+
+    AACFramer framer;
+    ASSERT(framer.parseConfig(packet, size));
+    ASSERT(framer.format() == AACFramer::FORMAT_LOAS);
+    EXPECT_EQ(framer.configSize(), 2);
+    EXPECT_EQ(framer.config()[0], 0x12);
+    EXPECT_EQ(framer.config()[1], 0x10);
+
+    Vector<AACFramer::Unit> units;
+    ASSERT(framer.split(packet, size, units) == 1);
+    EXPECT_EQ(units[0].size, sizeof(kPayload));
+    EXPECT(!memcmp(units[0].data, kPayload, sizeof(kPayload)));
+
+    // a second element cut short ends the packet
+    size_t second = makeLOAS(packet + size, kPayload, sizeof(kPayload));
+    EXPECT_EQ(framer.split(packet, size + second - 1, units), 1);
+    EXPECT_EQ(framer.split(packet, size + second, units), 2);
+    EXPECT_EQ(framer.split(packet, size - 1, units), 0);
+}
+
+// An element whose last subframe overruns it queues none of its subframes
+TEST(loasPartialElement)
+{
+    static const uint8_t kPayload[] = { 0x11, 0x22, 0x33, 0x44 };
+    uint8_t packet[128];
+    size_t size = makeLOAS(packet, kPayload, sizeof(kPayload), 2);
+
+    AACFramer framer;
+    ASSERT(framer.parseConfig(packet, size));
+    Vector<AACFramer::Unit> units;
+    ASSERT(framer.split(packet, size, units) == 2);
+
+    // the second element is one byte short of its last subframe
+    size_t second = makeLOAS(packet + size, kPayload, sizeof(kPayload), 2);
+    packet[size + 2]--;
+    EXPECT_EQ(framer.split(packet, size + second - 1, units), 2);
+    for (size_t i = 0; i < units.size(); ++i) {
+        EXPECT_EQ(units[i].size, sizeof(kPayload));
+        EXPECT(!memcmp(units[i].data, kPayload, sizeof(kPayload)));
+    }
+}
+
+// A packet the decoder only partly takes is not queued again on retry
+TEST(queueAudioInputRemainder)
+{
+    StagefrightContext* ctx = test::openSession(NULL, "audio/mp4a-latm");
+    ASSERT(ctx);
+
+    const int kFramesPerPacket = 6;
+    uint8_t packet[kFramesPerPacket * 64];
+    size_t size = 0;
+    for (int i = 0; i < kFramesPerPacket; ++i)
+        size += test::makeADTS(packet + size, 40, false, i);
+
+    // nobody dequeues output, the decoder backs up and refuses input
+    int accepted = 0;
+    int64_t pts = 0;
+    bool refused = false;
+    for (int i = 0; i < 40 && !refused; ++i) {
+        if (Stagefright_QueueInputBuffer(ctx, 0, packet, size, pts, 0)) {
+            accepted++;
+            pts += kFramesPerPacket * kAacFrameUs;
+        } else {
+            refused = true;
+        }
+    }
+    EXPECT(refused);
+    // the refused packet goes again once output is read
+    int64_t retryPts = pts;
+
+    Vector<int64_t> output;
+    bool retried = false;
+    int64_t deadline = test::nowUs() + 10000000;
+    while (test::nowUs() < deadline) {
+        uint8_t* data;
+        unsigned int outSize;
+        int64_t outPts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &outSize, &outPts);
+        if (index >= 0) {
+            output.push(outPts);
+            Stagefright_ReleaseOutputBuffer(ctx, index, outPts);
+        } else if (!retried) {
+            retried = Stagefright_QueueInputBuffer(ctx, 0, packet, size, retryPts, 0);
+            if (retried)
+                accepted++;
+        } else if (output.size() >= (size_t)(accepted * kFramesPerPacket)) {
+            break;
+        } else {
+            usleep(2000);
+        }
+    }
+
+    EXPECT(retried);
+    EXPECT_EQ(output.size(), accepted * kFramesPerPacket);
+    for (size_t i = 0; i < output.size(); ++i) {
+        if (output[i] != (int64_t)i * kAacFrameUs) {
+            EXPECT_EQ(output[i], (int64_t)i * kAacFrameUs);
+            break;
+        }
+    }
+
+    Stagefright_Release(ctx);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+TEST_MAIN()
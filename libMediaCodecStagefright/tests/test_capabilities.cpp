@@ -0,0 +1,171 @@
+/*****************************************************************************
+ * test_capabilities.cpp: Codec capability cache tests
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+class FakeProvider : public CodecCapabilityProvider {
+public:
+    FakeProvider()
+        : queries(0)
+        , status(OK)
+    {
+    }
+
+    virtual status_t query(const char* mimeType, bool hwOnly, Vector<CodecCapabilities>* results)
+    {
+        queries++;
+        results->clear();
+        if (status != OK)
+            return status;
+
+        CodecCapabilities caps;
+        caps.mComponentName = String8::format("OMX.test.%s.%s", strchr(mimeType, '/') + 1,
+                hwOnly ? "hw" : "any");
+        caps.mColorFormats.push(OMX_COLOR_FormatYUV420SemiPlanar);
+        caps.mColorFormats.push(OMX_QCOM_COLOR_FormatYVU420SemiPlanar);
+        CodecProfileLevel profileLevel;
+        profileLevel.mProfile = 8;
+        profileLevel.mLevel = 0x800;
+        caps.mProfileLevels.push(profileLevel);
+        results->push(caps);
+        return OK;
+    }
+
+    int32_t queries;
+    status_t status;
+};
+
+static String8 cachePath()
+{
+    return String8::format("/tmp/stagefright_caps_%d", getpid());
+}
+
+static void resetCache(const sp<CodecCapabilityProvider>& provider, const char* path)
+{
+    CodecCapabilityCache& cache = CodecCapabilityCache::instance();
+    cache.setStoragePath(path);
+    cache.invalidate();
+    cache.setProvider(provider);
+}
+
+TEST(queriesOncePerKey)
+{
+    sp<FakeProvider> provider = new FakeProvider;
+    resetCache(provider, NULL);
+    CodecCapabilityCache& cache = CodecCapabilityCache::instance();
+
+    Vector<CodecCapabilities> results;
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &results), OK);
+    ASSERT(results.size() == 1);
+    EXPECT(results[0].mComponentName == String8("OMX.test.avc.hw"));
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &results), OK);
+    EXPECT_EQ(provider->queries, 1);
+
+    EXPECT_EQ(cache.get(NULL, "video/avc", false, &results), OK);
+    EXPECT(results[0].mComponentName == String8("OMX.test.avc.any"));
+    EXPECT_EQ(cache.get(NULL, "video/hevc", true, &results), OK);
+    EXPECT_EQ(provider->queries, 3);
+
+    resetCache(NULL, NULL);
+}
+
+TEST(failedQueryIsNotCached)
+{
+    sp<FakeProvider> provider = new FakeProvider;
+    provider->status = UNKNOWN_ERROR;
+    resetCache(provider, NULL);
+    CodecCapabilityCache& cache = CodecCapabilityCache::instance();
+
+    Vector<CodecCapabilities> results;
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &results), UNKNOWN_ERROR);
+    provider->status = OK;
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &results), OK);
+    EXPECT_EQ(results.size(), 1);
+    EXPECT_EQ(provider->queries, 2);
+
+    resetCache(NULL, NULL);
+}
+
+// A new process loads the file instead of asking the components again
+TEST(persistsAcrossRestarts)
+{
+    String8 path = cachePath();
+    sp<FakeProvider> provider = new FakeProvider;
+    resetCache(provider, path.string());
+    CodecCapabilityCache& cache = CodecCapabilityCache::instance();
+
+    Vector<CodecCapabilities> written;
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &written), OK);
+    EXPECT_EQ(cache.get(NULL, "video/hevc", false, &written), OK);
+    EXPECT_EQ(access(path.string(), R_OK), 0);
+
+    sp<FakeProvider> restarted = new FakeProvider;
+    cache.setProvider(restarted);
+    cache.setStoragePath(path.string());
+
+    Vector<CodecCapabilities> results;
+    EXPECT_EQ(cache.get(NULL, "video/hevc", false, &results), OK);
+    EXPECT_EQ(restarted->queries, 0);
+    ASSERT(results.size() == 1);
+    EXPECT(results[0].mComponentName == written[0].mComponentName);
+    ASSERT(results[0].mColorFormats.size() == 2);
+    EXPECT_EQ(results[0].mColorFormats[1], OMX_QCOM_COLOR_FormatYVU420SemiPlanar);
+    ASSERT(results[0].mProfileLevels.size() == 1);
+    EXPECT_EQ(results[0].mProfileLevels[0].mProfile, 8);
+    EXPECT_EQ(results[0].mProfileLevels[0].mLevel, 0x800);
+
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &results), OK);
+    EXPECT_EQ(restarted->queries, 0);
+
+    cache.invalidate();
+    EXPECT(access(path.string(), F_OK) != 0);
+    resetCache(NULL, NULL);
+}
+
+// A system update may change the components, the old file is ignored
+TEST(staleFingerprint)
+{
+    String8 path = cachePath();
+    sp<FakeProvider> provider = new FakeProvider;
+    resetCache(provider, path.string());
+    CodecCapabilityCache& cache = CodecCapabilityCache::instance();
+
+    Vector<CodecCapabilities> results;
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &results), OK);
+
+    setenv("STAGEFRIGHT_FINGERPRINT", "vendor/device:9/OTA", 1);
+    sp<FakeProvider> updated = new FakeProvider;
+    cache.setProvider(updated);
+    cache.setStoragePath(path.string());
+    EXPECT_EQ(cache.get(NULL, "video/avc", true, &results), OK);
+    EXPECT_EQ(updated->queries, 1);
+    unsetenv("STAGEFRIGHT_FINGERPRINT");
+
+    resetCache(NULL, path.string());
+    resetCache(NULL, NULL);
+}
+
+// Without a provider the cache asks OMX, once for all sessions
+TEST(sessionsShareOMXQuery)
+{
+    resetCache(NULL, NULL);
+    fake::Window window;
+
+    for (int i = 0; i < 3; ++i) {
+        StagefrightContext* ctx = test::openSession(&window);
+        ASSERT(ctx);
+        EXPECT(WAIT_FOR(fake::codecCounters().starts == i + 1, 2000));
+        Stagefright_Release(ctx);
+        Stagefright_ClearDecoderPool(NULL);
+    }
+    EXPECT_EQ(fake::codecCounters().queries, 1);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,183 @@
+/*****************************************************************************
+ * test_common.h: Minimal test runner for the host tests, each test binary
+ * builds StagefrightDecoder.cpp against the shim in host/
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#ifndef STAGEFRIGHT_TEST_COMMON_H
+#define STAGEFRIGHT_TEST_COMMON_H
+
+#include "android_shim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace test {
+
+typedef void (*TestFunc)();
+
+struct TestCase {
+    const char* name;
+    TestFunc func;
+};
+
+inline std::vector<TestCase>& registry()
+{
+    static std::vector<TestCase> s_tests;
+    return s_tests;
+}
+
+inline int& failures()
+{
+    static int s_failures = 0;
+    return s_failures;
+}
+
+struct Registrar {
+    Registrar(const char* name, TestFunc func)
+    {
+        TestCase test = { name, func };
+        registry().push_back(test);
+    }
+};
+
+inline int64_t nowUs()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// Runs the tests named on the command line, all of them without arguments.
+// The process ends with _exit(): decoder threads of a failed test may still
+// be running and must not race the static destructors
+inline int run(int argc, char** argv)
+{
+    int count = 0;
+    for (size_t i = 0; i < registry().size(); ++i) {
+        const TestCase& test = registry()[i];
+        bool selected = argc < 2;
+        for (int arg = 1; arg < argc; ++arg)
+            selected |= !strcmp(argv[arg], test.name);
+        if (!selected)
+            continue;
+
+        fake::resetCodecs();
+        int before = failures();
+        int64_t start = nowUs();
+        test.func();
+        printf("[%s] %s (%lld ms)\n", failures() == before ? "  OK  " : " FAIL ", test.name,
+                (long long)(nowUs() - start) / 1000);
+        fflush(stdout);
+        count++;
+    }
+    printf("%d tests, %d failures\n", count, failures());
+    fflush(stdout);
+    _exit(failures() ? 1 : 0);
+}
+
+} // namespace test
+
+#define TEST(_name_) \
+    static void _name_(); \
+    static test::Registrar s_register_##_name_(#_name_, _name_); \
+    static void _name_()
+
+#define EXPECT(_cond_) \
+    do { \
+        if (!(_cond_)) { \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__, #_cond_); \
+            test::failures()++; \
+        } \
+    } while (0)
+
+#define EXPECT_EQ(_a_, _b_) \
+    do { \
+        long long _va_ = (long long)(_a_), _vb_ = (long long)(_b_); \
+        if (_va_ != _vb_) { \
+            fprintf(stderr, "%s:%d: expected %s == %s, got %lld != %lld\n", __FILE__, __LINE__, \
+                    #_a_, #_b_, _va_, _vb_); \
+            test::failures()++; \
+        } \
+    } while (0)
+
+// Ends the current test on a failed precondition
+#define ASSERT(_cond_) \
+    do { \
+        if (!(_cond_)) { \
+            fprintf(stderr, "%s:%d: required %s\n", __FILE__, __LINE__, #_cond_); \
+            test::failures()++; \
+            return; \
+        } \
+    } while (0)
+
+// Polls a condition updated by other threads, true once it holds
+#define WAIT_FOR(_cond_, _timeoutMs_) \
+    ({ \
+        int64_t _deadline_ = test::nowUs() + (int64_t)(_timeoutMs_) * 1000; \
+        while (!(_cond_) && test::nowUs() < _deadline_) \
+            usleep(1000); \
+        (bool)(_cond_); \
+    })
+
+#define TEST_MAIN() \
+    int main(int argc, char** argv) { return test::run(argc, argv); }
+
+// Stream helpers for the tests, StagefrightDecoder.cpp is included first
+static const int64_t kFrameUs = 33333; // 30 fps video
+static const int64_t kAacFrameUs = 1024000000LL / 44100;
+static const uint8_t kAvcIDR[] = { 0, 0, 0, 1, 0x65, 0x88, 0x84, 0x00 };
+
+namespace test {
+
+// A session on the stub decoder, NULL and released again if the decoder is
+// not created. The priority class applies before the decoder is created
+inline StagefrightContext* openSession(void* window, const char* mime = "video/avc",
+        int32_t priorityClass = SESSION_PRIORITY_NORMAL, const void* config = NULL, int configSize = 0)
+{
+    StagefrightContext* ctx = (StagefrightContext*)Stagefright_Configure(window, 320, 240,
+            (void*)config, configSize);
+    if (!ctx)
+        return NULL;
+    Stagefright_SetSessionPriority(ctx, priorityClass);
+    if (!Stagefright_CreateDecoderByType(ctx, mime)) {
+        Stagefright_Release(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// One ADTS frame, AAC LC 44.1 kHz stereo, crc adds the header checksum.
+// Several raw data blocks of payload bytes each are filled with fill, fill + 1..,
+// with crc their positions follow the header and a checksum each block
+inline size_t makeADTS(uint8_t* out, size_t payload, bool crc = false, uint8_t fill = 0, size_t blocks = 1)
+{
+    size_t header = crc ? 7 + 2 * blocks : 7;
+    size_t block = crc && blocks > 1 ? payload + 2 : payload;
+    size_t frame = header + blocks * block;
+    out[0] = 0xFF;
+    out[1] = crc ? 0xF0 : 0xF1;
+    out[2] = (1 << 6) | (4 << 2);
+    out[3] = (2 << 6) | ((frame >> 11) & 0x03);
+    out[4] = (frame >> 3) & 0xFF;
+    out[5] = ((frame & 0x07) << 5) | 0x1F;
+    out[6] = 0xFC | (blocks - 1);
+    memset(out + 7, 0, frame - 7);
+    for (size_t i = 1; crc && i < blocks; ++i) {
+        out[5 + 2 * i] = (i * block) >> 8;
+        out[6 + 2 * i] = (i * block) & 0xFF;
+    }
+    for (size_t i = 0; i < blocks; ++i)
+        memset(out + header + i * block, fill + i, payload);
+    return frame;
+}
+
+} // namespace test
+
+#endif // STAGEFRIGHT_TEST_COMMON_H
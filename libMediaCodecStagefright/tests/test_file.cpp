@@ -0,0 +1,199 @@
+/*****************************************************************************
+ * test_file.cpp: Memory mapped elementary stream index and the zero-copy
+ * feed from it
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static String8 filePath()
+{
+    return String8::format("/tmp/stagefright_es_%d", getpid());
+}
+
+static bool writeFile(const char* path, const uint8_t* data, size_t size)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+    bool written = fwrite(data, 1, size, file) == size;
+    fclose(file);
+    return written;
+}
+
+// Appends a NAL unit after a 3 or 4 byte start code, returns where it starts
+static size_t putNAL(uint8_t* out, size_t& size, bool longStartCode, const uint8_t* nal, size_t nalSize)
+{
+    size_t start = size;
+    if (longStartCode)
+        out[size++] = 0;
+    out[size++] = 0;
+    out[size++] = 0;
+    out[size++] = 1;
+    memcpy(out + size, nal, nalSize);
+    size += nalSize;
+    return start;
+}
+
+static const uint8_t kSPS[] = { 0x67, 0x42, 0x00, 0x1e, 0xab };
+static const uint8_t kPPS[] = { 0x68, 0xce, 0x38, 0x80 };
+static const uint8_t kIDR[] = { 0x65, 0x88, 0x84, 0x00, 0x10 };
+static const uint8_t kSlice[] = { 0x41, 0x9a, 0x02, 0x00 };
+static const uint8_t kNextSlice[] = { 0x41, 0x1a, 0x02, 0x00 }; // first_mb_in_slice > 0
+static const uint8_t kAUD[] = { 0x09, 0xf0 };
+
+// SPS PPS IDR | P with two slices | AUD P, offsets of the three access units
+static size_t makeAnnexB(uint8_t* out, size_t offsets[3])
+{
+    size_t size = 0;
+    offsets[0] = putNAL(out, size, true, kSPS, sizeof(kSPS));
+    putNAL(out, size, true, kPPS, sizeof(kPPS));
+    putNAL(out, size, false, kIDR, sizeof(kIDR));
+    offsets[1] = putNAL(out, size, true, kSlice, sizeof(kSlice));
+    putNAL(out, size, false, kNextSlice, sizeof(kNextSlice));
+    offsets[2] = putNAL(out, size, true, kAUD, sizeof(kAUD));
+    putNAL(out, size, true, kSlice, sizeof(kSlice));
+    return size;
+}
+
+TEST(annexBIndex)
+{
+    uint8_t stream[128];
+    size_t offsets[4];
+    size_t size = makeAnnexB(stream, offsets);
+    offsets[3] = size;
+    String8 path = filePath();
+    ASSERT(writeFile(path.string(), stream, size));
+
+    sp<ElementaryStreamFile> file = new ElementaryStreamFile();
+    ASSERT(file->open(path.string(), STREAM_TYPE_H264, kFrameUs));
+    unlink(path.string());
+    ASSERT(file->count() == 3);
+    EXPECT_EQ(file->audioConfigSize(), 0);
+
+    for (size_t i = 0; i < 3; ++i) {
+        const ElementaryStreamFile::AccessUnit* unit = file->peek();
+        ASSERT(unit);
+        EXPECT_EQ(unit->offset, offsets[i]);
+        EXPECT_EQ(unit->size, offsets[i + 1] - offsets[i]);
+        EXPECT_EQ(unit->pts, (int64_t)i * kFrameUs);
+        EXPECT_EQ(unit->flags, i == 0 ? OMX_BUFFERFLAG_SYNCFRAME : 0);
+        EXPECT(memcmp(file->data(*unit), stream + offsets[i], unit->size) == 0);
+        file->advance();
+    }
+    EXPECT(file->peek() == NULL);
+
+    // back to the IDR from anywhere in the stream
+    EXPECT_EQ(file->seekTo(2 * kFrameUs), 0);
+    EXPECT_EQ(file->peek()->offset, 0);
+}
+
+// Garbage between frames is skipped, a frame of several raw data blocks is
+// one access unit per block and a frame cut by the end of file is left out
+TEST(adtsIndex)
+{
+    static const uint8_t kGarbage[] = { 0x00, 0xff, 0xf1, 0xfc, 0x12 }; // sampling index 15
+    uint8_t stream[512];
+    size_t size = 0;
+    size_t offsets[5];
+    size_t sizes[5];
+
+    offsets[0] = size + 7;
+    sizes[0] = 20;
+    size += test::makeADTS(stream + size, 20, false, 1);
+    memcpy(stream + size, kGarbage, sizeof(kGarbage));
+    size += sizeof(kGarbage);
+    offsets[1] = size + 9;
+    sizes[1] = 30;
+    size += test::makeADTS(stream + size, 30, true, 2);
+    for (size_t i = 0; i < 3; ++i) {
+        offsets[2 + i] = size + 13 + i * 42;
+        sizes[2 + i] = 40;
+    }
+    size += test::makeADTS(stream + size, 40, true, 3, 3);
+    size_t truncated = test::makeADTS(stream + size, 60, false, 6);
+    size += truncated - 20;
+
+    String8 path = filePath();
+    ASSERT(writeFile(path.string(), stream, size));
+    sp<ElementaryStreamFile> file = new ElementaryStreamFile();
+    ASSERT(file->open(path.string(), STREAM_TYPE_ADTS, 0));
+    unlink(path.string());
+
+    ASSERT(file->count() == 5);
+    ASSERT(file->audioConfigSize() == 2);
+    EXPECT_EQ(file->audioConfig()[0], 0x12);
+    EXPECT_EQ(file->audioConfig()[1], 0x10);
+    for (size_t i = 0; i < 5; ++i) {
+        const ElementaryStreamFile::AccessUnit* unit = file->peek();
+        ASSERT(unit);
+        EXPECT_EQ(unit->offset, offsets[i]);
+        EXPECT_EQ(unit->size, sizes[i]);
+        EXPECT_EQ(unit->pts, (int64_t)i * 1024 * 1000000 / 44100);
+        EXPECT_EQ(unit->flags, OMX_BUFFERFLAG_SYNCFRAME);
+        EXPECT_EQ(file->data(*unit)[0], i + 1);
+        file->advance();
+    }
+}
+
+// Raw data blocks without CRC cannot be told apart, the file is refused
+TEST(adtsRawBlocksWithoutCrc)
+{
+    uint8_t stream[256];
+    size_t size = test::makeADTS(stream, 20, false, 1);
+    size += test::makeADTS(stream + size, 20, false, 2, 2);
+    String8 path = filePath();
+    ASSERT(writeFile(path.string(), stream, size));
+    sp<ElementaryStreamFile> file = new ElementaryStreamFile();
+    EXPECT(!file->open(path.string(), STREAM_TYPE_ADTS, 0));
+    unlink(path.string());
+}
+
+// The codec reads every access unit where the index points to in the mapping
+TEST(zeroCopyFeed)
+{
+    uint8_t stream[128];
+    size_t offsets[3];
+    size_t size = makeAnnexB(stream, offsets);
+    String8 path = filePath();
+    ASSERT(writeFile(path.string(), stream, size));
+
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    EXPECT_EQ(Stagefright_OpenInputFile(ctx, path.string(), STREAM_TYPE_H264, kFrameUs), 3);
+    unlink(path.string());
+
+    int32_t result = INFO_OK;
+    int64_t deadline = test::nowUs() + 2000000;
+    while (test::nowUs() < deadline) {
+        result = Stagefright_QueueInputFileUnit(ctx);
+        if (result == INFO_OUTPUT_END_OF_STREAM)
+            break;
+        uint8_t* data;
+        unsigned int outSize;
+        int64_t pts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &outSize, &pts);
+        if (index >= 0)
+            Stagefright_ReleaseOutputBuffer(ctx, index, pts);
+        else if (result != INFO_OK)
+            usleep(1000);
+    }
+    EXPECT_EQ(result, INFO_OUTPUT_END_OF_STREAM);
+    EXPECT(WAIT_FOR(fake::decodedPts().size() == 3, 2000));
+
+    Vector<int64_t> pts = fake::decodedPts();
+    Vector<const void*> data = fake::decodedData();
+    ASSERT(pts.size() == 3 && data.size() == 3);
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT_EQ(pts[i], (int64_t)i * kFrameUs);
+        EXPECT_EQ((const uint8_t*)data[i] - (const uint8_t*)data[0], offsets[i]);
+    }
+    Stagefright_Release(ctx);
+}
+
+TEST_MAIN()
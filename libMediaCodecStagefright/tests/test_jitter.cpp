@@ -0,0 +1,218 @@
+/*****************************************************************************
+ * test_jitter.cpp: Jitter buffer tests, the order is the one the stub codec
+ * took the access units in
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+#include <pthread.h>
+
+static bool queue(StagefrightContext* ctx, int64_t pts, int64_t sequence)
+{
+    return Stagefright_QueueNetworkInput(ctx, (uint8_t*)kAvcIDR, sizeof(kAvcIDR), pts, sequence, 0);
+}
+
+// Gives the output back until the codec took count units
+static bool decode(StagefrightContext* ctx, size_t count, int32_t timeoutMs)
+{
+    int64_t deadline = test::nowUs() + timeoutMs * 1000LL;
+    while (fake::decodedPts().size() < count) {
+        if (test::nowUs() > deadline)
+            return false;
+        uint8_t* data;
+        unsigned int size;
+        int64_t pts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &size, &pts);
+        if (index >= 0)
+            Stagefright_ReleaseOutputBuffer(ctx, index, pts);
+        else
+            usleep(1000);
+    }
+    return true;
+}
+
+static bool decodedInOrder(const int64_t* pts, size_t count)
+{
+    Vector<int64_t> decoded = fake::decodedPts();
+    if (decoded.size() != count)
+        return false;
+    for (size_t i = 0; i < count; ++i) {
+        if (decoded[i] != pts[i])
+            return false;
+    }
+    return true;
+}
+
+// Pairs swapped on the way are decoded by sequence, a unit behind a released one is late
+TEST(reordersBySequence)
+{
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    ASSERT(Stagefright_SetJitterBuffer(ctx, 40, 200));
+
+    for (int64_t i = 0; i < 10; i += 2) {
+        EXPECT(queue(ctx, (i + 1) * kFrameUs, i + 1));
+        EXPECT(queue(ctx, i * kFrameUs, i));
+    }
+    EXPECT(decode(ctx, 10, 2000));
+    int64_t pts[10];
+    for (int i = 0; i < 10; ++i)
+        pts[i] = i * kFrameUs;
+    EXPECT(decodedInOrder(pts, 10));
+
+    EXPECT(queue(ctx, 3 * kFrameUs, 3));
+    usleep(100000);
+    stagefright_jitter_stats_t stats;
+    Stagefright_GetJitterStats(ctx, &stats);
+    EXPECT_EQ(stats.released, 10);
+    EXPECT_EQ(stats.reordered, 5);
+    EXPECT_EQ(stats.late, 1);
+    EXPECT_EQ(stats.dropped, 0);
+    EXPECT_EQ(fake::decodedPts().size(), 10);
+    Stagefright_Release(ctx);
+}
+
+// Without a sequence the decode order is kept, B-frames come before their pts
+TEST(arrivalOrderWithoutSequence)
+{
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    ASSERT(Stagefright_SetJitterBuffer(ctx, 40, 200));
+
+    static const int64_t kDecodeOrder[] = { 0, 3, 1, 2, 6, 4, 5, 9, 7, 8 };
+    int64_t pts[10];
+    for (size_t i = 0; i < 10; ++i) {
+        pts[i] = kDecodeOrder[i] * kFrameUs;
+        EXPECT(Stagefright_QueueInputBuffer(ctx, 0, (uint8_t*)kAvcIDR, sizeof(kAvcIDR), pts[i], 0));
+    }
+    EXPECT(decode(ctx, 10, 2000));
+    EXPECT(decodedInOrder(pts, 10));
+
+    stagefright_jitter_stats_t stats;
+    Stagefright_GetJitterStats(ctx, &stats);
+    EXPECT_EQ(stats.released, 10);
+    EXPECT_EQ(stats.reordered, 0);
+    EXPECT_EQ(stats.late, 0);
+    Stagefright_Release(ctx);
+}
+
+// Units the opening decoder has no room for wait in the buffer
+TEST(refusedUnitRetried)
+{
+    fake::codecConfig().openDelayMs = 300;
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    ASSERT(Stagefright_SetJitterBuffer(ctx, 0, 10));
+
+    // 1 us apart, all of them are due at once
+    static const int kUnits = PREWARM_BUFFER_COUNT + 10;
+    int64_t pts[kUnits];
+    for (int i = 0; i < kUnits; ++i) {
+        pts[i] = i;
+        EXPECT(queue(ctx, i, i));
+    }
+    EXPECT(decode(ctx, kUnits, 3000));
+    EXPECT(decodedInOrder(pts, kUnits));
+
+    stagefright_jitter_stats_t stats;
+    Stagefright_GetJitterStats(ctx, &stats);
+    EXPECT_EQ(stats.released, kUnits);
+    EXPECT_EQ(stats.dropped, 0);
+    Stagefright_Release(ctx);
+}
+
+// A decoder that never takes a unit costs it after JITTER_SUBMIT_TIMEOUT_MS
+TEST(refusedUnitDropped)
+{
+    fake::codecConfig().failHwOpen = true;
+    fake::codecConfig().failSwOpen = true;
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    ASSERT(Stagefright_SetJitterBuffer(ctx, 0, 10));
+
+    EXPECT(queue(ctx, 0, 0));
+    EXPECT(queue(ctx, kFrameUs, 1));
+    stagefright_jitter_stats_t stats;
+    Stagefright_GetJitterStats(ctx, &stats);
+    EXPECT_EQ(stats.occupancy, 2);
+
+    int64_t start = test::nowUs();
+    EXPECT(WAIT_FOR((Stagefright_GetJitterStats(ctx, &stats), stats.dropped == 2),
+            3 * JITTER_SUBMIT_TIMEOUT_MS));
+    EXPECT((test::nowUs() - start) / 1000 >= 2 * JITTER_SUBMIT_TIMEOUT_MS - 100);
+    EXPECT_EQ(stats.released, 0);
+    EXPECT_EQ(stats.occupancy, 0);
+    Stagefright_Release(ctx);
+}
+
+struct Drainer {
+    StagefrightContext* ctx;
+    volatile bool stop;
+};
+
+// The output side of a player, the decoder waits for input room then
+static void* drainOutput(void* arg)
+{
+    Drainer* drainer = static_cast<Drainer*>(arg);
+    while (!drainer->stop)
+        decode(drainer->ctx, (size_t)-1, 10);
+    return NULL;
+}
+
+// A flush while the jitter thread hands a unit to the full decoder: nothing
+// queued before it is decoded after it
+TEST(flushDuringRelease)
+{
+    fake::codecConfig().decodeUs = 50000;
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    ASSERT(Stagefright_SetJitterBuffer(ctx, 0, 10));
+    Drainer drainer = { ctx, false };
+    pthread_t thread;
+    pthread_create(&thread, NULL, drainOutput, &drainer);
+
+    int64_t sequence = 0;
+    for (int round = 0; round < 8; ++round) {
+        // 1 us apart, the decoder input fills up at once
+        int64_t first = sequence;
+        for (int i = 0; i < 30; ++i, ++sequence)
+            EXPECT(queue(ctx, sequence, sequence));
+        size_t before = fake::decodedPts().size();
+        EXPECT(WAIT_FOR(fake::decodedPts().size() >= before + 2, 2000));
+        usleep(round * 7000); // somewhere in the jitter thread's wait for room
+
+        // the codec may still be reading the unit it took before the flush,
+        // it is through once the codec drained up to the flush
+        Stagefright_Flush(ctx);
+        stagefright_flush_stats_t stats;
+        EXPECT(WAIT_FOR((Stagefright_GetFlushStats(ctx, &stats), stats.flush_count == round + 1), 2000));
+        size_t flushed = fake::decodedPts().size();
+
+        // the first unit after the flush is a new sequence
+        sequence += 1000;
+        EXPECT(queue(ctx, sequence, sequence));
+        EXPECT(WAIT_FOR(fake::decodedPts().size() >= flushed + 1, 2000));
+        usleep(100000);
+        Vector<int64_t> decoded = fake::decodedPts();
+        EXPECT_EQ(decoded.size(), flushed + 1);
+        EXPECT_EQ(decoded[decoded.size() - 1], sequence);
+        for (size_t i = flushed; i < decoded.size(); ++i)
+            EXPECT(decoded[i] < first || decoded[i] >= first + 30);
+        ++sequence;
+    }
+    drainer.stop = true;
+    pthread_join(thread, NULL);
+    Stagefright_Release(ctx);
+}
+
+TEST_MAIN()
@@ -0,0 +1,184 @@
+/*****************************************************************************
+ * test_migration.cpp: HW/SW decoder migration tests, the stub provides a
+ * HW and a SW backend
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static const int kGopSize = 5;
+
+struct Output {
+    Vector<int64_t> pts;
+    int32_t formatChanges;
+};
+
+static size_t makeUnit(uint8_t* out, bool idr)
+{
+    static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+    memcpy(out, kStartCode, sizeof(kStartCode));
+    out[4] = idr ? 0x65 : 0x41;
+    out[5] = 0x88;
+    return 6;
+}
+
+static void drain(StagefrightContext* ctx, Output& output)
+{
+    while (true) {
+        uint8_t* data;
+        unsigned int size;
+        int64_t pts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &size, &pts);
+        if (index == INFO_OUTPUT_FORMAT_CHANGED) {
+            output.formatChanges++;
+            continue;
+        }
+        if (index < 0)
+            break;
+        output.pts.push(pts);
+        Stagefright_ReleaseOutputBuffer(ctx, index, pts);
+    }
+}
+
+// Queues count frames from frame first on, GOPs of kGopSize, and reads the output
+static void feed(StagefrightContext* ctx, int first, int count, Output& output)
+{
+    uint8_t unit[16];
+    for (int i = first; i < first + count; ++i) {
+        size_t size = makeUnit(unit, i % kGopSize == 0);
+        int64_t deadline = test::nowUs() + 2000000;
+        while (!Stagefright_QueueInputBuffer(ctx, 0, unit, size, i * kFrameUs, 0)
+                && test::nowUs() < deadline)
+            drain(ctx, output);
+        drain(ctx, output);
+    }
+}
+
+static void finish(StagefrightContext* ctx, size_t frames, Output& output)
+{
+    int64_t deadline = test::nowUs() + 2000000;
+    while (output.pts.size() < frames && test::nowUs() < deadline) {
+        drain(ctx, output);
+        usleep(1000);
+    }
+}
+
+TEST(openFallsBackToSoftware)
+{
+    fake::codecConfig().failHwOpen = true;
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+
+    Output output = Output();
+    feed(ctx, 0, 10, output);
+    finish(ctx, 10, output);
+    EXPECT_EQ(output.pts.size(), 10);
+
+    stagefright_migration_stats_t stats;
+    Stagefright_GetMigrationStats(ctx, &stats);
+    EXPECT_EQ(stats.mode, DECODER_MODE_SW);
+    EXPECT_EQ(stats.open_fallbacks, 1);
+    EXPECT_EQ(fake::codecCounters().hwCreates, 0);
+
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+// Input queued across the switch is decoded once, in order, by one of the two
+TEST(migrateAndBack)
+{
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+    EXPECT_EQ(fake::codecCounters().liveHw, 1);
+
+    Output output = Output();
+    feed(ctx, 0, 7, output);
+    EXPECT(Stagefright_SetDecoderMode(ctx, DECODER_MODE_SW));
+    feed(ctx, 7, 10, output);
+    finish(ctx, 17, output);
+
+    stagefright_migration_stats_t stats;
+    Stagefright_GetMigrationStats(ctx, &stats);
+    EXPECT_EQ(stats.mode, DECODER_MODE_SW);
+    EXPECT_EQ(stats.to_sw, 1);
+    EXPECT(stats.last_migration_ms >= 0);
+    EXPECT_EQ(fake::codecCounters().liveHw, 0);
+    EXPECT(output.formatChanges >= 2);
+
+    EXPECT(Stagefright_SetDecoderMode(ctx, DECODER_MODE_HW));
+    feed(ctx, 17, 10, output);
+    finish(ctx, 27, output);
+
+    Stagefright_GetMigrationStats(ctx, &stats);
+    EXPECT_EQ(stats.mode, DECODER_MODE_HW);
+    EXPECT_EQ(stats.to_hw, 1);
+    EXPECT_EQ(stats.failed, 0);
+    EXPECT_EQ(fake::codecCounters().liveHw, 1);
+
+    ASSERT(output.pts.size() == 27);
+    for (size_t i = 0; i < output.pts.size(); ++i) {
+        if (output.pts[i] != (int64_t)i * kFrameUs) {
+            EXPECT_EQ(output.pts[i], (int64_t)i * kFrameUs);
+            break;
+        }
+    }
+
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+// A HW component that keeps failing is replaced by a SW one, the session goes on
+TEST(hwErrorsMigrateToSoftware)
+{
+    fake::codecConfig().hwErrorsOnly = true;
+    fake::codecConfig().errorAfter = 3;
+    fake::codecConfig().errorCount = 1000;
+    fake::codecConfig().errorStatus = UNKNOWN_ERROR;
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+
+    Output output = Output();
+    feed(ctx, 0, 30, output);
+    int64_t deadline = test::nowUs() + 2000000;
+    while ((output.pts.isEmpty() || output.pts[output.pts.size() - 1] != 29 * kFrameUs)
+            && test::nowUs() < deadline) {
+        drain(ctx, output);
+        usleep(1000);
+    }
+
+    stagefright_migration_stats_t stats;
+    Stagefright_GetMigrationStats(ctx, &stats);
+    EXPECT_EQ(stats.mode, DECODER_MODE_SW);
+    EXPECT_EQ(stats.to_sw, 1);
+    EXPECT(WAIT_FOR(fake::codecCounters().liveHw == 0, 2000));
+
+    // frames up to the error come from the HW, the SW component starts at the
+    // next sync frame and decodes the rest in order
+    ASSERT(output.pts.size() > 3);
+    EXPECT_EQ(output.pts[0], 0);
+    size_t gap = 1;
+    while (gap < output.pts.size() && output.pts[gap] == output.pts[gap - 1] + kFrameUs)
+        ++gap;
+    ASSERT(gap < output.pts.size());
+    EXPECT(gap <= 3);
+    EXPECT_EQ(output.pts[gap], kGopSize * kFrameUs);
+    for (size_t i = gap + 1; i < output.pts.size(); ++i)
+        EXPECT_EQ(output.pts[i], output.pts[i - 1] + kFrameUs);
+    EXPECT_EQ(output.pts[output.pts.size() - 1], 29 * kFrameUs);
+
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+TEST_MAIN()
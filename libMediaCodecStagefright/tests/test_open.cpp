@@ -0,0 +1,47 @@
+/*****************************************************************************
+ * test_open.cpp: Video decoder open path tests
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+// The session getters take the decoder lock, a slow component allocation
+// on the decoder thread must not hold it
+TEST(gettersDuringSlowOpen)
+{
+    fake::codecConfig().openDelayMs = 300;
+    fake::Window window;
+
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    usleep(50000); // inside OMXCodec::Create()
+
+    int64_t worst = 0;
+    for (int i = 0; i < 20; ++i) {
+        int64_t start = test::nowUs();
+        source_video_format_t format;
+        Stagefright_GetOutputFormat(ctx, &format);
+        Stagefright_GetName(ctx);
+        Stagefright_OutputBufferCount(ctx);
+        int64_t spent = test::nowUs() - start;
+        if (spent > worst)
+            worst = spent;
+        usleep(5000);
+    }
+    EXPECT(worst < 50000);
+
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+    source_video_format_t format;
+    EXPECT(WAIT_FOR((Stagefright_GetOutputFormat(ctx, &format), format.width == 320), 1000));
+    EXPECT_EQ(format.height, 240);
+
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,98 @@
+/*****************************************************************************
+ * test_pcm.cpp: PCM ring output tests
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static StagefrightContext* openPcmSession(int32_t durationMs)
+{
+    StagefrightContext* ctx = test::openSession(NULL, "audio/mp4a-latm");
+    if (ctx && !Stagefright_SetPcmOutput(ctx, durationMs, PCM_FORMAT_S16, 2)) {
+        Stagefright_Release(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Ring readers never dequeue buffers, no format change event may pile up
+TEST(ringHasNoBufferEvents)
+{
+    StagefrightContext* ctx = openPcmSession(100);
+    ASSERT(ctx);
+
+    const int kPackets = 12;
+    uint8_t packet[64];
+    size_t size = test::makeADTS(packet, 32);
+    for (int i = 0; i < kPackets; ++i)
+        EXPECT(Stagefright_QueueInputBuffer(ctx, 0, packet, size, i * kAacFrameUs, 0));
+
+    int16_t pcm[1024 * 2];
+    int32_t frames = 0;
+    int64_t firstPts = -1;
+    int64_t deadline = test::nowUs() + 5000000;
+    while (frames < kPackets * 1024 && test::nowUs() < deadline) {
+        int64_t pts = -1;
+        int32_t result = Stagefright_ReadPcm(ctx, pcm, 1024, &pts);
+        if (result > 0) {
+            if (firstPts < 0)
+                firstPts = pts;
+            EXPECT_EQ(pts, firstPts + (frames / 1024) * kAacFrameUs);
+            frames += result;
+        } else {
+            usleep(1000);
+        }
+    }
+    EXPECT_EQ(frames, kPackets * 1024);
+    EXPECT_EQ(firstPts, 0);
+
+    uint8_t* data;
+    unsigned int outSize;
+    int64_t pts;
+    EXPECT_EQ(Stagefright_DequeueOutputBuffer(ctx, &data, &outSize, &pts), INFO_TRY_AGAIN_LATER);
+
+    Stagefright_Release(ctx);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+// The decoder thread waits for ring space, a read or a release wakes it
+TEST(writerWaitsForSpace)
+{
+    // the smallest ring holds 1024 frames, one codec buffer
+    StagefrightContext* ctx = openPcmSession(1);
+    ASSERT(ctx);
+
+    uint8_t packet[64];
+    size_t size = test::makeADTS(packet, 32);
+    for (int i = 0; i < 3; ++i)
+        EXPECT(Stagefright_QueueInputBuffer(ctx, 0, packet, size, i * kAacFrameUs, 0));
+
+    EXPECT(WAIT_FOR(Stagefright_PcmAvailable(ctx) == 1024, 2000));
+    EXPECT(WAIT_FOR(fake::codecCounters().outputs >= 2, 2000));
+    usleep(20000);
+    EXPECT_EQ(Stagefright_PcmAvailable(ctx), 1024);
+
+    // each read makes room for the next codec buffer
+    int16_t pcm[1024 * 2];
+    int64_t pts;
+    EXPECT_EQ(Stagefright_ReadPcm(ctx, pcm, 1024, &pts), 1024);
+    EXPECT(WAIT_FOR(Stagefright_PcmAvailable(ctx) == 1024, 50));
+    EXPECT_EQ(Stagefright_ReadPcm(ctx, pcm, 1024, &pts), 1024);
+    EXPECT_EQ(pts, kAacFrameUs);
+
+    // blocked on the full ring again, release must not wait for space
+    EXPECT(WAIT_FOR(Stagefright_PcmAvailable(ctx) == 1024, 50));
+    EXPECT(Stagefright_QueueInputBuffer(ctx, 0, packet, size, 3 * kAacFrameUs, 0));
+    EXPECT(WAIT_FOR(fake::codecCounters().outputs >= 4, 2000));
+
+    int64_t start = test::nowUs();
+    Stagefright_Release(ctx);
+    EXPECT((test::nowUs() - start) / 1000 < PCM_SPACE_WAIT_MS);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,130 @@
+/*****************************************************************************
+ * test_pool.cpp: Decoder pool tests, the stub codec takes openDelayMs to
+ * open like a real component
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static const int32_t kOpenDelayMs = 150;
+
+// Open request to the first decoded frame, -1 on a timeout
+static int32_t firstFrameMs(StagefrightContext* ctx)
+{
+    int64_t pts = 0;
+    int64_t deadline = test::nowUs() + 2000000;
+    while (test::nowUs() < deadline) {
+        if (Stagefright_QueueInputBuffer(ctx, 0, (uint8_t*)kAvcIDR, sizeof(kAvcIDR), pts, 0))
+            pts += kFrameUs;
+        uint8_t* data;
+        unsigned int size;
+        int64_t outPts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &size, &outPts);
+        if (index >= 0) {
+            Stagefright_ReleaseOutputBuffer(ctx, index, outPts);
+            stagefright_startup_stats_t stats;
+            Stagefright_GetStartupStats(ctx, &stats);
+            return stats.first_frame_ms;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
+// The next session on the window starts on the released one's component
+TEST(hitSkipsOpen)
+{
+    fake::codecConfig().openDelayMs = kOpenDelayMs;
+    Stagefright_SetDecoderPoolSize(2);
+    stagefright_pool_stats_t before, after;
+    Stagefright_GetDecoderPoolStats(&before);
+    fake::Window window;
+
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    int32_t missMs = firstFrameMs(ctx);
+    Stagefright_Release(ctx);
+    EXPECT_EQ(fake::codecCounters().live, 1);
+
+    ctx = test::openSession(&window);
+    ASSERT(ctx);
+    int32_t hitMs = firstFrameMs(ctx);
+    EXPECT(missMs >= kOpenDelayMs);
+    EXPECT(hitMs >= 0 && hitMs < kOpenDelayMs / 2);
+    EXPECT_EQ(fake::codecCounters().creates, 1);
+    printf("  first frame: %d ms fresh, %d ms pooled\n", missMs, hitMs);
+
+    // another window does not get it
+    fake::Window other;
+    StagefrightContext* otherCtx = test::openSession(&other);
+    ASSERT(otherCtx);
+    EXPECT(firstFrameMs(otherCtx) >= kOpenDelayMs);
+    EXPECT_EQ(fake::codecCounters().creates, 2);
+
+    Stagefright_GetDecoderPoolStats(&after);
+    EXPECT_EQ(after.hits - before.hits, 1);
+    EXPECT_EQ(after.misses - before.misses, 2);
+
+    Stagefright_Release(ctx);
+    Stagefright_Release(otherCtx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+    Stagefright_SetDecoderPoolSize(0);
+}
+
+// A claim right after the release waits for the flush to finish
+TEST(claimWhileFlushing)
+{
+    fake::codecConfig().decodeUs = 20000;
+    Stagefright_SetDecoderPoolSize(1);
+    fake::Window window;
+
+    for (int i = 0; i < 5; ++i) {
+        StagefrightContext* ctx = test::openSession(&window);
+        ASSERT(ctx);
+        EXPECT(firstFrameMs(ctx) >= 0);
+        for (int j = 0; j < 3; ++j)
+            Stagefright_QueueInputBuffer(ctx, 0, (uint8_t*)kAvcIDR, sizeof(kAvcIDR), (j + 1) * kFrameUs, 0);
+        Stagefright_Release(ctx);
+    }
+    EXPECT_EQ(fake::codecCounters().creates, 1);
+
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+    Stagefright_SetDecoderPoolSize(0);
+}
+
+// Parked decoders let go of a window once no session uses it for a while
+TEST(idleWindowReleased)
+{
+    Stagefright_SetDecoderPoolSize(2);
+    stagefright_pool_stats_t before, after;
+    Stagefright_GetDecoderPoolStats(&before);
+    fake::Window window;
+
+    StagefrightContext* first = test::openSession(&window);
+    StagefrightContext* second = test::openSession(&window);
+    ASSERT(first && second);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 2, 2000));
+
+    // the window still has a session
+    Stagefright_Release(first);
+    usleep((POOL_WINDOW_IDLE_MS + 300) * 1000);
+    Stagefright_GetDecoderPoolStats(&after);
+    EXPECT_EQ(after.idle, 1);
+
+    Stagefright_Release(second);
+    Stagefright_GetDecoderPoolStats(&after);
+    EXPECT_EQ(after.idle, 2);
+    EXPECT(WAIT_FOR(fake::codecCounters().live == 0, POOL_WINDOW_IDLE_MS + 1000));
+    Stagefright_GetDecoderPoolStats(&after);
+    EXPECT_EQ(after.idle, 0);
+    EXPECT_EQ(after.evicted - before.evicted, 2);
+    Stagefright_SetDecoderPoolSize(0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,154 @@
+/*****************************************************************************
+ * test_present.cpp: Presentation scheduler tests on a virtual clock, frames
+ * render into the stub window
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static const int64_t kPeriodUs = s_frameDisplayTimeMsec * 1000;
+
+// An external clock that only moves when the test sets it
+class VirtualClock {
+public:
+    VirtualClock()
+        : clock(new PresentationClock(PRESENTATION_CLOCK_EXTERNAL))
+    {
+    }
+
+    void set(int64_t mediaUs) { clock->setTime(mediaUs, mediaUs); }
+
+    sp<PresentationClock> clock;
+};
+
+// A video decoder without a codec, its renderer draws SW frames into the window
+struct Session {
+    Session()
+        : decoder(new Decoder())
+    {
+        decoder->configure(&window, 16, 16, NULL, 0);
+        scheduler = new PresentationScheduler(decoder.get(), virtualClock.clock);
+        scheduler->run(0, ANDROID_PRIORITY_DISPLAY);
+    }
+
+    ~Session()
+    {
+        scheduler->stop();
+        scheduler.clear();
+        decoder->release();
+    }
+
+    void post(int64_t pts)
+    {
+        uint8_t data[16];
+        memset(data, (uint8_t)(pts / kPeriodUs), sizeof(data));
+        Frame frame(OK, data, sizeof(data), pts, 0);
+        PresentEntry entry;
+        entry.pts = pts;
+        entry.frame.swap(frame);
+        scheduler->post(entry);
+    }
+
+    // Waits until the scheduler has nothing due left
+    void settle(int32_t queued)
+    {
+        stagefright_presentation_stats_t stats;
+        int64_t deadline = test::nowUs() + 1000000;
+        do {
+            usleep(2000);
+            scheduler->getStats(&stats);
+        } while (stats.queued != queued && test::nowUs() < deadline);
+        usleep(2000);
+    }
+
+    stagefright_presentation_stats_t stats()
+    {
+        stagefright_presentation_stats_t stats;
+        scheduler->getStats(&stats);
+        return stats;
+    }
+
+    fake::Window window;
+    VirtualClock virtualClock;
+    sp<Decoder> decoder;
+    sp<PresentationScheduler> scheduler;
+};
+
+TEST(waitsForClock)
+{
+    Session session;
+    session.post(kPeriodUs);
+    session.post(0);
+    usleep(3 * kPeriodUs);
+    EXPECT_EQ(session.window.queued(), 0); // not anchored
+
+    session.virtualClock.set(0);
+    session.settle(1);
+    EXPECT_EQ(session.window.queued(), 1);
+    usleep(2 * kPeriodUs);
+    EXPECT_EQ(session.window.queued(), 1); // the clock stands still
+
+    session.virtualClock.set(kPeriodUs);
+    session.settle(0);
+    EXPECT_EQ(session.window.queued(), 2);
+    EXPECT_EQ(session.stats().presented, 2);
+    EXPECT_EQ(session.stats().dropped_late, 0);
+    EXPECT_EQ(session.stats().max_jitter_us, 0);
+}
+
+// A frame more than a display period late is dropped only if the next one is due
+TEST(dropRule)
+{
+    Session session;
+    for (int i = 0; i < 4; ++i)
+        session.post(i * kPeriodUs);
+    session.post(10 * kPeriodUs);
+
+    // 3.5, 2.5 and 1.5 periods late with the next due, then half a period late
+    session.virtualClock.set(3 * kPeriodUs + kPeriodUs / 2);
+    session.settle(1);
+    stagefright_presentation_stats_t stats = session.stats();
+    EXPECT_EQ(stats.dropped_late, 3);
+    EXPECT_EQ(stats.presented, 1);
+    EXPECT_EQ(session.window.queued(), 1);
+    EXPECT_EQ(stats.jitter_histogram[5], 1); // 16..32 ms
+
+    // the last frame is shown however late it is
+    session.virtualClock.set(20 * kPeriodUs);
+    session.settle(0);
+    stats = session.stats();
+    EXPECT_EQ(stats.dropped_late, 3);
+    EXPECT_EQ(stats.presented, 2);
+    EXPECT_EQ(stats.max_jitter_us, 10 * kPeriodUs);
+
+    // late, but the next frame is not due yet
+    session.post(21 * kPeriodUs);
+    session.post(23 * kPeriodUs);
+    session.virtualClock.set(22 * kPeriodUs + kPeriodUs / 2);
+    session.settle(1);
+    stats = session.stats();
+    EXPECT_EQ(stats.dropped_late, 3);
+    EXPECT_EQ(stats.presented, 3);
+    EXPECT_EQ(session.window.queued(), 3);
+}
+
+// Flushed frames are not rendered
+TEST(clearDrops)
+{
+    Session session;
+    for (int i = 0; i < 5; ++i)
+        session.post(i * kPeriodUs);
+    session.scheduler->clear();
+    EXPECT_EQ(session.stats().queued, 0);
+
+    session.virtualClock.set(10 * kPeriodUs);
+    usleep(2 * kPeriodUs);
+    EXPECT_EQ(session.window.queued(), 0);
+    EXPECT_EQ(session.stats().presented, 0);
+}
+
+TEST_MAIN()
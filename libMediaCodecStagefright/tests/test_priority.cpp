@@ -0,0 +1,232 @@
+/*****************************************************************************
+ * test_priority.cpp: Session priority classes under load and HW decoder
+ * admission tests
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+#include <pthread.h>
+
+// Feeds sync frames and takes the output as fast as the decoder goes
+struct Session {
+    StagefrightContext* ctx;
+    volatile bool feeding;
+    volatile bool stop;
+    volatile int32_t outputs;
+    pthread_t thread;
+};
+
+static void* run(void* arg)
+{
+    Session* session = static_cast<Session*>(arg);
+    int64_t pts = 0;
+    while (!session->stop) {
+        if (session->feeding && Stagefright_QueueInputBuffer(session->ctx, 0, (uint8_t*)kAvcIDR,
+                sizeof(kAvcIDR), pts, 0))
+            pts += kFrameUs;
+        uint8_t* data;
+        unsigned int size;
+        int64_t outPts;
+        int32_t index = Stagefright_DequeueOutputBuffer(session->ctx, &data, &size, &outPts);
+        if (index >= 0) {
+            Stagefright_ReleaseOutputBuffer(session->ctx, index, outPts);
+            session->outputs++;
+        } else {
+            usleep(500);
+        }
+    }
+    return NULL;
+}
+
+static void start(Session& session, StagefrightContext* ctx, bool feeding)
+{
+    session.ctx = ctx;
+    session.feeding = feeding;
+    session.stop = false;
+    session.outputs = 0;
+    pthread_create(&session.thread, NULL, run, &session);
+}
+
+static void stop(Session& session)
+{
+    session.stop = true;
+    pthread_join(session.thread, NULL);
+    Stagefright_Release(session.ctx);
+}
+
+TEST(queueDepthByClass)
+{
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window, "video/avc", SESSION_PRIORITY_BACKGROUND);
+    ASSERT(ctx);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+
+    stagefright_priority_stats_t stats;
+    Stagefright_GetPriorityStats(ctx, &stats);
+    EXPECT_EQ(stats.priority_class, SESSION_PRIORITY_BACKGROUND);
+    EXPECT_EQ(stats.queue_depth, 2);
+
+    Stagefright_SetSessionPriority(ctx, SESSION_PRIORITY_FOREGROUND);
+    Stagefright_GetPriorityStats(ctx, &stats);
+    EXPECT_EQ(stats.priority_class, SESSION_PRIORITY_FOREGROUND);
+    EXPECT_EQ(stats.queue_depth, IN_BUFFER_COUNT);
+
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+// Background sessions run freely next to an idle foreground session and
+// yield once the foreground one has input waiting and no output ready
+TEST(backgroundYieldsToForeground)
+{
+    fake::codecConfig().decodeUs = 5000;
+    fake::Window window;
+
+    Session foreground, background[2];
+    StagefrightContext* ctx = test::openSession(&window, "video/avc", SESSION_PRIORITY_FOREGROUND);
+    ASSERT(ctx);
+    start(foreground, ctx, false);
+    for (int i = 0; i < 2; ++i) {
+        ctx = test::openSession(&window, "video/avc", SESSION_PRIORITY_BACKGROUND);
+        ASSERT(ctx);
+        start(background[i], ctx, true);
+    }
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 3, 2000));
+
+    usleep(300000);
+    stagefright_priority_stats_t stats;
+    for (int i = 0; i < 2; ++i) {
+        Stagefright_GetPriorityStats(background[i].ctx, &stats);
+        EXPECT_EQ(stats.throttle_events, 0);
+    }
+    int32_t idleOutputs = background[0].outputs + background[1].outputs;
+
+    for (int i = 0; i < 2; ++i)
+        background[i].outputs = 0;
+    foreground.feeding = true;
+    usleep(300000);
+    int32_t loadedOutputs = background[0].outputs + background[1].outputs;
+
+    int32_t throttled = 0;
+    for (int i = 0; i < 2; ++i) {
+        Stagefright_GetPriorityStats(background[i].ctx, &stats);
+        EXPECT(stats.throttle_events > 0);
+        throttled += stats.throttled_ms;
+    }
+    Stagefright_GetPriorityStats(foreground.ctx, &stats);
+    EXPECT_EQ(stats.throttle_events, 0);
+    EXPECT(foreground.outputs > 0);
+    EXPECT(throttled > 0);
+    EXPECT(loadedOutputs < idleOutputs);
+    printf("  background frames: %d idle foreground, %d busy foreground, %d ms throttled\n",
+            idleOutputs, loadedOutputs, throttled);
+
+    stop(foreground);
+    for (int i = 0; i < 2; ++i)
+        stop(background[i]);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+// The sessions here are plain keys, no decoder gets demoted for real
+static const int64_t kLoad = 1000;
+
+TEST(arbiterDemotesNewestBackground)
+{
+    HwDecoderArbiter& arbiter = HwDecoderArbiter::instance();
+    arbiter.setBudget(2 * kLoad, 4);
+    stagefright_hw_utilisation_t before, after;
+    arbiter.getUtilisation(&before);
+
+    int a, b, c;
+    EXPECT(arbiter.acquire(&a, NULL, kLoad, false));
+    EXPECT(arbiter.acquire(&b, NULL, kLoad, false));
+    EXPECT(arbiter.acquire(&c, NULL, kLoad, true));
+    EXPECT(arbiter.isGranted(&a));
+    EXPECT(!arbiter.isGranted(&b));
+    EXPECT(arbiter.isGranted(&c));
+
+    arbiter.getUtilisation(&after);
+    EXPECT_EQ(after.demoted - before.demoted, 1);
+    EXPECT_EQ(after.admitted - before.admitted, 3);
+    EXPECT_EQ(after.instances, 2);
+    EXPECT_EQ(after.foreground_instances, 1);
+    EXPECT_EQ(after.load_percent, 100);
+
+    arbiter.release(&a);
+    arbiter.release(&c);
+    arbiter.getUtilisation(&after);
+    EXPECT_EQ(after.used_mb_per_sec, 0);
+    arbiter.setBudget(0, 0);
+}
+
+// A background request does not wait, a foreground one never displaces another
+TEST(arbiterRoutesToSoftware)
+{
+    HwDecoderArbiter& arbiter = HwDecoderArbiter::instance();
+    arbiter.setBudget(kLoad, 1);
+    stagefright_hw_utilisation_t before, after;
+    arbiter.getUtilisation(&before);
+
+    int a, b, c;
+    EXPECT(arbiter.acquire(&a, NULL, kLoad, true));
+    int64_t start = test::nowUs();
+    EXPECT(!arbiter.acquire(&b, NULL, kLoad, false));
+    EXPECT((test::nowUs() - start) / 1000 < HW_ADMISSION_TIMEOUT_MS / 2);
+
+    EXPECT(!arbiter.acquire(&c, NULL, kLoad, true));
+    EXPECT((test::nowUs() - start) / 1000 >= HW_ADMISSION_TIMEOUT_MS);
+    EXPECT(arbiter.isGranted(&a));
+
+    arbiter.getUtilisation(&after);
+    EXPECT_EQ(after.routed_to_sw - before.routed_to_sw, 2);
+    EXPECT_EQ(after.queued - before.queued, 1);
+    EXPECT_EQ(after.demoted - before.demoted, 0);
+
+    arbiter.release(&a);
+    arbiter.setBudget(0, 0);
+}
+
+struct Releaser {
+    const void* session;
+    int32_t delayMs;
+};
+
+static void* releaseLater(void* arg)
+{
+    Releaser* releaser = static_cast<Releaser*>(arg);
+    usleep(releaser->delayMs * 1000);
+    HwDecoderArbiter::instance().release(releaser->session);
+    return NULL;
+}
+
+// A foreground request waits for the instance another session gives back
+TEST(arbiterForegroundWaitsForRelease)
+{
+    HwDecoderArbiter& arbiter = HwDecoderArbiter::instance();
+    arbiter.setBudget(kLoad, 1);
+
+    int a, b;
+    EXPECT(arbiter.acquire(&a, NULL, kLoad, true));
+    Releaser releaser = { &a, 100 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, releaseLater, &releaser);
+
+    int64_t start = test::nowUs();
+    EXPECT(arbiter.acquire(&b, NULL, kLoad, true));
+    int64_t waitMs = (test::nowUs() - start) / 1000;
+    EXPECT(waitMs >= 80 && waitMs < HW_ADMISSION_TIMEOUT_MS);
+    EXPECT(arbiter.isGranted(&b));
+    pthread_join(thread, NULL);
+
+    arbiter.release(&b);
+    arbiter.setBudget(0, 0);
+}
+
+TEST_MAIN()
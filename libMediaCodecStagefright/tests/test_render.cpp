@@ -0,0 +1,204 @@
+/*****************************************************************************
+ * test_render.cpp: Software rendering into a window, GraphicBuffer wrapper
+ * allocations and release fences, the stub window's fences are pipes
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+#include <dirent.h>
+#include <pthread.h>
+
+static sp<MetaData> planarFormat(int32_t width, int32_t height)
+{
+    sp<MetaData> meta = new MetaData;
+    meta->setInt32(kKeyColorFormat, OMX_COLOR_FormatYUV420Planar);
+    meta->setInt32(kKeyWidth, width);
+    meta->setInt32(kKeyHeight, height);
+    return meta;
+}
+
+struct Picture {
+    Picture(int32_t width, int32_t height)
+        : size(width * height * 3 / 2)
+        , data(new uint8_t[size])
+    {
+        for (size_t i = 0; i < size; ++i)
+            data[i] = (uint8_t)(i * 13 + 1);
+    }
+    ~Picture() { delete[] data; }
+
+    size_t size;
+    uint8_t* data;
+};
+
+// One wrapper per window buffer, not per frame
+TEST(wrappersPerWindowBuffer)
+{
+    fake::Window window(4);
+    sp<NativeWindowRenderer> renderer = new NativeWindowRenderer(&window);
+    renderer->init(planarFormat(320, 240));
+    Picture picture(320, 240);
+
+    int32_t wrappers = GraphicBuffer::wrapperCount();
+    for (int i = 0; i < 100; ++i)
+        renderer->render(picture.data, picture.size);
+    EXPECT_EQ(GraphicBuffer::wrapperCount() - wrappers, 4);
+    EXPECT_EQ(window.queued(), 100);
+    EXPECT_EQ(window.cancelled(), 0);
+
+    stagefright_render_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    renderer->getBufferStats(&stats);
+    EXPECT_EQ(stats.buffer_wrappers, 4);
+    EXPECT_EQ(stats.buffer_cache_hits, 96);
+
+    // the cached wrapper still writes into the buffer the window handed out
+    const uint8_t* luma = window.bufferData(window.lastQueued());
+    EXPECT(!memcmp(luma, picture.data, 320));
+    EXPECT(!memcmp(luma + 239 * 320, picture.data + 239 * 320, 320));
+}
+
+// New geometry, new window buffers, the stale wrappers are dropped
+TEST(geometryChangeRewraps)
+{
+    fake::Window window(3);
+    sp<NativeWindowRenderer> renderer = new NativeWindowRenderer(&window);
+    renderer->init(planarFormat(320, 240));
+    Picture small(320, 240);
+    for (int i = 0; i < 10; ++i)
+        renderer->render(small.data, small.size);
+
+    int32_t wrappers = GraphicBuffer::wrapperCount();
+    renderer->init(planarFormat(640, 480));
+    Picture large(640, 480);
+    for (int i = 0; i < 10; ++i)
+        renderer->render(large.data, large.size);
+    EXPECT_EQ(GraphicBuffer::wrapperCount() - wrappers, 3);
+    EXPECT_EQ(window.queued(), 20);
+    EXPECT_EQ(window.foreignQueued(), 0);
+
+    stagefright_render_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    renderer->getBufferStats(&stats);
+    EXPECT_EQ(stats.buffer_wrappers, 6);
+    EXPECT_EQ(stats.buffer_cache_hits, 14);
+
+    const uint8_t* luma = window.bufferData(window.lastQueued());
+    EXPECT(!memcmp(luma + 479 * 640, large.data + 479 * 640, 640));
+}
+
+static int32_t openFds()
+{
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir)
+        return -1;
+    int32_t count = 0;
+    while (readdir(dir))
+        count++;
+    closedir(dir);
+    return count;
+}
+
+struct Signaler {
+    fake::Window* window;
+    int32_t buffer;
+    int32_t delayMs;
+};
+
+static void* signalLater(void* arg)
+{
+    Signaler* signaler = static_cast<Signaler*>(arg);
+    usleep(signaler->delayMs * 1000);
+    signaler->window->signalFence(signaler->buffer);
+    return NULL;
+}
+
+// The CPU write waits until the consumer is done with the buffer
+TEST(fenceSignaledLater)
+{
+    fake::Window window(2);
+    window.setFences(true);
+    sp<NativeWindowRenderer> renderer = new NativeWindowRenderer(&window);
+    renderer->init(planarFormat(320, 240));
+    Picture picture(320, 240);
+    int32_t fds = openFds();
+
+    Signaler signaler = { &window, 0, 30 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, signalLater, &signaler);
+    int64_t start = test::nowUs();
+    renderer->render(picture.data, picture.size);
+    int64_t waitUs = test::nowUs() - start;
+    pthread_join(thread, NULL);
+
+    EXPECT(waitUs >= 20000 && waitUs < FENCE_TIMEOUT_MS * 1000);
+    EXPECT_EQ(window.queued(), 1);
+    stagefright_render_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    renderer->getBufferStats(&stats);
+    EXPECT_EQ(stats.fence_waits, 1);
+    EXPECT_EQ(stats.fence_timeouts, 0);
+    EXPECT(stats.max_fence_wait_us >= 20000);
+    EXPECT_EQ(openFds(), fds);
+}
+
+// Already signaled fences are polled once and not counted as a wait
+TEST(fenceSignaled)
+{
+    fake::Window window(2);
+    window.setFences(true);
+    window.setFencesSignaled(true);
+    sp<NativeWindowRenderer> renderer = new NativeWindowRenderer(&window);
+    renderer->init(planarFormat(320, 240));
+    Picture picture(320, 240);
+    int32_t fds = openFds();
+
+    for (int i = 0; i < 10; ++i)
+        renderer->render(picture.data, picture.size);
+    EXPECT_EQ(window.queued(), 10);
+    stagefright_render_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    renderer->getBufferStats(&stats);
+    EXPECT_EQ(stats.fence_waits, 0);
+    EXPECT_EQ(openFds(), fds);
+}
+
+// A consumer that never lets go costs one dropped frame, not a torn one
+TEST(fenceTimeoutCancels)
+{
+    fake::Window window(2);
+    window.setFences(true);
+    sp<NativeWindowRenderer> renderer = new NativeWindowRenderer(&window);
+    renderer->init(planarFormat(320, 240));
+    Picture picture(320, 240);
+    int32_t fds = openFds();
+
+    int64_t start = test::nowUs();
+    renderer->render(picture.data, picture.size);
+    EXPECT((test::nowUs() - start) / 1000 >= FENCE_TIMEOUT_MS);
+    EXPECT_EQ(window.queued(), 0);
+    EXPECT_EQ(window.cancelled(), 1);
+
+    // the next buffer is free
+    window.setFencesSignaled(true);
+    renderer->render(picture.data, picture.size);
+    EXPECT_EQ(window.queued(), 1);
+
+    stagefright_render_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    renderer->getBufferStats(&stats);
+    EXPECT_EQ(stats.fence_timeouts, 1);
+    EXPECT_EQ(stats.fence_waits, 1);
+
+    // the cancelled buffer's fence went back to the window with it, only the
+    // window's end of the never signaled one is left
+    renderer.clear();
+    EXPECT_EQ(openFds(), fds + 1);
+}
+
+TEST_MAIN()
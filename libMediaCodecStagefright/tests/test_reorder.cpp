@@ -0,0 +1,147 @@
+/*****************************************************************************
+ * test_reorder.cpp: Output pts reordering on synthetic decode order
+ * sequences, and the codec buffers the reorder window takes
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+// Runs frames stamped with pts (in frame durations, -1 for none) through
+// the reorder, out holds the pts in output order
+static void reorder(PtsReorder& reorder, const int64_t* frames, size_t count, Vector<int64_t>& out)
+{
+    uint8_t data[4] = { 0 };
+    Frame next;
+    for (size_t i = 0; i < count; ++i) {
+        Frame frame(OK, data, sizeof(data), frames[i] < 0 ? -1 : frames[i] * kFrameUs, 0);
+        reorder.add(frame);
+        while (reorder.next(next, false))
+            out.push(next.mPts);
+    }
+    while (reorder.next(next, true))
+        out.push(next.mPts);
+}
+
+// IPBB in decode order comes out in pts order, two frames cover the B-frames
+TEST(windowSortsBFrames)
+{
+    PtsReorder pts;
+    pts.setWindow(2);
+    static const int64_t kDecodeOrder[] = { 0, 3, 1, 2, 6, 4, 5, 9, 7, 8 };
+    Vector<int64_t> out;
+    reorder(pts, kDecodeOrder, 10, out);
+
+    ASSERT(out.size() == 10);
+    for (size_t i = 0; i < out.size(); ++i)
+        EXPECT_EQ(out[i], (int64_t)i * kFrameUs);
+    stagefright_reorder_stats_t stats;
+    pts.getStats(&stats);
+    EXPECT_EQ(stats.window, 2);
+    EXPECT_EQ(stats.reordered, 6);
+    EXPECT_EQ(stats.late, 0);
+    EXPECT_EQ(stats.last_pts, 9 * kFrameUs);
+}
+
+// Frames that missed the window are dropped, the output pts only go up
+TEST(lateFramesDropped)
+{
+    PtsReorder pts;
+    pts.setWindow(1);
+    static const int64_t kDecodeOrder[] = { 0, 3, 4, 1, 5, 5, 2, 7, 6, 8 };
+    Vector<int64_t> out;
+    reorder(pts, kDecodeOrder, 10, out);
+
+    static const int64_t kOutput[] = { 0, 3, 4, 5, 6, 7, 8 };
+    ASSERT(out.size() == 7);
+    for (size_t i = 0; i < out.size(); ++i) {
+        EXPECT_EQ(out[i], kOutput[i] * kFrameUs);
+        if (i > 0)
+            EXPECT(out[i] > out[i - 1]);
+    }
+    stagefright_reorder_stats_t stats;
+    pts.getStats(&stats);
+    EXPECT_EQ(stats.late, 3);
+    EXPECT_EQ(stats.last_pts, 8 * kFrameUs);
+}
+
+// Frames without a pts keep their decode position and get the next frame
+// time from the estimated duration
+TEST(missingPtsInterpolated)
+{
+    PtsReorder pts;
+    pts.setWindow(0);
+    static const int64_t kDecodeOrder[] = { 0, 1, -1, -1, 4 };
+    Vector<int64_t> out;
+    reorder(pts, kDecodeOrder, 5, out);
+
+    ASSERT(out.size() == 5);
+    for (size_t i = 1; i < out.size(); ++i)
+        EXPECT(out[i] > out[i - 1]);
+    EXPECT_EQ(out[3] - out[2], out[2] - out[1]);
+    EXPECT_EQ(out[4], 4 * kFrameUs);
+    stagefright_reorder_stats_t stats;
+    pts.getStats(&stats);
+    EXPECT_EQ(stats.interpolated, 2);
+    EXPECT_EQ(stats.late, 0);
+}
+
+// A full decode-ahead depth and a full window still fit the codec's buffers,
+// the decoder waits for the consumer and not for the codec
+TEST(decodeAheadLeavesRoomForWindow)
+{
+    fake::codecConfig().outputBuffers = OUT_BUFFER_COUNT;
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    Stagefright_SetDecodeAheadDepth(ctx, OUT_BUFFER_COUNT - 1);
+    Stagefright_SetPtsReorderWindow(ctx, REORDER_MAX_WINDOW);
+
+    static const int kFrames = 2 * OUT_BUFFER_COUNT;
+    int queued = 0;
+    int64_t deadline = test::nowUs() + 2000000;
+    while (queued < kFrames && fake::codecCounters().outputs < OUT_BUFFER_COUNT && test::nowUs() < deadline) {
+        if (Stagefright_QueueInputBuffer(ctx, 0, (uint8_t*)kAvcIDR, sizeof(kAvcIDR), queued * kFrameUs, 0))
+            queued++;
+    }
+    EXPECT(WAIT_FOR(fake::codecCounters().outputs == OUT_BUFFER_COUNT, 1000));
+
+    // the decoder holds every codec buffer, one of them waits for room
+    stagefright_output_stats_t stats;
+    EXPECT(WAIT_FOR((Stagefright_GetOutputStats(ctx, &stats), stats.queued == stats.depth), 1000));
+    usleep(100000);
+    Stagefright_GetOutputStats(ctx, &stats);
+    EXPECT_EQ(stats.depth, OUT_BUFFER_COUNT - 1 - REORDER_MAX_WINDOW);
+    EXPECT_EQ(stats.queued, stats.depth);
+    EXPECT_EQ(fake::codecCounters().outputs, OUT_BUFFER_COUNT);
+
+    // and decodes on as soon as the consumer gives frames back
+    int64_t next = 0;
+    deadline = test::nowUs() + 2000000;
+    while (next < queued && test::nowUs() < deadline) {
+        while (queued < kFrames
+                && Stagefright_QueueInputBuffer(ctx, 0, (uint8_t*)kAvcIDR, sizeof(kAvcIDR), queued * kFrameUs, 0))
+            queued++;
+        uint8_t* data;
+        unsigned int size;
+        int64_t pts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &size, &pts);
+        if (index >= 0) {
+            EXPECT_EQ(pts, next * kFrameUs);
+            next++;
+            Stagefright_ReleaseOutputBuffer(ctx, index, pts);
+        } else {
+            usleep(1000);
+        }
+        if (next == queued - REORDER_MAX_WINDOW && queued == kFrames)
+            break; // the rest waits in the window for more input
+    }
+    EXPECT_EQ(queued, kFrames);
+    EXPECT_EQ(next, kFrames - REORDER_MAX_WINDOW);
+    Stagefright_Release(ctx);
+}
+
+TEST_MAIN()
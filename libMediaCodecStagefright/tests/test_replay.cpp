@@ -0,0 +1,158 @@
+/*****************************************************************************
+ * test_replay.cpp: Input recording and its replay through the stub codec
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+static const int kUnits = 10;
+static const int32_t kGapMs = 20; // between the recorded queue calls
+
+static String8 recordPath()
+{
+    return String8::format("/tmp/stagefright_record_%d", getpid());
+}
+
+// IDR payloads of 9 to 13 bytes, the unit number last, every entry pads differently
+static size_t makeUnit(uint8_t* out, int i)
+{
+    size_t size = sizeof(kAvcIDR);
+    memcpy(out, kAvcIDR, size);
+    for (int j = 0; j <= i % 5; ++j)
+        out[size++] = i;
+    return size;
+}
+
+static uint32_t unitFlags(int i)
+{
+    return i % 5 == 0 ? OMX_BUFFERFLAG_SYNCFRAME : 0;
+}
+
+static void drain(StagefrightContext* ctx)
+{
+    uint8_t* data;
+    unsigned int size;
+    int64_t pts;
+    int32_t index;
+    while ((index = Stagefright_DequeueOutputBuffer(ctx, &data, &size, &pts)) >= 0)
+        Stagefright_ReleaseOutputBuffer(ctx, index, pts);
+}
+
+// Records kUnits queue calls kGapMs apart, returns the bytes queued
+static int64_t record(const char* path)
+{
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    if (!ctx || !Stagefright_StartRecording(ctx, path)) {
+        Stagefright_Release(ctx);
+        return -1;
+    }
+
+    int64_t bytes = 0;
+    for (int i = 0; i < kUnits; ++i) {
+        if (i > 0)
+            usleep(kGapMs * 1000);
+        uint8_t unit[16];
+        size_t size = makeUnit(unit, i);
+        if (!Stagefright_QueueInputBuffer(ctx, 0, unit, size, i * kFrameUs, unitFlags(i)))
+            break;
+        bytes += size;
+        drain(ctx);
+    }
+    bool stopped = Stagefright_StopRecording(ctx);
+    Stagefright_Release(ctx);
+    return stopped ? bytes : -1;
+}
+
+TEST(recordEntries)
+{
+    String8 path = recordPath();
+    ASSERT(record(path.string()) > 0);
+
+    StreamReplayer replayer;
+    ASSERT(replayer.open(path.string()));
+    unlink(path.string());
+    ASSERT(replayer.count() == kUnits);
+    for (int i = 0; i < kUnits; ++i) {
+        const uint8_t* payload = 0;
+        const record_entry_t* entry = replayer.entry(i, &payload);
+        ASSERT(entry && payload);
+        uint8_t unit[16];
+        size_t size = makeUnit(unit, i);
+        EXPECT_EQ(entry->size, size);
+        EXPECT(!memcmp(payload, unit, size));
+        EXPECT_EQ(entry->pts, i * kFrameUs);
+        EXPECT_EQ(entry->flags, unitFlags(i));
+        if (i == 0)
+            EXPECT_EQ(entry->delay_us, 0);
+        else
+            EXPECT(entry->delay_us >= kGapMs * 1000);
+        EXPECT_EQ((size_t)(payload - (const uint8_t*)entry) % 8, 0);
+    }
+    EXPECT(replayer.entry(kUnits, NULL) == NULL);
+}
+
+// Speed 1 keeps the recorded gaps, the codec sees the recorded units
+TEST(replayOriginalSpeed)
+{
+    String8 path = recordPath();
+    int64_t bytes = record(path.string());
+    ASSERT(bytes > 0);
+    size_t recorded = fake::decodedPts().size();
+
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    stagefright_replay_stats_t stats;
+    int64_t start = test::nowUs();
+    EXPECT(Stagefright_Replay(ctx, path.string(), 1.0f, &stats));
+    int32_t elapsedMs = (test::nowUs() - start) / 1000;
+    unlink(path.string());
+
+    EXPECT_EQ(stats.frames_queued, kUnits);
+    EXPECT_EQ(stats.frames_rejected, 0);
+    EXPECT_EQ(stats.frames_decoded, kUnits);
+    EXPECT_EQ(stats.frames_dropped, 0);
+    EXPECT_EQ(stats.bytes_queued, bytes);
+    EXPECT(stats.elapsed_ms >= (kUnits - 1) * kGapMs);
+    EXPECT(stats.elapsed_ms <= elapsedMs);
+    EXPECT(stats.fps > 0 && stats.fps <= kUnits * 1000.0f / ((kUnits - 1) * kGapMs));
+    EXPECT(stats.kbps > 0);
+    EXPECT(stats.latency_min_ms >= 0);
+    EXPECT(stats.latency_min_ms <= stats.latency_avg_ms);
+    EXPECT(stats.latency_avg_ms <= stats.latency_max_ms);
+
+    Vector<int64_t> pts = fake::decodedPts();
+    ASSERT(pts.size() == recorded + kUnits);
+    for (int i = 0; i < kUnits; ++i)
+        EXPECT_EQ(pts[recorded + i], i * kFrameUs);
+    Stagefright_Release(ctx);
+}
+
+// Speed 0 does not wait for the recorded gaps
+TEST(replayMaxSpeed)
+{
+    String8 path = recordPath();
+    ASSERT(record(path.string()) > 0);
+
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    stagefright_replay_stats_t stats;
+    EXPECT(Stagefright_Replay(ctx, path.string(), 0, &stats));
+    unlink(path.string());
+
+    EXPECT_EQ(stats.frames_queued, kUnits);
+    EXPECT_EQ(stats.frames_decoded + stats.frames_dropped, kUnits);
+    EXPECT(stats.elapsed_ms < (kUnits - 1) * kGapMs / 2);
+
+    // the record is gone
+    EXPECT(!Stagefright_Replay(ctx, path.string(), 0, &stats));
+    Stagefright_Release(ctx);
+}
+
+TEST_MAIN()
@@ -0,0 +1,228 @@
+/*****************************************************************************
+ * test_sync.cpp: Sync frame detection tests, Annex-B and avcC/hvcC input,
+ * MPEG-4 Part 2 and H.263 picture headers
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+// Appends a NAL unit, after a start code or a lengthSize-byte size prefix
+static size_t putNAL(uint8_t* out, size_t lengthSize, const uint8_t* nal, size_t size)
+{
+    size_t prefix = lengthSize ? lengthSize : 4;
+    for (size_t i = 0; i < prefix; ++i)
+        out[i] = lengthSize ? (size >> (8 * (prefix - 1 - i))) & 0xff : (i == prefix - 1);
+    memcpy(out + prefix, nal, size);
+    return prefix + size;
+}
+
+// avcC with SPS and PPS left out, only the length size matters here
+static const uint8_t kAVCC[] = { 0x01, 0x42, 0xe0, 0x1e, 0xff, 0xe0, 0x00 };
+
+TEST(nalLengthSize)
+{
+    EXPECT_EQ(getNALLengthSize("video/avc", kAVCC, sizeof(kAVCC)), 4);
+    uint8_t avcc2[sizeof(kAVCC)];
+    memcpy(avcc2, kAVCC, sizeof(kAVCC));
+    avcc2[4] = 0xfd;
+    EXPECT_EQ(getNALLengthSize("video/avc", avcc2, sizeof(avcc2)), 2);
+
+    static const uint8_t kAnnexB[] = { 0, 0, 0, 1, 0x67, 0x42, 0, 0x1e };
+    EXPECT_EQ(getNALLengthSize("video/avc", kAnnexB, sizeof(kAnnexB)), 0);
+    EXPECT_EQ(getNALLengthSize("video/avc", NULL, 0), 0);
+
+    uint8_t hvcc[23];
+    memset(hvcc, 0, sizeof(hvcc));
+    hvcc[0] = 1;
+    hvcc[21] = 0x0f;
+    EXPECT_EQ(getNALLengthSize("video/hevc", hvcc, sizeof(hvcc)), 4);
+    EXPECT_EQ(getNALLengthSize("video/mp4v-es", hvcc, sizeof(hvcc)), 0);
+}
+
+TEST(avcAnnexB)
+{
+    static const uint8_t kAUD[] = { 0x09, 0xf0 };
+    static const uint8_t kIDR[] = { 0x65, 0x88, 0x84 };
+    static const uint8_t kSlice[] = { 0x41, 0x9a, 0x02 };
+
+    uint8_t unit[64];
+    size_t size = putNAL(unit, 0, kAUD, sizeof(kAUD));
+    size += putNAL(unit + size, 0, kIDR, sizeof(kIDR));
+    EXPECT(isSyncFrame("video/avc", unit, size));
+
+    size = putNAL(unit, 0, kAUD, sizeof(kAUD));
+    size += putNAL(unit + size, 0, kSlice, sizeof(kSlice));
+    EXPECT(!isSyncFrame("video/avc", unit, size));
+}
+
+TEST(avcLengthPrefixed)
+{
+    static const uint8_t kSEI[] = { 0x06, 0x05, 0x01, 0x00, 0x80 };
+    uint8_t idr[8] = { 0x65, 0x88, 0x84, 0x00, 0x00, 0x01, 0x41, 0x00 };
+
+    uint8_t unit[512];
+    size_t size = putNAL(unit, 4, kSEI, sizeof(kSEI));
+    size += putNAL(unit + size, 4, idr, sizeof(idr));
+    EXPECT(isSyncFrame("video/avc", unit, size, 4));
+
+    // a 357 byte P slice, its size prefix reads 00 00 01 65 like an IDR start code
+    uint8_t slice[0x165];
+    memset(slice, 0x5a, sizeof(slice));
+    slice[0] = 0x41;
+    size = putNAL(unit, 4, slice, sizeof(slice));
+    EXPECT(!isSyncFrame("video/avc", unit, size, 4));
+    EXPECT(isSyncFrame("video/avc", unit, size, 0)); // what the Annex-B parser sees
+
+    // 2-byte prefixes, an empty unit is skipped
+    size = putNAL(unit, 2, idr, 0);
+    size += putNAL(unit + size, 2, idr, sizeof(idr));
+    EXPECT(isSyncFrame("video/avc", unit, size, 2));
+
+    // a unit larger than the buffer still shows its header
+    size = putNAL(unit, 4, slice, sizeof(slice));
+    EXPECT(!isSyncFrame("video/avc", unit, 6, 4));
+    EXPECT(!isSyncFrame("video/avc", unit, 3, 4));
+}
+
+TEST(hevcLengthPrefixed)
+{
+    static const uint8_t kVPS[] = { 0x40, 0x01, 0x0c };
+    static const uint8_t kIDR[] = { 0x26, 0x01, 0xaf }; // IDR_W_RADL
+    static const uint8_t kCRA[] = { 0x2a, 0x01, 0xaf };
+    static const uint8_t kTrail[] = { 0x02, 0x01, 0xd0 }; // TRAIL_R
+
+    uint8_t unit[64];
+    size_t size = putNAL(unit, 4, kVPS, sizeof(kVPS));
+    size += putNAL(unit + size, 4, kIDR, sizeof(kIDR));
+    EXPECT(isSyncFrame("video/hevc", unit, size, 4));
+
+    size = putNAL(unit, 4, kCRA, sizeof(kCRA));
+    EXPECT(isSyncFrame("video/hevc", unit, size, 4));
+
+    size = putNAL(unit, 4, kTrail, sizeof(kTrail));
+    EXPECT(!isSyncFrame("video/hevc", unit, size, 4));
+
+    size = putNAL(unit, 0, kIDR, sizeof(kIDR));
+    EXPECT(isSyncFrame("video/hevc", unit, size));
+}
+
+// Simple profile VOS, VO and VOL headers as an encoder puts them before the first VOP
+static const uint8_t kMPEG4VOL[] = {
+    0x00, 0x00, 0x01, 0xb0, 0x01, 0x00, 0x00, 0x01, 0xb5, 0x09, 0x00, 0x00, 0x01, 0x00,
+    0x00, 0x00, 0x01, 0x20, 0x00, 0x84, 0x5d, 0x4c, 0x28, 0x58, 0x21, 0x20, 0xa3, 0x1f
+};
+static const uint8_t kMPEG4GOV[] = { 0x00, 0x00, 0x01, 0xb3, 0x00, 0x10, 0x07 };
+
+// A VOP of the given vop_coding_type, I, P, B or S
+static size_t putVOP(uint8_t* out, int codingType)
+{
+    static const uint8_t kVOP[] = { 0x00, 0x00, 0x01, 0xb6, 0x10, 0x60, 0x91, 0x82, 0x3d, 0xb7 };
+    memcpy(out, kVOP, sizeof(kVOP));
+    out[4] = (out[4] & 0x3f) | (codingType << 6);
+    return sizeof(kVOP);
+}
+
+TEST(mpeg4VopCodingType)
+{
+    uint8_t unit[64];
+    size_t size = sizeof(kMPEG4VOL);
+    memcpy(unit, kMPEG4VOL, size);
+    memcpy(unit + size, kMPEG4GOV, sizeof(kMPEG4GOV));
+    size += sizeof(kMPEG4GOV);
+    putVOP(unit + size, 0);
+    EXPECT(isSyncFrame("video/mp4v-es", unit, size + 10));
+    putVOP(unit + size, 1);
+    EXPECT(!isSyncFrame("video/mp4v-es", unit, size + 10));
+
+    // VOPs without a header in front
+    for (int type = 0; type < 4; ++type) {
+        size = putVOP(unit, type);
+        EXPECT_EQ(isSyncFrame("video/mp4v-es", unit, size), type == 0);
+    }
+
+    // the VOL alone, then VOP start codes cut off before vop_coding_type
+    size = sizeof(kMPEG4VOL);
+    memcpy(unit, kMPEG4VOL, size);
+    EXPECT(!isSyncFrame("video/mp4v-es", unit, size));
+    putVOP(unit + size, 0);
+    EXPECT(!isSyncFrame("video/mp4v-es", unit, size + 4));
+    EXPECT(!isSyncFrame("video/mp4v-es", unit, size + 3));
+    EXPECT(isSyncFrame("video/mp4v-es", unit, size + 5));
+}
+
+// Short header PTYPE, QCIF, TR 0 and 1
+TEST(h263PictureCodingType)
+{
+    static const uint8_t kIntra[] = { 0x00, 0x00, 0x80, 0x02, 0x08, 0x08, 0x00 };
+    static const uint8_t kInter[] = { 0x00, 0x00, 0x80, 0x06, 0x0a, 0x08, 0x00 };
+    EXPECT(isSyncFrame("video/3gpp", kIntra, sizeof(kIntra)));
+    EXPECT(!isSyncFrame("video/3gpp", kInter, sizeof(kInter)));
+    EXPECT(isSyncFrame("video/3gpp", kIntra, 5));
+    EXPECT(!isSyncFrame("video/3gpp", kIntra, 4));
+
+    // no picture start code
+    uint8_t unit[sizeof(kIntra)];
+    memcpy(unit, kIntra, sizeof(kIntra));
+    unit[2] = 0x40;
+    EXPECT(!isSyncFrame("video/3gpp", unit, sizeof(unit)));
+}
+
+// PLUSPTYPE, the picture type is the first MPPTYPE field after OPPTYPE when UFEP is 1
+TEST(h263PlusPictureType)
+{
+    // UFEP 1, OPPTYPE QCIF with advanced intra coding, MPPTYPE I, P and B
+    static const uint8_t kOptI[] = { 0x00, 0x00, 0x80, 0x0a, 0x1c, 0xa0, 0x81, 0x00, 0x12, 0x00 };
+    static const uint8_t kOptP[] = { 0x00, 0x00, 0x80, 0x0a, 0x1c, 0xa0, 0x81, 0x04, 0x12, 0x00 };
+    static const uint8_t kOptB[] = { 0x00, 0x00, 0x80, 0x0a, 0x1c, 0xa0, 0x81, 0x0c, 0x12, 0x00 };
+    EXPECT(isSyncFrame("video/3gpp", kOptI, sizeof(kOptI)));
+    EXPECT(!isSyncFrame("video/3gpp", kOptP, sizeof(kOptP)));
+    EXPECT(!isSyncFrame("video/3gpp", kOptB, sizeof(kOptB)));
+    // cut off in OPPTYPE
+    EXPECT(!isSyncFrame("video/3gpp", kOptI, 7));
+
+    // UFEP 0, MPPTYPE follows right away
+    static const uint8_t kI[] = { 0x00, 0x00, 0x80, 0x0a, 0x1c, 0x00, 0x48 };
+    static const uint8_t kP[] = { 0x00, 0x00, 0x80, 0x0a, 0x1c, 0x10, 0x48 };
+    static const uint8_t kB[] = { 0x00, 0x00, 0x80, 0x0a, 0x1c, 0x30, 0x48 };
+    EXPECT(isSyncFrame("video/3gpp", kI, sizeof(kI)));
+    EXPECT(!isSyncFrame("video/3gpp", kP, sizeof(kP)));
+    EXPECT(!isSyncFrame("video/3gpp", kB, sizeof(kB)));
+    EXPECT(!isSyncFrame("video/3gpp", kI, 5));
+}
+
+// Keyframe-only admission follows the configured input format
+TEST(keyframeOnlyAVCC)
+{
+    fake::Window window;
+    StagefrightContext* ctx = test::openSession(&window, "video/avc", SESSION_PRIORITY_NORMAL,
+            kAVCC, sizeof(kAVCC));
+    ASSERT(ctx);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+    EXPECT(Stagefright_SetKeyframeOnly(ctx, true));
+
+    uint8_t slice[0x165];
+    memset(slice, 0x5a, sizeof(slice));
+    slice[0] = 0x41;
+    uint8_t unit[512];
+    size_t size = putNAL(unit, 4, slice, sizeof(slice));
+    EXPECT(Stagefright_QueueInputBuffer(ctx, 0, unit, size, 0, 0));
+
+    slice[0] = 0x65;
+    size = putNAL(unit, 4, slice, sizeof(slice));
+    EXPECT(Stagefright_QueueInputBuffer(ctx, 0, unit, size, 33333, 0));
+
+    stagefright_trickplay_stats_t stats;
+    Stagefright_GetTrickPlayStats(ctx, &stats);
+    EXPECT_EQ(stats.rejected_frames, 1);
+    EXPECT_EQ(stats.admitted_frames, 1);
+
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+TEST_MAIN()
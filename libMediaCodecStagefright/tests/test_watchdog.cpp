@@ -0,0 +1,202 @@
+/*****************************************************************************
+ * test_watchdog.cpp: Stalled decoder restart tests
+ *****************************************************************************
+ * Copyright (c) 2017 Oleg Smirnov
+ *
+ * The MIT License (MIT), see StagefrightDecoder.cpp
+ *****************************************************************************/
+
+#include "../jni/StagefrightDecoder.cpp"
+#include "test_common.h"
+
+#include <pthread.h>
+
+static size_t makeIDR(uint8_t* out)
+{
+    memcpy(out, kAvcIDR, sizeof(kAvcIDR));
+    return sizeof(kAvcIDR);
+}
+
+// Feeds sync frames and reads output until the decoder was replaced
+static bool runUntilRestart(StagefrightContext* ctx, int64_t& pts, int32_t timeoutMs)
+{
+    uint8_t unit[16];
+    size_t size = makeIDR(unit);
+    int64_t deadline = test::nowUs() + timeoutMs * 1000LL;
+    while (test::nowUs() < deadline) {
+        if (Stagefright_DequeueInputBuffer(ctx, 0) >= 0) {
+            Stagefright_QueueInputBuffer(ctx, 0, unit, size, pts, 0);
+            pts += kFrameUs;
+        }
+        uint8_t* data;
+        unsigned int outSize;
+        int64_t outPts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &outSize, &outPts);
+        if (index == INFO_OUTPUT_DECODER_RESTARTED)
+            return true;
+        if (index >= 0)
+            Stagefright_ReleaseOutputBuffer(ctx, index, outPts);
+        usleep(2000);
+    }
+    return false;
+}
+
+static int32_t decodeFrames(StagefrightContext* ctx, int64_t& pts, int32_t count)
+{
+    uint8_t unit[16];
+    size_t size = makeIDR(unit);
+    int32_t outputs = fake::codecCounters().outputs;
+    int64_t deadline = test::nowUs() + 2000000;
+    while (fake::codecCounters().outputs - outputs < count && test::nowUs() < deadline) {
+        if (Stagefright_QueueInputBuffer(ctx, 0, unit, size, pts, 0))
+            pts += kFrameUs;
+        uint8_t* data;
+        unsigned int outSize;
+        int64_t outPts;
+        int32_t index = Stagefright_DequeueOutputBuffer(ctx, &data, &outSize, &outPts);
+        if (index >= 0)
+            Stagefright_ReleaseOutputBuffer(ctx, index, outPts);
+    }
+    return fake::codecCounters().outputs - outputs;
+}
+
+// The abandoned thread stops its component once the codec returns, the new
+// decoder holds the session's HW grant
+TEST(restartStopsAbandonedCodec)
+{
+    fake::codecConfig().stallAfter = 2;
+    fake::Window window;
+
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    Stagefright_SetWatchdogTimeout(ctx, 200);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+
+    int64_t pts = 0;
+    ASSERT(runUntilRestart(ctx, pts, 5000));
+    stagefright_watchdog_stats_t stats;
+    Stagefright_GetWatchdogStats(ctx, &stats);
+    EXPECT_EQ(stats.restarts, 1);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 2, 2000));
+    EXPECT_EQ(fake::codecCounters().stalled, 1);
+    EXPECT_EQ(fake::codecCounters().live, 2);
+
+    stagefright_hw_utilisation_t hw;
+    Stagefright_GetHwUtilisation(&hw);
+    EXPECT_EQ(hw.instances, 1);
+
+    // only the old component wedges, the new one decodes
+    fake::codecConfig().stallAfter = -1;
+    EXPECT(decodeFrames(ctx, pts, 3) >= 3);
+
+    fake::releaseStall();
+    EXPECT(WAIT_FOR(fake::codecCounters().live == 1, 2000));
+    EXPECT_EQ(fake::codecCounters().stops, 1);
+
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+    Stagefright_GetHwUtilisation(&hw);
+    EXPECT_EQ(hw.instances, 0);
+}
+
+// A session that fell back to SW does not try the HW again after a restart
+TEST(restartKeepsSoftwareMode)
+{
+    fake::codecConfig().failHwOpen = true;
+    fake::codecConfig().stallAfter = 2;
+    fake::Window window;
+
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    Stagefright_SetWatchdogTimeout(ctx, 200);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+
+    int64_t pts = 0;
+    ASSERT(runUntilRestart(ctx, pts, 5000));
+    fake::codecConfig().stallAfter = -1;
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 2, 2000));
+
+    stagefright_migration_stats_t migration;
+    Stagefright_GetMigrationStats(ctx, &migration);
+    EXPECT_EQ(migration.mode, DECODER_MODE_SW);
+    EXPECT_EQ(migration.open_fallbacks, 0);
+    EXPECT_EQ(fake::codecCounters().hwCreates, 0);
+
+    fake::releaseStall();
+    EXPECT(WAIT_FOR(fake::codecCounters().live == 1, 2000));
+    Stagefright_Release(ctx);
+    Stagefright_ClearDecoderPool(NULL);
+    EXPECT_EQ(fake::codecCounters().live, 0);
+}
+
+// Release gives up on a wedged thread, which still stops the codec later
+TEST(releaseAbandonsStalledThread)
+{
+    fake::codecConfig().stallAfter = 1;
+    fake::Window window;
+
+    StagefrightContext* ctx = test::openSession(&window);
+    ASSERT(ctx);
+    Stagefright_SetWatchdogTimeout(ctx, 0);
+    EXPECT(WAIT_FOR(fake::codecCounters().starts == 1, 2000));
+
+    int64_t pts = 0;
+    uint8_t unit[16];
+    size_t size = makeIDR(unit);
+    for (int i = 0; i < 3; ++i, pts += kFrameUs)
+        Stagefright_QueueInputBuffer(ctx, 0, unit, size, pts, 0);
+    EXPECT(WAIT_FOR(fake::codecCounters().stalled == 1, 2000));
+
+    int64_t start = test::nowUs();
+    Stagefright_Release(ctx);
+    EXPECT((test::nowUs() - start) / 1000 < RELEASE_TIMEOUT_MS + 500);
+    EXPECT_EQ(fake::codecCounters().live, 1);
+
+    fake::releaseStall();
+    EXPECT(WAIT_FOR(fake::codecCounters().live == 0, 2000));
+    EXPECT_EQ(fake::codecCounters().stops, 1);
+    Stagefright_ClearDecoderPool(NULL);
+}
+
+struct Pusher {
+    BufferQueue* queue;
+    volatile int32_t result;
+    volatile bool done;
+};
+
+static void* pushOne(void* arg)
+{
+    Pusher* pusher = static_cast<Pusher*>(arg);
+    Frame frame;
+    pusher->result = pusher->queue->push(frame);
+    pusher->done = true;
+    return NULL;
+}
+
+// The decoder thread blocked on a full output queue returns on release
+TEST(pushInterruptible)
+{
+    BufferQueue queue(2);
+    for (int i = 0; i < 2; ++i) {
+        Frame frame;
+        EXPECT(queue.push(frame) >= 0);
+    }
+
+    Pusher pusher = { &queue, 0, false };
+    pthread_t thread;
+    pthread_create(&thread, NULL, pushOne, &pusher);
+    usleep(20000);
+    EXPECT(!pusher.done);
+
+    queue.release(); // a flush wake-up alone keeps waiting for a slot
+    usleep(20000);
+    EXPECT(!pusher.done);
+
+    queue.interrupt();
+    EXPECT(WAIT_FOR(pusher.done, 1000));
+    EXPECT_EQ(pusher.result, INFO_TRY_AGAIN_LATER);
+    pthread_join(thread, NULL);
+}
+
+TEST_MAIN()